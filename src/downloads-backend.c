@@ -1,6 +1,15 @@
 /**
  * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
  * This file is part of mediabox.
+ *
+ * Download manager backend. Torrents are handled by deluged and
+ * we keep a single RPC connection to it that is used to add,
+ * remove and list them. Plain HTTP and FTP downloads are handled
+ * by the built-in downloader.
+ *
+ * Downloads can be streamed. Torrents are switched to sequential
+ * mode and we poll their pieces to tell the player what parts of
+ * the file it can read.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -10,12 +19,24 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
 #include <unistd.h>
-#include <sys/types.h>
-#include <sys/wait.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
 #include <fcntl.h>
+#include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+#include <openssl/ssl.h>
+
+#define LOG_MODULE "download-backend"
 
 #ifdef ENABLE_IONICE
 #include "lib/ionice.h"
@@ -23,49 +44,1856 @@
 #include "lib/process.h"
 #include "lib/debug.h"
 #include "lib/log.h"
+#include "lib/settings.h"
+#include "lib/dispatch.h"
+#include "lib/linkedlist.h"
+#include "lib/rencode.h"
 #include "lib/file_util.h"
+#include "lib/download.h"
+#include "lib/cgroup.h"
+#include "lib/partfile.h"
+#include "lib/ui/player.h"
+#include "downloads-backend.h"
 
-#define DELUGE_BIN "/usr/bin/deluge-console"
 #define DELUGED_BIN "/usr/bin/deluged"
+#define DELUGED_NAME "Deluge Daemon"
+#define DELUGED_CGROUP "deluge-daemon"	/* derived from DELUGED_NAME */
 #define PREFIX "/usr/local"
 
+/* deluge RPC message types */
+#define MB_DELUGE_RPC_RESPONSE	(1)
+#define MB_DELUGE_RPC_ERROR	(2)
+#define MB_DELUGE_RPC_EVENT	(3)
+
+#define MB_DELUGE_POLL_INTERVAL	(2000)	/* msecs */
+#define MB_DELUGE_BACKOFF_MIN	(250)	/* msecs */
+#define MB_DELUGE_BACKOFF_MAX	(5000)	/* msecs */
+#define MB_DELUGE_IO_TIMEOUT	(5)	/* secs */
+#define MB_DELUGE_MAX_MESSAGE	(16 * 1024 * 1024)
 
-int daemon_id = -1;
+#define MB_DOWNLOADS_REFRESH	(1000)	/* msecs */
+#define MB_DOWNLOADS_NATIVE	"native-"
+#define MB_DOWNLOADS_REPORT	(10000)	/* msecs */
+#define MB_DOWNLOADS_STREAM_POLL	(1000)	/* msecs */
+#define MB_DOWNLOADS_STREAM_RETRY	(250)	/* msecs */
+#define MB_DELUGE_PIECE_DONE	(3)
 
 
 /**
- * mb_downloadmanager_addurl() -- Adds a URL to the download queue.
+ * RPC request types.
  */
-int
-mb_downloadmanager_addurl(char *url)
+enum mb_deluge_request_type
 {
-	int process_id, exit_status = -1;
+	MB_DELUGE_LOGIN,
+	MB_DELUGE_INTEREST,
+	MB_DELUGE_ADD,
+	MB_DELUGE_REMOVE,
+	MB_DELUGE_STATUS,
+	MB_DELUGE_CONFIG,
+	MB_DELUGE_STREAM,
+	MB_DELUGE_PIECES
+};
 
-	char * const args[] =
+
+/**
+ * An RPC request. Requests are queued on the outbox by the
+ * public functions and moved to the connection's pending list
+ * once sent.
+ */
+LISTABLE_STRUCT(mb_deluge_request,
+	int id;
+	enum mb_deluge_request_type type;
+	char *arg;
+	int value;	/* remove data flag or rate limit */
+);
+
+
+LISTABLE_STRUCT(mb_downloads_subscriber,
+	struct avbox_object *object;
+);
+
+
+/**
+ * A download being streamed. The object gets the path to
+ * play once there's something to play.
+ */
+LISTABLE_STRUCT(mb_downloads_stream,
+	char id[48];
+	char path[PATH_MAX];
+	struct avbox_object *object;
+	struct avbox_partfile *partfile;
+	int64_t next_poll;
+	int configured;
+	int pending;
+	int done;
+);
+
+
+/**
+ * Connection state. Only touched by the connection thread.
+ */
+struct mb_deluge_conn
+{
+	int fd;
+	SSL_CTX *ctx;
+	SSL *ssl;
+	int version;
+	int logged_in;
+	int backoff;
+	int next_id;
+	int status_pending;
+	int64_t next_poll;
+	char *rbuf;
+	size_t rlen;
+	size_t rcap;
+	LIST pending;
+};
+
+
+static int daemon_id = -1;
+static int wakefd = -1;
+static int quit = 0;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mb_downloads_update *snapshot = NULL;
+static struct mb_downloads_update *torrents = NULL;
+static struct avbox_player *player = NULL;
+static struct avbox_object *player_object = NULL;
+static int playback = 0;
+static int throttled = 0;
+static int deluge_throttled = 0;
+static int deluge_limit = 0;	/* last rate limit sent to deluged */
+static int64_t next_report = 0;
+static int64_t last_report = 0;
+static int64_t last_io = -1;
+LIST_DECLARE_STATIC(outbox);
+LIST_DECLARE_STATIC(subscribers);
+LIST_DECLARE_STATIC(streams);
+
+
+/**
+ * Gets the monotonic time in msecs.
+ */
+static int64_t
+mb_deluge_now(void)
+{
+	struct timespec tv;
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	return (tv.tv_sec * 1000LL) + (tv.tv_nsec / 1000000LL);
+}
+
+
+/**
+ * Wake the connection thread.
+ */
+static void
+mb_downloadmanager_wake(void)
+{
+	const uint64_t one = 1;
+	if (write(wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+		LOG_VPRINT_ERROR("Could not wake connection thread: %s",
+			strerror(errno));
+	}
+}
+
+
+static void
+mb_deluge_freerequest(struct mb_deluge_request * const req)
+{
+	free(req->arg);
+	free(req);
+}
+
+
+/**
+ * Queue a request for the connection thread.
+ */
+static int
+mb_downloadmanager_queue(const enum mb_deluge_request_type type,
+	const char * const arg, const int value)
+{
+	struct mb_deluge_request *req;
+
+	if ((req = malloc(sizeof(struct mb_deluge_request))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return -1;
+	}
+	if ((req->arg = strdup(arg)) == NULL) {
+		ASSERT(errno == ENOMEM);
+		free(req);
+		return -1;
+	}
+	req->type = type;
+	req->value = value;
+
+	pthread_mutex_lock(&lock);
+	LIST_APPEND(&outbox, req);
+	pthread_mutex_unlock(&lock);
+
+	mb_downloadmanager_wake();
+	return 0;
+}
+
+
+/**
+ * Replace a pending update with a newer one.
+ */
+static void *
+mb_downloadmanager_coalesce(void *pending, void *payload)
+{
+	free(pending);
+	return payload;
+}
+
+
+/**
+ * Send the current snapshot to a subscriber. Must
+ * be called with the lock held.
+ */
+static void
+mb_downloadmanager_publish(struct avbox_object *object)
+{
+	size_t sz;
+	struct mb_downloads_update *update;
+
+	ASSERT(snapshot != NULL);
+
+	sz = sizeof(struct mb_downloads_update) +
+		(snapshot->n * sizeof(struct mb_download_status));
+	if ((update = malloc(sz)) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return;
+	}
+	memcpy(update, snapshot, sz);
+
+	if (avbox_object_coalescemsg(&object, MB_MESSAGETYPE_DOWNLOADS,
+		AVBOX_DISPATCH_UNICAST, 0, update, mb_downloadmanager_coalesce) == NULL) {
+		LOG_VPRINT_ERROR("Could not send downloads update: %s",
+			strerror(errno));
+		free(update);
+	}
+}
+
+
+static int
+mb_downloadmanager_hassubscribers(void)
+{
+	int ret;
+	pthread_mutex_lock(&lock);
+	ret = !LIST_EMPTY(&subscribers);
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+
+/**
+ * Send the path to play (or the error) to whoever asked
+ * to stream a download. Must be called with the lock held.
+ */
+static void
+mb_downloadmanager_streamreply(struct mb_downloads_stream * const stream,
+	const int error)
+{
+	struct mb_downloads_stream_reply *reply;
+
+	if (stream->object == NULL) {
+		return;
+	}
+	if ((reply = malloc(sizeof(struct mb_downloads_stream_reply))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return;
+	}
+	snprintf(reply->id, sizeof(reply->id), "%s", stream->id);
+	snprintf(reply->path, sizeof(reply->path), "%s", stream->path);
+	reply->error = error;
+
+	if (avbox_object_sendmsg(&stream->object, MB_MESSAGETYPE_DOWNLOADS_STREAM,
+		AVBOX_DISPATCH_UNICAST, reply) == NULL) {
+		LOG_VPRINT_ERROR("Could not send stream reply: %s",
+			strerror(errno));
+		free(reply);
+	}
+	stream->object = NULL;
+}
+
+
+/**
+ * Stop streaming. Must be called with the lock held.
+ */
+static void
+mb_downloadmanager_freestream(struct mb_downloads_stream * const stream,
+	const int error)
+{
+	mb_downloadmanager_streamreply(stream, error);
+	if (stream->partfile != NULL) {
+		if (stream->done) {
+			avbox_partfile_setdone(stream->partfile, NULL);
+		} else {
+			avbox_partfile_abort(stream->partfile);
+		}
+		avbox_partfile_unref(stream->partfile);
+	}
+	LIST_REMOVE(stream);
+	free(stream);
+}
+
+
+/**
+ * Forget what we told deluged about the torrents we're
+ * streaming. Called when we lose the connection.
+ */
+static void
+mb_downloadmanager_resetstreams(void)
+{
+	struct mb_downloads_stream *stream;
+	pthread_mutex_lock(&lock);
+	LIST_FOREACH(struct mb_downloads_stream*, stream, &streams) {
+		stream->configured = 0;
+		stream->pending = 0;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ * Connect to the daemon.
+ */
+static int
+mb_deluge_connect(struct mb_deluge_conn * const c)
+{
+	int ret, fd = -1, one = 1;
+	char port[8];
+	char *host;
+	struct addrinfo hints, *res, *ai;
+	struct timeval tv;
+
+	if ((host = avbox_settings_getstring("downloads.rpc.host")) == NULL) {
+		if ((host = strdup("127.0.0.1")) == NULL) {
+			return -1;
+		}
+	}
+	snprintf(port, sizeof(port), "%i",
+		avbox_settings_getint("downloads.rpc.port", 58846));
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((ret = getaddrinfo(host, port, &hints, &res)) != 0) {
+		DEBUG_VPRINT("download-backend", "Could not resolve %s: %s",
+			host, gai_strerror(ret));
+		free(host);
+		return -1;
+	}
+
+	/* the daemon runs locally so just block
+	 * with a timeout */
+	tv.tv_sec = MB_DELUGE_IO_TIMEOUT;
+	tv.tv_usec = 0;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) == -1) {
+			continue;
+		}
+		(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		(void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		(void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd == -1) {
+		DEBUG_VPRINT("download-backend", "Could not connect to %s:%s",
+			host, port);
+		free(host);
+		return -1;
+	}
+
+	/* deluged only accepts TLS connections but it
+	 * can be turned off to talk to a stand-in server */
+	if (avbox_settings_getint("downloads.rpc.tls", 1)) {
+		if ((c->ctx = SSL_CTX_new(SSLv23_client_method())) == NULL ||
+			(c->ssl = SSL_new(c->ctx)) == NULL) {
+			LOG_PRINT_ERROR("Could not create TLS context");
+			goto err;
+		}
+		/* the daemon uses a self-signed certificate */
+		SSL_set_verify(c->ssl, SSL_VERIFY_NONE, NULL);
+		SSL_set_fd(c->ssl, fd);
+		if (SSL_connect(c->ssl) != 1) {
+			LOG_VPRINT_ERROR("TLS handshake with %s:%s failed",
+				host, port);
+			goto err;
+		}
+	}
+
+	DEBUG_VPRINT("download-backend", "Connected to %s:%s",
+		host, port);
+
+	free(host);
+	c->fd = fd;
+	c->version = avbox_settings_getint("downloads.rpc.version", 1);
+	c->logged_in = 0;
+	c->status_pending = 0;
+	c->next_poll = 0;
+	c->rlen = 0;
+	return 0;
+err:
+	if (c->ssl != NULL) {
+		SSL_free(c->ssl);
+		c->ssl = NULL;
+	}
+	if (c->ctx != NULL) {
+		SSL_CTX_free(c->ctx);
+		c->ctx = NULL;
+	}
+	free(host);
+	close(fd);
+	return -1;
+}
+
+
+/**
+ * Close the connection. Add and remove requests that did not
+ * get a reply are queued again.
+ */
+static void
+mb_deluge_disconnect(struct mb_deluge_conn * const c)
+{
+	struct mb_deluge_request *req;
+
+	if (c->fd == -1) {
+		return;
+	}
+
+	DEBUG_PRINT("download-backend", "Disconnecting");
+
+	if (c->ssl != NULL) {
+		SSL_free(c->ssl);
+		c->ssl = NULL;
+	}
+	if (c->ctx != NULL) {
+		SSL_CTX_free(c->ctx);
+		c->ctx = NULL;
+	}
+	close(c->fd);
+	c->fd = -1;
+
+	pthread_mutex_lock(&lock);
+	LIST_FOREACH_SAFE(struct mb_deluge_request*, req, &c->pending, {
+		LIST_REMOVE(req);
+		if (req->type == MB_DELUGE_ADD || req->type == MB_DELUGE_REMOVE ||
+			req->type == MB_DELUGE_CONFIG) {
+			LIST_ADD(&outbox, req);
+		} else {
+			mb_deluge_freerequest(req);
+		}
+	});
+	pthread_mutex_unlock(&lock);
+
+	/* the torrents we're streaming must be set up again */
+	mb_downloadmanager_resetstreams();
+}
+
+
+/**
+ * Write to the connection.
+ */
+static int
+mb_deluge_write(struct mb_deluge_conn * const c, const void *buf, size_t len)
+{
+	ssize_t ret;
+	const char *p = buf;
+	while (len > 0) {
+		if (c->ssl != NULL) {
+			if ((ret = SSL_write(c->ssl, p, len)) <= 0) {
+				return -1;
+			}
+		} else if ((ret = send(c->fd, p, len, MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+
+/**
+ * Read whatever is available from the connection.
+ *
+ * Returns the number of bytes read, 0 on EOF or -1 on error.
+ */
+static ssize_t
+mb_deluge_read(struct mb_deluge_conn * const c)
+{
+	ssize_t ret;
+
+	if (c->rcap - c->rlen < 4096) {
+		char *buf;
+		const size_t cap = (c->rcap == 0) ? 16384 : c->rcap * 2;
+		if (cap > MB_DELUGE_MAX_MESSAGE * 2) {
+			LOG_PRINT_ERROR("Message too large");
+			return -1;
+		}
+		if ((buf = realloc(c->rbuf, cap)) == NULL) {
+			return -1;
+		}
+		c->rbuf = buf;
+		c->rcap = cap;
+	}
+
+	if (c->ssl != NULL) {
+		if ((ret = SSL_read(c->ssl, c->rbuf + c->rlen, c->rcap - c->rlen)) <= 0) {
+			return (SSL_get_error(c->ssl, ret) == SSL_ERROR_ZERO_RETURN) ? 0 : -1;
+		}
+	} else {
+		while ((ret = recv(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen, 0)) == -1 && errno == EINTR);
+		if (ret <= 0) {
+			return ret;
+		}
+	}
+	c->rlen += ret;
+	return ret;
+}
+
+
+/**
+ * Inflate a zlib stream.
+ *
+ * Returns 1 if a whole stream was inflated, 0 if more input
+ * is needed or -1 on error.
+ */
+static int
+mb_deluge_inflate(const char * const in, const size_t len,
+	size_t * const consumed, char ** const out, size_t * const outlen)
+{
+	int ret;
+	char *buf = NULL, *tmp;
+	size_t cap = (len * 4) + 256;
+	z_stream z;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit(&z) != Z_OK) {
+		return -1;
+	}
+
+	z.next_in = (Bytef*) in;
+	z.avail_in = len;
+
+	do {
+		if (buf == NULL || z.avail_out == 0) {
+			if (buf != NULL) {
+				cap *= 2;
+			}
+			if (cap > MB_DELUGE_MAX_MESSAGE || (tmp = realloc(buf, cap)) == NULL) {
+				ret = Z_MEM_ERROR;
+				break;
+			}
+			buf = tmp;
+			z.next_out = (Bytef*) buf + z.total_out;
+			z.avail_out = cap - z.total_out;
+		}
+		ret = inflate(&z, Z_NO_FLUSH);
+	} while (ret == Z_OK || (ret == Z_BUF_ERROR && z.avail_out == 0));
+
+	if (ret == Z_STREAM_END) {
+		*consumed = z.total_in;
+		*outlen = z.total_out;
+		*out = buf;
+		inflateEnd(&z);
+		return 1;
+	}
+
+	inflateEnd(&z);
+	free(buf);
+	return (ret == Z_BUF_ERROR && z.avail_in == 0) ? 0 : -1;
+}
+
+
+/**
+ * Send a request.
+ */
+static int
+mb_deluge_call(struct mb_deluge_conn * const c, struct mb_deluge_request * const req)
+{
+	int ret = -1;
+	size_t i;
+	uLongf len;
+	unsigned char *buf = NULL;
+	struct avbox_rencode enc;
+	char *user = NULL, *password = NULL;
+	const char * const events[] =
 	{
-		"deluge-console",
-		"connect",
-		"127.0.0.1",
-		"mediabox",
-		"mediabox;",
-		"add",
-		url,
-		NULL
+		"TorrentAddedEvent",
+		"TorrentRemovedEvent",
+		"TorrentStateChangedEvent",
+		"TorrentFinishedEvent"
+	};
+	const char * const keys[] =
+	{
+		"name",
+		"progress",
+		"state",
+		"total_size",
+		"download_payload_rate",
+		"upload_payload_rate",
+		"eta"
+	};
+	const char * const stream_keys[] =
+	{
+		"save_path",
+		"files",
+		"piece_length",
+		"pieces",
+		"progress"
 	};
 
-	/* launch the deluged process */
-	if ((process_id = avbox_process_start(DELUGED_BIN, (const char **) args,
-		AVBOX_PROCESS_AUTORESTART | AVBOX_PROCESS_NICE | AVBOX_PROCESS_IONICE_IDLE |
-		AVBOX_PROCESS_SUPERUSER | AVBOX_PROCESS_WAIT, "deluge-console", NULL, NULL)) == -1) {
-		LOG_VPRINT(MB_LOGLEVEL_ERROR, "download-backend",
-			"Could not execute deluge-console (errno=%i)", errno);
+	req->id = c->next_id++;
+
+	/* [[id, method, args, kwargs]] */
+	avbox_rencode_init(&enc);
+	avbox_rencode_list(&enc);
+	avbox_rencode_list(&enc);
+	avbox_rencode_int(&enc, req->id);
+
+	switch (req->type) {
+	case MB_DELUGE_LOGIN:
+		if ((user = avbox_settings_getstring("downloads.rpc.user")) == NULL) {
+			user = strdup("mediabox");
+		}
+		if ((password = avbox_settings_getstring("downloads.rpc.password")) == NULL) {
+			password = strdup("mediabox");
+		}
+		if (user == NULL || password == NULL) {
+			goto end;
+		}
+		avbox_rencode_string(&enc, "daemon.login");
+		avbox_rencode_list(&enc);
+		avbox_rencode_string(&enc, user);
+		avbox_rencode_string(&enc, password);
+		avbox_rencode_end(&enc);
+		avbox_rencode_dict(&enc);
+		if (c->version >= 2) {
+			avbox_rencode_string(&enc, "client_version");
+			avbox_rencode_string(&enc, PACKAGE_VERSION);
+		}
+		avbox_rencode_end(&enc);
+		break;
+	case MB_DELUGE_INTEREST:
+		avbox_rencode_string(&enc, "daemon.set_event_interest");
+		avbox_rencode_list(&enc);
+		avbox_rencode_list(&enc);
+		for (i = 0; i < sizeof(events) / sizeof(events[0]); i++) {
+			avbox_rencode_string(&enc, events[i]);
+		}
+		avbox_rencode_end(&enc);
+		avbox_rencode_end(&enc);
+		avbox_rencode_dict(&enc);
+		avbox_rencode_end(&enc);
+		break;
+	case MB_DELUGE_ADD:
+		avbox_rencode_string(&enc, !strncmp(req->arg, "magnet:", 7) ?
+			"core.add_torrent_magnet" : "core.add_torrent_url");
+		avbox_rencode_list(&enc);
+		avbox_rencode_string(&enc, req->arg);
+		avbox_rencode_dict(&enc);
+		avbox_rencode_end(&enc);
+		avbox_rencode_end(&enc);
+		avbox_rencode_dict(&enc);
+		avbox_rencode_end(&enc);
+		break;
+	case MB_DELUGE_REMOVE:
+		avbox_rencode_string(&enc, "core.remove_torrent");
+		avbox_rencode_list(&enc);
+		avbox_rencode_string(&enc, req->arg);
+		avbox_rencode_bool(&enc, req->value);
+		avbox_rencode_end(&enc);
+		avbox_rencode_dict(&enc);
+		avbox_rencode_end(&enc);
+		break;
+	case MB_DELUGE_STATUS:
+		avbox_rencode_string(&enc, "core.get_torrents_status");
+		avbox_rencode_list(&enc);
+		avbox_rencode_dict(&enc);
+		avbox_rencode_end(&enc);
+		avbox_rencode_list(&enc);
+		for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+			avbox_rencode_string(&enc, keys[i]);
+		}
+		avbox_rencode_end(&enc);
+		avbox_rencode_end(&enc);
+		avbox_rencode_dict(&enc);
+		avbox_rencode_end(&enc);
+		break;
+	case MB_DELUGE_STREAM:
+		avbox_rencode_string(&enc, "core.set_torrent_options");
+		avbox_rencode_list(&enc);
+		avbox_rencode_list(&enc);
+		avbox_rencode_string(&enc, req->arg);
+		avbox_rencode_end(&enc);
+		avbox_rencode_dict(&enc);
+		avbox_rencode_string(&enc, "sequential_download");
+		avbox_rencode_bool(&enc, 1);
+		avbox_rencode_string(&enc, "prioritize_first_last_pieces");
+		avbox_rencode_bool(&enc, 1);
+		avbox_rencode_end(&enc);
+		avbox_rencode_end(&enc);
+		avbox_rencode_dict(&enc);
+		avbox_rencode_end(&enc);
+		break;
+	case MB_DELUGE_PIECES:
+		avbox_rencode_string(&enc, "core.get_torrent_status");
+		avbox_rencode_list(&enc);
+		avbox_rencode_string(&enc, req->arg);
+		avbox_rencode_list(&enc);
+		for (i = 0; i < sizeof(stream_keys) / sizeof(stream_keys[0]); i++) {
+			avbox_rencode_string(&enc, stream_keys[i]);
+		}
+		avbox_rencode_end(&enc);
+		avbox_rencode_end(&enc);
+		avbox_rencode_dict(&enc);
+		avbox_rencode_end(&enc);
+		break;
+	case MB_DELUGE_CONFIG:
+		/* deluge takes KiB/s and -1 for no limit */
+		avbox_rencode_string(&enc, "core.set_config");
+		avbox_rencode_list(&enc);
+		avbox_rencode_dict(&enc);
+		avbox_rencode_string(&enc, "max_download_speed");
+		avbox_rencode_float(&enc, (req->value > 0) ? req->value / 1024.0 : -1.0);
+		avbox_rencode_string(&enc, "max_upload_speed");
+		avbox_rencode_float(&enc, (req->value > 0) ? req->value / 1024.0 : -1.0);
+		avbox_rencode_end(&enc);
+		avbox_rencode_end(&enc);
+		avbox_rencode_dict(&enc);
+		avbox_rencode_end(&enc);
+		break;
+	default:
+		abort();
+	}
+
+	avbox_rencode_end(&enc);
+	avbox_rencode_end(&enc);
+
+	if (enc.error) {
+		errno = enc.error;
+		goto end;
+	}
+
+	/* version 1 messages are just zlib streams. Version 2
+	 * adds a header with the length */
+	len = compressBound(enc.len);
+	if ((buf = malloc(len + 5)) == NULL) {
+		goto end;
+	}
+	if (compress(buf + 5, &len, (Bytef*) enc.data, enc.len) != Z_OK) {
+		goto end;
+	}
+	if (c->version >= 2) {
+		buf[0] = 'D';
+		buf[1] = (len >> 24) & 0xFF;
+		buf[2] = (len >> 16) & 0xFF;
+		buf[3] = (len >> 8) & 0xFF;
+		buf[4] = len & 0xFF;
+		ret = mb_deluge_write(c, buf, len + 5);
+	} else {
+		ret = mb_deluge_write(c, buf + 5, len);
+	}
+
+	if (ret == 0) {
+		LIST_APPEND(&c->pending, req);
+	}
+end:
+	avbox_rencode_free(&enc);
+	free(buf);
+	free(user);
+	free(password);
+	return ret;
+}
+
+
+/**
+ * Send a request that takes no arguments.
+ */
+static int
+mb_deluge_callsimple(struct mb_deluge_conn * const c,
+	const enum mb_deluge_request_type type)
+{
+	struct mb_deluge_request *req;
+	if ((req = malloc(sizeof(struct mb_deluge_request))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return -1;
+	}
+	req->type = type;
+	req->arg = NULL;
+	if (mb_deluge_call(c, req) == -1) {
+		free(req);
 		return -1;
 	}
+	return 0;
+}
+
+
+/**
+ * Gets the first string in an error reply.
+ */
+static const char *
+mb_deluge_errorstring(const struct avbox_rvalue * const value)
+{
+	size_t i;
+	const char *str;
+	if (value->type == AVBOX_RVALUE_STRING) {
+		return value->v.str.data;
+	} else if (value->type == AVBOX_RVALUE_LIST) {
+		for (i = 0; i < value->v.list.n; i++) {
+			if ((str = mb_deluge_errorstring(&value->v.list.items[i])) != NULL) {
+				return str;
+			}
+		}
+	}
+	return NULL;
+}
+
+
+static double
+mb_deluge_number(const struct avbox_rvalue * const value)
+{
+	if (value == NULL) {
+		return 0;
+	} else if (value->type == AVBOX_RVALUE_INT) {
+		return value->v.i;
+	} else if (value->type == AVBOX_RVALUE_FLOAT) {
+		return value->v.f;
+	}
+	return 0;
+}
+
+
+static void
+mb_deluge_copystring(char * const dst, const size_t sz,
+	const struct avbox_rvalue * const value)
+{
+	if (value != NULL && value->type == AVBOX_RVALUE_STRING) {
+		snprintf(dst, sz, "%s", value->v.str.data);
+	}
+}
+
+
+static int
+mb_deluge_compare(const void *a, const void *b)
+{
+	const struct mb_download_status * const sa = a;
+	const struct mb_download_status * const sb = b;
+	const int ret = strcasecmp(sa->name, sb->name);
+	return (ret != 0) ? ret : strcmp(sa->id, sb->id);
+}
+
+
+/**
+ * Merge the last torrents list with the status of the built-in
+ * downloads and let the subscribers know if anything changed.
+ */
+static void
+mb_downloadmanager_refresh(void)
+{
+	int i, n, n_native = 0;
+	const int n_torrents = (torrents != NULL) ? torrents->n : 0;
+	struct avbox_download_stats *stats = NULL;
+	struct mb_downloads_update *update;
+	struct mb_downloads_subscriber *sub;
+
+	/* downloads may be added while we're at it */
+	while ((n = avbox_download_getstats(stats, n_native)) > n_native) {
+		free(stats);
+		n_native = n + 4;
+		if ((stats = malloc(n_native * sizeof(struct avbox_download_stats))) == NULL) {
+			ASSERT(errno == ENOMEM);
+			return;
+		}
+	}
+	n_native = n;
+
+	if ((update = calloc(1, sizeof(struct mb_downloads_update) +
+		((n_torrents + n_native) * sizeof(struct mb_download_status)))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		free(stats);
+		return;
+	}
+
+	if (n_torrents > 0) {
+		memcpy(update->items, torrents->items,
+			n_torrents * sizeof(struct mb_download_status));
+		update->n = n_torrents;
+	}
+
+	for (i = 0; i < n_native; i++) {
+		const struct avbox_download_stats * const st = &stats[i];
+		struct mb_download_status * const item = &update->items[update->n++];
+		snprintf(item->id, sizeof(item->id), MB_DOWNLOADS_NATIVE "%i", st->id);
+		snprintf(item->name, sizeof(item->name), "%s", st->name);
+		snprintf(item->state, sizeof(item->state), "%s",
+			(st->state == AVBOX_DOWNLOAD_QUEUED) ? "Queued" :
+			(st->state == AVBOX_DOWNLOAD_ACTIVE) ? "Downloading" :
+			(st->state == AVBOX_DOWNLOAD_DONE) ? "Finished" : "Error");
+		item->progress = (st->size > 0) ? (st->downloaded * 100.0) / st->size : 0;
+		item->total_size = st->size;
+		item->eta = (st->size > 0 && st->rate > 0) ?
+			(st->size - st->downloaded) / st->rate : -1;
+		item->download_rate = st->rate;
+		item->upload_rate = 0;
+	}
+	free(stats);
 
-	/* wait for process to exit */
-	avbox_process_wait(process_id, &exit_status);
+	qsort(update->items, update->n, sizeof(struct mb_download_status),
+		mb_deluge_compare);
 
-	return exit_status;
+	pthread_mutex_lock(&lock);
+	if (snapshot != NULL && snapshot->n == update->n &&
+		!memcmp(snapshot->items, update->items, update->n * sizeof(struct mb_download_status))) {
+		pthread_mutex_unlock(&lock);
+		free(update);
+		return;
+	}
+	free(snapshot);
+	snapshot = update;
+	LIST_FOREACH(struct mb_downloads_subscriber*, sub, &subscribers) {
+		mb_downloadmanager_publish(sub->object);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ * Update the torrents list with the reply to
+ * get_torrents_status.
+ */
+static void
+mb_deluge_updatestatus(const struct avbox_rvalue * const value)
+{
+	size_t i, sz;
+	struct mb_downloads_update *update;
+
+	if (value->type != AVBOX_RVALUE_DICT) {
+		LOG_PRINT_ERROR("Invalid status reply");
+		return;
+	}
+
+	sz = sizeof(struct mb_downloads_update) +
+		(value->v.list.n * sizeof(struct mb_download_status));
+	if ((update = calloc(1, sz)) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return;
+	}
+
+	for (i = 0; i < value->v.list.n; i++) {
+		const struct avbox_rvalue * const id = &value->v.list.items[i * 2];
+		const struct avbox_rvalue * const st = &value->v.list.items[(i * 2) + 1];
+		struct mb_download_status * const item = &update->items[update->n];
+		if (id->type != AVBOX_RVALUE_STRING || st->type != AVBOX_RVALUE_DICT) {
+			continue;
+		}
+		mb_deluge_copystring(item->id, sizeof(item->id), id);
+		mb_deluge_copystring(item->name, sizeof(item->name), avbox_rvalue_get(st, "name"));
+		mb_deluge_copystring(item->state, sizeof(item->state), avbox_rvalue_get(st, "state"));
+		item->progress = mb_deluge_number(avbox_rvalue_get(st, "progress"));
+		item->total_size = mb_deluge_number(avbox_rvalue_get(st, "total_size"));
+		item->eta = mb_deluge_number(avbox_rvalue_get(st, "eta"));
+		item->download_rate = mb_deluge_number(avbox_rvalue_get(st, "download_payload_rate"));
+		item->upload_rate = mb_deluge_number(avbox_rvalue_get(st, "upload_payload_rate"));
+		update->n++;
+	}
+
+	free(torrents);
+	torrents = update;
+	mb_downloadmanager_refresh();
+}
+
+
+/**
+ * Update a streamed torrent with the reply to get_torrent_status.
+ * We stream the largest file and mark the pieces that are done
+ * as available. If value is NULL the torrent is gone.
+ */
+static void
+mb_downloadmanager_updatestream(const char * const id,
+	const struct avbox_rvalue * const value)
+{
+	size_t i;
+	int64_t offset = 0, size = -1, piece_length, start, end;
+	const struct avbox_rvalue *files, *pieces, *save_path, *path = NULL;
+	struct mb_downloads_stream *stream;
+
+	pthread_mutex_lock(&lock);
+	LIST_FOREACH(struct mb_downloads_stream*, stream, &streams) {
+		if (!strcmp(stream->id, id)) {
+			break;
+		}
+	}
+	if (LIST_ISNULL(&streams, stream)) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	stream->pending = 0;
+	stream->next_poll = mb_deluge_now() + MB_DOWNLOADS_STREAM_POLL;
+
+	if (value == NULL || value->type != AVBOX_RVALUE_DICT ||
+		value->v.list.n == 0) {
+		mb_downloadmanager_freestream(stream, ENOENT);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	/* we get no pieces until we have the metadata */
+	files = avbox_rvalue_get(value, "files");
+	pieces = avbox_rvalue_get(value, "pieces");
+	save_path = avbox_rvalue_get(value, "save_path");
+	piece_length = mb_deluge_number(avbox_rvalue_get(value, "piece_length"));
+	if (files == NULL || files->type != AVBOX_RVALUE_LIST || files->v.list.n == 0 ||
+		save_path == NULL || save_path->type != AVBOX_RVALUE_STRING ||
+		pieces == NULL || pieces->type != AVBOX_RVALUE_LIST || piece_length <= 0) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	/* pick the largest file */
+	for (i = 0; i < files->v.list.n; i++) {
+		const struct avbox_rvalue * const file = &files->v.list.items[i];
+		const int64_t file_size = mb_deluge_number(avbox_rvalue_get(file, "size"));
+		if (file->type == AVBOX_RVALUE_DICT && file_size > size) {
+			size = file_size;
+			offset = mb_deluge_number(avbox_rvalue_get(file, "offset"));
+			path = avbox_rvalue_get(file, "path");
+		}
+	}
+	if (path == NULL || path->type != AVBOX_RVALUE_STRING || size <= 0) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	if (stream->partfile == NULL) {
+		snprintf(stream->path, sizeof(stream->path), "%s/%s",
+			save_path->v.str.data, path->v.str.data);
+		if ((stream->partfile = avbox_partfile_new(stream->path, stream->path,
+			size, NULL, NULL)) == NULL) {
+			LOG_VPRINT_ERROR("Cannot stream %s: %s",
+				stream->path, strerror(errno));
+			mb_downloadmanager_freestream(stream, errno);
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+		DEBUG_VPRINT("download-backend", "Streaming %s",
+			stream->path);
+	}
+
+	/* mark the pieces of the file that we have */
+	stream->done = (mb_deluge_number(avbox_rvalue_get(value, "progress")) >= 100.0);
+	if (!stream->done) {
+		stream->done = 1;
+		for (i = offset / piece_length; i < pieces->v.list.n &&
+			(int64_t) i * piece_length < offset + size; i++) {
+			if (mb_deluge_number(&pieces->v.list.items[i]) != MB_DELUGE_PIECE_DONE) {
+				stream->done = 0;
+				continue;
+			}
+			start = (int64_t) i * piece_length;
+			end = start + piece_length;
+			start = (start < offset) ? 0 : start - offset;
+			end = (end > offset + size) ? size : end - offset;
+			avbox_partfile_setavailable(stream->partfile, start, end - start);
+		}
+	}
+
+	/* the file is created when the first piece is written */
+	if (stream->object != NULL && access(stream->path, R_OK) == 0 &&
+		(stream->done || avbox_partfile_isavailable(stream->partfile, 0, 1))) {
+		mb_downloadmanager_streamreply(stream, 0);
+	}
+
+	if (stream->done) {
+		DEBUG_VPRINT("download-backend", "Finished streaming %s",
+			stream->path);
+		mb_downloadmanager_freestream(stream, 0);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ * Set up the downloads that are being streamed and poll the
+ * pieces of the torrents. The requests are built with the lock
+ * held and sent after releasing it so the other threads don't
+ * wait on the daemon.
+ *
+ * Returns the time until the next poll or -1 if the connection
+ * failed.
+ */
+static int
+mb_downloadmanager_pollstreams(struct mb_deluge_conn * const c, const int64_t now)
+{
+	int ret = INT_MAX;
+	struct mb_downloads_stream *stream;
+	struct mb_deluge_request *req;
+	LIST calls;
+
+	LIST_INIT(&calls);
+
+	pthread_mutex_lock(&lock);
+	LIST_FOREACH_SAFE(struct mb_downloads_stream*, stream, &streams, {
+		/* the built-in downloads are ready once
+		 * the size is known */
+		if (!strncmp(stream->id, MB_DOWNLOADS_NATIVE, sizeof(MB_DOWNLOADS_NATIVE) - 1)) {
+			if (avbox_download_stream(atoi(stream->id + sizeof(MB_DOWNLOADS_NATIVE) - 1),
+				stream->path, sizeof(stream->path)) == 0) {
+				mb_downloadmanager_streamreply(stream, 0);
+			} else if (errno == EAGAIN) {
+				ret = MB_DOWNLOADS_STREAM_RETRY;
+				continue;
+			} else {
+				mb_downloadmanager_streamreply(stream, errno);
+			}
+			LIST_REMOVE(stream);
+			free(stream);
+			continue;
+		}
+
+		if (!c->logged_in || stream->pending) {
+			continue;
+		}
+		if (!stream->configured) {
+			if ((req = malloc(sizeof(struct mb_deluge_request))) == NULL ||
+				(req->arg = strdup(stream->id)) == NULL) {
+				free(req);
+				continue;
+			}
+			req->type = MB_DELUGE_STREAM;
+			req->value = 0;
+			LIST_APPEND(&calls, req);
+			stream->configured = 1;
+		}
+		if (now >= stream->next_poll) {
+			if ((req = malloc(sizeof(struct mb_deluge_request))) == NULL ||
+				(req->arg = strdup(stream->id)) == NULL) {
+				free(req);
+				continue;
+			}
+			req->type = MB_DELUGE_PIECES;
+			req->value = 0;
+			LIST_APPEND(&calls, req);
+			stream->pending = 1;
+		} else if (stream->next_poll - now < ret) {
+			ret = stream->next_poll - now;
+		}
+	});
+	pthread_mutex_unlock(&lock);
+
+	/* if a call fails the streams are reset
+	 * when we disconnect */
+	LIST_FOREACH_SAFE(struct mb_deluge_request*, req, &calls, {
+		LIST_REMOVE(req);
+		if (ret == -1 || mb_deluge_call(c, req) == -1) {
+			mb_deluge_freerequest(req);
+			ret = -1;
+		}
+	});
+
+	return ret;
+}
+
+
+/**
+ * Handle a message from the daemon.
+ */
+static int
+mb_deluge_handlemsg(struct mb_deluge_conn * const c, const struct avbox_rvalue * const msg)
+{
+	int ret = 0;
+	const char *err;
+	struct mb_deluge_request *req;
+
+	if (msg->type != AVBOX_RVALUE_LIST || msg->v.list.n < 3 ||
+		msg->v.list.items[0].type != AVBOX_RVALUE_INT) {
+		LOG_PRINT_ERROR("Invalid RPC message");
+		return -1;
+	}
+
+	if (msg->v.list.items[0].v.i == MB_DELUGE_RPC_EVENT) {
+		/* refresh the list now */
+		c->next_poll = 0;
+		return 0;
+	}
+
+	if (msg->v.list.items[1].type != AVBOX_RVALUE_INT) {
+		LOG_PRINT_ERROR("Invalid RPC reply");
+		return -1;
+	}
+
+	LIST_FOREACH(struct mb_deluge_request*, req, &c->pending) {
+		if (req->id == msg->v.list.items[1].v.i) {
+			break;
+		}
+	}
+	if (LIST_ISNULL(&c->pending, req)) {
+		DEBUG_VPRINT("download-backend", "Unexpected reply (id=%i)",
+			(int) msg->v.list.items[1].v.i);
+		return 0;
+	}
+	LIST_REMOVE(req);
+
+	if (msg->v.list.items[0].v.i == MB_DELUGE_RPC_ERROR) {
+		if ((err = mb_deluge_errorstring(&msg->v.list.items[2])) == NULL) {
+			err = "Unknown error";
+		}
+		switch (req->type) {
+		case MB_DELUGE_LOGIN:
+			LOG_VPRINT_ERROR("Could not login to deluged: %s", err);
+			ret = -1;
+			break;
+		case MB_DELUGE_ADD:
+			LOG_VPRINT_ERROR("Could not add %s: %s", req->arg, err);
+			break;
+		case MB_DELUGE_REMOVE:
+			LOG_VPRINT_ERROR("Could not remove %s: %s", req->arg, err);
+			break;
+		case MB_DELUGE_CONFIG:
+			LOG_VPRINT_ERROR("Could not set deluged rate limit: %s", err);
+			break;
+		case MB_DELUGE_STREAM:
+			LOG_VPRINT_ERROR("Could not set %s to sequential: %s", req->arg, err);
+			break;
+		case MB_DELUGE_PIECES:
+			LOG_VPRINT_ERROR("Could not get pieces of %s: %s", req->arg, err);
+			mb_downloadmanager_updatestream(req->arg, NULL);
+			break;
+		case MB_DELUGE_STATUS:
+			c->status_pending = 0;
+			c->next_poll = mb_deluge_now() + MB_DELUGE_POLL_INTERVAL;
+			/* fall through */
+		default:
+			LOG_VPRINT_ERROR("RPC call failed: %s", err);
+		}
+		mb_deluge_freerequest(req);
+		return ret;
+	}
+
+	switch (req->type) {
+	case MB_DELUGE_LOGIN:
+		DEBUG_PRINT("download-backend", "Logged in");
+		c->logged_in = 1;
+		c->backoff = MB_DELUGE_BACKOFF_MIN;
+		c->next_poll = 0;
+		ret = mb_deluge_callsimple(c, MB_DELUGE_INTEREST);
+
+		/* the daemon may have been restarted so set
+		 * the rate limit again if we ever changed it */
+		if (deluge_limit != 0 &&
+			mb_downloadmanager_queue(MB_DELUGE_CONFIG, "", deluge_limit) == -1) {
+			LOG_PRINT_ERROR("Could not queue deluged rate limit");
+		}
+		break;
+	case MB_DELUGE_STATUS:
+		c->status_pending = 0;
+		c->next_poll = mb_deluge_now() + MB_DELUGE_POLL_INTERVAL;
+		mb_deluge_updatestatus(&msg->v.list.items[2]);
+		break;
+	case MB_DELUGE_ADD:
+	case MB_DELUGE_REMOVE:
+		c->next_poll = 0;
+		break;
+	case MB_DELUGE_PIECES:
+		mb_downloadmanager_updatestream(req->arg, &msg->v.list.items[2]);
+		break;
+	default:
+		break;
+	}
+
+	mb_deluge_freerequest(req);
+	return ret;
+}
+
+
+/**
+ * Handle all the complete messages in the read buffer.
+ */
+static int
+mb_deluge_parse(struct mb_deluge_conn * const c)
+{
+	int ret;
+	char *out;
+	size_t hdr, len, consumed, outlen;
+	struct avbox_rvalue *msg;
+
+	while (c->rlen > 0) {
+		/* version 2 messages start with a header and
+		 * version 1 messages are zlib streams */
+		if (c->rbuf[0] == 'D') {
+			if (c->rlen < 5) {
+				return 0;
+			}
+			hdr = 5;
+			len = ((size_t) (unsigned char) c->rbuf[1] << 24) |
+				((size_t) (unsigned char) c->rbuf[2] << 16) |
+				((size_t) (unsigned char) c->rbuf[3] << 8) |
+				(size_t) (unsigned char) c->rbuf[4];
+			if (len > MB_DELUGE_MAX_MESSAGE) {
+				LOG_PRINT_ERROR("Message too large");
+				return -1;
+			}
+			if (c->rlen < hdr + len) {
+				return 0;
+			}
+		} else {
+			hdr = 0;
+			len = c->rlen;
+		}
+
+		if ((ret = mb_deluge_inflate(c->rbuf + hdr, len, &consumed, &out, &outlen)) == 0) {
+			if (hdr == 0) {
+				return 0;
+			}
+			ret = -1;
+		}
+		if (ret == -1) {
+			LOG_PRINT_ERROR("Could not inflate RPC message");
+			return -1;
+		}
+
+		if (hdr != 0) {
+			consumed = len;
+		}
+		c->rlen -= hdr + consumed;
+		memmove(c->rbuf, c->rbuf + hdr + consumed, c->rlen);
+
+		msg = avbox_rencode_decode(out, outlen);
+		free(out);
+		if (msg == NULL) {
+			LOG_PRINT_ERROR("Could not decode RPC message");
+			return -1;
+		}
+		ret = mb_deluge_handlemsg(c, msg);
+		avbox_rvalue_free(msg);
+		if (ret == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Gets the directory where downloads are saved.
+ */
+static char *
+mb_downloadmanager_getdir(void)
+{
+	char *dir;
+	if ((dir = avbox_settings_getstring("downloads.directory")) == NULL) {
+		dir = getstatedir();
+	}
+	return dir;
+}
+
+
+/**
+ * Log the rates we're getting while throttled.
+ */
+static void
+mb_downloadmanager_report(const int64_t now)
+{
+	int i, n, down = 0, up = 0, disk = -1;
+	int64_t io = -1;
+	struct avbox_cgroup_stats stats[8];
+
+	pthread_mutex_lock(&lock);
+	if (snapshot != NULL) {
+		for (i = 0; i < snapshot->n; i++) {
+			down += snapshot->items[i].download_rate;
+			up += snapshot->items[i].upload_rate;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	n = avbox_cgroup_getstats(stats, sizeof(stats) / sizeof(stats[0]));
+	for (i = 0; i < n; i++) {
+		if (!strcmp(stats[i].name, DELUGED_CGROUP)) {
+			io = stats[i].io_read + stats[i].io_write;
+			break;
+		}
+	}
+	if (io != -1 && last_io != -1 && now > last_report) {
+		disk = ((io - last_io) * 1000) / (now - last_report);
+	}
+	last_io = io;
+	last_report = now;
+
+	if (disk == -1) {
+		LOG_VPRINT_INFO("Throttled downloads: %i KiB/s down, %i KiB/s up",
+			down / 1024, up / 1024);
+	} else {
+		LOG_VPRINT_INFO("Throttled downloads: %i KiB/s down, %i KiB/s up, deluged disk %i KiB/s",
+			down / 1024, up / 1024, disk / 1024);
+	}
+}
+
+
+/**
+ * Checks if we're streaming a torrent. The lock must be held.
+ */
+static int
+mb_downloadmanager_streamingtorrent(void)
+{
+	struct mb_downloads_stream *stream;
+	LIST_FOREACH(struct mb_downloads_stream*, stream, &streams) {
+		if (!stream->done && strncmp(stream->id, MB_DOWNLOADS_NATIVE,
+			sizeof(MB_DOWNLOADS_NATIVE) - 1)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Throttle the downloads while the player is active
+ * and restore them when it stops. If the player is
+ * streaming a torrent then deluged is left alone since
+ * the limits apply to all of it's torrents. The built-in
+ * downloader doesn't limit the downloads it's streaming.
+ */
+static void
+mb_downloadmanager_throttle(const int64_t now)
+{
+	int active, deluge_active, rate = 0, io = 0;
+	char *dir;
+
+	pthread_mutex_lock(&lock);
+	active = playback;
+	deluge_active = active && !mb_downloadmanager_streamingtorrent();
+	pthread_mutex_unlock(&lock);
+
+	if (active != throttled || deluge_active != deluge_throttled) {
+		rate = avbox_settings_getint("downloads.playback.rate", 512) * 1024;
+		io = avbox_settings_getint("downloads.playback.io", 4096) * 1024;
+	}
+
+	if (active != throttled) {
+		if (active) {
+			LOG_VPRINT_INFO("Playback started. Limiting downloads to %i KiB/s (disk %i KiB/s)",
+				rate / 1024, io / 1024);
+		} else {
+			LOG_PRINT_INFO("Playback stopped. Removing download limits");
+		}
+
+		avbox_download_setlimit(active ? rate : 0);
+
+		throttled = active;
+		last_io = -1;
+		last_report = now;
+		next_report = now + MB_DOWNLOADS_REPORT;
+	}
+
+	if (deluge_active != deluge_throttled) {
+		if (active && !deluge_active) {
+			LOG_PRINT_INFO("Streaming a torrent. Removing deluged limits");
+		}
+		deluge_limit = deluge_active ? rate : -1;
+		if (mb_downloadmanager_queue(MB_DELUGE_CONFIG, "", deluge_limit) == -1) {
+			LOG_PRINT_ERROR("Could not queue deluged rate limit");
+		}
+		if ((dir = mb_downloadmanager_getdir()) != NULL) {
+			(void) avbox_cgroup_setiolimit(DELUGED_NAME, dir,
+				deluge_active ? io : 0);
+			free(dir);
+		}
+		deluge_throttled = deluge_active;
+	}
+
+	if (throttled && now >= next_report) {
+		mb_downloadmanager_report(now);
+		next_report = now + MB_DOWNLOADS_REPORT;
+	}
+}
+
+
+/**
+ * Gets the time of the next connection attempt and doubles
+ * the delay for the one after. The delay is only reset once
+ * we're logged in so a daemon that accepts connections but
+ * fails the login doesn't get hammered.
+ */
+static int64_t
+mb_deluge_backoff(struct mb_deluge_conn * const c, const int64_t now)
+{
+	const int64_t next = now + c->backoff;
+	if ((c->backoff *= 2) > MB_DELUGE_BACKOFF_MAX) {
+		c->backoff = MB_DELUGE_BACKOFF_MAX;
+	}
+	return next;
+}
+
+
+/**
+ * Connection thread.
+ */
+static void *
+mb_downloadmanager_thread(void *arg)
+{
+	int i, timeout;
+	int64_t now, next_connect = 0, next_refresh = 0;
+	uint64_t cnt;
+	struct pollfd fds[2];
+	struct mb_deluge_request *req;
+	struct mb_deluge_conn c;
+
+	(void) arg;
+
+	DEBUG_SET_THREAD_NAME("downloads");
+
+	memset(&c, 0, sizeof(c));
+	c.fd = -1;
+	c.next_id = 1;
+	c.backoff = MB_DELUGE_BACKOFF_MIN;
+	LIST_INIT(&c.pending);
+
+	while (!quit) {
+		timeout = -1;
+		now = mb_deluge_now();
+
+		if (c.fd == -1) {
+			if (now < next_connect) {
+				timeout = next_connect - now;
+			} else if (mb_deluge_connect(&c) == -1 ||
+				mb_deluge_callsimple(&c, MB_DELUGE_LOGIN) == -1) {
+				/* the daemon may still be starting */
+				mb_deluge_disconnect(&c);
+				next_connect = mb_deluge_backoff(&c, now);
+				timeout = next_connect - now;
+			}
+		}
+
+		/* the built-in downloads don't depend on
+		 * the daemon so refresh them on their own */
+		mb_downloadmanager_throttle(now);
+
+		if (throttled || mb_downloadmanager_hassubscribers()) {
+			if (now >= next_refresh) {
+				mb_downloadmanager_refresh();
+				next_refresh = now + MB_DOWNLOADS_REFRESH;
+			}
+			if (timeout == -1 || timeout > next_refresh - now) {
+				timeout = next_refresh - now;
+			}
+		}
+
+		if (c.logged_in) {
+			/* send queued requests */
+			pthread_mutex_lock(&lock);
+			while ((req = LIST_NEXT(struct mb_deluge_request*, &outbox)) !=
+				(struct mb_deluge_request*) &outbox) {
+				LIST_REMOVE(req);
+				pthread_mutex_unlock(&lock);
+				if (mb_deluge_call(&c, req) == -1) {
+					pthread_mutex_lock(&lock);
+					LIST_ADD(&outbox, req);
+					pthread_mutex_unlock(&lock);
+					goto disconnect;
+				}
+				pthread_mutex_lock(&lock);
+			}
+			pthread_mutex_unlock(&lock);
+
+			/* poll the pieces of the torrents we're streaming */
+			if ((i = mb_downloadmanager_pollstreams(&c, now)) == -1) {
+				goto disconnect;
+			} else if (i != INT_MAX && (timeout == -1 || timeout > i)) {
+				timeout = i;
+			}
+
+			/* poll the daemon while someone is watching */
+			if (!c.status_pending && (throttled || mb_downloadmanager_hassubscribers())) {
+				if ((now = mb_deluge_now()) >= c.next_poll) {
+					if (mb_deluge_callsimple(&c, MB_DELUGE_STATUS) == -1) {
+						goto disconnect;
+					}
+					c.status_pending = 1;
+				} else if (timeout == -1 || timeout > c.next_poll - now) {
+					timeout = c.next_poll - now;
+				}
+			}
+		}
+
+		/* the built-in downloads are streamed without the daemon */
+		if (!c.logged_in && (i = mb_downloadmanager_pollstreams(&c, now)) != INT_MAX &&
+			(timeout == -1 || timeout > i)) {
+			timeout = i;
+		}
+
+		/* TLS may have buffered data */
+		if (c.ssl != NULL && SSL_pending(c.ssl) > 0) {
+			timeout = 0;
+		}
+
+		fds[0].fd = c.fd;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		fds[1].fd = wakefd;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+		if (poll(fds, 2, timeout) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG_VPRINT_ERROR("poll() failed: %s", strerror(errno));
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			(void) read(wakefd, &cnt, sizeof(cnt));
+		}
+
+		if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) ||
+			(c.ssl != NULL && SSL_pending(c.ssl) > 0)) {
+			if (mb_deluge_read(&c) <= 0 || mb_deluge_parse(&c) == -1) {
+				goto disconnect;
+			}
+		}
+		continue;
+disconnect:
+		LOG_PRINT_ERROR("Lost connection to deluged. Reconnecting");
+		mb_deluge_disconnect(&c);
+		next_connect = mb_deluge_backoff(&c, mb_deluge_now());
+	}
+
+	mb_deluge_disconnect(&c);
+	free(c.rbuf);
+	return NULL;
+}
+
+
+/**
+ * Adds a URL (or magnet link) to the download queue. Plain
+ * HTTP and FTP files go to the built-in downloader and
+ * everything else to deluged.
+ */
+int
+mb_downloadmanager_addurl(const char * const url)
+{
+	const size_t len = strlen(url);
+
+	DEBUG_VPRINT("download-backend", "Adding %s", url);
+
+	if ((!strncasecmp(url, "http://", 7) || !strncasecmp(url, "https://", 8) ||
+		!strncasecmp(url, "ftp://", 6) || !strncasecmp(url, "ftps://", 7)) &&
+		(len < 8 || strcasecmp(url + len - 8, ".torrent"))) {
+		if (avbox_download_add(url, NULL) == -1) {
+			return -1;
+		}
+		mb_downloadmanager_wake();
+		return 0;
+	}
+	return mb_downloadmanager_queue(MB_DELUGE_ADD, url, 0);
+}
+
+
+/**
+ * Removes a download.
+ */
+int
+mb_downloadmanager_remove(const char * const id, const int remove_data)
+{
+	DEBUG_VPRINT("download-backend", "Removing %s", id);
+	if (!strncmp(id, MB_DOWNLOADS_NATIVE, sizeof(MB_DOWNLOADS_NATIVE) - 1)) {
+		return avbox_download_remove(atoi(id + sizeof(MB_DOWNLOADS_NATIVE) - 1),
+			remove_data);
+	}
+	return mb_downloadmanager_queue(MB_DELUGE_REMOVE, id, remove_data);
+}
+
+
+/**
+ * Stream a download.
+ */
+int
+mb_downloadmanager_stream(const char * const id, struct avbox_object * const object)
+{
+	struct mb_downloads_stream *stream;
+
+	DEBUG_VPRINT("download-backend", "Streaming %s", id);
+
+	pthread_mutex_lock(&lock);
+	LIST_FOREACH(struct mb_downloads_stream*, stream, &streams) {
+		if (!strcmp(stream->id, id)) {
+			/* already streaming. Send the reply
+			 * now if we have one */
+			stream->object = object;
+			if (stream->partfile != NULL && access(stream->path, R_OK) == 0) {
+				mb_downloadmanager_streamreply(stream, 0);
+			}
+			pthread_mutex_unlock(&lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	if ((stream = malloc(sizeof(struct mb_downloads_stream))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return -1;
+	}
+	memset(stream, 0, sizeof(struct mb_downloads_stream));
+	snprintf(stream->id, sizeof(stream->id), "%s", id);
+	stream->object = object;
+
+	pthread_mutex_lock(&lock);
+	LIST_APPEND(&streams, stream);
+	pthread_mutex_unlock(&lock);
+
+	mb_downloadmanager_wake();
+	return 0;
+}
+
+
+/**
+ * Subscribe an object to download status updates.
+ */
+int
+mb_downloadmanager_subscribe(struct avbox_object * const object)
+{
+	struct mb_downloads_subscriber *sub;
+
+	if ((sub = malloc(sizeof(struct mb_downloads_subscriber))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return -1;
+	}
+	sub->object = object;
+
+	pthread_mutex_lock(&lock);
+	LIST_APPEND(&subscribers, sub);
+	if (snapshot != NULL) {
+		mb_downloadmanager_publish(object);
+	}
+	pthread_mutex_unlock(&lock);
+
+	/* start polling */
+	mb_downloadmanager_wake();
+	return 0;
+}
+
+
+/**
+ * Unsubscribe from status updates.
+ */
+void
+mb_downloadmanager_unsubscribe(struct avbox_object * const object)
+{
+	struct mb_downloads_subscriber *sub;
+	struct mb_downloads_stream *stream;
+	pthread_mutex_lock(&lock);
+	LIST_FOREACH_SAFE(struct mb_downloads_subscriber*, sub, &subscribers, {
+		if (sub->object == object) {
+			LIST_REMOVE(sub);
+			free(sub);
+			break;
+		}
+	});
+	LIST_FOREACH(struct mb_downloads_stream*, stream, &streams) {
+		if (stream->object == object) {
+			stream->object = NULL;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ * Handle player status notifications.
+ */
+static int
+mb_downloadmanager_playerhandler(void *context, struct avbox_message *msg)
+{
+	int changed;
+
+	(void) context;
+
+	switch (avbox_message_id(msg)) {
+	case AVBOX_MESSAGETYPE_PLAYER:
+	{
+		const struct avbox_player_status_data * const data =
+			avbox_message_payload(msg);
+		const int active = (data->status == MB_PLAYER_STATUS_PLAYING ||
+			data->status == MB_PLAYER_STATUS_BUFFERING);
+
+		pthread_mutex_lock(&lock);
+		changed = (playback != active);
+		playback = active;
+		pthread_mutex_unlock(&lock);
+
+		if (changed) {
+			mb_downloadmanager_wake();
+		}
+
+		/* the next subscriber frees the payload */
+		return AVBOX_DISPATCH_CONTINUE;
+	}
+	case AVBOX_MESSAGETYPE_DESTROY:
+	case AVBOX_MESSAGETYPE_CLEANUP:
+		break;
+	default:
+		return AVBOX_DISPATCH_CONTINUE;
+	}
+	return AVBOX_DISPATCH_OK;
+}
+
+
+/**
+ * Throttle downloads while a player is active.
+ */
+int
+mb_downloadmanager_watchplayer(struct avbox_player * const inst)
+{
+	ASSERT(player == NULL);
+
+	if ((player_object = avbox_object_new(
+		mb_downloadmanager_playerhandler, NULL)) == NULL) {
+		LOG_VPRINT_ERROR("Could not create player object: %s",
+			strerror(errno));
+		return -1;
+	}
+	if (avbox_player_subscribe(inst, player_object) == -1) {
+		LOG_VPRINT_ERROR("Could not subscribe to player: %s",
+			strerror(errno));
+		avbox_object_destroy(player_object);
+		player_object = NULL;
+		return -1;
+	}
+	player = inst;
+	return 0;
+}
+
+
+/**
+ * Stop watching the player and remove the limits.
+ */
+void
+mb_downloadmanager_unwatchplayer(void)
+{
+	if (player == NULL) {
+		return;
+	}
+
+	(void) avbox_player_unsubscribe(player, player_object);
+	avbox_object_destroy(player_object);
+	player_object = NULL;
+	player = NULL;
+
+	pthread_mutex_lock(&lock);
+	playback = 0;
+	pthread_mutex_unlock(&lock);
+	mb_downloadmanager_wake();
 }
 
 
@@ -88,6 +1916,10 @@ mb_downloadmanager_init(void)
 
 	DEBUG_PRINT("download-backend", "Initializing download manager");
 
+	LIST_INIT(&outbox);
+	LIST_INIT(&subscribers);
+	LIST_INIT(&streams);
+
 	/* create all config files for deluged */
 	umask(000);
 
@@ -96,14 +1928,44 @@ mb_downloadmanager_init(void)
 	cp(DATADIR "/mediabox/deluge/auth", "/tmp/mediabox/deluge/auth");
 	unlink("/tmp/mediabox/deluge/deluged.pid");
 
+	/* start the built-in downloader */
+	if (avbox_download_init() == -1) {
+		LOG_PRINT_ERROR("Could not initialize downloader");
+		return -1;
+	}
+
 	/* launch the deluged process */
 	if ((daemon_id = avbox_process_start(DELUGED_BIN, (const char **) args,
-		AVBOX_PROCESS_AUTORESTART | AVBOX_PROCESS_NICE | AVBOX_PROCESS_IONICE_IDLE | AVBOX_PROCESS_SUPERUSER,
-		"Deluge Daemon", NULL, NULL)) == -1) {
+		AVBOX_PROCESS_AUTORESTART | AVBOX_PROCESS_NICE | AVBOX_PROCESS_IONICE_IDLE | AVBOX_PROCESS_SUPERUSER |
+		AVBOX_PROCESS_CGROUP, DELUGED_NAME, NULL, NULL)) == -1) {
 		fprintf(stderr, "download-backend: Could not start deluge daemon\n");
+		avbox_download_shutdown();
+		return -1;
+	}
+
+	if ((wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+		LOG_VPRINT_ERROR("Could not create eventfd: %s",
+			strerror(errno));
+		avbox_process_stop(daemon_id);
+		daemon_id = -1;
+		avbox_download_shutdown();
 		return -1;
 	}
-return 0;
+
+	/* start the connection thread. It will keep
+	 * trying until the daemon is up */
+	quit = 0;
+	if (pthread_create(&thread, NULL, mb_downloadmanager_thread, NULL) != 0) {
+		LOG_PRINT_ERROR("Could not start connection thread");
+		close(wakefd);
+		wakefd = -1;
+		avbox_process_stop(daemon_id);
+		daemon_id = -1;
+		avbox_download_shutdown();
+		return -1;
+	}
+
+	return 0;
 }
 
 
@@ -113,9 +1975,41 @@ return 0;
 void
 mb_downloadmanager_destroy(void)
 {
+	struct mb_deluge_request *req;
+	struct mb_downloads_subscriber *sub;
+	struct mb_downloads_stream *stream;
+
 	DEBUG_PRINT("download-backend", "Shutting down download manager");
 
+	if (wakefd != -1) {
+		quit = 1;
+		mb_downloadmanager_wake();
+		pthread_join(thread, NULL);
+		close(wakefd);
+		wakefd = -1;
+
+		LIST_FOREACH_SAFE(struct mb_deluge_request*, req, &outbox, {
+			LIST_REMOVE(req);
+			mb_deluge_freerequest(req);
+		});
+		LIST_FOREACH_SAFE(struct mb_downloads_subscriber*, sub, &subscribers, {
+			LIST_REMOVE(sub);
+			free(sub);
+		});
+		LIST_FOREACH_SAFE(struct mb_downloads_stream*, stream, &streams, {
+			stream->object = NULL;
+			mb_downloadmanager_freestream(stream, ECANCELED);
+		});
+		free(snapshot);
+		snapshot = NULL;
+		free(torrents);
+		torrents = NULL;
+	}
+
+	avbox_download_shutdown();
+
 	if (daemon_id != -1) {
 		avbox_process_stop(daemon_id);
+		daemon_id = -1;
 	}
 }
@@ -5,10 +5,122 @@
 
 #ifndef __MB_DLBE_H__
 #define __MB_DLBE_H__
+#include <stdint.h>
+#include <limits.h>
+#include "lib/dispatch.h"
 
 
+struct avbox_player;
+
+
+/**
+ * Sent to subscribers when the downloads list changes. The
+ * payload is a struct mb_downloads_update that the receiver
+ * must free.
+ */
+#define MB_MESSAGETYPE_DOWNLOADS	(AVBOX_MESSAGETYPE_USER)
+
+
+/**
+ * Sent in reply to mb_downloadmanager_stream(). The payload
+ * is a struct mb_downloads_stream_reply that the receiver
+ * must free.
+ */
+#define MB_MESSAGETYPE_DOWNLOADS_STREAM	(AVBOX_MESSAGETYPE_USER + 1)
+
+
+/**
+ * Status of a download.
+ */
+struct mb_download_status
+{
+	char id[48];
+	char name[256];
+	char state[16];
+	float progress;		/* percent */
+	int64_t total_size;	/* bytes */
+	int64_t eta;		/* seconds */
+	int download_rate;	/* bytes/sec */
+	int upload_rate;	/* bytes/sec */
+};
+
+
+/**
+ * Snapshot of the downloads list.
+ */
+struct mb_downloads_update
+{
+	int n;
+	struct mb_download_status items[];
+};
+
+
+/**
+ * Reply to a stream request. If error is 0 path can be
+ * played while it downloads.
+ */
+struct mb_downloads_stream_reply
+{
+	char id[48];
+	char path[PATH_MAX];
+	int error;
+};
+
+
+/**
+ * Adds a URL (or magnet link) to the download queue. The
+ * request is queued and sent to the daemon asynchronously.
+ */
+int
+mb_downloadmanager_addurl(const char * const url);
+
+
+/**
+ * Removes a download.
+ */
+int
+mb_downloadmanager_remove(const char * const id, const int remove_data);
+
+
+/**
+ * Stream a download. The torrent is switched to sequential
+ * download and the object gets a MB_MESSAGETYPE_DOWNLOADS_STREAM
+ * message with the path to play once there is something to play.
+ */
+int
+mb_downloadmanager_stream(const char * const id, struct avbox_object * const object);
+
+
+/**
+ * Subscribe an object to download status updates. The current
+ * list is sent right away and after that only when it changes.
+ */
 int
-mb_downloadmanager_addurl(char *url);
+mb_downloadmanager_subscribe(struct avbox_object * const object);
+
+
+/**
+ * Unsubscribe from status updates. Pending stream replies
+ * to the object are dropped.
+ */
+void
+mb_downloadmanager_unsubscribe(struct avbox_object * const object);
+
+
+/**
+ * Throttle downloads while the player is playing or buffering.
+ * The limits are set by the downloads.playback.rate and
+ * downloads.playback.io settings (KiB/s).
+ *
+ * Player notifications are anycast so this must be called
+ * before subscribing objects that consume them.
+ */
+int
+mb_downloadmanager_watchplayer(struct avbox_player * const inst);
+
+
+void
+mb_downloadmanager_unwatchplayer(void);
 
 
 int
@@ -18,34 +18,25 @@
 #include "lib/log.h"
 #include "lib/debug.h"
 #include "lib/dispatch.h"
-#include "lib/process.h"
-#include "lib/timers.h"
-#include "lib/thread.h"
 #include "lib/application.h"
 #include "lib/ui/video.h"
 #include "lib/ui/listview.h"
 #include "lib/ui/input.h"
+#include "lib/ui/player.h"
 #include "lib/linkedlist.h"
+#include "downloads-backend.h"
+#include "shell.h"
 
-#ifdef ENABLE_IONICE
-#include "lib/ionice.h"
-#include "lib/su.h"
-#endif
-
-#define DELUGE_BIN "/usr/bin/deluge-console"
-
-
-LISTABLE_STRUCT(mbox_download,
-	char *id;
-	char *name;
-	int updated;
-);
 
-struct finditemdata
+/**
+ * A row of the downloads list. The listview items point
+ * to these.
+ */
+struct mbox_download
 {
-	int found;
-	char *item;
-	char *id;
+	char id[48];
+	char *text;
+	int seen;
 };
 
 
@@ -54,354 +45,141 @@ struct mbox_downloads
 	struct avbox_window *window;
 	struct avbox_listview *menu;
 	struct avbox_object *parent_object;
-	struct avbox_delegate *worker;
-	int update_timer_id;
-	LIST downloads;
+	struct mbox_download **model;	/* sorted by id */
+	int n_model;
 };
 
-struct mbox_downloads_update_context
-{
-	struct avbox_listview *list;
-	char *id;
-	char *name;
-};
-
-
-/**
- * Removes an item from the list from main thread.
- */
-static void *
-mbox_downloads_removeitem(void *arg)
-{
-	struct mbox_downloads_update_context * const ctx = arg;
-	DEBUG_VPRINT("downloads", "Removing listview item %s",
-		ctx->id);
-	avbox_listview_removeitem(ctx->list, ctx->id);
-	return NULL;
-}
-
 
-/**
- * Adds an entry to the list from the main thread.
- */
-static void *
-mbox_downloads_additem(void *arg)
+static int
+mbox_downloads_compare(const void *a, const void *b)
 {
-	struct mbox_downloads_update_context * const ctx = arg;
-	DEBUG_VPRINT("downloads", "Adding listview item (name=%s)",
-		ctx->name);
-	avbox_listview_additem(ctx->list, ctx->name, ctx->id);
-	return NULL;
+	return strcmp((*(struct mbox_download * const *) a)->id,
+		(*(struct mbox_download * const *) b)->id);
 }
 
 
-/**
- * Updates a listview entry from the main thread.
- */
-static void *
-mbox_downloads_updateitem(void *arg)
+static int
+mbox_downloads_comparekey(const void *key, const void *b)
 {
-	struct mbox_downloads_update_context * const ctx = arg;
-	DEBUG_VPRINT("downloads", "Updating listview item (name=%s)",
-		ctx->name);
-	avbox_listview_setitemtext(ctx->list, ctx->id, ctx->name);
-	return NULL;
+	return strcmp(key, (*(struct mbox_download * const *) b)->id);
 }
 
 
 /**
- * Updates the window from the main thread.
+ * Free the model.
  */
-static void *
-mbox_downloads_updatewindow(void *arg)
+static void
+mbox_downloads_freemodel(struct mbox_downloads * const inst)
 {
-	struct avbox_window * const window = arg;
-	avbox_window_update(window);
-	return NULL;
+	int i;
+	for (i = 0; i < inst->n_model; i++) {
+		free(inst->model[i]->text);
+		free(inst->model[i]);
+	}
+	free(inst->model);
+	inst->model = NULL;
+	inst->n_model = 0;
 }
 
 
 /**
- * Updates an entry on the downloads list.
- * NOTE: This function is called by mbox_downloads_populatelistasync()
- * which is called from a background thread.
+ * Apply a status update from the download manager. The update
+ * is diffed against the model by id and only the rows that
+ * changed are touched and repainted.
  */
-static int
-mbox_downloads_updateentry(struct mbox_downloads *inst, char *id, char *name)
+static void
+mbox_downloads_update(struct mbox_downloads * const inst,
+	const struct mb_downloads_update * const update)
 {
-	int found = 0;
-	struct mbox_download *dl;
-	struct mbox_downloads_update_context ctx;
-	struct avbox_delegate *del;
-
-	DEBUG_VPRINT("downloads", "Updating entry (id=%s, name=%s)",
-		id, name);
+	int i, n = 0, changed = 0;
+	char buf[512];
+	struct mbox_download *dl, **pdl, **model;
 
-	LIST_FOREACH(struct mbox_download*, dl, &inst->downloads) {
-		if (!strcmp(dl->id, id)) {
-			found = 1;
-			break;
-		}
+	if ((model = malloc((update->n + 1) * sizeof(struct mbox_download*))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return;
 	}
 
-	if (found) {
-		assert(dl->name != NULL);
-		free(dl->name);
-		if ((dl->name = strdup(name)) == NULL) {
-			fprintf(stderr, "downloads: Out of memory\n");
-		}
-
-		dl->updated = 1;
+	for (i = 0; i < update->n; i++) {
+		const struct mb_download_status * const item = &update->items[i];
 
-		/* update listview item from main thread */
-		ctx.list = inst->menu;
-		ctx.id = dl->id;
-		ctx.name = name;
-		if ((del = avbox_window_delegate(inst->window,
-			mbox_downloads_updateitem, &ctx)) == NULL) {
-			LOG_VPRINT_ERROR("Could not update item: %s",
-				strerror(errno));
+		if (item->download_rate >= 1024 * 1024) {
+			snprintf(buf, sizeof(buf), "%s (%.2f%%, %.1f MB/s)",
+				item->name, item->progress, item->download_rate / (1024.0 * 1024.0));
+		} else if (item->download_rate > 0) {
+			snprintf(buf, sizeof(buf), "%s (%.2f%%, %i KB/s)",
+				item->name, item->progress, item->download_rate / 1024);
 		} else {
-			avbox_delegate_wait(del, NULL);
+			snprintf(buf, sizeof(buf), "%s (%.2f%%)",
+				item->name, item->progress);
 		}
 
-	} else {
-		if ((dl = malloc(sizeof(struct mbox_download))) == NULL) {
-			fprintf(stderr, "downloads: Out of memory\n");
-			return -1;
-		}
-		if ((dl->id = strdup(id)) == NULL) {
-			fprintf(stderr, "downloads: Out of memory\n");
-			free(dl);
-			return -1;
-		}
-		if ((dl->name = strdup(name)) == NULL) {
-			fprintf(stderr, "downloads: Out of memory\n");
-			free(dl->id);
-			free(dl);
-			return -1;
-		}
-
-		dl->updated = 1;
-
-		/* add item to in-memory list */
-		LIST_ADD(&inst->downloads, dl);
-
-		/* add entry to listview from main thread */
-		ctx.list = inst->menu;
-		ctx.name = dl->name;
-		ctx.id = dl->id;
-		if ((del = avbox_window_delegate(inst->window,
-			mbox_downloads_additem, &ctx)) == NULL) {
-			LOG_VPRINT_ERROR("Could not update entry: %s",
-				strerror(errno));
-		} else {
-			avbox_delegate_wait(del, NULL);
-		}
-	}
-	return 0;
-}
-
-
-/**
- * Free listview item.
- */
-static int
-mbox_downloads_freeitems(void *item, void *data)
-{
-	(void) data;
-	free(item);
-	return 0;
-}
-
-
-/**
- * Populates the downloads list from a background thread.
- */
-static void*
-mbox_downloads_populatelistasync(void *data)
-{
-	int process_id, exit_status = -1;
-	FILE *f;
-	size_t n = 0;;
-	char *str = NULL, *name = NULL, *id = NULL, *progress = NULL, *progressbar = NULL;
-	char buf[512];
-	struct mbox_downloads * const inst = data;
-	struct avbox_delegate * del;
-	const char * const deluge_args[] =
-	{
-		"deluge-console",
-		"connect",
-		"127.0.0.1",
-		"mediabox",
-		"mediabox;",
-		"info",
-		NULL
-	};
-
-	DEBUG_PRINT("downloads", "Populating list (background)");
-
-	/* run the deluge-console process */
-	if ((process_id = avbox_process_start(DELUGE_BIN, deluge_args,
-		AVBOX_PROCESS_NICE | AVBOX_PROCESS_SUPERUSER | AVBOX_PROCESS_STDOUT_PIPE |
-		AVBOX_PROCESS_WAIT, "deluge-console", NULL, NULL)) == -1) {
-		LOG_PRINT_ERROR("Could not execute deluge-console");
-		return (void*) (intptr_t) -1;
-	}
-
-	f = fdopen(avbox_process_openfd(process_id, STDOUT_FILENO), "r");
-	if (f == NULL) {
-		LOG_PRINT_ERROR("Could not open stream");
-		return (void*) (intptr_t) -1;
-	} else {
-		while (getline(&str, &n, f) != -1) {
-			if (str != NULL) {
-				if (!memcmp(str, "Name: ", 6)) {
-					str[strlen(str) - 1] = '\0';
-					name = strdup(str + 6);
-					if (name == NULL) {
-						LOG_PRINT_ERROR("Out of memory");
-					}
-					/* fprintf(stderr, "Name: %s\n", name); */
-
-				} else if (!memcmp("ID: ", str, 4)) {
-					if (name != NULL) {
-						str[strlen(str) - 1] = '\0';
-						id = strdup(str + 4);
-						if (id == NULL) {
-							LOG_PRINT_ERROR("Out of memory");
-							free(name);
-							name = NULL;
-						} else {
-							/* fprintf(stderr, "ID: %s\n", id); */
-						}
-					}
-
-				} else if (!memcmp("Progress: ", str, 10)) {
-					if (id != NULL) {
-						progress = str + 10;
-						progressbar = progress;
-
-						while (*progressbar != ' ') {
-							progressbar++;
-						}
-						*progressbar++ = '\0';
-						progressbar[strlen(progressbar) -1] = '\0';
-
-						if ((progress = strdup(progress)) == NULL) {
-							LOG_PRINT_ERROR("Out of memory");
-							free(id);
-							free(name);
-							id = NULL;
-							name = NULL;
-						} else if ((progressbar = strdup(progressbar)) == NULL) {
-							LOG_PRINT_ERROR("Out of memory");
-							free(progress);
-							free(id);
-							free(name);
-							progress = NULL;
-							id = NULL;
-							name = NULL;
-						} else {
-							snprintf(buf, 512, "%s (%s)",
-								name, progress);
-
-							mbox_downloads_updateentry(inst, id, buf);
-
-							free(name);
-							free(progress);
-							free(progressbar);
-							free(id);
-							name = NULL;
-							progress = NULL;
-							progressbar = NULL;
-							id = NULL;
-						}
-					}
-				}
-				free(str);
-				str = NULL;
-				n = 0;
+		if ((pdl = bsearch(item->id, inst->model, inst->n_model,
+			sizeof(struct mbox_download*), mbox_downloads_comparekey)) != NULL) {
+			dl = *pdl;
+			if (dl->seen) {
+				continue;
 			}
-		}
-		fclose(f);
-
-		if (str != NULL) {
-			free(str);
-		}
-
-		struct mbox_download *dl;
-		LIST_FOREACH_SAFE(struct mbox_download*, dl, &inst->downloads, {
-			if (!dl->updated) {
-				struct mbox_downloads_update_context ctx;
-				ctx.list = inst->menu;
-				ctx.id = dl->id;
-				if ((del = avbox_window_delegate(inst->window,
-					mbox_downloads_removeitem, &ctx)) == NULL) {
-					LOG_VPRINT_ERROR("Could not remove entry: %s",
-						strerror(errno));
-				} else {
-					avbox_delegate_wait(del, NULL);
+			if (strcmp(dl->text, buf)) {
+				char * const text = strdup(buf);
+				if (text != NULL) {
+					DEBUG_VPRINT("downloads", "Updating listview item (name=%s)",
+						buf);
+					free(dl->text);
+					dl->text = text;
+					avbox_listview_setitemtext(inst->menu, dl, dl->text);
+					changed++;
 				}
-				LIST_REMOVE(dl);
-				free(dl->id);
-				free(dl->name);
+			}
+		} else {
+			if ((dl = malloc(sizeof(struct mbox_download))) == NULL) {
+				ASSERT(errno == ENOMEM);
+				continue;
+			}
+			if ((dl->text = strdup(buf)) == NULL) {
+				ASSERT(errno == ENOMEM);
+				free(dl);
+				continue;
+			}
+			snprintf(dl->id, sizeof(dl->id), "%s", item->id);
+			DEBUG_VPRINT("downloads", "Adding listview item (name=%s)",
+				dl->text);
+			if (avbox_listview_additem(inst->menu, dl->text, dl) == -1) {
+				free(dl->text);
 				free(dl);
-			} else {
-				dl->updated = 0;
+				continue;
 			}
-		});
+			changed++;
+		}
+		dl->seen = 1;
+		model[n++] = dl;
 	}
 
-	/* update the window from the main thread */
-	if ((del = avbox_window_delegate(inst->window,
-		mbox_downloads_updatewindow, inst->window)) == NULL) {
-		LOG_VPRINT_ERROR("Could not update window: %s",
-			strerror(errno));
-	} else {
-		avbox_delegate_wait(del, NULL);
+	/* remove the entries that are gone */
+	for (i = 0; i < inst->n_model; i++) {
+		dl = inst->model[i];
+		if (!dl->seen) {
+			DEBUG_VPRINT("downloads", "Removing listview item %s",
+				dl->id);
+			avbox_listview_removeitem(inst->menu, dl);
+			free(dl->text);
+			free(dl);
+			changed++;
+		}
 	}
 
-	/* wait for process to exit */
-	if (avbox_process_wait(process_id, &exit_status) == -1) {
-		LOG_PRINT(MB_LOGLEVEL_ERROR, "download", "avbox_process_wait() failed");
-		return (void*) (intptr_t) -1;
+	for (i = 0; i < n; i++) {
+		model[i]->seen = 0;
 	}
+	qsort(model, n, sizeof(struct mbox_download*), mbox_downloads_compare);
 
-	DEBUG_PRINT("downloads", "List populated");
-	return (void*) (intptr_t) ((exit_status == 0) ? 0 : -1);
-}
-
+	free(inst->model);
+	inst->model = model;
+	inst->n_model = n;
 
-/**
- * Manages the background thread that updates the list.
- */
-static void
-mbox_downloads_populatelist(int id, void *data)
-{
-	struct mbox_downloads * const inst = data;
-
-	/* if the background thread is still running */
-	if (inst->worker != NULL) {
-		/* check if it finished and collect result */
-		if (avbox_delegate_finished(inst->worker)) {
-			void *result;
-			DEBUG_PRINT("downloads", "Worker completed");
-			avbox_delegate_wait(inst->worker, &result);
-			inst->worker = NULL;
-			if ((intptr_t) result != 0) {
-				avbox_timer_cancel(inst->update_timer_id);
-				inst->update_timer_id = -1;
-			}
-		}
-	} else {
-		DEBUG_PRINT("downloads", "Populating list");
-		/* populate the list from a background thread */
-		if ((inst->worker = avbox_thread_delegate(
-			mbox_downloads_populatelistasync, data)) == NULL) {
-			LOG_VPRINT_ERROR("Could not populate list: %s",
-				strerror(errno));
-		}
+	/* lay out and repaint only what changed */
+	if (changed) {
+		avbox_listview_update(inst->menu);
 	}
 }
 
@@ -417,20 +195,65 @@ mbox_downloads_messagehandler(void *context, struct avbox_message *msg)
 	switch (avbox_message_id(msg)) {
 	case AVBOX_MESSAGETYPE_SELECTED:
 	{
-#ifndef NDEBUG
-		char *selected = avbox_listview_getselected(inst->menu);
+		struct mbox_download * const selected =
+			avbox_listview_getselected(inst->menu);
 		assert(selected != NULL);
 		DEBUG_VPRINT("downloads", "Selected %s",
-			selected);
-#endif
+			selected->id);
+
+		/* we play it once there's something to play */
+		if (mb_downloadmanager_stream(selected->id,
+			avbox_window_object(inst->window)) == -1) {
+			LOG_VPRINT_ERROR("Could not stream %s: %s",
+				selected->id, strerror(errno));
+		}
 		break;
 	}
-	case AVBOX_MESSAGETYPE_DISMISSED:
+	case MB_MESSAGETYPE_DOWNLOADS_STREAM:
 	{
-		/* cancel the update timer */
-		if (inst->update_timer_id != -1) {
-			avbox_timer_cancel(inst->update_timer_id);
+		struct avbox_player *player;
+		struct mb_downloads_stream_reply * const reply =
+			avbox_message_payload(msg);
+
+		if (reply->error != 0) {
+			LOG_VPRINT_ERROR("Could not stream %s: %s",
+				reply->id, strerror(reply->error));
+			free(reply);
+			break;
+		}
+
+		/* get the active player instance */
+		if ((player = mbox_shell_getactiveplayer()) == NULL) {
+			LOG_PRINT_ERROR("Could not get active player!");
+			free(reply);
+			break;
+		}
+
+		if (avbox_player_play(player, reply->path) == 0) {
+			DEBUG_PRINT("downloads", "Play succeeded. Closing");
+
+			mb_downloadmanager_unsubscribe(avbox_window_object(inst->window));
+
+			/* hide window */
+			avbox_listview_releasefocus(inst->menu);
+			avbox_window_hide(inst->window);
+
+			/* send dismissed message */
+			if (avbox_object_sendmsg(&inst->parent_object,
+				AVBOX_MESSAGETYPE_DISMISSED, AVBOX_DISPATCH_UNICAST, inst) == NULL) {
+				LOG_VPRINT_ERROR("Could not send DISMISSED message: %s",
+					strerror(errno));
+			}
+		} else {
+			LOG_VPRINT_ERROR("Could not play %s", reply->path);
 		}
+		free(reply);
+		break;
+	}
+	case AVBOX_MESSAGETYPE_DISMISSED:
+	{
+		/* stop receiving updates */
+		mb_downloadmanager_unsubscribe(avbox_window_object(inst->window));
 
 		/* hide the downloads window */
 		avbox_listview_releasefocus(inst->menu);
@@ -445,40 +268,32 @@ mbox_downloads_messagehandler(void *context, struct avbox_message *msg)
 
 		break;
 	}
-	case AVBOX_MESSAGETYPE_TIMER:
+	case MB_MESSAGETYPE_DOWNLOADS:
 	{
-		struct avbox_timer_data * const timer_data =
+		struct mb_downloads_update * const update =
 			avbox_message_payload(msg);
-		mbox_downloads_populatelist(timer_data->id, timer_data->data);
-		free(timer_data);
+		mbox_downloads_update(inst, update);
+		free(update);
 		break;
 	}
 	case AVBOX_MESSAGETYPE_DESTROY:
 	{
-		if (inst->update_timer_id != -1) {
-			DEBUG_PRINT("downloads", "Cancelling update timer");
-			avbox_timer_cancel(inst->update_timer_id);
-		}
-
-		/* if the worker is still running wait for it
-		 * to exit */
-		if (inst->worker != NULL) {
-			DEBUG_PRINT("downloads", "Waiting for worker");
-			avbox_delegate_wait(inst->worker, NULL);
-		}
+		mb_downloadmanager_unsubscribe(avbox_window_object(inst->window));
 
 		if (avbox_window_isvisible(inst->window)) {
 			avbox_listview_releasefocus(inst->menu);
 			avbox_window_hide(inst->window);
 		}
 		if (inst->menu != NULL) {
-			avbox_listview_enumitems(inst->menu, mbox_downloads_freeitems, NULL);
 			avbox_listview_destroy(inst->menu);
 		}
 		break;
 	}
 	case AVBOX_MESSAGETYPE_CLEANUP:
 	{
+		/* the listview items point to the
+		 * model so free it last */
+		mbox_downloads_freemodel(inst);
 		free(inst);
 		break;
 	}
@@ -508,7 +323,6 @@ mbox_downloads_new(struct avbox_object *parent)
 	}
 
 	memset(inst, 0, sizeof(struct mbox_downloads));
-	LIST_INIT(&inst->downloads);
 
 	/* set height according to font size */
 	avbox_window_getcanvassize(avbox_video_getrootwindow(0), &xres, &yres);
@@ -551,8 +365,6 @@ mbox_downloads_new(struct avbox_object *parent)
 
 	/* initialize */
 	inst->parent_object = parent;
-	inst->update_timer_id = -1;
-	inst->worker = NULL;
 	return inst;
 }
 
@@ -560,21 +372,12 @@ mbox_downloads_new(struct avbox_object *parent)
 int
 mbox_downloads_show(struct mbox_downloads * const inst)
 {
-	struct timespec tv;
-
 	/* show the menu window */
         avbox_window_show(inst->window);
 
-	/* populate the list */
-	mbox_downloads_populatelist(0, inst);
-
-	/* register the update timer */
-	tv.tv_sec = 2;
-	tv.tv_nsec = 0;
-	inst->update_timer_id = avbox_timer_register(&tv,
-		AVBOX_TIMER_TYPE_AUTORELOAD | AVBOX_TIMER_MESSAGE,
-		avbox_window_object(inst->window), NULL, inst);
-	if (inst->update_timer_id == -1) {
+	/* the download manager sends the list right
+	 * away and then every time it changes */
+	if (mb_downloadmanager_subscribe(avbox_window_object(inst->window)) == -1) {
 		avbox_window_hide(inst->window);
 		return -1;
 	}
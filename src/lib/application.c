@@ -25,10 +25,13 @@
 #include "bluetooth.h"
 #include "application.h"
 #include "settings.h"
+#include "realtime.h"
+#include "cgroup.h"
 #include "timers.h"
 #include "process.h"
 #include "sysinit.h"
 #include "su.h"
+#include "url_util.h"
 #ifdef ENABLE_IONICE
 #include "ionice.h"
 #endif
@@ -203,6 +206,10 @@ avbox_application_delegate(avbox_delegate_fn func, void *arg)
 	/* send delegate to the main thread */
 	if (avbox_object_sendmsg(&dispatch_object,
 		AVBOX_MESSAGETYPE_DELEGATE, AVBOX_DISPATCH_UNICAST, del) == NULL) {
+		LOG_VPRINT_ERROR("Could not delegate to main thread: %s",
+			strerror(errno));
+		avbox_delegate_destroy(del);
+		return NULL;
 	}
 
 	return del;
@@ -382,12 +389,30 @@ avbox_application_init(int argc, char **cargv, const char *logf)
 		return -1;
 	}
 
+	/* initialize url fetcher */
+	if (mb_url_init() == -1) {
+		LOG_PRINT_ERROR("Could not initialize url fetcher");
+		return -1;
+	}
+
 	/* initialize settings database */
 	if (avbox_settings_init() == -1) {
 		LOG_PRINT_ERROR("Could not initialize settings database");
 		return -1;
 	}
 
+	/* load real-time settings */
+	if (avbox_rt_init() == -1) {
+		LOG_PRINT_ERROR("Could not initialize real-time settings");
+		return -1;
+	}
+
+	/* initialize cgroups for helper processes */
+	if (avbox_cgroup_init() == -1) {
+		LOG_PRINT_ERROR("Could not initialize cgroups");
+		return -1;
+	}
+
 	/* initialize timers system */
 	if (avbox_timers_init() != 0) {
 		LOG_PRINT_ERROR("Could not initialize timers subsystem");
@@ -515,12 +540,14 @@ avbox_application_run(void)
 	/* cleanup */
 	avbox_audiostream_shutdown();
 	avbox_process_shutdown();
+	avbox_cgroup_shutdown();
 	avbox_timers_shutdown();
 	avbox_settings_shutdown();
 	avbox_input_shutdown();
 #ifdef ENABLE_BLUETOOTH
 	avbox_bluetooth_shutdown();
 #endif
+	mb_url_shutdown();
 	avbox_thread_shutdown();
 	avbox_dispatch_shutdown();
 	avbox_video_shutdown();
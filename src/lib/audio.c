@@ -16,6 +16,7 @@
 #include "time_util.h"
 #include "math_util.h"
 #include "queue.h"
+#include "realtime.h"
 
 
 /**
@@ -373,6 +374,7 @@ avbox_audiostream_output(void *arg)
 	inst->framerate = 48000;
 
 	(void) avbox_gainroot();
+	(void) avbox_rt_enter(AVBOX_RT_AUDIO);
 
 	/* initialize alsa device */
 	if ((ret = snd_pcm_open(&inst->pcm_handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
@@ -580,6 +582,8 @@ end:
 	pthread_cond_signal(&inst->wake);
 	pthread_mutex_unlock(&inst->lock);
 
+	avbox_rt_leave();
+
 	return NULL;
 }
 
@@ -654,7 +654,7 @@ avbox_bluetooth_mainloop(void * arg)
 	/* launch the bluealsa process */
 	if ((bluealsa_daemon_id = avbox_process_start(BLUEALSA_BIN, bluealsa_args,
 		AVBOX_PROCESS_AUTORESTART | AVBOX_PROCESS_NICE | AVBOX_PROCESS_IONICE_IDLE |
-		AVBOX_PROCESS_SUPERUSER, "bluealsa", NULL, NULL)) == -1) {
+		AVBOX_PROCESS_SUPERUSER | AVBOX_PROCESS_CGROUP, "bluealsa", NULL, NULL)) == -1) {
 		LOG_PRINT_ERROR("WARNING!!: Could not start bluealsa daemon");
 	}
 
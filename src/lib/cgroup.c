@@ -0,0 +1,573 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <mntent.h>
+#include <pthread.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#define LOG_MODULE "cgroup"
+
+#include "log.h"
+#include "debug.h"
+#include "linkedlist.h"
+#include "settings.h"
+#include "cgroup.h"
+
+
+/* helpers get half the weight of mediabox by default */
+#define AVBOX_CGROUP_DEFAULT_WEIGHT	(50)
+
+
+/**
+ * A helper's group.
+ */
+LISTABLE_STRUCT(avbox_cgroup,
+	char name[32];
+	char *path;
+	int freeze;
+);
+
+
+static LIST groups;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char *base = NULL;
+static int paused = 0;
+
+
+/**
+ * Write a value to a file on a group.
+ */
+static int
+avbox_cgroup_write(const char * const dir, const char * const file,
+	const char * const value)
+{
+	int fd, ret = 0;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) == -1) {
+		return -1;
+	}
+	if (write(fd, value, strlen(value)) == -1) {
+		ret = -1;
+	}
+	close(fd);
+	return ret;
+}
+
+
+/**
+ * Read a file from a group.
+ */
+static int
+avbox_cgroup_read(const char * const dir, const char * const file,
+	char * const buf, const size_t bufsz)
+{
+	int fd;
+	ssize_t res;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		return -1;
+	}
+	if ((res = read(fd, buf, bufsz - 1)) == -1) {
+		close(fd);
+		return -1;
+	}
+	buf[res] = '\0';
+	close(fd);
+	return 0;
+}
+
+
+/**
+ * Gets the value of a key on a flat keyed file
+ * (like cpu.stat).
+ */
+static int64_t
+avbox_cgroup_getkey(const char * const buf, const char * const key)
+{
+	const char *p = buf;
+	const size_t len = strlen(key);
+
+	while ((p = strstr(p, key)) != NULL) {
+		if ((p == buf || p[-1] == '\n' || p[-1] == ' ') && p[len] == ' ') {
+			return strtoll(p + len + 1, NULL, 10);
+		}
+		p += len;
+	}
+	return 0;
+}
+
+
+/**
+ * Sum the values of a key for all devices on io.stat.
+ */
+static int64_t
+avbox_cgroup_getiokey(const char * const buf, const char * const key)
+{
+	int64_t ret = 0;
+	const char *p = buf;
+	const size_t len = strlen(key);
+
+	while ((p = strstr(p, key)) != NULL) {
+		if (p != buf && p[-1] == ' ' && p[len] == '=') {
+			ret += strtoll(p + len + 1, NULL, 10);
+		}
+		p += len;
+	}
+	return ret;
+}
+
+
+/**
+ * Gets the directory of the cgroup we're running on.
+ */
+static char *
+avbox_cgroup_self(void)
+{
+	FILE *f;
+	struct mntent *ent;
+	char *mnt = NULL, *line = NULL, *ret = NULL;
+	size_t n = 0;
+
+	/* find where cgroup2 is mounted */
+	if ((f = setmntent("/proc/self/mounts", "r")) == NULL) {
+		return NULL;
+	}
+	while ((ent = getmntent(f)) != NULL) {
+		if (!strcmp(ent->mnt_type, "cgroup2")) {
+			mnt = strdup(ent->mnt_dir);
+			break;
+		}
+	}
+	endmntent(f);
+	if (mnt == NULL) {
+		return NULL;
+	}
+
+	/* the unified hierarchy line looks like 0::/path */
+	if ((f = fopen("/proc/self/cgroup", "r")) == NULL) {
+		free(mnt);
+		return NULL;
+	}
+	while (getline(&line, &n, f) != -1) {
+		if (!strncmp(line, "0::", 3)) {
+			line[strcspn(line, "\n")] = '\0';
+			if ((ret = malloc(strlen(mnt) + strlen(line + 3) + 1)) != NULL) {
+				strcpy(ret, mnt);
+				if (strcmp(line + 3, "/")) {
+					strcat(ret, line + 3);
+				}
+			}
+			break;
+		}
+	}
+	free(line);
+	fclose(f);
+	free(mnt);
+	return ret;
+}
+
+
+/**
+ * Gets the size setting for a group's memory limit.
+ */
+static void
+avbox_cgroup_setmemory(struct avbox_cgroup * const group, const char * const file)
+{
+	char key[96], *value;
+
+	snprintf(key, sizeof(key), "cgroup.%s.%s", group->name,
+		(!strcmp(file, "memory.high")) ? "memory_high" : "memory_max");
+	if ((value = avbox_settings_getstring(key)) != NULL) {
+		if (avbox_cgroup_write(group->path, file, value) == -1) {
+			LOG_VPRINT_ERROR("Could not set %s for %s: %s",
+				file, group->name, strerror(errno));
+		}
+		free(value);
+	}
+}
+
+
+/**
+ * Gets a group. Creates it if it doesn't exist. The
+ * lock must be held.
+ */
+static struct avbox_cgroup *
+avbox_cgroup_get(const char * const name)
+{
+	int i, weight;
+	char key[96], buf[32];
+	struct avbox_cgroup *group;
+
+	/* the name is used on paths and settings keys */
+	for (i = 0; name[i] != '\0' && i < sizeof(buf) - 1; i++) {
+		buf[i] = isalnum(name[i]) ? tolower(name[i]) : '-';
+	}
+	buf[i] = '\0';
+
+	LIST_FOREACH(struct avbox_cgroup*, group, &groups) {
+		if (!strcmp(group->name, buf)) {
+			return group;
+		}
+	}
+
+	if ((group = malloc(sizeof(struct avbox_cgroup))) == NULL) {
+		LOG_PRINT_ERROR("Could not create group: Out of memory");
+		return NULL;
+	}
+	strcpy(group->name, buf);
+
+	if ((group->path = malloc(strlen(base) + strlen(group->name) + 2)) == NULL) {
+		LOG_PRINT_ERROR("Could not create group: Out of memory");
+		free(group);
+		return NULL;
+	}
+	sprintf(group->path, "%s/%s", base, group->name);
+
+	if (mkdir(group->path, 0755) == -1 && errno != EEXIST) {
+		LOG_VPRINT_ERROR("Could not create group %s: %s",
+			group->path, strerror(errno));
+		free(group->path);
+		free(group);
+		return NULL;
+	}
+
+	/* apply the group's settings */
+	snprintf(key, sizeof(key), "cgroup.%s.cpu_weight", group->name);
+	weight = avbox_settings_getint(key, AVBOX_CGROUP_DEFAULT_WEIGHT);
+	snprintf(buf, sizeof(buf), "%i", weight);
+	if (avbox_cgroup_write(group->path, "cpu.weight", buf) == -1) {
+		LOG_VPRINT_ERROR("Could not set cpu.weight for %s: %s",
+			group->name, strerror(errno));
+	}
+
+	snprintf(key, sizeof(key), "cgroup.%s.io_weight", group->name);
+	weight = avbox_settings_getint(key, AVBOX_CGROUP_DEFAULT_WEIGHT);
+	snprintf(buf, sizeof(buf), "default %i", weight);
+	if (avbox_cgroup_write(group->path, "io.weight", buf) == -1) {
+		LOG_VPRINT_ERROR("Could not set io.weight for %s: %s",
+			group->name, strerror(errno));
+	}
+
+	avbox_cgroup_setmemory(group, "memory.high");
+	avbox_cgroup_setmemory(group, "memory.max");
+
+	snprintf(key, sizeof(key), "cgroup.%s.freeze", group->name);
+	group->freeze = avbox_settings_getbool(key);
+
+	LIST_ADD(&groups, group);
+
+	DEBUG_VPRINT("cgroup", "Created group %s (freeze=%i)",
+		group->path, group->freeze);
+
+	return group;
+}
+
+
+/**
+ * Move a process to it's own group.
+ */
+int
+avbox_cgroup_attach(const char * const name, const pid_t pid)
+{
+	int ret = -1;
+	char buf[32];
+	struct avbox_cgroup *group;
+
+	if (base == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	if ((group = avbox_cgroup_get(name)) != NULL) {
+		snprintf(buf, sizeof(buf), "%i", (int) pid);
+		if ((ret = avbox_cgroup_write(group->path, "cgroup.procs", buf)) == -1) {
+			LOG_VPRINT_ERROR("Could not move process %i to %s: %s",
+				(int) pid, group->path, strerror(errno));
+		} else if (paused && group->freeze) {
+			(void) avbox_cgroup_write(group->path, "cgroup.freeze", "1");
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+
+/**
+ * Gets the whole disk device that holds a path. io.max
+ * doesn't take partitions.
+ */
+static int
+avbox_cgroup_getdisk(const char * const path, char * const dev, const size_t devsz)
+{
+	struct stat st;
+	char sysfs[PATH_MAX];
+
+	if (stat(path, &st) == -1) {
+		return -1;
+	}
+	if (major(st.st_dev) == 0) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	snprintf(sysfs, sizeof(sysfs), "/sys/dev/block/%u:%u/partition",
+		major(st.st_dev), minor(st.st_dev));
+	if (access(sysfs, F_OK) == 0) {
+		snprintf(sysfs, sizeof(sysfs), "/sys/dev/block/%u:%u/..",
+			major(st.st_dev), minor(st.st_dev));
+		if (avbox_cgroup_read(sysfs, "dev", dev, devsz) == -1) {
+			return -1;
+		}
+		dev[strcspn(dev, "\n")] = '\0';
+	} else {
+		snprintf(dev, devsz, "%u:%u", major(st.st_dev), minor(st.st_dev));
+	}
+	return 0;
+}
+
+
+/**
+ * Limit the IO bandwidth of a group on the
+ * disk that holds path.
+ */
+int
+avbox_cgroup_setiolimit(const char * const name, const char * const path,
+	const int64_t bps)
+{
+	int ret = -1;
+	char dev[32], buf[128];
+	struct avbox_cgroup *group;
+
+	if (base == NULL) {
+		return 0;
+	}
+
+	if (avbox_cgroup_getdisk(path, dev, sizeof(dev)) == -1) {
+		LOG_VPRINT_ERROR("Could not find the disk for %s: %s",
+			path, strerror(errno));
+		return -1;
+	}
+
+	if (bps > 0) {
+		snprintf(buf, sizeof(buf), "%s rbps=%" PRIi64 " wbps=%" PRIi64,
+			dev, bps, bps);
+	} else {
+		snprintf(buf, sizeof(buf), "%s rbps=max wbps=max", dev);
+	}
+
+	pthread_mutex_lock(&lock);
+	if ((group = avbox_cgroup_get(name)) != NULL) {
+		DEBUG_VPRINT("cgroup", "Setting io.max for %s to %s",
+			group->name, buf);
+		if ((ret = avbox_cgroup_write(group->path, "io.max", buf)) == -1) {
+			LOG_VPRINT_ERROR("Could not set io.max for %s: %s",
+				group->name, strerror(errno));
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+
+/**
+ * Freeze or thaw the groups that have the
+ * freeze setting enabled. The lock must be held.
+ */
+static void
+avbox_cgroup_freeze(const int freeze)
+{
+	struct avbox_cgroup *group;
+	LIST_FOREACH(struct avbox_cgroup*, group, &groups) {
+		if (group->freeze) {
+			DEBUG_VPRINT("cgroup", "%s %s", freeze ? "Freezing" : "Thawing",
+				group->name);
+			if (avbox_cgroup_write(group->path, "cgroup.freeze",
+				freeze ? "1" : "0") == -1) {
+				LOG_VPRINT_ERROR("Could not %s %s: %s",
+					freeze ? "freeze" : "thaw", group->name,
+					strerror(errno));
+			}
+		}
+	}
+}
+
+
+/**
+ * Freeze the groups that have the freeze setting enabled.
+ */
+void
+avbox_cgroup_pause(void)
+{
+	if (base == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	if (paused++ == 0) {
+		avbox_cgroup_freeze(1);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ * Thaw the groups frozen by avbox_cgroup_pause().
+ */
+void
+avbox_cgroup_resume(void)
+{
+	if (base == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	ASSERT(paused > 0);
+	if (--paused == 0) {
+		avbox_cgroup_freeze(0);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ * Get the resource usage of all groups.
+ */
+int
+avbox_cgroup_getstats(struct avbox_cgroup_stats *stats, int n)
+{
+	int cnt = 0;
+	char buf[4096];
+	struct avbox_cgroup *group;
+
+	if (base == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	LIST_FOREACH(struct avbox_cgroup*, group, &groups) {
+		if (cnt == n) {
+			break;
+		}
+		memset(&stats[cnt], 0, sizeof(struct avbox_cgroup_stats));
+		strcpy(stats[cnt].name, group->name);
+		stats[cnt].frozen = paused && group->freeze;
+		if (avbox_cgroup_read(group->path, "cpu.stat", buf, sizeof(buf)) == 0) {
+			stats[cnt].cpu_time = avbox_cgroup_getkey(buf, "usage_usec");
+		}
+		if (avbox_cgroup_read(group->path, "memory.current", buf, sizeof(buf)) == 0) {
+			stats[cnt].memory = strtoll(buf, NULL, 10);
+		}
+		if (avbox_cgroup_read(group->path, "io.stat", buf, sizeof(buf)) == 0) {
+			stats[cnt].io_read = avbox_cgroup_getiokey(buf, "rbytes");
+			stats[cnt].io_write = avbox_cgroup_getiokey(buf, "wbytes");
+		}
+		cnt++;
+	}
+	pthread_mutex_unlock(&lock);
+	return cnt;
+}
+
+
+/**
+ * Initialize cgroup support.
+ */
+int
+avbox_cgroup_init(void)
+{
+	char *self, *leaf;
+	const char * const controllers[] = { "+cpu", "+io", "+memory" };
+
+	LIST_INIT(&groups);
+
+	if (!avbox_settings_getbool("cgroup.enabled")) {
+		return 0;
+	}
+
+	if ((self = avbox_cgroup_self()) == NULL) {
+		LOG_PRINT_ERROR("cgroup2 hierarchy not found. Helpers will not be isolated");
+		return 0;
+	}
+
+	/* controllers can only be enabled for groups that
+	 * have no processes (except for the root group) so if
+	 * we're not on the root move ourselves to a leaf */
+	if (avbox_cgroup_write(self, "cgroup.subtree_control", "+cpu") == -1 &&
+		errno == EBUSY) {
+		if ((leaf = malloc(strlen(self) + sizeof("/mediabox"))) == NULL) {
+			LOG_PRINT_ERROR("Could not initialize cgroups: Out of memory");
+			free(self);
+			return -1;
+		}
+		sprintf(leaf, "%s/mediabox", self);
+		if ((mkdir(leaf, 0755) == -1 && errno != EEXIST) ||
+			avbox_cgroup_write(leaf, "cgroup.procs", "0") == -1) {
+			LOG_VPRINT_ERROR("Could not move to %s: %s. Helpers will not be isolated",
+				leaf, strerror(errno));
+			free(leaf);
+			free(self);
+			return 0;
+		}
+		free(leaf);
+	}
+
+	for (int i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+		if (avbox_cgroup_write(self, "cgroup.subtree_control", controllers[i]) == -1) {
+			LOG_VPRINT_ERROR("Could not enable %s controller: %s",
+				controllers[i] + 1, strerror(errno));
+		}
+	}
+
+	base = self;
+
+	LOG_VPRINT_INFO("Helpers will run on groups under %s", base);
+
+	return 0;
+}
+
+
+/**
+ * Remove our groups.
+ */
+void
+avbox_cgroup_shutdown(void)
+{
+	struct avbox_cgroup *group;
+
+	if (base == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	LIST_FOREACH_SAFE(struct avbox_cgroup*, group, &groups, {
+		if (paused && group->freeze) {
+			(void) avbox_cgroup_write(group->path, "cgroup.freeze", "0");
+		}
+		if (rmdir(group->path) == -1) {
+			DEBUG_VPRINT("cgroup", "Could not remove %s: %s",
+				group->path, strerror(errno));
+		}
+		LIST_REMOVE(group);
+		free(group->path);
+		free(group);
+	});
+	free(base);
+	base = NULL;
+	pthread_mutex_unlock(&lock);
+}
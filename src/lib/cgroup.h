@@ -0,0 +1,79 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ */
+
+#ifndef __AVBOX_CGROUP_H__
+#define __AVBOX_CGROUP_H__
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/**
+ * Resource usage of a helper's group.
+ */
+struct avbox_cgroup_stats
+{
+	char name[32];
+	int frozen;
+	int64_t cpu_time;	/* usecs */
+	int64_t memory;		/* bytes */
+	int64_t io_read;	/* bytes */
+	int64_t io_write;	/* bytes */
+};
+
+
+/**
+ * Move a process to it's own group. The group is created with
+ * the cgroup.<name>.* settings the first time it's used.
+ */
+int
+avbox_cgroup_attach(const char * const name, const pid_t pid);
+
+
+/**
+ * Limit the read and write bandwidth of a group on the disk
+ * that holds path. A bps of 0 removes the limit.
+ */
+int
+avbox_cgroup_setiolimit(const char * const name, const char * const path,
+	const int64_t bps);
+
+
+/**
+ * Freeze the groups that have the freeze setting
+ * enabled. Calls nest.
+ */
+void
+avbox_cgroup_pause(void);
+
+
+/**
+ * Thaw the groups frozen by avbox_cgroup_pause().
+ */
+void
+avbox_cgroup_resume(void);
+
+
+/**
+ * Get the resource usage of all groups.
+ *
+ * Returns the number of entries filled.
+ */
+int
+avbox_cgroup_getstats(struct avbox_cgroup_stats *stats, int n);
+
+
+/**
+ * Initialize cgroup support. Does nothing unless the
+ * cgroup.enabled setting is set.
+ */
+int
+avbox_cgroup_init(void);
+
+
+void
+avbox_cgroup_shutdown(void);
+
+
+#endif
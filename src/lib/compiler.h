@@ -22,5 +22,6 @@
 
 #define ATOMIC_INC(addr) (__sync_fetch_and_add(addr, 1))
 #define ATOMIC_DEC(addr) (__sync_fetch_and_sub(addr, 1))
+#define ATOMIC_CAS(addr, oldval, newval) (__sync_val_compare_and_swap(addr, oldval, newval))
 
 #endif
@@ -1,24 +1,127 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
+#include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define LOG_MODULE "delegate"
+
+#include "log.h"
+#include "debug.h"
+#include "compiler.h"
+#include "dispatch.h"
 #include "delegate.h"
 
+
+/* the maximum number of free delegates that
+ * we keep around for reuse */
+#define AVBOX_DELEGATE_POOL_SIZE	(64)
+
+
+/*
+ * Delegate states.
+ */
+#define AVBOX_DELEGATE_PENDING		(0)
+#define AVBOX_DELEGATE_FINISHED		(1)
+#define AVBOX_DELEGATE_DETTACHED	(2)
+#define AVBOX_DELEGATE_CHAINED		(3)
+
+
 /**
  * Delegate call.
  */
 struct avbox_delegate
 {
-	pthread_mutex_t lock;
-	pthread_cond_t cond;
+	int state;
 	avbox_delegate_fn func;
 	void *arg;
 	void *result;
-	int finished;
-	int dettached;
+	avbox_delegate_callback then;
+	void *then_context;
+	struct avbox_object *then_object;
+	struct avbox_delegate *next;
 };
 
 
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct avbox_delegate *pool = NULL;
+static int pool_size = 0;
+
+
+/**
+ * Return a delegate to the pool.
+ */
+static void
+avbox_delegate_release(struct avbox_delegate * const del)
+{
+	pthread_mutex_lock(&pool_lock);
+	if (pool_size < AVBOX_DELEGATE_POOL_SIZE) {
+		del->next = pool;
+		pool = del;
+		pool_size++;
+		pthread_mutex_unlock(&pool_lock);
+		return;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	free(del);
+}
+
+
+/**
+ * Wake the thread waiting on a delegate.
+ *
+ * NOTE: By the time we get here the waiter may have already
+ * seen the new state and released the delegate. This is harmless
+ * since at worst it will cause a spurious wakeup on a recycled
+ * delegate.
+ */
+static inline void
+avbox_delegate_wake(struct avbox_delegate * const del)
+{
+	(void) syscall(SYS_futex, &del->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+
+/**
+ * Invokes the completion callback on the thread
+ * that called avbox_delegate_then().
+ */
+static void *
+avbox_delegate_callthen(void *arg)
+{
+	struct avbox_delegate * const del = arg;
+	del->then(del->then_context, del->result);
+	return del->result;
+}
+
+
+/**
+ * Send a finished delegate back to the thread that
+ * called avbox_delegate_then() so it can run the completion
+ * callback.
+ */
+static void
+avbox_delegate_chain(struct avbox_delegate * const del)
+{
+	struct avbox_object *object = del->then_object;
+
+	/* the delegate is recycled to carry the callback. Since
+	 * it is dettached it will be released after it runs */
+	del->func = avbox_delegate_callthen;
+	del->arg = del;
+	del->state = AVBOX_DELEGATE_DETTACHED;
+
+	if (avbox_object_sendmsg(&object, AVBOX_MESSAGETYPE_DELEGATE,
+		AVBOX_DISPATCH_UNICAST, del) == NULL) {
+		LOG_VPRINT_ERROR("Could not dispatch completion callback: %s",
+			strerror(errno));
+		avbox_delegate_release(del);
+	}
+}
+
 
 /**
  * Dettach a delegate call.
@@ -27,14 +130,52 @@ void
 avbox_delegate_dettach(struct avbox_delegate *delegate)
 {
 	assert(delegate != NULL);
-	pthread_mutex_lock(&delegate->lock);
-	if (delegate->finished) {
-		free(delegate);
-		return;
-	} else {
-		delegate->dettached = 1;
+	switch (ATOMIC_CAS(&delegate->state, AVBOX_DELEGATE_PENDING, AVBOX_DELEGATE_DETTACHED)) {
+	case AVBOX_DELEGATE_PENDING:
+		break;
+	case AVBOX_DELEGATE_FINISHED:
+		avbox_delegate_release(delegate);
+		break;
+	default:
+		DEBUG_ABORT("delegate", "Delegate already dettached!");
 	}
-	pthread_mutex_unlock(&delegate->lock);
+}
+
+
+/**
+ * Dettach a delegate call and invoke a callback with the result
+ * once it completes. The callback runs on the calling thread's dispatch
+ * queue, so the calling thread must have one and must outlive the
+ * delegate.
+ *
+ * Returns -1 and sets errno to ENOENT if the calling thread has
+ * no dispatch queue.
+ */
+int
+avbox_delegate_then(struct avbox_delegate * const delegate,
+	avbox_delegate_callback func, void *context)
+{
+	assert(delegate != NULL);
+	assert(func != NULL);
+
+	if ((delegate->then_object = avbox_dispatch_getobject()) == NULL) {
+		assert(errno == ENOENT);
+		return -1;
+	}
+
+	delegate->then = func;
+	delegate->then_context = context;
+
+	switch (ATOMIC_CAS(&delegate->state, AVBOX_DELEGATE_PENDING, AVBOX_DELEGATE_CHAINED)) {
+	case AVBOX_DELEGATE_PENDING:
+		break;
+	case AVBOX_DELEGATE_FINISHED:
+		avbox_delegate_chain(delegate);
+		break;
+	default:
+		DEBUG_ABORT("delegate", "Delegate already dettached!");
+	}
+	return 0;
 }
 
 
@@ -45,7 +186,7 @@ int
 avbox_delegate_finished(struct avbox_delegate * const delegate)
 {
 	assert(delegate != NULL);
-	return delegate->finished;
+	return (delegate->state == AVBOX_DELEGATE_FINISHED);
 }
 
 
@@ -57,16 +198,18 @@ int
 avbox_delegate_wait(struct avbox_delegate *delegate, void **result)
 {
 	assert(delegate != NULL);
-	pthread_mutex_lock(&delegate->lock);
-	assert(!delegate->dettached);
-	if (!delegate->finished) {
-		pthread_cond_wait(&delegate->cond, &delegate->lock);
+	while (*((volatile int*) &delegate->state) == AVBOX_DELEGATE_PENDING) {
+		if (syscall(SYS_futex, &delegate->state, FUTEX_WAIT_PRIVATE,
+			AVBOX_DELEGATE_PENDING, NULL, NULL, 0) == -1) {
+			ASSERT(errno == EAGAIN || errno == EINTR);
+		}
 	}
-	pthread_mutex_unlock(&delegate->lock);
+	__sync_synchronize();
+	ASSERT(delegate->state == AVBOX_DELEGATE_FINISHED);
 	if (result != NULL) {
 		*result = delegate->result;
 	}
-	free(delegate);
+	avbox_delegate_release(delegate);
 	return 0;
 }
 
@@ -78,7 +221,7 @@ avbox_delegate_wait(struct avbox_delegate *delegate, void **result)
 void
 avbox_delegate_destroy(struct avbox_delegate * const delegate)
 {
-	free(delegate);
+	avbox_delegate_release(delegate);
 }
 
 
@@ -90,17 +233,17 @@ avbox_delegate_new(avbox_delegate_fn func, void *arg)
 {
 	struct avbox_delegate * del;
 
-	/* allocate memory */
-	if ((del = malloc(sizeof(struct avbox_delegate))) == NULL) {
-		assert(errno == ENOMEM);
-		return NULL;
+	/* take a delegate from the pool or allocate
+	 * a new one */
+	pthread_mutex_lock(&pool_lock);
+	if ((del = pool) != NULL) {
+		pool = del->next;
+		pool_size--;
 	}
+	pthread_mutex_unlock(&pool_lock);
 
-	/* initialize locking primitives */
-	if (pthread_mutex_init(&del->lock, NULL) != 0 ||
-		pthread_cond_init(&del->cond, NULL) != 0) {
-		errno = EINVAL;
-		free(del);
+	if (del == NULL && (del = malloc(sizeof(struct avbox_delegate))) == NULL) {
+		assert(errno == ENOMEM);
 		return NULL;
 	}
 
@@ -108,8 +251,11 @@ avbox_delegate_new(avbox_delegate_fn func, void *arg)
 	del->func = func;
 	del->arg = arg;
 	del->result = NULL;
-	del->finished = 0;
-	del->dettached = 0;
+	del->then = NULL;
+	del->then_context = NULL;
+	del->then_object = NULL;
+	del->next = NULL;
+	del->state = AVBOX_DELEGATE_PENDING;
 
 	return del;
 }
@@ -125,15 +271,17 @@ avbox_delegate_execute(struct avbox_delegate * const del)
 	del->result = del->func(del->arg);
 
 	/* update state and notify waiter */
-	pthread_mutex_lock(&del->lock);
-	del->finished = 1;
-	if (del->dettached) {
-		pthread_mutex_unlock(&del->lock);
-		free(del);
-	} else {
-		pthread_cond_signal(&del->cond);
-		pthread_mutex_unlock(&del->lock);
+	switch (ATOMIC_CAS(&del->state, AVBOX_DELEGATE_PENDING, AVBOX_DELEGATE_FINISHED)) {
+	case AVBOX_DELEGATE_PENDING:
+		avbox_delegate_wake(del);
+		break;
+	case AVBOX_DELEGATE_DETTACHED:
+		avbox_delegate_release(del);
+		break;
+	case AVBOX_DELEGATE_CHAINED:
+		avbox_delegate_chain(del);
+		break;
+	default:
+		DEBUG_ABORT("delegate", "Invalid delegate state!");
 	}
 }
-
-
@@ -5,6 +5,12 @@
 typedef void* (*avbox_delegate_fn)(void *args);
 
 
+/**
+ * Delegate completion callback.
+ */
+typedef void (*avbox_delegate_callback)(void *context, void *result);
+
+
 struct avbox_delegate;
 
 
@@ -23,6 +29,15 @@ void
 avbox_delegate_dettach(struct avbox_delegate *delegate);
 
 
+/**
+ * Dettach a delegate call and invoke a callback with
+ * the result on the calling thread once it completes.
+ */
+int
+avbox_delegate_then(struct avbox_delegate * const delegate,
+	avbox_delegate_callback func, void *context);
+
+
 /**
  * Check if the delegate has finished executing.
  */
@@ -17,6 +17,7 @@
 #include "debug.h"
 #include "linkedlist.h"
 #include "queue.h"
+#include "delegate.h"
 #include "dispatch.h"
 #include "compiler.h"
 
@@ -27,6 +28,7 @@
 LISTABLE_STRUCT(avbox_dispatch_queue,
 	pid_t tid;
 	struct avbox_queue *queue;
+	struct avbox_object *object;
 );
 
 
@@ -43,6 +45,27 @@ LISTABLE_STRUCT(avbox_object,
 );
 
 
+/**
+ * Broadcast subscription.
+ */
+LISTABLE_STRUCT(avbox_dispatch_subscription,
+	struct avbox_object *object;
+	int id;
+);
+
+
+/**
+ * Payload shared by the copies of a coalescing
+ * multicast message.
+ */
+struct avbox_dispatch_payload
+{
+	unsigned int refs;
+	void *data;
+	avbox_message_coalescer coalesce;
+};
+
+
 /**
  * Dispatch message structure.
  */
@@ -50,14 +73,19 @@ struct avbox_message
 {
 	int id;
 	int flags;
+	int key;
 	struct avbox_object** dest;
 	void *payload;
+	avbox_message_coalescer coalesce;
+	struct avbox_dispatch_payload *shared;
 };
 
 
 static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t subscriptions_lock = PTHREAD_MUTEX_INITIALIZER;
 static int initialized = 0;
 static LIST queues;
+static LIST subscriptions;
 
 
 static pid_t
@@ -126,6 +154,28 @@ avbox_object_unref(struct avbox_object *obj)
 }
 
 
+/**
+ * Drops a reference to a shared payload. When the last one
+ * is dropped the payload is passed to the coalescer together
+ * with the one that superseded it, or NULL if it was delivered.
+ */
+static void
+avbox_dispatch_payloadunref(struct avbox_dispatch_payload * const shared,
+	void * const next)
+{
+	ASSERT(shared != NULL);
+	if (ATOMIC_DEC(&shared->refs) == 1) {
+		if (shared->coalesce != NULL) {
+			void * const ret = shared->coalesce(shared->data, next);
+			DEBUG_VASSERT("dispatch", (ret == next),
+				"Coalescer kept a shared payload (%p)", ret);
+			(void) ret;
+		}
+		free(shared);
+	}
+}
+
+
 /**
  * Decrease reference counter and free
  * the message once the counter reaches zero.
@@ -134,6 +184,9 @@ static void
 avbox_dispatch_freemsg(struct avbox_message *msg)
 {
 	assert(msg != NULL);
+	if (msg->shared != NULL) {
+		avbox_dispatch_payloadunref(msg->shared, NULL);
+	}
 	if (msg->dest != NULL) {
 		struct avbox_object **dest = msg->dest;
 		while (*dest != NULL) {
@@ -159,6 +212,7 @@ avbox_object_handler(struct avbox_object *object, struct avbox_message * const m
 		/* destroy object so it won't receive
 		 * more messages */
 		object->destroyed = 1;
+		(void) avbox_object_unsubscribe(object, -1);
 
 		(void) object->handler(object->context, msg);
 
@@ -308,35 +362,268 @@ avbox_dispatch_destdup(struct avbox_object **dest)
 
 
 /**
- * Sends a message.
+ * Allocate and initialize a message.
  */
-struct avbox_message*
-avbox_object_sendmsg(struct avbox_object **dest,
-	int id, int flags, void * const payload)
+static struct avbox_message *
+avbox_dispatch_newmsg(int id, int flags, int key, void * const payload,
+	avbox_message_coalescer coalesce)
 {
-	int cast;
 	struct avbox_message *msg;
-	struct avbox_dispatch_queue *q;
 
-	/* allocate message */
 	if ((msg = malloc(sizeof(struct avbox_message))) == NULL) {
 		assert(errno == ENOMEM);
 		return NULL;
 	}
 
-	/* initialize message */
 	msg->dest = NULL;
 	msg->flags = flags;
 	msg->payload = payload;
 	msg->id = id;
+	msg->key = key;
+	msg->coalesce = coalesce;
+	msg->shared = NULL;
+	return msg;
+}
+
+
+/**
+ * Check if two destination lists are identical.
+ */
+static int
+avbox_dispatch_samedest(struct avbox_object **a, struct avbox_object **b)
+{
+	while (*a != NULL && *a == *b) {
+		a++;
+		b++;
+	}
+	return (*a == *b);
+}
+
+
+/**
+ * Merges a coalescing message into a pending one. This is
+ * called by avbox_queue_coalesce() with the queue locked.
+ */
+static int
+avbox_dispatch_merge(void *queued, void *item)
+{
+	struct avbox_message * const pending = queued;
+	struct avbox_message * const msg = item;
+
+	if (pending->flags != msg->flags || pending->id != msg->id ||
+		pending->key != msg->key || !avbox_dispatch_samedest(pending->dest, msg->dest)) {
+		return 0;
+	}
+
+	if (msg->shared != NULL) {
+		/* the pending copy takes the new payload and the old
+		 * one is released once no other copy is using it */
+		struct avbox_dispatch_payload * const old = pending->shared;
+		ASSERT(old != NULL);
+		pending->shared = msg->shared;
+		pending->payload = msg->payload;
+		msg->shared = NULL;
+		avbox_dispatch_payloadunref(old, pending->payload);
+	} else if (msg->coalesce != NULL) {
+		pending->payload = msg->coalesce(pending->payload, msg->payload);
+	} else {
+		pending->payload = msg->payload;
+	}
+	return 1;
+}
+
+
+/**
+ * Puts a message on a dispatch queue. If it is a coalescing
+ * message and a matching message is pending it is merged into
+ * that one instead.
+ */
+static struct avbox_message *
+avbox_dispatch_post(struct avbox_dispatch_queue * const q, struct avbox_message *msg)
+{
+	struct avbox_message *queued;
 
-	cast = flags & (AVBOX_DISPATCH_UNICAST |
+	if (msg->flags & AVBOX_DISPATCH_COALESCE) {
+		if ((queued = avbox_queue_coalesce(q->queue, msg, avbox_dispatch_merge)) == NULL) {
+			goto err;
+		}
+		if (queued != msg) {
+			avbox_dispatch_freemsg(msg);
+		}
+		return queued;
+	}
+
+	if (avbox_queue_put(q->queue, msg) == -1) {
+		goto err;
+	}
+	return msg;
+err:
+	assert(errno == ENOMEM || errno == EAGAIN || errno == ESHUTDOWN);
+	avbox_dispatch_freemsg(msg);
+	return NULL;
+}
+
+
+/**
+ * Sends a copy of the message to every thread that owns
+ * at least one of the destination objects. Each copy is only
+ * dispatched to the objects that live on that thread.
+ *
+ * All copies share the same payload. When coalescing each copy
+ * is merged on its own queue and the payload is reference counted
+ * so it is only released when no copy is using it.
+ */
+static struct avbox_message *
+avbox_dispatch_multicast(struct avbox_object **dest, int id, int flags,
+	int key, void * const payload, avbox_message_coalescer coalesce)
+{
+	int i, j, n, cnt;
+	struct avbox_message *msg, *ret = NULL;
+	struct avbox_dispatch_payload *shared = NULL;
+
+	ASSERT(dest != NULL);
+	ASSERT(*dest != NULL);
+
+	for (n = 0; dest[n] != NULL; n++);
+
+	/* we hold a reference until all copies are posted */
+	if (flags & AVBOX_DISPATCH_COALESCE) {
+		if ((shared = malloc(sizeof(struct avbox_dispatch_payload))) == NULL) {
+			assert(errno == ENOMEM);
+			return NULL;
+		}
+		shared->refs = 1;
+		shared->data = payload;
+		shared->coalesce = coalesce;
+	}
+
+	for (i = 0; i < n; i++) {
+		/* skip queues that already got a copy */
+		for (j = 0; j < i && dest[j]->q != dest[i]->q; j++);
+		if (j < i) {
+			continue;
+		}
+
+		for (j = i, cnt = 0; j < n; j++) {
+			if (dest[j]->q == dest[i]->q) {
+				cnt++;
+			}
+		}
+
+		if ((msg = avbox_dispatch_newmsg(id, flags, key, payload, coalesce)) == NULL) {
+			continue;
+		}
+		if ((msg->dest = malloc((cnt + 1) * sizeof(struct avbox_object*))) == NULL) {
+			assert(errno == ENOMEM);
+			free(msg);
+			continue;
+		}
+		for (j = i, cnt = 0; j < n; j++) {
+			if (dest[j]->q == dest[i]->q) {
+				if (dest[j]->destroyed) {
+					DEBUG_PRINT("dispatch", "Sending message to destroyed object!!");
+				}
+				msg->dest[cnt++] = avbox_object_ref(dest[j]);
+			}
+		}
+		msg->dest[cnt] = NULL;
+
+		if (shared != NULL) {
+			ATOMIC_INC(&shared->refs);
+			msg->shared = shared;
+		}
+
+		if ((msg = avbox_dispatch_post(dest[i]->q, msg)) != NULL) {
+			ret = msg;
+		}
+	}
+
+	if (shared != NULL) {
+		if (ret == NULL) {
+			/* nothing was sent so the caller still
+			 * owns the payload */
+			ASSERT(shared->refs == 1);
+			free(shared);
+		} else {
+			avbox_dispatch_payloadunref(shared, NULL);
+		}
+	}
+
+	return ret;
+}
+
+
+/**
+ * Sends a message to all the objects subscribed to
+ * its type.
+ */
+static struct avbox_message *
+avbox_dispatch_broadcast(int id, int flags, int key,
+	void * const payload, avbox_message_coalescer coalesce)
+{
+	int cnt = 0;
+	struct avbox_dispatch_subscription *sub;
+	struct avbox_object **dest, **pdest;
+	struct avbox_message *msg;
+
+	/* build a list of subscribers. We need to reference
+	 * them before releasing the lock */
+	pthread_mutex_lock(&subscriptions_lock);
+	LIST_FOREACH(struct avbox_dispatch_subscription*, sub, &subscriptions) {
+		if (sub->id == id && !sub->object->destroyed) {
+			cnt++;
+		}
+	}
+	if (cnt == 0) {
+		pthread_mutex_unlock(&subscriptions_lock);
+		errno = ENOENT;
+		return NULL;
+	}
+	if ((pdest = dest = malloc((cnt + 1) * sizeof(struct avbox_object*))) == NULL) {
+		assert(errno == ENOMEM);
+		pthread_mutex_unlock(&subscriptions_lock);
+		return NULL;
+	}
+	LIST_FOREACH(struct avbox_dispatch_subscription*, sub, &subscriptions) {
+		if (sub->id == id && !sub->object->destroyed) {
+			*pdest++ = avbox_object_ref(sub->object);
+		}
+	}
+	*pdest = NULL;
+	pthread_mutex_unlock(&subscriptions_lock);
+
+	/* the copies are delivered as multicast messages */
+	msg = avbox_dispatch_multicast(dest, id,
+		(flags & ~AVBOX_DISPATCH_BROADCAST) | AVBOX_DISPATCH_MULTICAST,
+		key, payload, coalesce);
+
+	for (pdest = dest; *pdest != NULL; pdest++) {
+		avbox_object_unref(*pdest);
+	}
+	free(dest);
+	return msg;
+}
+
+
+/**
+ * Sends a message.
+ */
+static struct avbox_message*
+avbox_dispatch_send(struct avbox_object **dest, int id, int flags,
+	int key, void * const payload, avbox_message_coalescer coalesce)
+{
+	struct avbox_message *msg;
+	const int cast = flags & (AVBOX_DISPATCH_UNICAST |
 		AVBOX_DISPATCH_ANYCAST | AVBOX_DISPATCH_MULTICAST |
 		AVBOX_DISPATCH_BROADCAST);
 
 	switch (cast) {
 	case AVBOX_DISPATCH_UNICAST:
 	{
+		ASSERT(dest != NULL);
+		if ((msg = avbox_dispatch_newmsg(id, flags, key, payload, coalesce)) == NULL) {
+			return NULL;
+		}
 		if ((msg->dest = malloc(sizeof(struct avbox_object*) * 2)) == NULL) {
 			assert(errno == ENOMEM);
 			free(msg);
@@ -344,34 +631,169 @@ avbox_object_sendmsg(struct avbox_object **dest,
 		}
 		msg->dest[0] = avbox_object_ref(*dest);
 		msg->dest[1] = NULL;
-		q = (*dest)->q;
-		break;
+		return avbox_dispatch_post((*dest)->q, msg);
 	}
 	case AVBOX_DISPATCH_ANYCAST:
-	case AVBOX_DISPATCH_MULTICAST:
 	{
+		/* the handlers are tried in order so all
+		 * destinations get the message on the thread of the
+		 * first one */
 		ASSERT(dest != NULL);
+		if ((msg = avbox_dispatch_newmsg(id, flags, key, payload, coalesce)) == NULL) {
+			return NULL;
+		}
 		if ((msg->dest = avbox_dispatch_destdup(dest)) == NULL) {
 			assert(errno == ENOMEM);
 			free(msg);
 			return NULL;
 		}
 		assert(*msg->dest != NULL);
-		q = (*msg->dest)->q;
-		break;
+		return avbox_dispatch_post((*msg->dest)->q, msg);
 	}
+	case AVBOX_DISPATCH_MULTICAST:
+		return avbox_dispatch_multicast(dest, id, flags, key, payload, coalesce);
+	case AVBOX_DISPATCH_BROADCAST:
+		return avbox_dispatch_broadcast(id, flags, key, payload, coalesce);
 	default:
 		DEBUG_VABORT("dispatch", "Invalid cast: %i", cast);
 	}
+}
 
-	/* put the message on the target thread's queue */
-	if (avbox_queue_put(q->queue, msg) == -1) {
-		assert(errno == ENOMEM || errno == EAGAIN || errno == ESHUTDOWN);
-		avbox_dispatch_freemsg(msg);
-		return NULL;
+
+/**
+ * Sends a message.
+ *
+ * For AVBOX_DISPATCH_BROADCAST the dest argument is ignored and the
+ * message is sent to every object subscribed to the message type with
+ * avbox_object_subscribe(). If there are no subscribers it returns NULL
+ * and sets errno to ENOENT.
+ */
+struct avbox_message*
+avbox_object_sendmsg(struct avbox_object **dest,
+	int id, int flags, void * const payload)
+{
+	return avbox_dispatch_send(dest, id, flags & ~AVBOX_DISPATCH_COALESCE,
+		0, payload, NULL);
+}
+
+
+/**
+ * Sends a message that replaces any message with the same
+ * type, key, flags and destination that is still pending so that the
+ * handler only sees the latest state.
+ *
+ * If coalesce is not NULL it is called with the pending and new
+ * payloads and returns the one to be delivered. It is responsible for
+ * freeing the other. If it is NULL the pending payload is just dropped.
+ *
+ * Multicast and broadcast copies are coalesced on each thread's queue
+ * separately and share the payload, so the handlers must not free it.
+ * Once no copy is using a payload the coalescer is called with it and
+ * the payload that superseded it, or NULL if it was delivered, and it
+ * must free it and return the second argument.
+ */
+struct avbox_message*
+avbox_object_coalescemsg(struct avbox_object **dest,
+	int id, int flags, int key, void * const payload,
+	avbox_message_coalescer coalesce)
+{
+	return avbox_dispatch_send(dest, id, flags | AVBOX_DISPATCH_COALESCE,
+		key, payload, coalesce);
+}
+
+
+/**
+ * Subscribe an object to broadcasts of a message type.
+ */
+int
+avbox_object_subscribe(struct avbox_object * const obj, int id)
+{
+	struct avbox_dispatch_subscription *sub;
+
+	ASSERT(obj != NULL);
+
+	pthread_mutex_lock(&subscriptions_lock);
+	LIST_FOREACH(struct avbox_dispatch_subscription*, sub, &subscriptions) {
+		if (sub->object == obj && sub->id == id) {
+			pthread_mutex_unlock(&subscriptions_lock);
+			errno = EEXIST;
+			return -1;
+		}
+	}
+	if ((sub = malloc(sizeof(struct avbox_dispatch_subscription))) == NULL) {
+		assert(errno == ENOMEM);
+		pthread_mutex_unlock(&subscriptions_lock);
+		return -1;
 	}
+	sub->object = obj;
+	sub->id = id;
+	LIST_APPEND(&subscriptions, sub);
+	pthread_mutex_unlock(&subscriptions_lock);
+	return 0;
+}
 
-	return msg;
+
+/**
+ * Unsubscribe an object from broadcasts of a message type.
+ * If id is -1 all the object's subscriptions are removed.
+ */
+int
+avbox_object_unsubscribe(struct avbox_object * const obj, int id)
+{
+	int ret = -1;
+	struct avbox_dispatch_subscription *sub;
+
+	pthread_mutex_lock(&subscriptions_lock);
+	LIST_FOREACH_SAFE(struct avbox_dispatch_subscription*, sub, &subscriptions, {
+		if (sub->object == obj && (id == -1 || sub->id == id)) {
+			LIST_REMOVE(sub);
+			free(sub);
+			ret = 0;
+		}
+	});
+	pthread_mutex_unlock(&subscriptions_lock);
+
+	if (ret == -1) {
+		errno = ENOENT;
+	}
+	return ret;
+}
+
+
+/**
+ * Message handler for the queue's own object.
+ */
+static int
+avbox_dispatch_queuehandler(void *context, struct avbox_message *msg)
+{
+	switch (avbox_message_id(msg)) {
+	case AVBOX_MESSAGETYPE_DELEGATE:
+		avbox_delegate_execute(avbox_message_payload(msg));
+		break;
+	default:
+		DEBUG_VPRINT("dispatch", "Queue object received unexpected message (id=0x%02x)",
+			avbox_message_id(msg));
+		break;
+	}
+	return AVBOX_DISPATCH_OK;
+}
+
+
+/**
+ * Gets the dispatch object of the calling thread's queue. It
+ * executes any delegates sent to it.
+ *
+ * Returns NULL and sets errno to ENOENT if the thread has
+ * no dispatch queue.
+ */
+struct avbox_object *
+avbox_dispatch_getobject(void)
+{
+	struct avbox_dispatch_queue *q;
+	if ((q = avbox_dispatch_getqueue(gettid())) == NULL) {
+		return NULL;
+	}
+	return q->object;
 }
 
 
@@ -444,6 +866,7 @@ avbox_dispatch_init()
 
 	if (!initialized) {
 		LIST_INIT(&queues);
+		LIST_INIT(&subscriptions);
 		initialized = 1;
 	}
 
@@ -472,6 +895,16 @@ avbox_dispatch_init()
 	pthread_mutex_lock(&queue_lock);
 	LIST_ADD(&queues, q);
 	pthread_mutex_unlock(&queue_lock);
+
+	/* create the queue's own object */
+	if ((q->object = avbox_object_new(avbox_dispatch_queuehandler, NULL)) == NULL) {
+		pthread_mutex_lock(&queue_lock);
+		LIST_REMOVE(q);
+		pthread_mutex_unlock(&queue_lock);
+		avbox_queue_destroy(q->queue);
+		free(q);
+		return -1;
+	}
 	return 0;
 }
 
@@ -525,6 +958,10 @@ avbox_dispatch_shutdown(void)
 	}
 	avbox_queue_destroy(q->queue);
 
+	/* release the queue's own object */
+	q->object->destroyed = 1;
+	avbox_object_unref(q->object);
+
 	/* remove queue from list and free it */
 	pthread_mutex_lock(&queue_lock);
 	LIST_REMOVE(q);
@@ -10,6 +10,7 @@
 #define AVBOX_DISPATCH_MULTICAST	(2)
 #define AVBOX_DISPATCH_ANYCAST		(4)
 #define AVBOX_DISPATCH_EXPECT_REPLY	(8)
+#define AVBOX_DISPATCH_COALESCE		(16)	/* set by avbox_object_coalescemsg() */
 
 
 /*
@@ -27,6 +28,7 @@
 #define AVBOX_MESSAGETYPE_DISMISSED	(0x0A)
 #define AVBOX_MESSAGETYPE_DESTROY	(0x0C)
 #define AVBOX_MESSAGETYPE_CLEANUP	(0x0D)
+#define AVBOX_MESSAGETYPE_WAKEUP	(0x0E)
 #define AVBOX_MESSAGETYPE_USER		(0xFF)
 
 #define AVBOX_DISPATCH_OK		(0)
@@ -43,6 +45,15 @@ struct avbox_message;
 typedef int (*avbox_message_handler)(void *context, struct avbox_message *msg);
 
 
+/**
+ * Message coalescing function. It is called when a message sent
+ * with avbox_object_coalescemsg() supersedes one that is still pending
+ * and must return the payload to deliver and free the other one.
+ * Multicast payloads are shared, see avbox_object_coalescemsg().
+ */
+typedef void* (*avbox_message_coalescer)(void *pending, void *payload);
+
+
 /**
  * Get the type of a message
  */
@@ -78,6 +89,13 @@ struct avbox_message *
 avbox_dispatch_peekmsg(void);
 
 
+/**
+ * Gets the dispatch object of the calling thread's queue.
+ */
+struct avbox_object *
+avbox_dispatch_getobject(void);
+
+
 /**
  * Sends a message.
  */
@@ -86,6 +104,32 @@ avbox_object_sendmsg(struct avbox_object **dest,
 	int type, int flags, void * const payload);
 
 
+/**
+ * Sends a message that replaces any message with the same
+ * type, key and destination that is still pending. Multicast
+ * and broadcast copies share a reference counted payload that
+ * is passed to the coalescer once no copy is using it.
+ */
+struct avbox_message*
+avbox_object_coalescemsg(struct avbox_object **dest,
+	int type, int flags, int key, void * const payload,
+	avbox_message_coalescer coalesce);
+
+
+/**
+ * Subscribe an object to broadcasts of a message type.
+ */
+int
+avbox_object_subscribe(struct avbox_object * const obj, int type);
+
+
+/**
+ * Unsubscribe an object from broadcasts of a message type.
+ */
+int
+avbox_object_unsubscribe(struct avbox_object * const obj, int type);
+
+
 /**
  * Create a dispatch object.
  */
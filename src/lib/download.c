@@ -0,0 +1,1450 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ *
+ * Built-in HTTP/FTP downloader. All transfers run on a single
+ * thread driven by a curl multi handle. Files that support byte
+ * ranges are split into segments that are downloaded in parallel
+ * and the progress is saved so they can be resumed.
+ *
+ * A download can also be streamed. The file is then registered as
+ * a partfile and a connection is moved to wherever the reader is
+ * waiting when that part is far from any running transfer.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <curl/curl.h>
+
+#define LOG_MODULE "download"
+
+#include "log.h"
+#include "debug.h"
+#include "settings.h"
+#include "linkedlist.h"
+#include "file_util.h"
+#include "url_util.h"
+#include "partfile.h"
+#include "download.h"
+#ifdef ENABLE_IONICE
+#include "ionice.h"
+#endif
+
+
+#define AVBOX_DOWNLOAD_MAX_SEGMENTS	(16)
+#define AVBOX_DOWNLOAD_MIN_SEGMENT	(4LL * 1024 * 1024)
+#define AVBOX_DOWNLOAD_FLUSH_CHUNK	(4LL * 1024 * 1024)
+#define AVBOX_DOWNLOAD_MAX_RETRIES	(5)
+#define AVBOX_DOWNLOAD_SAVE_INTERVAL	(5000)	/* msecs */
+#define AVBOX_DOWNLOAD_TICK		(1000)	/* msecs */
+#define AVBOX_DOWNLOAD_SEEK_DISTANCE	(2LL * 1024 * 1024)
+
+
+struct avbox_download;
+
+
+/**
+ * A byte range of a file being downloaded on
+ * it's own connection.
+ */
+struct avbox_download_segment
+{
+	struct avbox_download *dl;
+	CURL *curl;
+	int64_t pos;		/* next offset to write */
+	int64_t end;		/* last offset or -1 if unknown */
+	int64_t flushed;	/* written back up to here */
+	int64_t writing;	/* writeback started up to here */
+	int retries;
+	int ranged;		/* sent a Range header */
+	int used;
+};
+
+
+LISTABLE_STRUCT(avbox_download,
+	int id;
+	char *url;
+	char *name;
+	char *path;
+	char *part;
+	char *state_file;
+	enum avbox_download_state state;
+	int fd;
+	int ranges;
+	int ranges_ignored;
+	int64_t size;
+	int64_t downloaded;
+	int64_t last_downloaded;
+	int64_t last_save;
+	int rate;
+	int remove;
+	int remove_data;
+	int stream;
+	struct avbox_partfile *partfile;
+	CURL *probe;
+	struct avbox_download_segment segments[AVBOX_DOWNLOAD_MAX_SEGMENTS];
+	char error[CURL_ERROR_SIZE];
+);
+
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static CURLM *multi = NULL;
+static int quit = 0;
+static int next_id = 1;
+static int max_active = 3;
+static int max_segments = 4;
+static int rate_limit = 0;
+static int rate_limit_changed = 0;
+static curl_off_t segment_limit = 0;
+static char *default_dir = NULL;
+LIST_DECLARE_STATIC(downloads);
+
+
+/**
+ * Gets the monotonic time in msecs.
+ */
+static int64_t
+avbox_download_now(void)
+{
+	struct timespec tv;
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	return (tv.tv_sec * 1000LL) + (tv.tv_nsec / 1000000LL);
+}
+
+
+/**
+ * Gets the number of segments in use.
+ */
+static int
+avbox_download_activesegments(const struct avbox_download * const dl)
+{
+	int i, n = 0;
+	for (i = 0; i < AVBOX_DOWNLOAD_MAX_SEGMENTS; i++) {
+		if (dl->segments[i].used && dl->segments[i].curl != NULL) {
+			n++;
+		}
+	}
+	return n;
+}
+
+
+/**
+ * Save the ranges that are left so the download
+ * can be resumed.
+ */
+static void
+avbox_download_savestate(struct avbox_download * const dl)
+{
+	int i;
+	FILE *f;
+	char tmp[PATH_MAX];
+
+	if (!dl->ranges || dl->size == -1) {
+		return;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", dl->state_file);
+	if ((f = fopen(tmp, "w")) == NULL) {
+		LOG_VPRINT_ERROR("Could not save %s: %s",
+			dl->state_file, strerror(errno));
+		return;
+	}
+	fprintf(f, "%s\n%" PRIi64 "\n", dl->url, dl->size);
+	for (i = 0; i < AVBOX_DOWNLOAD_MAX_SEGMENTS; i++) {
+		const struct avbox_download_segment * const seg = &dl->segments[i];
+		if (seg->used && seg->pos <= seg->end) {
+			fprintf(f, "%" PRIi64 " %" PRIi64 "\n", seg->pos, seg->end);
+		}
+	}
+	if (fclose(f) == 0) {
+		(void) rename(tmp, dl->state_file);
+	}
+	dl->last_save = avbox_download_now();
+}
+
+
+/**
+ * Load a saved state. Returns 0 if the state was restored.
+ */
+static int
+avbox_download_loadstate(struct avbox_download * const dl)
+{
+	int n = 0;
+	FILE *f;
+	char url[4096];
+	int64_t size, pos, end;
+
+	if ((f = fopen(dl->state_file, "r")) == NULL) {
+		return -1;
+	}
+	if (fgets(url, sizeof(url), f) == NULL ||
+		strncmp(url, dl->url, strlen(dl->url)) ||
+		fscanf(f, "%" SCNi64, &size) != 1) {
+		fclose(f);
+		return -1;
+	}
+	while (n < AVBOX_DOWNLOAD_MAX_SEGMENTS &&
+		fscanf(f, "%" SCNi64 " %" SCNi64, &pos, &end) == 2) {
+		if (pos < 0 || pos > end || end >= size) {
+			fclose(f);
+			return -1;
+		}
+		dl->segments[n].pos = pos;
+		dl->segments[n].end = end;
+		dl->segments[n].flushed = pos;
+		dl->segments[n].writing = pos;
+		dl->segments[n].used = 1;
+		n++;
+	}
+	fclose(f);
+
+	dl->size = size;
+	dl->ranges = 1;
+	dl->downloaded = size;
+	for (n = 0; n < AVBOX_DOWNLOAD_MAX_SEGMENTS; n++) {
+		if (dl->segments[n].used) {
+			dl->downloaded -= (dl->segments[n].end - dl->segments[n].pos) + 1;
+		}
+	}
+	dl->last_downloaded = dl->downloaded;
+
+	DEBUG_VPRINT("download", "Resuming %s at %" PRIi64 "/%" PRIi64,
+		dl->name, dl->downloaded, dl->size);
+	return 0;
+}
+
+
+/**
+ * Write back what was written to a segment and drop it
+ * from the page cache so a large download doesn't evict
+ * everything else.
+ */
+static void
+avbox_download_flush(struct avbox_download_segment * const seg, const int all)
+{
+	const int fd = seg->dl->fd;
+
+	if (!all && seg->pos - seg->writing < AVBOX_DOWNLOAD_FLUSH_CHUNK) {
+		return;
+	}
+
+	/* wait for the chunk whose writeback we started last time
+	 * and drop it. It had a whole chunk of network time to
+	 * finish so this only blocks when the disk can't keep up */
+	if (seg->writing > seg->flushed && !all) {
+		(void) sync_file_range(fd, seg->flushed, seg->writing - seg->flushed,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER);
+		(void) posix_fadvise(fd, seg->flushed, seg->writing - seg->flushed,
+			POSIX_FADV_DONTNEED);
+		seg->flushed = seg->writing;
+	}
+
+	/* start writing back the current chunk without waiting */
+	if (seg->pos > seg->writing) {
+		(void) sync_file_range(fd, seg->writing, seg->pos - seg->writing,
+			SYNC_FILE_RANGE_WRITE);
+		seg->writing = seg->pos;
+	}
+
+	/* when the segment is done we don't wait at all. Pages
+	 * still under writeback just stay in the cache */
+	if (all && seg->pos > seg->flushed) {
+		(void) posix_fadvise(fd, seg->flushed, seg->pos - seg->flushed,
+			POSIX_FADV_DONTNEED);
+		seg->flushed = seg->pos;
+	}
+}
+
+
+/**
+ * Curl write callback.
+ */
+static size_t
+avbox_download_write(char *ptr, size_t size, size_t nmemb, void *data)
+{
+	size_t len = size * nmemb, written = 0;
+	ssize_t ret;
+	struct avbox_download_segment * const seg = data;
+	struct avbox_download * const dl = seg->dl;
+
+	/* if the server ignored the range we would write
+	 * the wrong data */
+	if (seg->ranged) {
+		long code = 0;
+		curl_easy_getinfo(seg->curl, CURLINFO_RESPONSE_CODE, &code);
+		if (code == 200) {
+			LOG_VPRINT_ERROR("Server ignored range request for %s",
+				dl->name);
+			dl->ranges_ignored = 1;
+			return 0;
+		}
+		seg->ranged = 0;
+	}
+
+	/* the segment may have been split while
+	 * the request was in flight */
+	if (seg->end != -1 && seg->pos + (int64_t) len > seg->end + 1) {
+		len = (seg->end + 1) - seg->pos;
+	}
+
+	while (written < len) {
+		if ((ret = pwrite(dl->fd, ptr + written, len - written, seg->pos)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG_VPRINT_ERROR("Could not write %s: %s",
+				dl->part, strerror(errno));
+			return 0;
+		}
+		if (dl->partfile != NULL) {
+			avbox_partfile_setavailable(dl->partfile, seg->pos, ret);
+		}
+		written += ret;
+		seg->pos += ret;
+		dl->downloaded += ret;
+	}
+
+	avbox_download_flush(seg, 0);
+
+	/* returning less than we got stops the transfer. That's
+	 * what we want if the segment was split and we're done */
+	return written;
+}
+
+
+/**
+ * Header callback used while probing.
+ */
+static size_t
+avbox_download_header(char *buf, size_t size, size_t nitems, void *data)
+{
+	struct avbox_download * const dl = data;
+	const size_t len = size * nitems;
+	if (len >= 19 && !strncasecmp(buf, "Accept-Ranges:", 14)) {
+		const char *p = buf + 14;
+		while (*p == ' ') {
+			p++;
+		}
+		if (!strncasecmp(p, "bytes", 5)) {
+			dl->ranges = 1;
+		}
+	}
+	return len;
+}
+
+
+/**
+ * Set the options common to all requests.
+ */
+static CURL *
+avbox_download_newhandle(struct avbox_download * const dl)
+{
+	CURL *curl;
+	if ((curl = curl_easy_init()) == NULL) {
+		return NULL;
+	}
+	curl_easy_setopt(curl, CURLOPT_URL, dl->url);
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, "mediabox/" PACKAGE_VERSION);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, dl->error);
+	return curl;
+}
+
+
+/**
+ * Start the transfer of a segment.
+ */
+static int
+avbox_download_startsegment(struct avbox_download_segment * const seg)
+{
+	char range[64];
+	struct avbox_download * const dl = seg->dl;
+
+	ASSERT(seg->curl == NULL);
+
+	if ((seg->curl = avbox_download_newhandle(dl)) == NULL) {
+		return -1;
+	}
+	curl_easy_setopt(seg->curl, CURLOPT_WRITEFUNCTION, avbox_download_write);
+	curl_easy_setopt(seg->curl, CURLOPT_WRITEDATA, seg);
+	curl_easy_setopt(seg->curl, CURLOPT_PRIVATE, seg);
+	curl_easy_setopt(seg->curl, CURLOPT_MAX_RECV_SPEED_LARGE,
+		dl->stream ? 0 : segment_limit);
+
+	seg->ranged = 0;
+	if (dl->ranges && (seg->pos > 0 || seg->end != dl->size - 1)) {
+		snprintf(range, sizeof(range), "%" PRIi64 "-%" PRIi64,
+			seg->pos, seg->end);
+		curl_easy_setopt(seg->curl, CURLOPT_RANGE, range);
+		seg->ranged = !strncasecmp(dl->url, "http", 4);
+	}
+
+	if (curl_multi_add_handle(multi, seg->curl) != CURLM_OK) {
+		curl_easy_cleanup(seg->curl);
+		seg->curl = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Stop the transfer of a segment.
+ */
+static void
+avbox_download_stopsegment(struct avbox_download_segment * const seg)
+{
+	if (seg->curl != NULL) {
+		curl_multi_remove_handle(multi, seg->curl);
+		curl_easy_cleanup(seg->curl);
+		seg->curl = NULL;
+	}
+}
+
+
+/**
+ * Stop all transfers of a download.
+ */
+static void
+avbox_download_stop(struct avbox_download * const dl)
+{
+	int i;
+	if (dl->probe != NULL) {
+		curl_multi_remove_handle(multi, dl->probe);
+		curl_easy_cleanup(dl->probe);
+		dl->probe = NULL;
+	}
+	for (i = 0; i < AVBOX_DOWNLOAD_MAX_SEGMENTS; i++) {
+		avbox_download_stopsegment(&dl->segments[i]);
+	}
+	if (dl->fd != -1) {
+		close(dl->fd);
+		dl->fd = -1;
+	}
+}
+
+
+/**
+ * Stop streaming a download. If done is set readers keep
+ * reading the finished file, otherwise their reads fail.
+ */
+static void
+avbox_download_closepartfile(struct avbox_download * const dl, const int done)
+{
+	struct avbox_partfile *partfile;
+
+	pthread_mutex_lock(&lock);
+	partfile = dl->partfile;
+	dl->partfile = NULL;
+	dl->stream = 0;
+	pthread_mutex_unlock(&lock);
+
+	if (partfile != NULL) {
+		if (done) {
+			avbox_partfile_setdone(partfile, dl->path);
+		} else {
+			avbox_partfile_abort(partfile);
+		}
+		avbox_partfile_unref(partfile);
+	}
+}
+
+
+/**
+ * Mark a download as failed.
+ */
+static void
+avbox_download_fail(struct avbox_download * const dl)
+{
+	LOG_VPRINT_ERROR("Download of %s failed: %s",
+		dl->name, (dl->error[0] != '\0') ? dl->error : "Unknown error");
+	avbox_download_savestate(dl);
+	avbox_download_stop(dl);
+	avbox_download_closepartfile(dl, 0);
+	pthread_mutex_lock(&lock);
+	dl->state = AVBOX_DOWNLOAD_FAILED;
+	dl->rate = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ * Split the largest range left so that a connection
+ * that is done can help with it.
+ */
+static int
+avbox_download_split(struct avbox_download * const dl,
+	struct avbox_download_segment * const seg)
+{
+	int i, ahead = 0;
+	int64_t left, largest = 0, readpos = -1;
+	struct avbox_download_segment *victim = NULL;
+
+	if (!dl->ranges) {
+		return -1;
+	}
+
+	if (dl->partfile != NULL) {
+		readpos = avbox_partfile_getreadpos(dl->partfile);
+	}
+
+	for (i = 0; i < AVBOX_DOWNLOAD_MAX_SEGMENTS; i++) {
+		struct avbox_download_segment * const s = &dl->segments[i];
+		if (s == seg || !s->used || s->end == -1 ||
+			(left = (s->end - s->pos) + 1) < 2 * AVBOX_DOWNLOAD_MIN_SEGMENT) {
+			continue;
+		}
+		/* when streaming help with the range the reader
+		 * gets to first, otherwise the largest one */
+		if (readpos != -1 && s->end >= readpos) {
+			if (!ahead || s->pos < victim->pos) {
+				largest = left;
+				victim = s;
+				ahead = 1;
+			}
+		} else if (!ahead && left > largest) {
+			largest = left;
+			victim = s;
+		}
+	}
+
+	if (victim == NULL) {
+		return -1;
+	}
+
+	seg->end = victim->end;
+	seg->pos = seg->flushed = seg->writing = victim->pos + (largest / 2);
+	seg->retries = 0;
+	seg->used = 1;
+	victim->end = seg->pos - 1;
+
+	DEBUG_VPRINT("download", "Splitting %s at %" PRIi64,
+		dl->name, seg->pos);
+
+	return avbox_download_startsegment(seg);
+}
+
+
+/**
+ * Start downloading the file once we know
+ * it's size.
+ */
+static void
+avbox_download_begin(struct avbox_download * const dl)
+{
+	int i, n = 1;
+
+	if ((dl->fd = open(dl->part, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+		snprintf(dl->error, sizeof(dl->error), "Could not open %s: %s",
+			dl->part, strerror(errno));
+		avbox_download_fail(dl);
+		return;
+	}
+
+	/* a fresh download */
+	if (!dl->segments[0].used) {
+		if (dl->size > 0 && dl->ranges && !dl->ranges_ignored) {
+			n = dl->size / AVBOX_DOWNLOAD_MIN_SEGMENT;
+			n = (n < 1) ? 1 : (n > max_segments) ? max_segments : n;
+		} else {
+			dl->ranges = 0;
+		}
+
+		/* reserve the space upfront so the file doesn't
+		 * fragment and we fail early if it doesn't fit */
+		(void) ftruncate(dl->fd, 0);
+		if (dl->size > 0 && fallocate(dl->fd, 0, 0, dl->size) == -1 &&
+			errno != EOPNOTSUPP && errno != ENOSYS) {
+			snprintf(dl->error, sizeof(dl->error), "Could not allocate %s: %s",
+				dl->part, strerror(errno));
+			avbox_download_fail(dl);
+			return;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct avbox_download_segment * const seg = &dl->segments[i];
+			seg->pos = seg->flushed = seg->writing = (dl->size / n) * i;
+			seg->end = (dl->size <= 0) ? -1 :
+				(i == n - 1) ? dl->size - 1 : ((dl->size / n) * (i + 1)) - 1;
+			seg->used = 1;
+		}
+		dl->downloaded = dl->last_downloaded = 0;
+	}
+
+	DEBUG_VPRINT("download", "Downloading %s (size=%" PRIi64 ", ranges=%i, segments=%i)",
+		dl->name, dl->size, dl->ranges, n);
+
+	for (i = 0; i < AVBOX_DOWNLOAD_MAX_SEGMENTS; i++) {
+		if (dl->segments[i].used && avbox_download_startsegment(&dl->segments[i]) == -1) {
+			snprintf(dl->error, sizeof(dl->error), "Could not start transfer");
+			avbox_download_fail(dl);
+			return;
+		}
+	}
+
+	/* more connections than ranges saved */
+	for (i = 0; i < AVBOX_DOWNLOAD_MAX_SEGMENTS &&
+		avbox_download_activesegments(dl) < max_segments; i++) {
+		if (!dl->segments[i].used && avbox_download_split(dl, &dl->segments[i]) == -1) {
+			break;
+		}
+	}
+
+	avbox_download_savestate(dl);
+}
+
+
+/**
+ * Start a download. If there is a saved state we resume
+ * it, otherwise we probe the server for the size and
+ * range support first.
+ */
+static void
+avbox_download_start(struct avbox_download * const dl)
+{
+	if (avbox_download_loadstate(dl) == 0) {
+		avbox_download_begin(dl);
+		return;
+	}
+
+	if ((dl->probe = avbox_download_newhandle(dl)) == NULL) {
+		avbox_download_fail(dl);
+		return;
+	}
+	curl_easy_setopt(dl->probe, CURLOPT_NOBODY, 1L);
+	curl_easy_setopt(dl->probe, CURLOPT_HEADERFUNCTION, avbox_download_header);
+	curl_easy_setopt(dl->probe, CURLOPT_HEADERDATA, dl);
+	curl_easy_setopt(dl->probe, CURLOPT_PRIVATE, NULL);
+	if (curl_multi_add_handle(multi, dl->probe) != CURLM_OK) {
+		curl_easy_cleanup(dl->probe);
+		dl->probe = NULL;
+		avbox_download_fail(dl);
+	}
+}
+
+
+/**
+ * Rename the file once all segments are done.
+ */
+static void
+avbox_download_finish(struct avbox_download * const dl)
+{
+	int i;
+
+	for (i = 0; i < AVBOX_DOWNLOAD_MAX_SEGMENTS; i++) {
+		avbox_download_flush(&dl->segments[i], 1);
+		dl->segments[i].used = 0;
+	}
+
+	/* if we didn't know the size we do now */
+	if (dl->size == -1) {
+		dl->size = dl->downloaded;
+	}
+
+	avbox_download_stop(dl);
+
+	if (rename(dl->part, dl->path) == -1) {
+		snprintf(dl->error, sizeof(dl->error), "Could not rename %s: %s",
+			dl->part, strerror(errno));
+		avbox_download_fail(dl);
+		return;
+	}
+	(void) unlink(dl->state_file);
+	avbox_download_closepartfile(dl, 1);
+
+	LOG_VPRINT_INFO("Finished downloading %s",
+		dl->name);
+
+	pthread_mutex_lock(&lock);
+	dl->state = AVBOX_DOWNLOAD_DONE;
+	dl->rate = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ * Handle a finished transfer.
+ */
+static void
+avbox_download_done(CURL * const curl, const CURLcode result)
+{
+	int i;
+	long code = 0;
+	struct avbox_download *dl;
+	struct avbox_download_segment *seg = NULL;
+
+	curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**) &seg);
+
+	/* find the owner of a probe */
+	if (seg == NULL) {
+		pthread_mutex_lock(&lock);
+		LIST_FOREACH(struct avbox_download*, dl, &downloads) {
+			if (dl->probe == curl) {
+				break;
+			}
+		}
+		pthread_mutex_unlock(&lock);
+		ASSERT(!LIST_ISNULL(&downloads, dl));
+
+		if (result == CURLE_OK) {
+			curl_off_t len = -1;
+			char *url = NULL;
+			curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &len);
+			curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+			dl->size = len;
+			/* FTP servers support REST */
+			if (url != NULL && !strncasecmp(url, "ftp", 3)) {
+				dl->ranges = 1;
+			}
+		} else {
+			/* some servers don't do HEAD so just
+			 * try a plain download */
+			dl->size = -1;
+			dl->ranges = 0;
+		}
+		dl->error[0] = '\0';
+		curl_multi_remove_handle(multi, curl);
+		curl_easy_cleanup(curl);
+		dl->probe = NULL;
+		avbox_download_begin(dl);
+		return;
+	}
+
+	dl = seg->dl;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+	avbox_download_stopsegment(seg);
+
+	/* the segment was split and the other half
+	 * is being downloaded by someone else */
+	if (result == CURLE_WRITE_ERROR && seg->end != -1 && seg->pos > seg->end) {
+		goto done;
+	}
+
+	if (result != CURLE_OK) {
+		/* the server doesn't really support ranges. Start
+		 * over with a single connection */
+		if (dl->ranges_ignored && dl->ranges) {
+			for (i = 0; i < AVBOX_DOWNLOAD_MAX_SEGMENTS; i++) {
+				avbox_download_stopsegment(&dl->segments[i]);
+				dl->segments[i].used = 0;
+			}
+			(void) unlink(dl->state_file);
+			close(dl->fd);
+			dl->fd = -1;
+			dl->ranges = 0;
+			avbox_download_closepartfile(dl, 0);
+			dl->error[0] = '\0';
+			avbox_download_begin(dl);
+			return;
+		}
+
+		/* retry from where we left or from the
+		 * start if we can't resume */
+		if ((code < 400 || code >= 500) &&
+			seg->retries++ < AVBOX_DOWNLOAD_MAX_RETRIES) {
+			DEBUG_VPRINT("download", "Retrying %s at %" PRIi64 ": %s",
+				dl->name, dl->ranges ? seg->pos : 0, dl->error);
+			if (!dl->ranges) {
+				avbox_download_closepartfile(dl, 0);
+				dl->downloaded -= seg->pos;
+				seg->pos = seg->flushed = seg->writing = 0;
+				(void) ftruncate(dl->fd, 0);
+			}
+			if (avbox_download_startsegment(seg) == 0) {
+				return;
+			}
+		}
+		avbox_download_fail(dl);
+		return;
+	}
+
+	if (seg->end != -1 && seg->pos <= seg->end) {
+		snprintf(dl->error, sizeof(dl->error), "Transfer ended early");
+		avbox_download_fail(dl);
+		return;
+	}
+
+done:
+	avbox_download_flush(seg, 1);
+	seg->used = 0;
+
+	/* help with what's left */
+	if (avbox_download_split(dl, seg) == 0) {
+		return;
+	}
+
+	for (i = 0; i < AVBOX_DOWNLOAD_MAX_SEGMENTS; i++) {
+		if (dl->segments[i].used) {
+			return;
+		}
+	}
+	avbox_download_finish(dl);
+}
+
+
+/**
+ * Free a download.
+ */
+static void
+avbox_download_free(struct avbox_download * const dl)
+{
+	free(dl->url);
+	free(dl->name);
+	free(dl->path);
+	free(dl->part);
+	free(dl->state_file);
+	free(dl);
+}
+
+
+/**
+ * Start queued downloads, handle removals and
+ * update the stats.
+ */
+static void
+avbox_download_schedule(const int64_t now, const int tick)
+{
+	int i, active = 0, n_start = 0;
+	int64_t elapsed;
+	struct avbox_download *dl, *start[AVBOX_DOWNLOAD_MAX_SEGMENTS];
+	LIST_DECLARE(removed);
+	static int64_t last_tick = 0;
+
+	LIST_INIT(&removed);
+
+	pthread_mutex_lock(&lock);
+
+	elapsed = now - last_tick;
+	if (tick) {
+		last_tick = now;
+	}
+
+	LIST_FOREACH_SAFE(struct avbox_download*, dl, &downloads, {
+		if (dl->remove) {
+			LIST_REMOVE(dl);
+			LIST_APPEND(&removed, dl);
+		} else if (dl->state == AVBOX_DOWNLOAD_ACTIVE) {
+			active++;
+			if (tick && elapsed > 0) {
+				const int rate = ((dl->downloaded - dl->last_downloaded) * 1000) / elapsed;
+				dl->rate = (dl->rate + rate) / 2;
+				dl->last_downloaded = dl->downloaded;
+			}
+		}
+	});
+
+	LIST_FOREACH(struct avbox_download*, dl, &downloads) {
+		if (n_start >= AVBOX_DOWNLOAD_MAX_SEGMENTS) {
+			break;
+		}
+		/* streams don't wait in the queue */
+		if (dl->state == AVBOX_DOWNLOAD_QUEUED &&
+			(active < max_active || dl->stream)) {
+			dl->state = AVBOX_DOWNLOAD_ACTIVE;
+			start[n_start++] = dl;
+			active++;
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	/* the rest of the list is only changed by this thread */
+	LIST_FOREACH_SAFE(struct avbox_download*, dl, &removed, {
+		avbox_download_stop(dl);
+		avbox_download_closepartfile(dl, 0);
+		if (dl->remove_data) {
+			(void) unlink(dl->part);
+			(void) unlink(dl->state_file);
+		} else if (dl->state == AVBOX_DOWNLOAD_ACTIVE) {
+			avbox_download_savestate(dl);
+		}
+		LIST_REMOVE(dl);
+		avbox_download_free(dl);
+	});
+
+	for (i = 0; i < n_start; i++) {
+		avbox_download_start(start[i]);
+	}
+
+	if (tick) {
+		pthread_mutex_lock(&lock);
+		LIST_FOREACH(struct avbox_download*, dl, &downloads) {
+			if (dl->state == AVBOX_DOWNLOAD_ACTIVE && dl->fd != -1 &&
+				now - dl->last_save >= AVBOX_DOWNLOAD_SAVE_INTERVAL) {
+				avbox_download_savestate(dl);
+			}
+		}
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+
+/**
+ * Split the rate limit between all connections. This runs
+ * every tick while there's a limit because connections come
+ * and go. Downloads that are being streamed are never limited
+ * since someone is waiting for them.
+ */
+static void
+avbox_download_applylimit(void)
+{
+	int i, n = 0, limit, changed;
+	struct avbox_download *dl;
+
+	pthread_mutex_lock(&lock);
+	limit = rate_limit;
+	changed = rate_limit_changed;
+	rate_limit_changed = 0;
+	if (limit == 0 && !changed) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	LIST_FOREACH(struct avbox_download*, dl, &downloads) {
+		if (!dl->stream) {
+			n += avbox_download_activesegments(dl);
+		}
+	}
+
+	segment_limit = (limit == 0) ? 0 : (n > 1) ? limit / n : limit;
+
+	LIST_FOREACH(struct avbox_download*, dl, &downloads) {
+		for (i = 0; i < AVBOX_DOWNLOAD_MAX_SEGMENTS; i++) {
+			if (dl->segments[i].curl != NULL) {
+				curl_easy_setopt(dl->segments[i].curl,
+					CURLOPT_MAX_RECV_SPEED_LARGE,
+					dl->stream ? 0 : segment_limit);
+			}
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+#ifdef ENABLE_IONICE
+	/* we also get out of the way of other disk users */
+	if (changed) {
+		(void) ioprio_set(IOPRIO_WHO_PROCESS, syscall(SYS_gettid),
+			(limit == 0) ? IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 4) :
+			IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+	}
+#endif
+}
+
+
+/**
+ * Called by readers of a streamed download when they
+ * are waiting for data.
+ */
+static void
+avbox_download_wakeup(void *context)
+{
+	(void) context;
+	if (multi != NULL) {
+		curl_multi_wakeup(multi);
+	}
+}
+
+
+/**
+ * Register a streamed download as a partfile. Everything
+ * outside the segments that are left is available.
+ */
+static void
+avbox_download_openpartfile(struct avbox_download * const dl)
+{
+	int i, j, n = 0;
+	int64_t pos = 0;
+	struct avbox_partfile *partfile;
+	struct avbox_download_segment *left[AVBOX_DOWNLOAD_MAX_SEGMENTS], *tmp;
+
+	if ((partfile = avbox_partfile_new(dl->path, dl->part, dl->size,
+		avbox_download_wakeup, NULL)) == NULL) {
+		LOG_VPRINT_ERROR("Cannot stream %s: %s",
+			dl->name, strerror(errno));
+		pthread_mutex_lock(&lock);
+		dl->stream = 0;
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	/* sort what's left by offset */
+	for (i = 0; i < AVBOX_DOWNLOAD_MAX_SEGMENTS; i++) {
+		if (dl->segments[i].used) {
+			left[n] = &dl->segments[i];
+			for (j = n++; j > 0 && left[j - 1]->pos > left[j]->pos; j--) {
+				tmp = left[j];
+				left[j] = left[j - 1];
+				left[j - 1] = tmp;
+			}
+		}
+	}
+	for (i = 0; i < n; i++) {
+		avbox_partfile_setavailable(partfile, pos, left[i]->pos - pos);
+		pos = left[i]->end + 1;
+	}
+	avbox_partfile_setavailable(partfile, pos, dl->size - pos);
+
+	DEBUG_VPRINT("download", "Streaming %s (%" PRIi64 "/%" PRIi64 " bytes)",
+		dl->name, dl->downloaded, dl->size);
+
+	pthread_mutex_lock(&lock);
+	dl->partfile = partfile;
+	pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ * Move a connection to where the reader of a streamed
+ * download is waiting if no transfer is going to get
+ * there soon.
+ */
+static void
+avbox_download_follow(void)
+{
+	int i;
+	int64_t readpos;
+	struct avbox_download *dl;
+	struct avbox_download_segment *seg, *covering;
+
+	/* the list is only changed by this thread */
+	LIST_FOREACH(struct avbox_download*, dl, &downloads) {
+		if (!dl->stream || dl->state != AVBOX_DOWNLOAD_ACTIVE ||
+			dl->fd == -1 || dl->size <= 0) {
+			continue;
+		}
+		if (dl->partfile == NULL) {
+			avbox_download_openpartfile(dl);
+			continue;
+		}
+		if (!dl->ranges || (readpos = avbox_partfile_getreadpos(dl->partfile)) == -1 ||
+			avbox_partfile_isavailable(dl->partfile, readpos, 1)) {
+			continue;
+		}
+
+		seg = covering = NULL;
+		for (i = 0; i < AVBOX_DOWNLOAD_MAX_SEGMENTS; i++) {
+			struct avbox_download_segment * const s = &dl->segments[i];
+			if (s->used && s->pos <= readpos && readpos <= s->end) {
+				covering = s;
+			} else if (!s->used && seg == NULL) {
+				seg = s;
+			}
+		}
+
+		/* we allow one connection over the limit so
+		 * seeking doesn't have to wait for a segment
+		 * to finish */
+		if (covering == NULL || seg == NULL ||
+			readpos - covering->pos < AVBOX_DOWNLOAD_SEEK_DISTANCE ||
+			avbox_download_activesegments(dl) > max_segments) {
+			continue;
+		}
+
+		seg->pos = seg->flushed = seg->writing = readpos;
+		seg->end = covering->end;
+		seg->retries = 0;
+		seg->used = 1;
+		covering->end = readpos - 1;
+
+		DEBUG_VPRINT("download", "Seeking %s to %" PRIi64,
+			dl->name, readpos);
+
+		if (avbox_download_startsegment(seg) == -1) {
+			covering->end = seg->end;
+			seg->used = 0;
+		}
+	}
+}
+
+
+/**
+ * Downloader thread.
+ */
+static void *
+avbox_download_thread(void *arg)
+{
+	int running;
+	int64_t now, next_tick = 0;
+	CURLMsg *msg;
+
+	(void) arg;
+
+	DEBUG_SET_THREAD_NAME("download");
+
+	while (!quit) {
+		now = avbox_download_now();
+		avbox_download_schedule(now, now >= next_tick);
+		avbox_download_follow();
+		if (now >= next_tick) {
+			avbox_download_applylimit();
+			next_tick = now + AVBOX_DOWNLOAD_TICK;
+		}
+
+		(void) curl_multi_perform(multi, &running);
+		while ((msg = curl_multi_info_read(multi, &running)) != NULL) {
+			if (msg->msg == CURLMSG_DONE) {
+				avbox_download_done(msg->easy_handle, msg->data.result);
+			}
+		}
+
+		(void) curl_multi_poll(multi, NULL, 0,
+			(int) (next_tick - avbox_download_now()), NULL);
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Make up a local file name for a URL.
+ */
+static char *
+avbox_download_filename(const char * const url, const int id)
+{
+	const char *p, *end;
+	char buf[NAME_MAX + 1];
+	size_t len;
+
+	/* skip the query and take the last
+	 * path component */
+	for (end = url; *end != '\0' && *end != '?' && *end != '#'; end++);
+	for (p = end; p > url && p[-1] != '/'; p--);
+
+	len = end - p;
+	if (len == 0 || len >= sizeof(buf) || strstr(url, "://") > p) {
+		snprintf(buf, sizeof(buf), "download-%i", id);
+	} else {
+		memcpy(buf, p, len);
+		buf[len] = '\0';
+		urldecode(buf, buf);
+		if (buf[0] == '.' || buf[0] == '\0' || strchr(buf, '/') != NULL) {
+			snprintf(buf, sizeof(buf), "download-%i", id);
+		}
+	}
+	return strdup(buf);
+}
+
+
+/**
+ * Add a download.
+ */
+int
+avbox_download_add(const char * const url, const char * const dir)
+{
+	int i, id;
+	char buf[PATH_MAX];
+	struct avbox_download *dl;
+
+	if ((dl = malloc(sizeof(struct avbox_download))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return -1;
+	}
+	memset(dl, 0, sizeof(struct avbox_download));
+
+	pthread_mutex_lock(&lock);
+	id = next_id++;
+	pthread_mutex_unlock(&lock);
+
+	dl->id = id;
+	dl->fd = -1;
+	dl->size = -1;
+	dl->state = AVBOX_DOWNLOAD_QUEUED;
+
+	if ((dl->url = strdup(url)) == NULL ||
+		(dl->name = avbox_download_filename(url, id)) == NULL) {
+		goto err;
+	}
+
+	snprintf(buf, sizeof(buf), "%s/%s",
+		(dir != NULL) ? dir : default_dir, dl->name);
+	if ((dl->path = strdup(buf)) == NULL) {
+		goto err;
+	}
+	strncat(buf, ".part", sizeof(buf) - strlen(buf) - 1);
+	if ((dl->part = strdup(buf)) == NULL) {
+		goto err;
+	}
+	snprintf(buf, sizeof(buf), "%s.mbdl", dl->path);
+	if ((dl->state_file = strdup(buf)) == NULL) {
+		goto err;
+	}
+
+	for (i = 0; i < AVBOX_DOWNLOAD_MAX_SEGMENTS; i++) {
+		dl->segments[i].dl = dl;
+	}
+
+	DEBUG_VPRINT("download", "Queuing %s as %s",
+		url, dl->path);
+
+	pthread_mutex_lock(&lock);
+	LIST_APPEND(&downloads, dl);
+	pthread_mutex_unlock(&lock);
+
+	curl_multi_wakeup(multi);
+	return id;
+err:
+	avbox_download_free(dl);
+	errno = ENOMEM;
+	return -1;
+}
+
+
+/**
+ * Cancel and remove a download.
+ */
+int
+avbox_download_remove(const int id, const int remove_data)
+{
+	struct avbox_download *dl;
+
+	pthread_mutex_lock(&lock);
+	LIST_FOREACH(struct avbox_download*, dl, &downloads) {
+		if (dl->id == id) {
+			dl->remove = 1;
+			dl->remove_data = remove_data;
+			pthread_mutex_unlock(&lock);
+			curl_multi_wakeup(multi);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	errno = ENOENT;
+	return -1;
+}
+
+
+/**
+ * Get the statistics of all downloads.
+ */
+int
+avbox_download_getstats(struct avbox_download_stats *stats, const int n)
+{
+	int i = 0;
+	struct avbox_download *dl;
+
+	pthread_mutex_lock(&lock);
+	LIST_FOREACH(struct avbox_download*, dl, &downloads) {
+		if (dl->remove) {
+			continue;
+		}
+		if (i < n) {
+			stats[i].id = dl->id;
+			stats[i].state = dl->state;
+			snprintf(stats[i].name, sizeof(stats[i].name), "%s", dl->name);
+			stats[i].size = dl->size;
+			stats[i].downloaded = dl->downloaded;
+			stats[i].rate = dl->rate;
+			stats[i].segments = avbox_download_activesegments(dl);
+		}
+		i++;
+	}
+	pthread_mutex_unlock(&lock);
+	return i;
+}
+
+
+/**
+ * Stream a download.
+ */
+int
+avbox_download_stream(const int id, char * const path, const size_t n)
+{
+	int ret = -1;
+	struct avbox_download *dl;
+
+	pthread_mutex_lock(&lock);
+	LIST_FOREACH(struct avbox_download*, dl, &downloads) {
+		if (dl->id != id || dl->remove) {
+			continue;
+		}
+		if (dl->state == AVBOX_DOWNLOAD_DONE || dl->partfile != NULL) {
+			snprintf(path, n, "%s", dl->path);
+			ret = 0;
+		} else if (dl->state == AVBOX_DOWNLOAD_FAILED) {
+			errno = EIO;
+		} else if (dl->fd != -1 && dl->size <= 0) {
+			/* we can't seek without the size */
+			errno = ENOTSUP;
+		} else {
+			dl->stream = 1;
+			errno = EAGAIN;
+		}
+		pthread_mutex_unlock(&lock);
+		curl_multi_wakeup(multi);
+		return ret;
+	}
+	pthread_mutex_unlock(&lock);
+	errno = ENOENT;
+	return -1;
+}
+
+
+/**
+ * Limit the combined download rate.
+ */
+void
+avbox_download_setlimit(const int rate)
+{
+	pthread_mutex_lock(&lock);
+	if (rate_limit != rate) {
+		rate_limit = (rate > 0) ? rate : 0;
+		rate_limit_changed = 1;
+	}
+	pthread_mutex_unlock(&lock);
+
+	/* apply it now */
+	if (multi != NULL) {
+		curl_multi_wakeup(multi);
+	}
+}
+
+
+/**
+ * Queue the downloads that were interrupted.
+ */
+static void
+avbox_download_resumeall(void)
+{
+	FILE *f;
+	DIR *dir;
+	size_t len;
+	struct dirent *ent;
+	char path[PATH_MAX], url[4096];
+
+	if ((dir = opendir(default_dir)) == NULL) {
+		return;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		if ((len = strlen(ent->d_name)) <= 5 ||
+			strcmp(ent->d_name + len - 5, ".mbdl")) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", default_dir, ent->d_name);
+		if ((f = fopen(path, "r")) == NULL) {
+			continue;
+		}
+		if (fgets(url, sizeof(url), f) != NULL) {
+			url[strcspn(url, "\n")] = '\0';
+			if (url[0] != '\0') {
+				(void) avbox_download_add(url, NULL);
+			}
+		}
+		fclose(f);
+	}
+	closedir(dir);
+}
+
+
+/**
+ * Initialize the downloader.
+ */
+int
+avbox_download_init(void)
+{
+	char *statedir;
+	char buf[PATH_MAX];
+
+	DEBUG_PRINT("download", "Initializing downloader");
+
+	LIST_INIT(&downloads);
+
+	if ((default_dir = avbox_settings_getstring("downloads.directory")) == NULL) {
+		if ((statedir = getstatedir()) == NULL) {
+			LOG_PRINT_ERROR("Could not get state directory");
+			return -1;
+		}
+		snprintf(buf, sizeof(buf), "%s/downloads", statedir);
+		free(statedir);
+		if ((default_dir = strdup(buf)) == NULL) {
+			return -1;
+		}
+	}
+	(void) mkdir_p(default_dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+
+	max_active = avbox_settings_getint("downloads.http.max_active", max_active);
+	max_segments = avbox_settings_getint("downloads.http.segments", max_segments);
+	if (max_segments < 1 || max_segments > AVBOX_DOWNLOAD_MAX_SEGMENTS) {
+		LOG_VPRINT_ERROR("Invalid downloads.http.segments %i. Using 4",
+			max_segments);
+		max_segments = 4;
+	}
+
+	if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK ||
+		(multi = curl_multi_init()) == NULL) {
+		LOG_PRINT_ERROR("Could not initialize curl");
+		free(default_dir);
+		default_dir = NULL;
+		return -1;
+	}
+
+	avbox_download_resumeall();
+
+	quit = 0;
+	if (pthread_create(&thread, NULL, avbox_download_thread, NULL) != 0) {
+		LOG_PRINT_ERROR("Could not start downloader thread");
+		curl_multi_cleanup(multi);
+		multi = NULL;
+		free(default_dir);
+		default_dir = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Shutdown the downloader.
+ */
+void
+avbox_download_shutdown(void)
+{
+	struct avbox_download *dl;
+
+	if (multi == NULL) {
+		return;
+	}
+
+	DEBUG_PRINT("download", "Shutting down downloader");
+
+	quit = 1;
+	curl_multi_wakeup(multi);
+	pthread_join(thread, NULL);
+
+	LIST_FOREACH_SAFE(struct avbox_download*, dl, &downloads, {
+		if (dl->state == AVBOX_DOWNLOAD_ACTIVE) {
+			avbox_download_savestate(dl);
+		}
+		avbox_download_stop(dl);
+		avbox_download_closepartfile(dl, 0);
+		LIST_REMOVE(dl);
+		avbox_download_free(dl);
+	});
+
+	curl_multi_cleanup(multi);
+	multi = NULL;
+	curl_global_cleanup();
+	free(default_dir);
+	default_dir = NULL;
+}
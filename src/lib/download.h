@@ -0,0 +1,99 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ */
+
+#ifndef __AVBOX_DOWNLOAD_H__
+#define __AVBOX_DOWNLOAD_H__
+#include <stdint.h>
+#include <stddef.h>
+
+
+enum avbox_download_state
+{
+	AVBOX_DOWNLOAD_QUEUED,
+	AVBOX_DOWNLOAD_ACTIVE,
+	AVBOX_DOWNLOAD_DONE,
+	AVBOX_DOWNLOAD_FAILED
+};
+
+
+/**
+ * Download statistics.
+ */
+struct avbox_download_stats
+{
+	int id;
+	enum avbox_download_state state;
+	char name[256];
+	int64_t size;		/* bytes. -1 if unknown */
+	int64_t downloaded;	/* bytes */
+	int rate;		/* bytes/sec */
+	int segments;		/* active connections */
+};
+
+
+/**
+ * Add a download. The file is saved to the downloads.directory
+ * setting if dir is NULL.
+ *
+ * Returns the download id or -1 on failure.
+ */
+int
+avbox_download_add(const char * const url, const char * const dir);
+
+
+/**
+ * Cancel and remove a download.
+ */
+int
+avbox_download_remove(const int id, const int remove_data);
+
+
+/**
+ * Get the statistics of all downloads.
+ *
+ * Returns the number of downloads, which may be more
+ * than n.
+ */
+int
+avbox_download_getstats(struct avbox_download_stats *stats, const int n);
+
+
+/**
+ * Start streaming a download. The download is moved ahead of the
+ * queue and registered as a partfile so the player can read it
+ * while it downloads.
+ *
+ * Returns 0 and copies the path to play to path once it's ready
+ * or -1 with errno set to EAGAIN if it's not ready yet.
+ */
+int
+avbox_download_stream(const int id, char * const path, const size_t n);
+
+
+/**
+ * Limit the combined rate of all downloads to rate
+ * bytes/sec. A rate of 0 removes the limit.
+ */
+void
+avbox_download_setlimit(const int rate);
+
+
+/**
+ * Initialize the downloader and resume any
+ * unfinished downloads.
+ */
+int
+avbox_download_init(void);
+
+
+/**
+ * Shutdown the downloader. Unfinished downloads are
+ * resumed on the next run.
+ */
+void
+avbox_download_shutdown(void);
+
+
+#endif
@@ -0,0 +1,407 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+#define LOG_MODULE "partfile"
+
+#include "log.h"
+#include "debug.h"
+#include "linkedlist.h"
+#include "partfile.h"
+
+
+LISTABLE_STRUCT(avbox_partfile,
+	char *path;
+	char *datapath;
+	int64_t size;
+	int64_t readpos;
+	int64_t (*ranges)[2];	/* sorted [start, end) */
+	int n_ranges;
+	int cap_ranges;
+	int refs;
+	int done;
+	int aborted;
+	int registered;
+	avbox_partfile_wakeup wakeup;
+	void *context;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+);
+
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST registry = { &registry, &registry };
+
+
+/**
+ * Gets the number of bytes available at offset. The
+ * lock must be held.
+ */
+static int64_t
+avbox_partfile_contiguous(const struct avbox_partfile * const inst,
+	const int64_t offset)
+{
+	int lo = 0, hi = inst->n_ranges - 1, mid;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (offset < inst->ranges[mid][0]) {
+			hi = mid - 1;
+		} else if (offset >= inst->ranges[mid][1]) {
+			lo = mid + 1;
+		} else {
+			return inst->ranges[mid][1] - offset;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Remove the file from the registry so no new readers
+ * find it. The registry lock must be held.
+ */
+static void
+avbox_partfile_unregister(struct avbox_partfile * const inst)
+{
+	if (inst->registered) {
+		LIST_REMOVE(inst);
+		inst->registered = 0;
+	}
+}
+
+
+/**
+ * Register a file that is being downloaded.
+ */
+struct avbox_partfile *
+avbox_partfile_new(const char * const path, const char * const datapath,
+	const int64_t size, avbox_partfile_wakeup wakeup, void *context)
+{
+	struct avbox_partfile *inst, *other;
+
+	if ((inst = malloc(sizeof(struct avbox_partfile))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return NULL;
+	}
+	memset(inst, 0, sizeof(struct avbox_partfile));
+
+	if ((inst->path = strdup(path)) == NULL ||
+		(inst->datapath = strdup(datapath)) == NULL) {
+		free(inst->path);
+		free(inst);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	inst->size = size;
+	inst->readpos = -1;
+	inst->refs = 1;
+	inst->wakeup = wakeup;
+	inst->context = context;
+	pthread_mutex_init(&inst->lock, NULL);
+	pthread_cond_init(&inst->cond, NULL);
+
+	pthread_mutex_lock(&registry_lock);
+	LIST_FOREACH(struct avbox_partfile*, other, &registry) {
+		if (!strcmp(other->path, path)) {
+			pthread_mutex_unlock(&registry_lock);
+			LOG_VPRINT_ERROR("%s is already registered", path);
+			pthread_cond_destroy(&inst->cond);
+			pthread_mutex_destroy(&inst->lock);
+			free(inst->datapath);
+			free(inst->path);
+			free(inst);
+			errno = EEXIST;
+			return NULL;
+		}
+	}
+	LIST_APPEND(&registry, inst);
+	inst->registered = 1;
+	pthread_mutex_unlock(&registry_lock);
+
+	DEBUG_VPRINT("partfile", "Registered %s (size=%" PRIi64 ")",
+		path, size);
+
+	return inst;
+}
+
+
+/**
+ * Mark a range as downloaded.
+ */
+void
+avbox_partfile_setavailable(struct avbox_partfile * const inst,
+	const int64_t offset, const int64_t len)
+{
+	int i, j;
+	int64_t start = offset, end = offset + len;
+
+	if (len <= 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&inst->lock);
+
+	/* find the first range that ends at or after start */
+	for (i = 0; i < inst->n_ranges && inst->ranges[i][1] < start; i++);
+
+	/* merge all the ranges that touch the new one */
+	for (j = i; j < inst->n_ranges && inst->ranges[j][0] <= end; j++) {
+		if (inst->ranges[j][0] < start) {
+			start = inst->ranges[j][0];
+		}
+		if (inst->ranges[j][1] > end) {
+			end = inst->ranges[j][1];
+		}
+	}
+
+	if (j == i) {
+		/* insert a new range at i */
+		if (inst->n_ranges == inst->cap_ranges) {
+			const int cap = (inst->cap_ranges == 0) ? 16 : inst->cap_ranges * 2;
+			int64_t (*ranges)[2];
+			if ((ranges = realloc(inst->ranges, cap * sizeof(*ranges))) == NULL) {
+				LOG_PRINT_ERROR("Could not grow ranges: Out of memory");
+				pthread_mutex_unlock(&inst->lock);
+				return;
+			}
+			inst->ranges = ranges;
+			inst->cap_ranges = cap;
+		}
+		memmove(&inst->ranges[i + 1], &inst->ranges[i],
+			(inst->n_ranges - i) * sizeof(*inst->ranges));
+		inst->n_ranges++;
+	} else if (j > i + 1) {
+		/* collapse ranges i..j-1 into i */
+		memmove(&inst->ranges[i + 1], &inst->ranges[j],
+			(inst->n_ranges - j) * sizeof(*inst->ranges));
+		inst->n_ranges -= (j - i - 1);
+	}
+	inst->ranges[i][0] = start;
+	inst->ranges[i][1] = end;
+
+	pthread_cond_broadcast(&inst->cond);
+	pthread_mutex_unlock(&inst->lock);
+}
+
+
+/**
+ * Mark the whole file as downloaded.
+ */
+void
+avbox_partfile_setdone(struct avbox_partfile * const inst,
+	const char * const datapath)
+{
+	char *copy;
+
+	pthread_mutex_lock(&registry_lock);
+	avbox_partfile_unregister(inst);
+	pthread_mutex_unlock(&registry_lock);
+
+	pthread_mutex_lock(&inst->lock);
+	if (datapath != NULL && (copy = strdup(datapath)) != NULL) {
+		free(inst->datapath);
+		inst->datapath = copy;
+	}
+	inst->done = 1;
+	pthread_cond_broadcast(&inst->cond);
+	pthread_mutex_unlock(&inst->lock);
+}
+
+
+/**
+ * Fail all reads.
+ */
+void
+avbox_partfile_abort(struct avbox_partfile * const inst)
+{
+	pthread_mutex_lock(&registry_lock);
+	avbox_partfile_unregister(inst);
+	pthread_mutex_unlock(&registry_lock);
+
+	pthread_mutex_lock(&inst->lock);
+	inst->aborted = 1;
+	pthread_cond_broadcast(&inst->cond);
+	pthread_mutex_unlock(&inst->lock);
+}
+
+
+/**
+ * Gets the offset of the last read.
+ */
+int64_t
+avbox_partfile_getreadpos(struct avbox_partfile * const inst)
+{
+	int64_t pos;
+	pthread_mutex_lock(&inst->lock);
+	pos = inst->readpos;
+	pthread_mutex_unlock(&inst->lock);
+	return pos;
+}
+
+
+/**
+ * Checks if a range is available.
+ */
+int
+avbox_partfile_isavailable(struct avbox_partfile * const inst,
+	const int64_t offset, const int64_t len)
+{
+	int ret;
+	pthread_mutex_lock(&inst->lock);
+	ret = inst->done || avbox_partfile_contiguous(inst, offset) >= len;
+	pthread_mutex_unlock(&inst->lock);
+	return ret;
+}
+
+
+/**
+ * Find a file being downloaded.
+ */
+struct avbox_partfile *
+avbox_partfile_get(const char * const path)
+{
+	struct avbox_partfile *inst;
+
+	pthread_mutex_lock(&registry_lock);
+	LIST_FOREACH(struct avbox_partfile*, inst, &registry) {
+		if (!strcmp(inst->path, path)) {
+			inst->refs++;
+			pthread_mutex_unlock(&registry_lock);
+			return inst;
+		}
+	}
+	pthread_mutex_unlock(&registry_lock);
+	return NULL;
+}
+
+
+/**
+ * Open the file for reading.
+ */
+int
+avbox_partfile_open(struct avbox_partfile * const inst)
+{
+	int fd;
+	pthread_mutex_lock(&inst->lock);
+	fd = open(inst->datapath, O_RDONLY | O_CLOEXEC);
+	pthread_mutex_unlock(&inst->lock);
+	return fd;
+}
+
+
+/**
+ * Gets the size of the file.
+ */
+int64_t
+avbox_partfile_size(struct avbox_partfile * const inst)
+{
+	return inst->size;
+}
+
+
+/**
+ * Wait until a range is available.
+ */
+int64_t
+avbox_partfile_wait(struct avbox_partfile * const inst, const int64_t offset,
+	const int64_t len, const int timeout, int * const percent)
+{
+	int64_t avail, want;
+	int woken = 0;
+	struct timespec ts;
+
+	if (offset >= inst->size) {
+		return 0;
+	}
+	want = (len < inst->size - offset) ? len : inst->size - offset;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (timeout % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&inst->lock);
+	inst->readpos = offset;
+
+	while (1) {
+		if (inst->aborted) {
+			pthread_mutex_unlock(&inst->lock);
+			errno = EIO;
+			return -1;
+		}
+		if (inst->done) {
+			avail = inst->size - offset;
+			break;
+		}
+		if ((avail = avbox_partfile_contiguous(inst, offset)) >= want) {
+			break;
+		}
+		if (percent != NULL) {
+			*percent = (avail * 100) / want;
+		}
+
+		/* let the downloader know that we're
+		 * waiting for this */
+		if (inst->wakeup != NULL && !woken++) {
+			pthread_mutex_unlock(&inst->lock);
+			inst->wakeup(inst->context);
+			pthread_mutex_lock(&inst->lock);
+		}
+
+		if (pthread_cond_timedwait(&inst->cond, &inst->lock, &ts) == ETIMEDOUT) {
+			pthread_mutex_unlock(&inst->lock);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+
+	pthread_mutex_unlock(&inst->lock);
+
+	if (percent != NULL) {
+		*percent = 100;
+	}
+	return avail;
+}
+
+
+/**
+ * Drop a reference.
+ */
+void
+avbox_partfile_unref(struct avbox_partfile * const inst)
+{
+	pthread_mutex_lock(&registry_lock);
+	if (--inst->refs > 0) {
+		pthread_mutex_unlock(&registry_lock);
+		return;
+	}
+	avbox_partfile_unregister(inst);
+	pthread_mutex_unlock(&registry_lock);
+
+	DEBUG_VPRINT("partfile", "Freeing %s", inst->path);
+
+	pthread_cond_destroy(&inst->cond);
+	pthread_mutex_destroy(&inst->lock);
+	free(inst->ranges);
+	free(inst->datapath);
+	free(inst->path);
+	free(inst);
+}
@@ -0,0 +1,119 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ */
+
+#ifndef __AVBOX_PARTFILE_H__
+#define __AVBOX_PARTFILE_H__
+#include <stdint.h>
+
+
+/**
+ * A file that is still being downloaded. The downloader registers
+ * it and marks the ranges as they arrive. Readers block until the
+ * range they want is there and the downloader uses their position
+ * to decide what to get next.
+ */
+struct avbox_partfile;
+
+
+/**
+ * Called by avbox_partfile_wait() when a reader is waiting
+ * for data that is not there.
+ */
+typedef void (*avbox_partfile_wakeup)(void *context);
+
+
+/**
+ * Register a file that is being downloaded. The file is looked
+ * up by path and the data is read from datapath.
+ */
+struct avbox_partfile *
+avbox_partfile_new(const char * const path, const char * const datapath,
+	const int64_t size, avbox_partfile_wakeup wakeup, void *context);
+
+
+/**
+ * Mark a range as downloaded.
+ */
+void
+avbox_partfile_setavailable(struct avbox_partfile * const inst,
+	const int64_t offset, const int64_t len);
+
+
+/**
+ * Mark the whole file as downloaded. The data is now
+ * at datapath.
+ */
+void
+avbox_partfile_setdone(struct avbox_partfile * const inst,
+	const char * const datapath);
+
+
+/**
+ * Fail all reads. Used when the download is removed or fails.
+ */
+void
+avbox_partfile_abort(struct avbox_partfile * const inst);
+
+
+/**
+ * Gets the offset of the last read or -1 if nothing
+ * has been read yet.
+ */
+int64_t
+avbox_partfile_getreadpos(struct avbox_partfile * const inst);
+
+
+/**
+ * Checks if a range is available.
+ */
+int
+avbox_partfile_isavailable(struct avbox_partfile * const inst,
+	const int64_t offset, const int64_t len);
+
+
+/**
+ * Find a file being downloaded and take a reference
+ * to it. Returns NULL if the path is not registered.
+ */
+struct avbox_partfile *
+avbox_partfile_get(const char * const path);
+
+
+/**
+ * Open the file for reading.
+ */
+int
+avbox_partfile_open(struct avbox_partfile * const inst);
+
+
+/**
+ * Gets the size of the file.
+ */
+int64_t
+avbox_partfile_size(struct avbox_partfile * const inst);
+
+
+/**
+ * Wait until len bytes (or up to the end of the file) are
+ * available at offset. Returns the number of bytes available,
+ * 0 at the end of the file or -1 if the download failed or
+ * the timeout expired (errno is set to ETIMEDOUT).
+ *
+ * If percent is not NULL it is set to the percent of the
+ * wanted range that is available.
+ */
+int64_t
+avbox_partfile_wait(struct avbox_partfile * const inst, const int64_t offset,
+	const int64_t len, const int timeout, int * const percent);
+
+
+/**
+ * Drop a reference.
+ */
+void
+avbox_partfile_unref(struct avbox_partfile * const inst);
+
+
+#endif
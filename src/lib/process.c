@@ -18,6 +18,14 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sched.h>
 
 #define LOG_MODULE "process"
 
@@ -25,10 +33,13 @@
 #include "log.h"
 #include "linkedlist.h"
 #include "timers.h"
-#include "su.h"
 #include "process.h"
 #include "math_util.h"
-#include "file_util.h"
+#include "dispatch.h"
+#include "delegate.h"
+#include "thread.h"
+#include "time_util.h"
+#include "cgroup.h"
 
 
 #ifdef ENABLE_IONICE
@@ -39,6 +50,39 @@
 struct avbox_process;
 
 
+#define AVBOX_PROCESS_RINGSZ		(8 * 1024)
+#define AVBOX_PROCESS_LINES_BATCH	(64)
+
+
+/**
+ * Line buffered process output stream. The monitor thread reads
+ * into a ring buffer and lines are handed to the callback straight
+ * from it. Streams are reference counted since they may outlive the
+ * process and be in the middle of a delivery.
+ */
+LISTABLE_STRUCT(avbox_process_stream,
+	int id;
+	int fileno;
+	int fd;
+	int refs;
+	int eof;
+	int done;
+	int claimed;
+	int pending;
+	int busy;
+	int paused;
+	int direct;
+	char *name;
+	avbox_process_linefn callback;
+	void *callback_data;
+	struct avbox_object *object;
+	size_t head;
+	size_t len;
+	char buf[AVBOX_PROCESS_RINGSZ];
+	char line[AVBOX_PROCESS_RINGSZ + 1];
+);
+
+
 struct callback_state {
 	int result;
 	int returned;
@@ -52,6 +96,7 @@ struct callback_state {
 LISTABLE_STRUCT(avbox_process,
 	int id;
 	pid_t pid;
+	int pidfd;
 	int stdin;
 	int stdout;
 	int stderr;
@@ -68,16 +113,596 @@ LISTABLE_STRUCT(avbox_process,
 	void *exit_callback_data;
 	int stopping;
 	struct callback_state *cbstate;
+	struct avbox_process_stream *streams[2];
+	avbox_process_linefn line_callback[2];
+	void *line_callback_data[2];
+	struct avbox_object *line_object[2];
+	int line_claimed[2];
 	pthread_cond_t cond;
 );
 
 
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open	(434)
+#endif
+
+
+/* The event loop tags each epoll entry with the kind of event
+ * on the low bits and the process id or stream pointer on
+ * the rest */
+#define AVBOX_PROCESS_EV_PID		(0)
+#define AVBOX_PROCESS_EV_STREAM		(1)
+#define AVBOX_PROCESS_EV_WAKE		(2)
+#define AVBOX_PROCESS_EV_SIGNAL		(3)
+#define AVBOX_PROCESS_EV(id, kind)	((((uint64_t) (id)) << 2) | (kind))
+#define AVBOX_PROCESS_EV_STREAMPTR(s)	(((uint64_t) (uintptr_t) (s)) | AVBOX_PROCESS_EV_STREAM)
+#define AVBOX_PROCESS_EV_ID(ev)		((int) ((ev) >> 2))
+#define AVBOX_PROCESS_EV_PTR(ev)	((void*) (uintptr_t) ((ev) & ~((uint64_t) 3)))
+#define AVBOX_PROCESS_EV_KIND(ev)	((int) ((ev) & 3))
+
+#define AVBOX_PROCESS_MAX_EVENTS	(16)
+#define AVBOX_PROCESS_SPAWN_STACK	(64 * 1024)
+
+#ifndef SYS_close_range
+#define SYS_close_range	(436)
+#endif
+
+
 static LIST process_list;
+static LIST stream_list;
 static pthread_mutex_t process_list_lock = PTHREAD_MUTEX_INITIALIZER;
 static int nextid = 1;
 static pthread_t monitor_thread;
-static pthread_t io_thread;
-static int quit = 0, io_quit = 0;
+static int quit = 0;
+static int epollfd = -1;
+static int wakefd = -1;
+static int sigfd = -1;
+static int use_pidfd = 1;
+
+
+/**
+ * Wake the event loop.
+ */
+static void
+avbox_process_wakeloop(void)
+{
+	const uint64_t one = 1;
+	if (write(wakefd, &one, sizeof(one)) == -1) {
+		LOG_VPRINT_ERROR("Could not wake process monitor: %s",
+			strerror(errno));
+	}
+}
+
+
+/**
+ * SIGCHLD handler. Only used when pidfds are not available
+ * to catch signals delivered to threads that don't have SIGCHLD
+ * blocked (and therefore don't show on the signalfd).
+ */
+static void
+avbox_process_sigchld(int signum)
+{
+	const uint64_t one = 1;
+	const int saved_errno = errno;
+	(void) signum;
+	(void) write(wakefd, &one, sizeof(one));
+	errno = saved_errno;
+}
+
+
+/**
+ * Add a file descriptor to the event loop.
+ */
+static int
+avbox_process_epolladd(const int fd, const uint64_t ev)
+{
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u64 = ev;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		LOG_VPRINT_ERROR("Could not add fd to epoll set: %s",
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Start catching SIGCHLD with a signalfd and reaping children
+ * with waitpid(). This is used instead of pidfds when the kernel
+ * doesn't support them or when we fail to open one. The process
+ * list must be locked if the monitor thread is running.
+ */
+static int
+avbox_process_sigchldinit(void)
+{
+	sigset_t mask;
+	struct sigaction sa;
+
+	use_pidfd = 0;
+
+	if (sigfd != -1) {
+		return 0;
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0 ||
+		(sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK)) == -1) {
+		LOG_VPRINT_ERROR("Could not create signalfd: %s",
+			strerror(errno));
+		return -1;
+	}
+	if (avbox_process_epolladd(sigfd,
+		AVBOX_PROCESS_EV(0, AVBOX_PROCESS_EV_SIGNAL)) == -1) {
+		close(sigfd);
+		sigfd = -1;
+		return -1;
+	}
+
+	/* threads started before us don't have SIGCHLD
+	 * blocked so we need a handler for those */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = avbox_process_sigchld;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+		LOG_VPRINT_ERROR("Could not install SIGCHLD handler: %s",
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Remove a file descriptor from the event loop and close it.
+ */
+static void
+avbox_process_epollclose(int * const fd)
+{
+	if (*fd != -1) {
+		(void) epoll_ctl(epollfd, EPOLL_CTL_DEL, *fd, NULL);
+		close(*fd);
+		*fd = -1;
+	}
+}
+
+
+/**
+ * Drop a reference to an output stream. The process
+ * list must be locked.
+ */
+static void
+avbox_process_streamunref(struct avbox_process_stream * const s)
+{
+	if (--s->refs == 0) {
+		assert(s->fd == -1);
+		free(s->name);
+		free(s);
+	}
+}
+
+
+/**
+ * Stop or resume reading from a stream. We stop when the
+ * buffer is full so the process blocks until we catch up.
+ */
+static void
+avbox_process_streampause(struct avbox_process_stream * const s, const int pause)
+{
+	struct epoll_event event;
+
+	if (s->fd == -1 || s->paused == pause) {
+		return;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events = pause ? 0 : EPOLLIN;
+	event.data.u64 = AVBOX_PROCESS_EV_STREAMPTR(s);
+	if (epoll_ctl(epollfd, EPOLL_CTL_MOD, s->fd, &event) == -1) {
+		LOG_VPRINT_ERROR("Could not modify epoll set: %s",
+			strerror(errno));
+		return;
+	}
+	s->paused = pause;
+}
+
+
+/**
+ * Discard everything on a stream's buffer.
+ */
+static void
+avbox_process_streamdrop(struct avbox_process_stream * const s)
+{
+	if (!s->busy) {
+		s->head = 0;
+		s->len = 0;
+		avbox_process_streampause(s, 0);
+	}
+}
+
+
+/**
+ * Gets the next line from a stream's buffer and the number
+ * of bytes it takes on the buffer. Lines are terminated in place
+ * unless they wrap around the end of the buffer.
+ */
+static char *
+avbox_process_streamline(struct avbox_process_stream * const s, size_t * const consumed)
+{
+	size_t n, first;
+	char *line;
+
+	for (n = 0; n < s->len; n++) {
+		if (s->buf[(s->head + n) % AVBOX_PROCESS_RINGSZ] == '\n') {
+			break;
+		}
+	}
+
+	if (n == s->len) {
+		/* no line terminator. Hand out what we have if the
+		 * buffer is full or nothing else is coming */
+		if (s->len == 0 || (s->len < AVBOX_PROCESS_RINGSZ && !s->eof)) {
+			return NULL;
+		}
+		*consumed = n;
+	} else {
+		*consumed = n + 1;
+	}
+
+	if (n < s->len && s->head + n < AVBOX_PROCESS_RINGSZ) {
+		line = &s->buf[s->head];
+		line[n] = '\0';
+	} else {
+		first = MIN(n, AVBOX_PROCESS_RINGSZ - s->head);
+		memcpy(s->line, &s->buf[s->head], first);
+		memcpy(s->line + first, s->buf, n - first);
+		s->line[n] = '\0';
+		line = s->line;
+	}
+
+	if (n > 0 && line[n - 1] == '\r') {
+		line[n - 1] = '\0';
+	}
+	return line;
+}
+
+
+/**
+ * Hand buffered lines to a stream's callback. Unless the stream
+ * is delivered directly by the monitor thread the list lock is
+ * released while the callback runs. The process list must be locked.
+ *
+ * Returns 1 if it stopped with lines still pending.
+ */
+static int
+avbox_process_streamconsume(struct avbox_process_stream * const s)
+{
+	int ret = 0, count = 0;
+	size_t n;
+	char *line;
+	void *data;
+	avbox_process_linefn callback;
+
+	s->busy = 1;
+
+	while ((callback = s->callback) != NULL) {
+		data = s->callback_data;
+
+		/* don't hog the dispatch thread */
+		if (count++ == AVBOX_PROCESS_LINES_BATCH) {
+			ret = 1;
+			break;
+		}
+
+		if ((line = avbox_process_streamline(s, &n)) == NULL) {
+			/* let the callback know when we're done */
+			if (s->eof && s->len == 0 && !s->done) {
+				s->done = 1;
+				if (!s->direct) {
+					pthread_mutex_unlock(&process_list_lock);
+				}
+				callback(s->id, s->fileno, NULL, data);
+				if (!s->direct) {
+					pthread_mutex_lock(&process_list_lock);
+				}
+			}
+			break;
+		}
+
+		if (!s->direct) {
+			pthread_mutex_unlock(&process_list_lock);
+		}
+		callback(s->id, s->fileno, line, data);
+		if (!s->direct) {
+			pthread_mutex_lock(&process_list_lock);
+		}
+
+		s->head = (s->head + n) % AVBOX_PROCESS_RINGSZ;
+		s->len -= n;
+		avbox_process_streampause(s, 0);
+	}
+
+	s->busy = 0;
+
+	/* if the callback was unregistered while
+	 * we were running drop the rest */
+	if (s->callback == NULL && s->claimed) {
+		avbox_process_streamdrop(s);
+	}
+
+	return ret;
+}
+
+
+static void
+avbox_process_streamnotify(struct avbox_process_stream * const s);
+
+
+/**
+ * Delivers a stream's lines on the dispatch thread
+ * that registered the callback.
+ */
+static void *
+avbox_process_streamdeliver(void *arg)
+{
+	struct avbox_process_stream * const s = arg;
+
+	pthread_mutex_lock(&process_list_lock);
+	s->pending = 0;
+	if (avbox_process_streamconsume(s)) {
+		avbox_process_streamnotify(s);
+	}
+	avbox_process_streamunref(s);
+	pthread_mutex_unlock(&process_list_lock);
+	return NULL;
+}
+
+
+/**
+ * Schedule the delivery of a stream's lines. The process
+ * list must be locked.
+ */
+static void
+avbox_process_streamnotify(struct avbox_process_stream * const s)
+{
+	struct avbox_delegate *del;
+	struct avbox_object *object;
+
+	if (s->callback == NULL || s->pending || s->done) {
+		return;
+	}
+
+	/* log streams are handled right here */
+	if (s->direct) {
+		while (avbox_process_streamconsume(s));
+		return;
+	}
+
+	if ((del = avbox_delegate_new(avbox_process_streamdeliver, s)) == NULL) {
+		LOG_VPRINT_ERROR("Could not deliver process output: %s",
+			strerror(errno));
+		return;
+	}
+
+	s->pending = 1;
+	s->refs++;
+
+	object = s->object;
+	if (avbox_object_sendmsg(&object, AVBOX_MESSAGETYPE_DELEGATE,
+		AVBOX_DISPATCH_UNICAST, del) == NULL) {
+		LOG_VPRINT_ERROR("Could not deliver process output: %s",
+			strerror(errno));
+		avbox_delegate_destroy(del);
+		s->pending = 0;
+		s->refs--;
+		return;
+	}
+	avbox_delegate_dettach(del);
+}
+
+
+/**
+ * Read a process' output into the stream's buffer. The
+ * process list must be locked.
+ */
+static void
+avbox_process_streamread(struct avbox_process_stream * const s)
+{
+	ssize_t res;
+	int newline = 0;
+	struct iovec iov[2];
+	const size_t tail = (s->head + s->len) % AVBOX_PROCESS_RINGSZ;
+	const size_t avail = AVBOX_PROCESS_RINGSZ - s->len;
+
+	if (avail == 0) {
+		avbox_process_streampause(s, 1);
+		return;
+	}
+
+	/* read straight into the free part of the ring */
+	iov[0].iov_base = &s->buf[tail];
+	iov[0].iov_len = MIN(avail, AVBOX_PROCESS_RINGSZ - tail);
+	iov[1].iov_base = s->buf;
+	iov[1].iov_len = avail - iov[0].iov_len;
+
+	if ((res = readv(s->fd, iov, 2)) == -1) {
+		if (errno == EINTR || errno == EAGAIN) {
+			return;
+		}
+		LOG_VPRINT_ERROR("Could not read process output: %s",
+			strerror(errno));
+	}
+	if (res <= 0) {
+		/* the process closed it's end */
+		avbox_process_epollclose(&s->fd);
+		s->eof = 1;
+		LIST_REMOVE(s);
+		avbox_process_streamnotify(s);
+		avbox_process_streamunref(s);
+		return;
+	}
+
+	s->len += res;
+
+	if (s->callback == NULL) {
+		if (s->claimed) {
+			avbox_process_streamdrop(s);
+		} else if (s->len == AVBOX_PROCESS_RINGSZ) {
+			avbox_process_streampause(s, 1);
+		}
+		return;
+	}
+
+	if (memchr(iov[0].iov_base, '\n', MIN((size_t) res, iov[0].iov_len)) != NULL ||
+		((size_t) res > iov[0].iov_len && memchr(iov[1].iov_base, '\n', res - iov[0].iov_len) != NULL)) {
+		newline = 1;
+	}
+	if (s->len == AVBOX_PROCESS_RINGSZ) {
+		avbox_process_streampause(s, 1);
+	}
+	if (newline || s->len == AVBOX_PROCESS_RINGSZ) {
+		avbox_process_streamnotify(s);
+	}
+}
+
+
+/**
+ * Writes a line of output to the log.
+ */
+static void
+avbox_process_logline(int id, int std_fileno, const char *line, void *data)
+{
+	const struct avbox_process_stream * const s = data;
+	(void) id;
+	(void) std_fileno;
+	if (line != NULL) {
+		LOG_VPRINT_ERROR("%s: %s", s->name, line);
+	}
+}
+
+
+/**
+ * Create a line buffered stream for a process' output. The
+ * process list must be locked.
+ */
+static struct avbox_process_stream *
+avbox_process_streamnew(struct avbox_process * const proc, const int std_fileno, const int fd)
+{
+	const int i = std_fileno - STDOUT_FILENO;
+	struct avbox_process_stream *s;
+
+	if ((s = malloc(sizeof(struct avbox_process_stream))) == NULL) {
+		LOG_PRINT_ERROR("Could not create stream: Out of memory");
+		return NULL;
+	}
+
+	memset(s, 0, sizeof(struct avbox_process_stream));
+	if ((s->name = strdup(proc->name)) == NULL) {
+		LOG_PRINT_ERROR("Could not create stream: Out of memory");
+		free(s);
+		return NULL;
+	}
+
+	/* one reference for the monitor and one for the process */
+	s->id = proc->id;
+	s->fileno = std_fileno;
+	s->fd = fd;
+	s->refs = 2;
+
+	if (proc->flags & ((std_fileno == STDOUT_FILENO) ?
+		AVBOX_PROCESS_STDOUT_LOG : AVBOX_PROCESS_STDERR_LOG)) {
+		s->direct = 1;
+		s->claimed = 1;
+		s->callback = avbox_process_logline;
+		s->callback_data = s;
+	} else {
+		s->claimed = proc->line_claimed[i];
+		s->callback = proc->line_callback[i];
+		s->callback_data = proc->line_callback_data[i];
+		s->object = proc->line_object[i];
+	}
+
+	(void) fcntl(fd, F_SETFL, O_NONBLOCK);
+	if (avbox_process_epolladd(fd, AVBOX_PROCESS_EV_STREAMPTR(s)) == -1) {
+		free(s->name);
+		free(s);
+		return NULL;
+	}
+
+	LIST_ADD(&stream_list, s);
+	return s;
+}
+
+
+/**
+ * Checks if a process has output that nobody
+ * has claimed yet.
+ */
+static int
+avbox_process_unclaimed(const struct avbox_process * const proc)
+{
+	int i;
+	if (quit) {
+		return 0;
+	}
+	for (i = 0; i < 2; i++) {
+		if (proc->streams[i] != NULL && !proc->streams[i]->claimed) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Start watching a newly forked process.
+ */
+static void
+avbox_process_watch(struct avbox_process * const proc)
+{
+	int i;
+	if (use_pidfd) {
+		if ((proc->pidfd = syscall(SYS_pidfd_open, proc->pid, 0)) == -1) {
+			/* switch to reaping with waitpid(). The child may
+			 * have exitted already so wake the monitor to check */
+			LOG_VPRINT_ERROR("Could not open pidfd for '%s': %s. Using signalfd",
+				proc->name, strerror(errno));
+			if (avbox_process_sigchldinit() == -1) {
+				LOG_VPRINT_ERROR("The exit of '%s' may not be caught",
+					proc->name);
+			}
+			avbox_process_wakeloop();
+		} else {
+			(void) fcntl(proc->pidfd, F_SETFD, FD_CLOEXEC);
+			(void) avbox_process_epolladd(proc->pidfd,
+				AVBOX_PROCESS_EV(proc->id, AVBOX_PROCESS_EV_PID));
+		}
+	}
+
+	/* logged and line buffered output goes to a stream
+	 * which takes ownership of the pipe */
+	for (i = 0; i < 2; i++) {
+		int * const fd = (i == 0) ? &proc->stdout : &proc->stderr;
+		const enum avbox_process_flags flags = (i == 0) ?
+			(AVBOX_PROCESS_STDOUT_LOG | AVBOX_PROCESS_STDOUT_LINES) :
+			(AVBOX_PROCESS_STDERR_LOG | AVBOX_PROCESS_STDERR_LINES);
+
+		if (proc->streams[i] != NULL) {
+			avbox_process_streamunref(proc->streams[i]);
+			proc->streams[i] = NULL;
+		}
+		if ((proc->flags & flags) && *fd != -1) {
+			if ((proc->streams[i] = avbox_process_streamnew(proc,
+				STDOUT_FILENO + i, *fd)) != NULL) {
+				*fd = -1;
+			}
+		}
+	}
+}
 
 
 /**
@@ -120,45 +745,265 @@ avbox_process_getbyid(const int id, const int locked)
 		}
 	}
 
-	if (!locked) {
-		pthread_mutex_unlock(&process_list_lock);
+	if (!locked) {
+		pthread_mutex_unlock(&process_list_lock);
+	}
+
+	return ret;
+}
+
+
+/**
+ * Everything the child needs to exec a process. It is
+ * shared with the child when spawning with CLONE_VM.
+ */
+struct avbox_process_spawnargs
+{
+	const char *binary;
+	char * const *args;
+	enum avbox_process_flags flags;
+	int fds[3];
+	sigset_t sigmask;
+	int errfd;
+	int error;
+};
+
+
+/**
+ * Close a range of file descriptors on the child.
+ */
+static void
+avbox_process_closerange(const unsigned first, const unsigned last)
+{
+	unsigned i;
+	if (first > last) {
+		return;
+	}
+	if (syscall(SYS_close_range, first, last, 0) == -1) {
+		for (i = first; i <= last && i < 1024; i++) {
+			(void) close(i);
+		}
+	}
+}
+
+
+/**
+ * Sets the effective uid and gid to root on the child. We can't
+ * use avbox_gainroot() because with CLONE_VM the C library would
+ * change the credentials of all our threads.
+ */
+static int
+avbox_process_childroot(void)
+{
+	if (geteuid() == 0) {
+		return 0;
+	} else if (getuid() != 0) {
+		return -1;
+	}
+	if (syscall(SYS_setresgid, -1, 0, -1) == -1 ||
+		syscall(SYS_setresuid, -1, 0, -1) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Runs on the child until it execs the process. Since it may
+ * be borrowing our memory it must not allocate, lock or log.
+ */
+static int
+avbox_process_child(void *arg)
+{
+	int i, sig;
+	struct sigaction sa;
+	struct avbox_process_spawnargs * const spawn = arg;
+
+	/* our signal handlers must never run here */
+	for (sig = 1; sig < _NSIG; sig++) {
+		if (sig == SIGKILL || sig == SIGSTOP) {
+			continue;
+		}
+		if (sigaction(sig, NULL, &sa) == 0 &&
+			sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN) {
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_handler = SIG_DFL;
+			(void) sigaction(sig, &sa, NULL);
+		}
+	}
+
+	/* duplicate standard file descriptors. All the pipes are
+	 * close-on-exec so clear the flag if they're already in place */
+	for (i = 0; i < 3; i++) {
+		if (spawn->fds[i] == i) {
+			(void) fcntl(i, F_SETFD, 0);
+		} else if (dup2(spawn->fds[i], i) == -1) {
+			goto err;
+		}
+	}
+
+	/* close all file descriptors >= 3 except the error pipe. If
+	 * it was below 3 it's gone already so we can't report errors */
+	if (spawn->errfd < 3) {
+		spawn->errfd = -1;
+		avbox_process_closerange(3, ~0U);
+	} else {
+		avbox_process_closerange(3, spawn->errfd - 1);
+		avbox_process_closerange(spawn->errfd + 1, ~0U);
+	}
+
+	/* set the process niceness */
+	if (spawn->flags & AVBOX_PROCESS_NICE) {
+		(void) nice(5);
+	}
+
+#ifdef ENABLE_IONICE
+	/* set the process IO priority */
+	if (spawn->flags & (AVBOX_PROCESS_IONICE_IDLE | AVBOX_PROCESS_IONICE_BE)) {
+		const uid_t euid = geteuid();
+		const gid_t egid = getegid();
+		if (avbox_process_childroot() == 0) {
+			(void) ioprio_set(IOPRIO_WHO_PROCESS, 0,
+				(spawn->flags & AVBOX_PROCESS_IONICE_IDLE) ?
+				IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0) :
+				IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 0));
+			/* drop the gid first while we're still root */
+			if (syscall(SYS_setresgid, -1, egid, -1) == -1 ||
+				syscall(SYS_setresuid, -1, euid, -1) == -1) {
+				goto err;
+			}
+		}
+	}
+#endif
+
+	/* if the process requires root then elevate privilege */
+	if (spawn->flags & AVBOX_PROCESS_SUPERUSER) {
+		(void) avbox_process_childroot();
+	}
+
+	/* restore the signal mask */
+	sigdelset(&spawn->sigmask, SIGCHLD);
+	(void) sigprocmask(SIG_SETMASK, &spawn->sigmask, NULL);
+
+	/* execute the process */
+	execv(spawn->binary, spawn->args);
+
+err:
+	/* let the parent know what happened. When we're
+	 * forked it can only find out through the pipe */
+	spawn->error = errno;
+	if (spawn->errfd != -1) {
+		(void) write(spawn->errfd, &spawn->error, sizeof(spawn->error));
+	}
+	_exit(EXIT_FAILURE);
+}
+
+
+/**
+ * Spawn a process. The child shares our memory (CLONE_VM) and we
+ * are suspended until it execs (CLONE_VFORK) so, unlike fork(), the
+ * cost doesn't grow with our resident set and it doesn't need to
+ * commit memory for a copy. Falls back to fork() if clone() fails.
+ */
+static pid_t
+avbox_process_spawn(struct avbox_process_spawnargs * const spawn, const int use_fork)
+{
+	int saved_errno, errpipe[2];
+	ssize_t ret;
+	pid_t pid = -1;
+	void *stack = MAP_FAILED;
+	sigset_t all;
+
+	spawn->error = 0;
+	spawn->errfd = -1;
+
+	/* block all signals until the child has it's own handlers */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &spawn->sigmask);
+
+	if (!use_fork && (stack = mmap(NULL, AVBOX_PROCESS_SPAWN_STACK,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+		-1, 0)) != MAP_FAILED) {
+		pid = clone(avbox_process_child, (char*) stack + AVBOX_PROCESS_SPAWN_STACK,
+			CLONE_VM | CLONE_VFORK | SIGCHLD, spawn);
+		saved_errno = errno;
+		munmap(stack, AVBOX_PROCESS_SPAWN_STACK);
+		if (pid == -1) {
+			LOG_VPRINT_ERROR("clone() failed: %s. Falling back to fork()",
+				strerror(saved_errno));
+		}
+	}
+	if (pid == -1) {
+		/* the child doesn't share our memory so it
+		 * reports exec() errors through a pipe */
+		if (pipe2(errpipe, O_CLOEXEC) == 0) {
+			spawn->errfd = errpipe[1];
+		}
+		if ((pid = fork()) == 0) {
+			avbox_process_child(spawn);
+		}
+		saved_errno = errno;
+		if (spawn->errfd != -1) {
+			close(errpipe[1]);
+			spawn->errfd = -1;
+			if (pid != -1) {
+				while ((ret = read(errpipe[0], &spawn->error,
+					sizeof(spawn->error))) == -1 && errno == EINTR);
+				if (ret != sizeof(spawn->error)) {
+					spawn->error = 0;
+				}
+			}
+			close(errpipe[0]);
+		}
+		errno = saved_errno;
+	}
+
+	saved_errno = errno;
+	pthread_sigmask(SIG_SETMASK, &spawn->sigmask, NULL);
+	errno = saved_errno;
+
+	if (pid != -1 && spawn->error != 0) {
+		LOG_VPRINT_ERROR("Could not execute '%s': %s",
+			spawn->binary, strerror(spawn->error));
 	}
 
-	return ret;
+	return pid;
 }
 
 
 /**
- * Forks and execs a process.
+ * Spawns a process and sets up it's standard file descriptors.
  */
 static pid_t
 avbox_process_fork(struct avbox_process *proc)
 {
 	int ret = -1;
 	int in[2] = { -1, -1 }, out[2] = { -1, -1 }, err[2] = { -1, -1 };
+	struct avbox_process_spawnargs spawn;
 
 	/* if the process is created with the STDERR_xxx or STDOUT_xxx flags
 	 * we create a pipe for it. Otherwise we open /dev/null and set it as
-	 * the process stdin/stderr respectively */
+	 * the process stdin/stderr respectively. Everything is close-on-exec
+	 * so that only the child's standard descriptors survive */
 	if (proc->flags & AVBOX_PROCESS_STDOUT) {
-		if (pipe(out) == -1) {
+		if (pipe2(out, O_CLOEXEC) == -1) {
 			LOG_VPRINT_ERROR("Could not create pipes: %s", strerror(errno));
 			goto end;
 		}
 	} else {
-		if ((out[1] = open("/dev/null", O_WRONLY)) == -1) {
+		if ((out[1] = open("/dev/null", O_WRONLY | O_CLOEXEC)) == -1) {
 			LOG_VPRINT_ERROR("Could not open /dev/null: %s",
 				strerror(errno));
 			goto end;
 		}
 	}
 	if (proc->flags & AVBOX_PROCESS_STDERR) {
-		if (pipe(err) == -1) {
+		if (pipe2(err, O_CLOEXEC) == -1) {
 			LOG_VPRINT_ERROR("Could not create pipes: %s", strerror(errno));
 			goto end;
 		}
 	} else {
-		if ((err[1] = open("/dev/null", O_WRONLY)) == -1) {
+		if ((err[1] = open("/dev/null", O_WRONLY | O_CLOEXEC)) == -1) {
 			LOG_VPRINT_ERROR("Could not open /dev/null: %s",
 				strerror(errno));
 			goto end;
@@ -166,99 +1011,40 @@ avbox_process_fork(struct avbox_process *proc)
 	}
 
 	/* for stdin we always create a pipe */
-	if (pipe(in) == -1) {
+	if (pipe2(in, O_CLOEXEC) == -1) {
 		LOG_VPRINT_ERROR("Could not create pipes: %s", strerror(errno));
 		goto end;
 	}
 
-	/* fork */
-	if ((proc->pid = fork()) == -1) {
-		LOG_VPRINT_ERROR("Could not fork(): %s", strerror(errno));
-		goto end;
-
-	} else if (proc->pid != 0) {
-		/* close child end of pipes */
-		close(in[0]);
-		if (out[1] != -1) {
-			close(out[1]);
-		}
-		if (err[1] != -1) {
-			close(err[1]);
-		}
-
-		proc->stdin = in[1];
-		proc->stdout = out[0];
-		proc->stderr = err[0];
-
-		/* fork() succeeded so return the pid of the new process */
-		return proc->pid;
-	}
-
-	/**** Child process falls through ****/
-
-	/* close parent end of pipes */
-	close(in[1]);
-	if (out[0] != -1) {
-		close(out[0]);
-	}
-	if (err[0] != -1) {
-		close(err[0]);
-	}
+	spawn.binary = proc->binary;
+	spawn.args = proc->args;
+	spawn.flags = proc->flags;
+	spawn.fds[STDIN_FILENO] = in[0];
+	spawn.fds[STDOUT_FILENO] = out[1];
+	spawn.fds[STDERR_FILENO] = err[1];
 
-	/* duplicate standard file descriptors */
-	if (dup2(in[0], STDIN_FILENO) == -1 ||
-		dup2(out[1], STDOUT_FILENO) == -1 ||
-		dup2(err[1], STDERR_FILENO) == -1) {
-		LOG_VPRINT_ERROR("Could not create standard file descriptors: %s",
-			strerror(errno));
-		exit(EXIT_FAILURE);
+	if ((proc->pid = avbox_process_spawn(&spawn, 0)) == -1) {
+		LOG_VPRINT_ERROR("Could not spawn process: %s", strerror(errno));
+		goto end;
 	}
 
-	/* close all file descriptors >= 3 */
-	closefrom(3);
-
-	/* set the process niceness */
-	if (proc->flags & AVBOX_PROCESS_NICE) {
-		if (nice(5) == -1) {
-			LOG_VPRINT_ERROR("Could not set process niceness: %s",
-				strerror(errno));
-		}
+	/* move it to it's own cgroup */
+	if (proc->flags & AVBOX_PROCESS_CGROUP) {
+		(void) avbox_cgroup_attach(proc->name, proc->pid);
 	}
 
-#ifdef ENABLE_IONICE
-	/* set the process IO priority */
-	if (proc->flags & AVBOX_PROCESS_IONICE_IDLE) {
-		if (avbox_gainroot() == 0) {
-			if (ioprio_set(IOPRIO_WHO_PROCESS, getpid(), IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) == -1) {
-				LOG_VPRINT_ERROR("Could not set process IO priority to IDLE: %s",
-					strerror(errno));
-			}
-			avbox_droproot();
-		}
-	} else if (proc->flags & AVBOX_PROCESS_IONICE_BE) {
-		if (avbox_gainroot() == 0) {
-			if (ioprio_set(IOPRIO_WHO_PROCESS, getpid(), IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 0)) == -1) {
-				LOG_VPRINT_ERROR("Could not set process IO priority to BE: %s",
-					strerror(errno));
-			}
-			avbox_droproot();
-		}
-	}
-#endif
+	/* close child end of pipes */
+	close(in[0]);
+	close(out[1]);
+	close(err[1]);
 
-	/* if the process requires root then elevate privilege */
-	if (proc->flags & AVBOX_PROCESS_SUPERUSER) {
-		if (avbox_gainroot() == -1) {
-			LOG_VPRINT_ERROR("Could not gain root for process '%s' (id=%i)",
-				proc->name, proc->id);
-		}
-	}
+	proc->stdin = in[1];
+	proc->stdout = out[0];
+	proc->stderr = err[0];
 
-	/* execute the process */
-	execv(proc->binary, proc->args);
+	avbox_process_watch(proc);
 
-	/* if execv() failed then exit with error status */
-	exit(EXIT_FAILURE);
+	return proc->pid;
 
 end:
 	if (in[0] != -1) close(in[0]);
@@ -352,6 +1138,11 @@ avbox_process_free(struct avbox_process *proc)
 	if (proc->cbstate != NULL) {
 		free(proc->cbstate);
 	}
+	for (int i = 0; i < 2; i++) {
+		if (proc->streams[i] != NULL) {
+			avbox_process_streamunref(proc->streams[i]);
+		}
+	}
 	free(proc);
 }
 
@@ -404,7 +1195,8 @@ avbox_process_force_kill(int id, void *data)
 
 /**
  * Restarts a process that is not currently running.
- * This is only called after a process chrashes.
+ * This is only called after a process chrashes. The
+ * process list must be locked.
  */
 static enum avbox_timer_result
 avbox_process_autorestart(int id, void *data)
@@ -425,277 +1217,298 @@ avbox_process_autorestart(int id, void *data)
 
 
 /**
- * Runs on it's own thread and handles standard IO
- * to/from processes.
+ * Restarts a process after a delay.
  */
-static void *
-avbox_process_io_thread(void *arg)
+static enum avbox_timer_result
+avbox_process_autorestart_timer(int id, void *data)
 {
-	fd_set fds;
-	int fd_max, res;
-	char buf[1024];
-	struct avbox_process *proc;
-	struct timeval tv;
+	enum avbox_timer_result ret;
+	pthread_mutex_lock(&process_list_lock);
+	ret = avbox_process_autorestart(id, data);
+	pthread_mutex_unlock(&process_list_lock);
+	return ret;
+}
 
-	MB_DEBUG_SET_THREAD_NAME("proc-io");
-	DEBUG_PRINT("process", "Starting IO thread");
 
-	while (!io_quit) {
+/**
+ * Invokes the exit callback from a worker thread and
+ * wakes the event loop when it returns.
+ */
+static void *
+avbox_process_callback_helper(void *data)
+{
+	struct avbox_process * const proc =
+		(struct avbox_process*) data;
+	proc->cbstate->result = proc->exit_callback(proc->id,
+		proc->exit_status, proc->exit_callback_data);
+	__sync_synchronize();
+	proc->cbstate->returned = 1;
+	avbox_process_wakeloop();
+	return NULL;
+}
 
-		fd_max = 0;
-		FD_ZERO(&fds);
 
-		/* build a file descriptor set to select() */
-		pthread_mutex_lock(&process_list_lock);
-		LIST_FOREACH(struct avbox_process*, proc, &process_list) {
-			if (proc->flags & AVBOX_PROCESS_STDOUT_LOG) {
-				if (proc->stdout != -1) {
-					FD_SET(proc->stdout, &fds);
-					fd_max = MAX(fd_max, proc->stdout);
-				}
-			}
-			if (proc->flags & AVBOX_PROCESS_STDERR_LOG) {
-				if (proc->stderr != -1) {
-					FD_SET(proc->stderr, &fds);
-					fd_max = MAX(fd_max, proc->stderr);
+/**
+ * Finish handling a process exit. Restarts the process if
+ * needed or wakes anyone waiting for it or frees it.
+ * The process list must be locked.
+ */
+static void
+avbox_process_finish(struct avbox_process * const proc, const int cbresult)
+{
+	/* if the process terminated abormally and the AUTORESTART flag is
+	 * set then restart the process */
+	if (cbresult == 0 && ((proc->flags & AVBOX_PROCESS_AUTORESTART_ALWAYS) != 0 ||
+		(proc->exit_status != 0 && (proc->flags & AVBOX_PROCESS_AUTORESTART) != 0))) {
+		if (!proc->stopping) {
+			LOG_VPRINT_INFO("Auto restarting process '%s' (id=%i)",
+				proc->name, proc->id);
+
+			if (proc->autorestart_delay == 0) {
+				/* if the process is set to restart without
+				 * delay then restart it now */
+				avbox_process_autorestart(0, proc);
+			} else {
+				/* set a timer to restart the process
+				 * after a delay */
+				struct timespec tv;
+				tv.tv_sec = proc->autorestart_delay;
+				tv.tv_nsec = 0;
+				if (avbox_timer_register(&tv, AVBOX_TIMER_TYPE_ONESHOT, NULL,
+					avbox_process_autorestart_timer, proc) == -1) {
+					LOG_PRINT_ERROR("Could not register autorestart timer");
 				}
 			}
+			return;
 		}
-		pthread_mutex_unlock(&process_list_lock);
+	}
 
-		/* if no file descriptors to monitor sleep
-		 * for 1/2 second */
-		if (fd_max == 0) {
-			usleep(500L * 1000L);
-			continue;
-		}
+	if (proc->flags & AVBOX_PROCESS_WAIT) {
+		/* save exit status and wake any threads waiting
+		 * on this process */
+		proc->exitted = 1;
+		pthread_cond_broadcast(&proc->cond);
+	} else if (avbox_process_unclaimed(proc)) {
+		/* keep it around until someone claims it's output */
+		proc->exitted = 1;
+	} else {
+		DEBUG_VPRINT("process", "Freeing process %i", proc->id);
+		/* remove process from list */
+		LIST_REMOVE(proc);
+		/* cleanup */
+		avbox_process_free(proc);
+	}
+}
 
-		/* select the output file descriptors of all processes */
-		tv.tv_sec = 0;
-		tv.tv_usec = 500 * 1000L;
-		if ((res = select(fd_max + 1, &fds, NULL, NULL, &tv)) == 0) {
-			continue;
-		} else if (res < 0) {
-			if (errno == EINTR) {
-				continue;
-			}
-			LOG_VPRINT_ERROR("select() failed: %s (errno=%i)",
-				strerror(errno), errno);
-			usleep(500 * 1000L);
-			continue;
+
+/**
+ * Handle a process exit. The process list must be locked.
+ */
+static void
+avbox_process_exited(struct avbox_process * const proc, const int status)
+{
+	struct avbox_delegate *del;
+	const pid_t pid = proc->pid;
+
+	assert(proc->cbstate == NULL);
+
+	/* close file descriptors. Streams stay open
+	 * until we've read all the output */
+	if (proc->stdin != -1) close(proc->stdin);
+	avbox_process_epollclose(&proc->stdout);
+	avbox_process_epollclose(&proc->stderr);
+	avbox_process_epollclose(&proc->pidfd);
+
+	/* clear file descriptors and PID */
+	proc->pid = -1;
+	proc->stdin = -1;
+
+	/* save exit status */
+	proc->exit_status = WEXITSTATUS(status);
+
+	/* if the process terminated abnormally then log
+	 * an error message */
+	if (proc->exit_status) {
+		LOG_VPRINT_WARN("Process '%s' exitted with status %i (id=%i,pid=%i)",
+			proc->name, proc->exit_status, proc->id, pid);
+	} else {
+		DEBUG_VPRINT("process", "Process '%s' exitted with status %i (id=%i,pid=%i)",
+			proc->name, proc->exit_status, proc->id, pid);
+	}
+
+	/* if we have a callback function invoke it from another
+	 * thread. We'll finish when it returns */
+	if (proc->exit_callback != NULL) {
+		if ((proc->cbstate = malloc(sizeof(struct callback_state))) == NULL) {
+			LOG_PRINT_ERROR("Could not allocate callback state. Aborting");
+			abort();
 		}
+		proc->cbstate->result = 0;
+		proc->cbstate->returned = 0;
+		proc->cbstate->timer = -1;
+		if ((del = avbox_thread_delegate(avbox_process_callback_helper, proc)) == NULL) {
+			LOG_PRINT_ERROR("Could not fire callback!");
+			abort();
+		}
+		avbox_delegate_dettach(del);
+		return;
+	}
 
-		/* process all pending output */
-		pthread_mutex_lock(&process_list_lock);
+	avbox_process_finish(proc, 0);
+}
+
+
+/**
+ * Reap any children that exited. Used with the signalfd
+ * fallback. The process list must be locked.
+ */
+static void
+avbox_process_reapall(void)
+{
+	pid_t pid;
+	int status, found;
+	struct avbox_process *proc;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		found = 0;
 		LIST_FOREACH(struct avbox_process*, proc, &process_list) {
-			if (proc->flags & AVBOX_PROCESS_STDOUT_LOG) {
-				if (proc->stdout != -1 && FD_ISSET(proc->stdout, &fds)) {
-					if ((res = read(proc->stdout, buf, sizeof(buf))) == -1) {
-						LOG_VPRINT_ERROR("Could not read process STDOUT: %s",
-							strerror(errno));
-						continue;
-					}
-					if (proc->flags & AVBOX_PROCESS_STDOUT_LOG) {
-						/* TODO: We need to break the output in lines */
-						LOG_VPRINT_ERROR("%s: %s", proc->name, buf);
-					}
-				}
-			}
-			if (proc->flags & AVBOX_PROCESS_STDERR_LOG) {
-				if (proc->stderr != -1 && FD_ISSET(proc->stderr, &fds)) {
-					if ((res = read(proc->stderr, buf, sizeof(buf))) == -1) {
-						LOG_VPRINT_ERROR("Could not read process STDERR: %s",
-							strerror(errno));
-						continue;
-					}
-					if (proc->flags & AVBOX_PROCESS_STDERR_LOG) {
-						/* TODO: We need to break the output in lines */
-						LOG_VPRINT_ERROR("%s: %s", proc->name, buf);
-					}
-				}
+			if (proc->pid == pid) {
+				avbox_process_exited(proc, status);
+				found = 1;
+				break;
 			}
 		}
-		pthread_mutex_unlock(&process_list_lock);
-
+		/* if the process was not found log an error */
+		if (!found) {
+			LOG_VPRINT_ERROR("Unmanaged process with pid %i exitted", pid);
+		}
 	}
+}
 
-	DEBUG_PRINT("process", "IO thread exitting");
 
-	return NULL;
+/**
+ * Finish handling the exit of processes whose
+ * callbacks have returned. The process list must be locked.
+ */
+static void
+avbox_process_checkcallbacks(void)
+{
+	int cbresult;
+	struct avbox_process *proc;
+
+	LIST_FOREACH_SAFE(struct avbox_process*, proc, &process_list, {
+		if (proc->cbstate != NULL && proc->cbstate->returned) {
+			/* at this point we're back from the callback
+			 * so we can continue */
+			cbresult = proc->cbstate->result;
+			free(proc->cbstate);
+			proc->cbstate = NULL;
+			avbox_process_finish(proc, cbresult);
+		}
+	});
 }
 
 
 /**
- * Invokes the callback function from another thread.
+ * Free processes that were kept around for their output. This
+ * is only done when shutting down. The process list must be locked.
  */
-static enum avbox_timer_result
-avbox_process_callback_helper(int id, void *data)
+static void
+avbox_process_sweep(void)
 {
-	struct avbox_process * const proc =
-		(struct avbox_process*) data;
-	proc->cbstate->result = proc->exit_callback(proc->id,
-		proc->exit_status, proc->exit_callback_data);
-	proc->cbstate->returned = 1;
-	return AVBOX_TIMER_CALLBACK_RESULT_STOP;
+	struct avbox_process *proc;
+	LIST_FOREACH_SAFE(struct avbox_process*, proc, &process_list, {
+		if (proc->exitted && proc->cbstate == NULL &&
+			!(proc->flags & AVBOX_PROCESS_WAIT)) {
+			LIST_REMOVE(proc);
+			avbox_process_free(proc);
+		}
+	});
 }
 
 
 /**
- * This function runs on it's own thread and
- * waits for processes to exit and then handles
- * the event appropriately.
+ * Process monitor event loop. Handles process exits
+ * and output. It only wakes up when there's something
+ * to do.
  */
 static void *
 avbox_process_monitor_thread(void *arg)
 {
-	pid_t pid;
-	int status, found = 0, cbresult;
+	int i, n, status;
+	uint64_t ev, counter;
+	struct signalfd_siginfo si;
+	struct epoll_event events[AVBOX_PROCESS_MAX_EVENTS];
 	struct avbox_process *proc;
+	struct avbox_process_stream *s;
+
+	(void) arg;
 
 	MB_DEBUG_SET_THREAD_NAME("proc-mon");
 	DEBUG_PRINT("process", "Starting process monitor thread");
 
+	pthread_mutex_lock(&process_list_lock);
+
 	while (!quit || LIST_SIZE(&process_list) > 0) {
-		if ((pid = waitpid(-1, &status, WNOHANG)) <= 0) {
-			if (errno == EINTR) {
-				usleep(500 * 1000L);
-			} else if (errno == ECHILD) {
-				usleep(500 * 1000L);
-			} else {
-				LOG_VPRINT_ERROR("Could not wait() for process: %s",
+		pthread_mutex_unlock(&process_list_lock);
+		if ((n = epoll_wait(epollfd, events, AVBOX_PROCESS_MAX_EVENTS, -1)) == -1) {
+			if (errno != EINTR) {
+				LOG_VPRINT_ERROR("epoll_wait() failed: %s",
 					strerror(errno));
-				break;
+				abort();
 			}
-
-			/* since processes may have pid set to -1
-			 * we need to change to something else to avoid
-			 * a false match bellow */
-			pid = -2;
+			n = 0;
 		}
-
-
 		pthread_mutex_lock(&process_list_lock);
 
-		LIST_FOREACH_SAFE(struct avbox_process*, proc, &process_list, {
-			if (proc->pid == pid || proc->cbstate != NULL) {
-				if (proc->pid == pid) {
-
-					assert(proc->cbstate == NULL);
-
-					/* close file descriptors */
-					if (proc->stdin != -1) close(proc->stdin);
-					if (proc->stdout != -1) close(proc->stdout);
-					if (proc->stderr != -1) close(proc->stderr);
-
-					/* clear file descriptors and PID */
-					proc->pid = -1;
-					proc->stdin = -1;
-					proc->stdout = -1;
-					proc->stderr = -1;
-
-					/* save exit status */
-					proc->exit_status = WEXITSTATUS(status);
-
-					/* if the process terminated abnormally then log
-					 * an error message */
-					if (proc->exit_status) {
-						LOG_VPRINT_WARN("Process '%s' exitted with status %i (id=%i,pid=%i)",
-							proc->name, proc->exit_status, proc->id, pid);
-					} else {
-						DEBUG_VPRINT("process", "Process '%s' exitted with status %i (id=%i,pid=%i)",
-							proc->name, proc->exit_status, proc->id, pid);
-					}
-
-					/* if we have a callback function invoke it from another
-					 * thread and continue */
-					if (proc->exit_callback != NULL) {
-						if ((proc->cbstate = malloc(sizeof(struct callback_state))) == NULL) {
-							LOG_PRINT_ERROR("Could not allocate callback state. Aborting");
-							abort();
-						}
-						proc->cbstate->result = 0;
-						proc->cbstate->returned = 0;
-
-						/* for now we use a 0 interval oneshot timer to invoke the
-						 * callback from another thread */
-						struct timespec tv;
-						tv.tv_sec = 0;
-						tv.tv_nsec = 0;
-						if ((proc->cbstate->timer = avbox_timer_register(&tv,
-							AVBOX_TIMER_TYPE_ONESHOT, NULL, avbox_process_callback_helper, proc)) == -1) {
-							LOG_PRINT_ERROR("Could not fire callback!");
-							abort();
-						}
-						continue;
-					} else {
-						cbresult = 0;
-					}
-				} else if (proc->cbstate != NULL) {
-					if (!proc->cbstate->returned) {
-						continue;
-					}
-
-					/* at this point we're back from the callback
-					 * so we can continue */
-					cbresult = proc->cbstate->result;
-					free(proc->cbstate);
-					proc->cbstate = NULL;
-				}
-
-				/* if the process terminated abormally and the AUTORESTART flag is
-				 * set then restart the process */
-				if (cbresult == 0 && ((proc->flags & AVBOX_PROCESS_AUTORESTART_ALWAYS) != 0 ||
-					(proc->exit_status != 0 && (proc->flags & AVBOX_PROCESS_AUTORESTART) != 0))) {
-					if (!proc->stopping) {
-						LOG_VPRINT_INFO("Auto restarting process '%s' (id=%i,pid=%i)",
-							proc->name, proc->id, pid);
-
-						if (proc->autorestart_delay == 0) {
-							/* if the process is set to restart without
-							 * delay then restart it now */
-							avbox_process_autorestart(0, proc);
-						} else {
-							/* set a timer to restart the process
-							 * after a delay */
-							struct timespec tv;
-							tv.tv_sec = proc->autorestart_delay;
-							tv.tv_nsec = 0;
-							if (avbox_timer_register(&tv, AVBOX_TIMER_TYPE_AUTORELOAD, NULL,
-								avbox_process_autorestart, proc) == -1) {
-								LOG_PRINT_ERROR("Could not register autorestart timer");
-							}
-						}
-						continue;
-					}
-				}
+		for (i = 0; i < n; i++) {
+			ev = events[i].data.u64;
 
-				if (proc->flags & AVBOX_PROCESS_WAIT) {
-					/* save exit status and wake any threads waiting
-					 * on this process */
-					proc->exitted = 1;
-					pthread_cond_broadcast(&proc->cond);
+			switch (AVBOX_PROCESS_EV_KIND(ev)) {
+			case AVBOX_PROCESS_EV_WAKE:
+			case AVBOX_PROCESS_EV_SIGNAL:
+				if (AVBOX_PROCESS_EV_KIND(ev) == AVBOX_PROCESS_EV_WAKE) {
+					(void) read(wakefd, &counter, sizeof(counter));
 				} else {
-					DEBUG_VPRINT("process", "Freeing process %i", proc->id);
-					/* remove process from list */
-					LIST_REMOVE(proc);
-					/* cleanup */
-					avbox_process_free(proc);
+					while (read(sigfd, &si, sizeof(si)) > 0);
 				}
-
-				found = 1;
-				continue;
+				if (!use_pidfd) {
+					avbox_process_reapall();
+				}
+				break;
+			case AVBOX_PROCESS_EV_PID:
+				if ((proc = avbox_process_getbyid(AVBOX_PROCESS_EV_ID(ev), 1)) != NULL &&
+					proc->pid != -1 && waitpid(proc->pid, &status, WNOHANG) == proc->pid) {
+					avbox_process_exited(proc, status);
+				}
+				break;
+			case AVBOX_PROCESS_EV_STREAM:
+				avbox_process_streamread(AVBOX_PROCESS_EV_PTR(ev));
+				break;
+			default:
+				abort();
 			}
-		});
+		}
 
-		pthread_mutex_unlock(&process_list_lock);
+		avbox_process_checkcallbacks();
 
-		/* if the process was not found log an error */
-		if (!found && pid > 0) {
-			LOG_VPRINT_ERROR("Unmanaged process with pid %i exitted", pid);
+		if (quit) {
+			avbox_process_sweep();
 		}
 	}
 
-	io_quit = 1;
+	/* close any streams left open by processes that
+	 * handed their pipes to someone else */
+	LIST_FOREACH_SAFE(struct avbox_process_stream*, s, &stream_list, {
+		avbox_process_epollclose(&s->fd);
+		s->eof = 1;
+		LIST_REMOVE(s);
+		avbox_process_streamunref(s);
+	});
+
+	pthread_mutex_unlock(&process_list_lock);
+
+	DEBUG_PRINT("process", "Process monitor exiting");
 
 	return NULL;
 }
@@ -746,6 +1559,7 @@ avbox_process_openfd(int id, int std_fileno)
 
 	/* Clear the file descriptor from the process object and
 	 * return it */
+	pthread_mutex_lock(&process_list_lock);
 	switch (std_fileno) {
 	case STDIN_FILENO:
 		result = proc->stdin;
@@ -762,10 +1576,84 @@ avbox_process_openfd(int id, int std_fileno)
 	default:
 		result = -1;
 	}
+
+	/* stop watching it */
+	if (result != -1) {
+		(void) epoll_ctl(epollfd, EPOLL_CTL_DEL, result, NULL);
+	}
+	pthread_mutex_unlock(&process_list_lock);
 	return result;
 }
 
 
+/**
+ * Register a callback to receive the output of a process
+ * one line at a time.
+ */
+int
+avbox_process_setlinecallback(int id, int std_fileno,
+	struct avbox_object *object, avbox_process_linefn callback, void *data)
+{
+	int i;
+	struct avbox_process *proc;
+	struct avbox_process_stream *s;
+
+	assert(std_fileno == STDOUT_FILENO || std_fileno == STDERR_FILENO);
+	i = std_fileno - STDOUT_FILENO;
+
+	/* by default deliver to the calling thread */
+	if (callback != NULL && object == NULL &&
+		(object = avbox_dispatch_getobject()) == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&process_list_lock);
+
+	if ((proc = avbox_process_getbyid(id, 1)) == NULL) {
+		pthread_mutex_unlock(&process_list_lock);
+		errno = ENOENT;
+		return -1;
+	}
+	if (!(proc->flags & ((i == 0) ?
+		AVBOX_PROCESS_STDOUT_LINES : AVBOX_PROCESS_STDERR_LINES))) {
+		pthread_mutex_unlock(&process_list_lock);
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* save it so it survives restarts */
+	proc->line_callback[i] = callback;
+	proc->line_callback_data[i] = data;
+	proc->line_object[i] = object;
+	proc->line_claimed[i] = 1;
+
+	if ((s = proc->streams[i]) != NULL) {
+		s->callback = callback;
+		s->callback_data = data;
+		s->object = object;
+		s->claimed = 1;
+		if (callback == NULL) {
+			avbox_process_streamdrop(s);
+		} else {
+			avbox_process_streamnotify(s);
+		}
+	}
+
+	/* if the process already exitted it may
+	 * have been waiting for us */
+	if (proc->exitted && proc->cbstate == NULL &&
+		!(proc->flags & AVBOX_PROCESS_WAIT) &&
+		!avbox_process_unclaimed(proc)) {
+		DEBUG_VPRINT("process", "Freeing process %i", proc->id);
+		LIST_REMOVE(proc);
+		avbox_process_free(proc);
+	}
+
+	pthread_mutex_unlock(&process_list_lock);
+	return 0;
+}
+
+
 /**
  * Set the amount of time, in seconds, to wait for a process
  * to exit after sending SIGTERM before sending SIGKILL.
@@ -824,6 +1712,7 @@ avbox_process_start(const char *binary, const char * const argv[],
 
 	/* initialize process structure and add it to list */
 	proc->id = avbox_process_get_next_id();
+	proc->pidfd = -1;
 	proc->stdin = -1;
 	proc->stdout = -1;
 	proc->stderr = -1;
@@ -840,6 +1729,11 @@ avbox_process_start(const char *binary, const char * const argv[],
 	proc->exit_callback = exit_callback;
 	proc->exit_callback_data = callback_data;
 	proc->cbstate = NULL;
+	memset(proc->streams, 0, sizeof(proc->streams));
+	memset(proc->line_callback, 0, sizeof(proc->line_callback));
+	memset(proc->line_callback_data, 0, sizeof(proc->line_callback_data));
+	memset(proc->line_object, 0, sizeof(proc->line_object));
+	memset(proc->line_claimed, 0, sizeof(proc->line_claimed));
 
 	/* initialize pthread primitives */
 	if (pthread_cond_init(&proc->cond, NULL) != 0) {
@@ -952,6 +1846,11 @@ avbox_process_stop(int id)
 		DEBUG_VPRINT("process", "Found process %i (pid=%i name='%s')",
 			id, proc->pid, proc->name);
 
+		/* it already exitted */
+		if (proc->pid == -1) {
+			return 0;
+		}
+
 		proc->stopping = 1;
 
 		if (proc->flags & AVBOX_PROCESS_SIGKILL) {
@@ -990,32 +1889,132 @@ avbox_process_stop(int id)
 }
 
 
+/**
+ * Measure how long it takes to spawn a process as our
+ * resident set grows, with clone() and with fork().
+ */
+void
+avbox_process_benchmark(void)
+{
+	int i, mb, mode, fd;
+	int64_t elapsed[2];
+	pid_t pid;
+	char *ballast;
+	struct timespec start, end;
+	struct avbox_process_spawnargs spawn;
+	const int iterations = 50;
+	const char * const args[] = { "true", NULL };
+	const int sizes[] = { 0, 32, 64, 128, 256 };
+
+	if ((fd = open("/dev/null", O_RDWR | O_CLOEXEC)) == -1) {
+		LOG_VPRINT_ERROR("Could not open /dev/null: %s",
+			strerror(errno));
+		return;
+	}
+
+	spawn.binary = "/bin/true";
+	spawn.args = (char * const*) args;
+	spawn.flags = AVBOX_PROCESS_NONE;
+	spawn.fds[STDIN_FILENO] = fd;
+	spawn.fds[STDOUT_FILENO] = fd;
+	spawn.fds[STDERR_FILENO] = fd;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		mb = sizes[i];
+
+		/* grow our resident set */
+		if ((ballast = malloc(MAX(mb, 1) * 1024 * 1024)) == NULL) {
+			LOG_VPRINT_ERROR("Could not allocate %i MiB", mb);
+			break;
+		}
+		memset(ballast, 1, MAX(mb, 1) * 1024 * 1024);
+
+		for (mode = 0; mode < 2; mode++) {
+			elapsed[mode] = 0;
+			for (int n = 0; n < iterations; n++) {
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				if ((pid = avbox_process_spawn(&spawn, mode)) == -1) {
+					LOG_VPRINT_ERROR("Could not spawn process: %s",
+						strerror(errno));
+					break;
+				}
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				elapsed[mode] += utimediff(&end, &start);
+				(void) waitpid(pid, NULL, 0);
+			}
+		}
+
+		LOG_VPRINT_INFO("RSS +%3i MiB: clone() %6li usecs, fork() %6li usecs",
+			mb, (long) (elapsed[0] / iterations), (long) (elapsed[1] / iterations));
+
+		free(ballast);
+	}
+
+	close(fd);
+}
+
+
 /**
  * Initialize the process manager.
  */
 int
 avbox_process_init(void)
 {
+	int fd;
+
 	DEBUG_PRINT("process", "Initializing process monitor");
 
 	LIST_INIT(&process_list);
+	LIST_INIT(&stream_list);
 
 	quit = 0;
-	io_quit = 0;
 
-	if (pthread_create(&monitor_thread, NULL, avbox_process_monitor_thread, NULL) != 0) {
-		LOG_PRINT_ERROR("Could not create monitor thread!");
+	if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		LOG_VPRINT_ERROR("Could not create epoll fd: %s",
+			strerror(errno));
 		return -1;
 	}
+	if ((wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+		LOG_VPRINT_ERROR("Could not create eventfd: %s",
+			strerror(errno));
+		goto err;
+	}
+	if (avbox_process_epolladd(wakefd,
+		AVBOX_PROCESS_EV(0, AVBOX_PROCESS_EV_WAKE)) == -1) {
+		goto err;
+	}
 
-	if (pthread_create(&io_thread, NULL, avbox_process_io_thread, NULL) != 0) {
-		LOG_PRINT_ERROR("Could not create IO thread!");
-		quit = 1;
-		pthread_join(io_thread, 0);
-		return -1;
+	/* use pidfds if the kernel supports them (>= 5.3). Otherwise
+	 * fallback to a signalfd for SIGCHLD */
+	if ((fd = syscall(SYS_pidfd_open, getpid(), 0)) == -1) {
+		LOG_VPRINT_INFO("pidfds not available (%s). Using signalfd",
+			strerror(errno));
+		if (avbox_process_sigchldinit() == -1) {
+			goto err;
+		}
+	} else {
+		close(fd);
+		use_pidfd = 1;
+	}
+
+	if (pthread_create(&monitor_thread, NULL, avbox_process_monitor_thread, NULL) != 0) {
+		LOG_PRINT_ERROR("Could not create monitor thread!");
+		goto err;
 	}
 
 	return 0;
+err:
+	if (sigfd != -1) {
+		close(sigfd);
+		sigfd = -1;
+	}
+	if (wakefd != -1) {
+		close(wakefd);
+		wakefd = -1;
+	}
+	close(epollfd);
+	epollfd = -1;
+	return -1;
 }
 
 
@@ -1049,10 +2048,19 @@ avbox_process_shutdown(void)
 
 	}
 
-	/* wait for threads */
-	DEBUG_PRINT("process", "Waiting for monitor threads");
+	/* wake the monitor so it sees the quit
+	 * flag and wait for it */
+	avbox_process_wakeloop();
+	DEBUG_PRINT("process", "Waiting for monitor thread");
 	pthread_join(monitor_thread, 0);
-	pthread_join(io_thread, 0);
+
+	if (sigfd != -1) {
+		close(sigfd);
+		sigfd = -1;
+	}
+	close(wakefd);
+	close(epollfd);
+	wakefd = epollfd = -1;
 
 	DEBUG_PRINT("process", "Process monitor down");
 }
@@ -7,6 +7,9 @@
 #define __PROCESS_H__
 
 
+struct avbox_object;
+
+
 /* Process flags enumerator */
 enum avbox_process_flags
 {
@@ -24,10 +27,13 @@ enum avbox_process_flags
 	AVBOX_PROCESS_STDERR_PIPE		= 0x00000400,
 	AVBOX_PROCESS_WAIT			= 0x00000800,
 	AVBOX_PROCESS_AUTORESTART_ALWAYS	= 0x00001000,
+	AVBOX_PROCESS_STDOUT_LINES		= 0x00002000,
+	AVBOX_PROCESS_STDERR_LINES		= 0x00004000,
+	AVBOX_PROCESS_CGROUP			= 0x00008000,
 
 	AVBOX_PROCESS_IONICE = (AVBOX_PROCESS_IONICE_IDLE | AVBOX_PROCESS_IONICE_BE | AVBOX_PROCESS_IONICE_RT),
-	AVBOX_PROCESS_STDOUT = (AVBOX_PROCESS_STDOUT_LOG | AVBOX_PROCESS_STDOUT_PIPE),
-	AVBOX_PROCESS_STDERR = (AVBOX_PROCESS_STDERR_LOG | AVBOX_PROCESS_STDERR_PIPE)
+	AVBOX_PROCESS_STDOUT = (AVBOX_PROCESS_STDOUT_LOG | AVBOX_PROCESS_STDOUT_PIPE | AVBOX_PROCESS_STDOUT_LINES),
+	AVBOX_PROCESS_STDERR = (AVBOX_PROCESS_STDERR_LOG | AVBOX_PROCESS_STDERR_PIPE | AVBOX_PROCESS_STDERR_LINES)
 };
 
 
@@ -36,6 +42,13 @@ typedef int (*avbox_process_exit)(int id, int exit_status,
 	void *data);
 
 
+/* Process output line callback. The line is NUL terminated
+ * and stripped of it's line terminator. It is called with
+ * line == NULL once the stream is closed */
+typedef void (*avbox_process_linefn)(int id, int std_fileno,
+	const char *line, void *data);
+
+
 /**
  * Wait for a process to exit.
  */
@@ -55,6 +68,21 @@ int
 avbox_process_openfd(int id, int std_fileno);
 
 
+/**
+ * Register a callback to receive the output of a process started
+ * with AVBOX_PROCESS_STDOUT_LINES or AVBOX_PROCESS_STDERR_LINES one
+ * line at a time. The callback is delivered by the dispatch thread of
+ * object (which must run delegates) or the calling thread's if object
+ * is NULL. Output is buffered until a callback is registered. Passing
+ * a NULL callback discards any further output.
+ *
+ * The callback must be changed from the thread it is delivered on.
+ */
+int
+avbox_process_setlinecallback(int id, int std_fileno,
+	struct avbox_object *object, avbox_process_linefn callback, void *data);
+
+
 /**
  * Set the amount of time, in seconds, to wait for a process
  * to exit after sending SIGTERM before sending SIGKILL.
@@ -72,6 +100,14 @@ int
 avbox_process_stop(int id);
 
 
+/**
+ * Benchmark process spawn latency against the size of
+ * our resident set.
+ */
+void
+avbox_process_benchmark(void);
+
+
 int
 avbox_process_init(void);
 
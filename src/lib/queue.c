@@ -12,6 +12,7 @@
 #include "log.h"
 #include "debug.h"
 #include "linkedlist.h"
+#include "queue.h"
 
 
 /**
@@ -223,6 +224,47 @@ end:
 }
 
 
+/**
+ * Puts an item in the queue unless it can be merged into
+ * an item that is already queued. The merge function is called
+ * with the queue locked for every queued item (oldest first) until
+ * it returns non-zero.
+ *
+ * Returns the item that is left on the queue (either the item
+ * argument or the queued item that it was merged into) or NULL on
+ * error and sets errno to the same values as avbox_queue_put().
+ */
+void *
+avbox_queue_coalesce(struct avbox_queue *inst, void *item, avbox_queue_mergefn merge)
+{
+	struct avbox_queue_node *node;
+
+	assert(inst != NULL);
+	assert(item != NULL);
+	assert(merge != NULL);
+
+	pthread_mutex_lock(&inst->lock);
+	for (node = LIST_PREV(struct avbox_queue_node*, &inst->items);
+		!LIST_ISNULL(&inst->items, node);
+		node = LIST_PREV(struct avbox_queue_node*, node)) {
+		if (merge(node->value, item)) {
+			void * const queued = node->value;
+			pthread_mutex_unlock(&inst->lock);
+			return queued;
+		}
+	}
+	pthread_mutex_unlock(&inst->lock);
+
+	/* nothing to merge with so queue it. Another
+	 * item may have been queued in the meantime but that
+	 * only costs us a redundant item */
+	if (avbox_queue_put(inst, item) == -1) {
+		return NULL;
+	}
+	return item;
+}
+
+
 /**
  * Check if the queue is closed.
  */
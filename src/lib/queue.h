@@ -58,6 +58,21 @@ int
 avbox_queue_put(struct avbox_queue *inst, void *item);
 
 
+/**
+ * Queue merge function. Returns non-zero if item was merged
+ * into queued.
+ */
+typedef int (*avbox_queue_mergefn)(void *queued, void *item);
+
+
+/**
+ * Puts an item in the queue unless it can be merged into
+ * an item that is already queued.
+ */
+void *
+avbox_queue_coalesce(struct avbox_queue *inst, void *item, avbox_queue_mergefn merge);
+
+
 /**
  * Check if the queue is closed.
  */
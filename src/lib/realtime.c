@@ -0,0 +1,301 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define LOG_MODULE "realtime"
+
+#include "log.h"
+#include "debug.h"
+#include "settings.h"
+#include "su.h"
+#include "realtime.h"
+
+
+/* how much of the stack to fault in before
+ * going real-time */
+#define AVBOX_RT_STACK_PREFAULT	(64 * 1024)
+
+
+/**
+ * Settings for a latency class.
+ */
+struct avbox_rt_params
+{
+	const char *name;
+	int priority;
+	int cpu;
+};
+
+
+static int enabled = 0;
+static int policy = SCHED_RR;
+static int lock_memory = 1;
+static struct avbox_rt_params params[] =
+{
+	{ "audio", 20, -1 },
+	{ "video", 10, -1 }
+};
+
+/* number of threads that need memory locked */
+static int locked = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread int rt_thread = 0;
+static __thread int rt_pinned = 0;
+static __thread cpu_set_t rt_cpus;
+
+
+/**
+ * Fault in the top of the stack so the thread
+ * doesn't take page faults on it later.
+ */
+static void
+avbox_rt_prefaultstack(void)
+{
+	volatile unsigned char stack[AVBOX_RT_STACK_PREFAULT];
+	memset((unsigned char*) stack, 0, sizeof(stack));
+}
+
+
+/**
+ * Lock all current and future pages in memory. This covers
+ * audio buffers and frame pools without having to track every
+ * allocation. Where supported pages are only locked once they
+ * are touched.
+ */
+static void
+avbox_rt_lockmemory(void)
+{
+	int flags = MCL_CURRENT | MCL_FUTURE;
+
+	pthread_mutex_lock(&lock);
+	if (locked++ > 0) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+#ifdef MCL_ONFAULT
+	flags |= MCL_ONFAULT;
+#endif
+	if (mlockall(flags) == -1) {
+#ifdef MCL_ONFAULT
+		/* older kernels don't support MCL_ONFAULT */
+		if (errno == EINVAL) {
+			flags &= ~MCL_ONFAULT;
+			if (mlockall(flags) == 0) {
+				goto end;
+			}
+		}
+#endif
+		LOG_VPRINT_ERROR("Could not lock memory: %s",
+			strerror(errno));
+	}
+end:
+	pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ * Drop a memory lock reference.
+ */
+static void
+avbox_rt_unlockmemory(void)
+{
+	pthread_mutex_lock(&lock);
+	if (--locked == 0) {
+		(void) munlockall();
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ * Pin the calling thread to a CPU. The current affinity
+ * is saved so avbox_rt_unpin() can restore it.
+ */
+static void
+avbox_rt_pin(const struct avbox_rt_params * const p)
+{
+	int ret;
+	cpu_set_t cpus;
+
+	ASSERT(!rt_pinned);
+
+	if ((ret = pthread_getaffinity_np(pthread_self(), sizeof(rt_cpus), &rt_cpus)) != 0) {
+		LOG_VPRINT_ERROR("Could not get %s thread affinity: %s. Not pinning",
+			p->name, strerror(ret));
+		return;
+	}
+
+	CPU_ZERO(&cpus);
+	CPU_SET(p->cpu, &cpus);
+	if ((ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) != 0) {
+		LOG_VPRINT_ERROR("Could not pin %s thread to CPU %i: %s",
+			p->name, p->cpu, strerror(ret));
+		return;
+	}
+	rt_pinned = 1;
+}
+
+
+/**
+ * Restore the affinity saved by avbox_rt_pin().
+ */
+static void
+avbox_rt_unpin(void)
+{
+	int ret;
+
+	if (!rt_pinned) {
+		return;
+	}
+	if ((ret = pthread_setaffinity_np(pthread_self(), sizeof(rt_cpus), &rt_cpus)) != 0) {
+		LOG_VPRINT_ERROR("Could not restore thread affinity: %s",
+			strerror(ret));
+	}
+	rt_pinned = 0;
+}
+
+
+/**
+ * Run the calling thread with the real-time settings of
+ * a latency class.
+ */
+int
+avbox_rt_enter(const enum avbox_rt_class cls)
+{
+	int ret;
+	struct sched_param parms;
+	struct avbox_rt_params * const p = &params[cls];
+
+	if (!enabled || rt_thread) {
+		return rt_thread ? 0 : -1;
+	}
+
+	/* pin the thread to a CPU */
+	if (p->cpu >= 0) {
+		avbox_rt_pin(p);
+	}
+
+	/* switch to a real-time policy. If we don't have
+	 * permission try again as root */
+	parms.sched_priority = p->priority;
+	if ((ret = pthread_setschedparam(pthread_self(), policy, &parms)) == EPERM) {
+		if (avbox_gainroot() == 0) {
+			ret = pthread_setschedparam(pthread_self(), policy, &parms);
+		}
+	}
+	if (ret != 0) {
+		LOG_VPRINT_ERROR("Could not set real-time priority for %s thread: %s. "
+			"Running at normal priority", p->name, strerror(ret));
+		avbox_rt_unpin();
+		return -1;
+	}
+
+	if (lock_memory) {
+		avbox_rt_lockmemory();
+	}
+	avbox_rt_prefaultstack();
+	rt_thread = 1;
+
+	DEBUG_VPRINT("realtime", "%s thread running with %s priority %i",
+		p->name, (policy == SCHED_FIFO) ? "SCHED_FIFO" : "SCHED_RR",
+		p->priority);
+
+	return 0;
+}
+
+
+/**
+ * Restore normal scheduling and the CPU affinity on a
+ * thread that called avbox_rt_enter() successfully.
+ */
+void
+avbox_rt_leave(void)
+{
+	struct sched_param parms;
+
+	if (!rt_thread) {
+		return;
+	}
+
+	parms.sched_priority = 0;
+	(void) pthread_setschedparam(pthread_self(), SCHED_OTHER, &parms);
+	if (lock_memory) {
+		avbox_rt_unlockmemory();
+	}
+	avbox_rt_unpin();
+	rt_thread = 0;
+}
+
+
+/**
+ * Load the real-time settings.
+ */
+int
+avbox_rt_init(void)
+{
+	char *str;
+	int min, max;
+
+	if (!(enabled = avbox_settings_getbool("rt.enabled"))) {
+		return 0;
+	}
+
+	if ((str = avbox_settings_getstring("rt.policy")) != NULL) {
+		if (!strcmp(str, "fifo")) {
+			policy = SCHED_FIFO;
+		} else if (!strcmp(str, "rr")) {
+			policy = SCHED_RR;
+		} else {
+			LOG_VPRINT_ERROR("Invalid rt.policy '%s'. Using 'rr'",
+				str);
+		}
+		free(str);
+	}
+
+	lock_memory = avbox_settings_getint("rt.mlock", 1);
+
+	min = sched_get_priority_min(policy);
+	max = sched_get_priority_max(policy);
+
+	params[AVBOX_RT_AUDIO].priority = avbox_settings_getint("rt.audio.priority",
+		params[AVBOX_RT_AUDIO].priority);
+	params[AVBOX_RT_AUDIO].cpu = avbox_settings_getint("rt.audio.cpu",
+		params[AVBOX_RT_AUDIO].cpu);
+	params[AVBOX_RT_VIDEO].priority = avbox_settings_getint("rt.video.priority",
+		params[AVBOX_RT_VIDEO].priority);
+	params[AVBOX_RT_VIDEO].cpu = avbox_settings_getint("rt.video.cpu",
+		params[AVBOX_RT_VIDEO].cpu);
+
+	/* sanitize priorities and CPUs */
+	for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+		if (params[i].priority < min || params[i].priority > max) {
+			LOG_VPRINT_ERROR("Invalid %s priority %i. Must be between %i and %i",
+				params[i].name, params[i].priority, min, max);
+			params[i].priority = (params[i].priority < min) ? min : max;
+		}
+		if (params[i].cpu >= sysconf(_SC_NPROCESSORS_ONLN)) {
+			LOG_VPRINT_ERROR("Invalid %s CPU %i. Not pinning",
+				params[i].name, params[i].cpu);
+			params[i].cpu = -1;
+		}
+	}
+
+	LOG_VPRINT_INFO("Real-time scheduling enabled (audio=%i video=%i)",
+		params[AVBOX_RT_AUDIO].priority, params[AVBOX_RT_VIDEO].priority);
+
+	return 0;
+}
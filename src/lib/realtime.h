@@ -0,0 +1,48 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ */
+
+#ifndef __AVBOX_REALTIME_H__
+#define __AVBOX_REALTIME_H__
+
+
+/**
+ * Latency classes.
+ */
+enum avbox_rt_class
+{
+	AVBOX_RT_AUDIO,
+	AVBOX_RT_VIDEO
+};
+
+
+/**
+ * Run the calling thread with the real-time settings of
+ * a latency class. Does nothing unless real-time scheduling
+ * is enabled (rt.enabled setting).
+ *
+ * Returns 0 if the thread is running with real-time priority,
+ * -1 otherwise. Failures are not fatal, the thread just keeps
+ * running at normal priority.
+ */
+int
+avbox_rt_enter(const enum avbox_rt_class cls);
+
+
+/**
+ * Restore normal scheduling and the CPU affinity on a
+ * thread that called avbox_rt_enter() successfully.
+ */
+void
+avbox_rt_leave(void);
+
+
+/**
+ * Load the real-time settings.
+ */
+int
+avbox_rt_init(void);
+
+
+#endif
@@ -0,0 +1,524 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ *
+ * Encoder/decoder for rencode, the serialization format
+ * used by the Deluge RPC protocol.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define LOG_MODULE "rencode"
+
+#include "debug.h"
+#include "rencode.h"
+
+
+#define CHR_LIST		(59)
+#define CHR_DICT		(60)
+#define CHR_INT			(61)
+#define CHR_INT1		(62)
+#define CHR_INT2		(63)
+#define CHR_INT4		(64)
+#define CHR_INT8		(65)
+#define CHR_FLOAT32		(66)
+#define CHR_FLOAT64		(44)
+#define CHR_TRUE		(67)
+#define CHR_FALSE		(68)
+#define CHR_NONE		(69)
+#define CHR_TERM		(127)
+
+#define INT_POS_FIXED_START	(0)
+#define INT_POS_FIXED_COUNT	(44)
+#define INT_NEG_FIXED_START	(70)
+#define INT_NEG_FIXED_COUNT	(32)
+#define DICT_FIXED_START	(102)
+#define DICT_FIXED_COUNT	(25)
+#define STR_FIXED_START		(128)
+#define STR_FIXED_COUNT		(64)
+#define LIST_FIXED_START	(STR_FIXED_START + STR_FIXED_COUNT)
+#define LIST_FIXED_COUNT	(64)
+
+/* limit nesting so bad input can't blow the stack */
+#define AVBOX_RENCODE_MAX_DEPTH	(32)
+
+
+/**
+ * Decoder state.
+ */
+struct avbox_rdecoder
+{
+	const unsigned char *p;
+	const unsigned char *end;
+	int depth;
+};
+
+
+void
+avbox_rencode_init(struct avbox_rencode * const enc)
+{
+	enc->data = NULL;
+	enc->len = 0;
+	enc->cap = 0;
+	enc->error = 0;
+}
+
+
+void
+avbox_rencode_free(struct avbox_rencode * const enc)
+{
+	free(enc->data);
+	avbox_rencode_init(enc);
+}
+
+
+/**
+ * Append bytes to the encoder buffer.
+ */
+static void
+avbox_rencode_append(struct avbox_rencode * const enc,
+	const void * const data, const size_t len)
+{
+	if (enc->error) {
+		return;
+	}
+	if (enc->len + len > enc->cap) {
+		size_t cap = (enc->cap == 0) ? 256 : enc->cap;
+		char *buf;
+		while (cap < enc->len + len) {
+			cap *= 2;
+		}
+		if ((buf = realloc(enc->data, cap)) == NULL) {
+			enc->error = ENOMEM;
+			return;
+		}
+		enc->data = buf;
+		enc->cap = cap;
+	}
+	memcpy(enc->data + enc->len, data, len);
+	enc->len += len;
+}
+
+
+static void
+avbox_rencode_byte(struct avbox_rencode * const enc, const unsigned char c)
+{
+	avbox_rencode_append(enc, &c, 1);
+}
+
+
+/**
+ * Append a big endian integer.
+ */
+static void
+avbox_rencode_be(struct avbox_rencode * const enc, uint64_t value, const int size)
+{
+	int i;
+	unsigned char buf[8];
+	for (i = size - 1; i >= 0; i--) {
+		buf[i] = value & 0xFF;
+		value >>= 8;
+	}
+	avbox_rencode_append(enc, buf, size);
+}
+
+
+void
+avbox_rencode_none(struct avbox_rencode * const enc)
+{
+	avbox_rencode_byte(enc, CHR_NONE);
+}
+
+
+void
+avbox_rencode_bool(struct avbox_rencode * const enc, const int value)
+{
+	avbox_rencode_byte(enc, value ? CHR_TRUE : CHR_FALSE);
+}
+
+
+void
+avbox_rencode_int(struct avbox_rencode * const enc, const int64_t value)
+{
+	if (value >= 0 && value < INT_POS_FIXED_COUNT) {
+		avbox_rencode_byte(enc, INT_POS_FIXED_START + value);
+	} else if (value < 0 && value >= -INT_NEG_FIXED_COUNT) {
+		avbox_rencode_byte(enc, INT_NEG_FIXED_START - 1 - value);
+	} else if (value >= -128 && value < 128) {
+		avbox_rencode_byte(enc, CHR_INT1);
+		avbox_rencode_be(enc, value, 1);
+	} else if (value >= -32768 && value < 32768) {
+		avbox_rencode_byte(enc, CHR_INT2);
+		avbox_rencode_be(enc, value, 2);
+	} else if (value >= INT32_MIN && value <= INT32_MAX) {
+		avbox_rencode_byte(enc, CHR_INT4);
+		avbox_rencode_be(enc, value, 4);
+	} else {
+		avbox_rencode_byte(enc, CHR_INT8);
+		avbox_rencode_be(enc, value, 8);
+	}
+}
+
+
+void
+avbox_rencode_float(struct avbox_rencode * const enc, const double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	avbox_rencode_byte(enc, CHR_FLOAT64);
+	avbox_rencode_be(enc, bits, 8);
+}
+
+
+void
+avbox_rencode_string(struct avbox_rencode * const enc, const char * const str)
+{
+	char buf[24];
+	const size_t len = strlen(str);
+	if (len < STR_FIXED_COUNT) {
+		avbox_rencode_byte(enc, STR_FIXED_START + len);
+	} else {
+		snprintf(buf, sizeof(buf), "%zu:", len);
+		avbox_rencode_append(enc, buf, strlen(buf));
+	}
+	avbox_rencode_append(enc, str, len);
+}
+
+
+void
+avbox_rencode_list(struct avbox_rencode * const enc)
+{
+	avbox_rencode_byte(enc, CHR_LIST);
+}
+
+
+void
+avbox_rencode_dict(struct avbox_rencode * const enc)
+{
+	avbox_rencode_byte(enc, CHR_DICT);
+}
+
+
+void
+avbox_rencode_end(struct avbox_rencode * const enc)
+{
+	avbox_rencode_byte(enc, CHR_TERM);
+}
+
+
+/**
+ * Read a big endian integer.
+ */
+static int
+avbox_rencode_readbe(struct avbox_rdecoder * const dec, const int size, int64_t * const value)
+{
+	int i;
+	uint64_t v = 0;
+	if (dec->end - dec->p < size) {
+		return -1;
+	}
+	for (i = 0; i < size; i++) {
+		v = (v << 8) | *dec->p++;
+	}
+	/* sign extend */
+	if (size < 8 && (v & (1ULL << ((size * 8) - 1)))) {
+		v |= ~0ULL << (size * 8);
+	}
+	*value = (int64_t) v;
+	return 0;
+}
+
+
+/**
+ * Read a string of a given length.
+ */
+static int
+avbox_rencode_readstr(struct avbox_rdecoder * const dec,
+	struct avbox_rvalue * const value, const size_t len)
+{
+	if ((size_t) (dec->end - dec->p) < len) {
+		return -1;
+	}
+	if ((value->v.str.data = malloc(len + 1)) == NULL) {
+		return -1;
+	}
+	memcpy(value->v.str.data, dec->p, len);
+	value->v.str.data[len] = '\0';
+	value->v.str.len = len;
+	value->type = AVBOX_RVALUE_STRING;
+	dec->p += len;
+	return 0;
+}
+
+
+static int
+avbox_rencode_readvalue(struct avbox_rdecoder * const dec, struct avbox_rvalue * const value);
+
+
+/**
+ * Read the items of a list or dictionary. If n is -1 items
+ * are read until a terminator is found.
+ */
+static int
+avbox_rencode_readitems(struct avbox_rdecoder * const dec,
+	struct avbox_rvalue * const value, const enum avbox_rvalue_type type, int n)
+{
+	size_t cap = 0;
+	struct avbox_rvalue *items;
+
+	value->type = type;
+	value->v.list.items = NULL;
+	value->v.list.n = 0;
+
+	if (++dec->depth > AVBOX_RENCODE_MAX_DEPTH) {
+		return -1;
+	}
+
+	/* a dictionary entry takes two items */
+	if (type == AVBOX_RVALUE_DICT && n != -1) {
+		n *= 2;
+	}
+
+	while (n == -1 || value->v.list.n < n) {
+		if (n == -1) {
+			if (dec->p == dec->end) {
+				return -1;
+			} else if (*dec->p == CHR_TERM) {
+				dec->p++;
+				break;
+			}
+		}
+		if (value->v.list.n == cap) {
+			cap = (cap == 0) ? 8 : cap * 2;
+			if ((items = realloc(value->v.list.items, cap * sizeof(struct avbox_rvalue))) == NULL) {
+				return -1;
+			}
+			value->v.list.items = items;
+		}
+		if (avbox_rencode_readvalue(dec, &value->v.list.items[value->v.list.n]) == -1) {
+			return -1;
+		}
+		value->v.list.n++;
+	}
+
+	if (type == AVBOX_RVALUE_DICT) {
+		if (value->v.list.n % 2) {
+			return -1;
+		}
+		value->v.list.n /= 2;
+	}
+
+	dec->depth--;
+	return 0;
+}
+
+
+/**
+ * Read a value.
+ */
+static int
+avbox_rencode_readvalue(struct avbox_rdecoder * const dec, struct avbox_rvalue * const value)
+{
+	unsigned char c;
+	int64_t i;
+	char *end;
+
+	value->type = AVBOX_RVALUE_NONE;
+
+	if (dec->p == dec->end) {
+		return -1;
+	}
+
+	c = *dec->p++;
+
+	if (c < INT_POS_FIXED_START + INT_POS_FIXED_COUNT) {
+		value->type = AVBOX_RVALUE_INT;
+		value->v.i = c - INT_POS_FIXED_START;
+	} else if (c >= INT_NEG_FIXED_START && c < INT_NEG_FIXED_START + INT_NEG_FIXED_COUNT) {
+		value->type = AVBOX_RVALUE_INT;
+		value->v.i = -1 - (c - INT_NEG_FIXED_START);
+	} else if (c >= STR_FIXED_START && c < STR_FIXED_START + STR_FIXED_COUNT) {
+		return avbox_rencode_readstr(dec, value, c - STR_FIXED_START);
+	} else if (c >= LIST_FIXED_START) {
+		return avbox_rencode_readitems(dec, value, AVBOX_RVALUE_LIST, c - LIST_FIXED_START);
+	} else if (c >= DICT_FIXED_START && c < DICT_FIXED_START + DICT_FIXED_COUNT) {
+		return avbox_rencode_readitems(dec, value, AVBOX_RVALUE_DICT, c - DICT_FIXED_START);
+	} else if (c >= '0' && c <= '9') {
+		/* <length>:<bytes> string */
+		size_t len = c - '0';
+		while (dec->p < dec->end && *dec->p != ':') {
+			if (*dec->p < '0' || *dec->p > '9') {
+				return -1;
+			}
+			len = (len * 10) + (*dec->p++ - '0');
+		}
+		if (dec->p++ == dec->end) {
+			return -1;
+		}
+		return avbox_rencode_readstr(dec, value, len);
+	} else {
+		switch (c) {
+		case CHR_LIST:
+			return avbox_rencode_readitems(dec, value, AVBOX_RVALUE_LIST, -1);
+		case CHR_DICT:
+			return avbox_rencode_readitems(dec, value, AVBOX_RVALUE_DICT, -1);
+		case CHR_INT:
+		{
+			/* decimal terminated by CHR_TERM */
+			char buf[32];
+			const unsigned char *term = memchr(dec->p, CHR_TERM, dec->end - dec->p);
+			if (term == NULL || term - dec->p >= sizeof(buf)) {
+				return -1;
+			}
+			memcpy(buf, dec->p, term - dec->p);
+			buf[term - dec->p] = '\0';
+			value->type = AVBOX_RVALUE_INT;
+			value->v.i = strtoll(buf, &end, 10);
+			dec->p = term + 1;
+			break;
+		}
+		case CHR_INT1:
+		case CHR_INT2:
+		case CHR_INT4:
+		case CHR_INT8:
+			if (avbox_rencode_readbe(dec, 1 << (c - CHR_INT1), &i) == -1) {
+				return -1;
+			}
+			value->type = AVBOX_RVALUE_INT;
+			value->v.i = i;
+			break;
+		case CHR_FLOAT32:
+		{
+			float f;
+			uint32_t bits;
+			if (avbox_rencode_readbe(dec, 4, &i) == -1) {
+				return -1;
+			}
+			bits = (uint32_t) i;
+			memcpy(&f, &bits, sizeof(f));
+			value->type = AVBOX_RVALUE_FLOAT;
+			value->v.f = f;
+			break;
+		}
+		case CHR_FLOAT64:
+		{
+			uint64_t bits;
+			if (avbox_rencode_readbe(dec, 8, &i) == -1) {
+				return -1;
+			}
+			bits = (uint64_t) i;
+			value->type = AVBOX_RVALUE_FLOAT;
+			memcpy(&value->v.f, &bits, sizeof(value->v.f));
+			break;
+		}
+		case CHR_TRUE:
+		case CHR_FALSE:
+			value->type = AVBOX_RVALUE_BOOL;
+			value->v.i = (c == CHR_TRUE);
+			break;
+		case CHR_NONE:
+			break;
+		default:
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Free the contents of a value.
+ */
+static void
+avbox_rvalue_clear(struct avbox_rvalue * const value)
+{
+	size_t i, n;
+	switch (value->type) {
+	case AVBOX_RVALUE_STRING:
+		free(value->v.str.data);
+		break;
+	case AVBOX_RVALUE_LIST:
+	case AVBOX_RVALUE_DICT:
+		n = value->v.list.n * ((value->type == AVBOX_RVALUE_DICT) ? 2 : 1);
+		for (i = 0; i < n; i++) {
+			avbox_rvalue_clear(&value->v.list.items[i]);
+		}
+		free(value->v.list.items);
+		break;
+	default:
+		break;
+	}
+	value->type = AVBOX_RVALUE_NONE;
+}
+
+
+/**
+ * Decode a value.
+ */
+struct avbox_rvalue *
+avbox_rencode_decode(const char * const buf, const size_t len)
+{
+	struct avbox_rdecoder dec;
+	struct avbox_rvalue *value;
+
+	if ((value = malloc(sizeof(struct avbox_rvalue))) == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	dec.p = (const unsigned char*) buf;
+	dec.end = dec.p + len;
+	dec.depth = 0;
+
+	if (avbox_rencode_readvalue(&dec, value) == -1) {
+		/* a partially decoded dictionary may have an odd
+		 * number of items so clear it as a list */
+		if (value->type == AVBOX_RVALUE_DICT) {
+			value->type = AVBOX_RVALUE_LIST;
+		}
+		avbox_rvalue_free(value);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return value;
+}
+
+
+/**
+ * Free a decoded value.
+ */
+void
+avbox_rvalue_free(struct avbox_rvalue * const value)
+{
+	if (value != NULL) {
+		avbox_rvalue_clear(value);
+		free(value);
+	}
+}
+
+
+/**
+ * Gets a dictionary entry by it's (string) key.
+ */
+struct avbox_rvalue *
+avbox_rvalue_get(const struct avbox_rvalue * const dict, const char * const key)
+{
+	size_t i;
+	if (dict == NULL || dict->type != AVBOX_RVALUE_DICT) {
+		return NULL;
+	}
+	for (i = 0; i < dict->v.list.n; i++) {
+		const struct avbox_rvalue * const k = &dict->v.list.items[i * 2];
+		if (k->type == AVBOX_RVALUE_STRING && !strcmp(k->v.str.data, key)) {
+			return &dict->v.list.items[(i * 2) + 1];
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,131 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ */
+
+#ifndef __AVBOX_RENCODE_H__
+#define __AVBOX_RENCODE_H__
+#include <stdint.h>
+#include <stddef.h>
+
+
+/**
+ * rencode value types.
+ */
+enum avbox_rvalue_type
+{
+	AVBOX_RVALUE_NONE,
+	AVBOX_RVALUE_BOOL,
+	AVBOX_RVALUE_INT,
+	AVBOX_RVALUE_FLOAT,
+	AVBOX_RVALUE_STRING,
+	AVBOX_RVALUE_LIST,
+	AVBOX_RVALUE_DICT
+};
+
+
+/**
+ * A decoded value. Strings are NUL terminated. Dictionary
+ * items are stored as key/value pairs so a dictionary with
+ * n entries has 2n items.
+ */
+struct avbox_rvalue
+{
+	enum avbox_rvalue_type type;
+	union {
+		int64_t i;
+		double f;
+		struct {
+			char *data;
+			size_t len;
+		} str;
+		struct {
+			struct avbox_rvalue *items;
+			size_t n;
+		} list;
+	} v;
+};
+
+
+/**
+ * Encoder buffer.
+ */
+struct avbox_rencode
+{
+	char *data;
+	size_t len;
+	size_t cap;
+	int error;
+};
+
+
+void
+avbox_rencode_init(struct avbox_rencode * const enc);
+
+
+void
+avbox_rencode_free(struct avbox_rencode * const enc);
+
+
+void
+avbox_rencode_none(struct avbox_rencode * const enc);
+
+
+void
+avbox_rencode_bool(struct avbox_rencode * const enc, const int value);
+
+
+void
+avbox_rencode_int(struct avbox_rencode * const enc, const int64_t value);
+
+
+void
+avbox_rencode_float(struct avbox_rencode * const enc, const double value);
+
+
+void
+avbox_rencode_string(struct avbox_rencode * const enc, const char * const str);
+
+
+/**
+ * Start a list or dictionary. Items (or key/value pairs)
+ * follow and avbox_rencode_end() closes it.
+ */
+void
+avbox_rencode_list(struct avbox_rencode * const enc);
+
+
+void
+avbox_rencode_dict(struct avbox_rencode * const enc);
+
+
+void
+avbox_rencode_end(struct avbox_rencode * const enc);
+
+
+/**
+ * Decode a value.
+ *
+ * Returns NULL and sets errno to EINVAL if the buffer does not
+ * contain a valid value or to ENOMEM if out of memory.
+ */
+struct avbox_rvalue *
+avbox_rencode_decode(const char * const buf, const size_t len);
+
+
+/**
+ * Free a decoded value.
+ */
+void
+avbox_rvalue_free(struct avbox_rvalue * const value);
+
+
+/**
+ * Gets a dictionary entry by it's (string) key. Returns
+ * NULL if not found.
+ */
+struct avbox_rvalue *
+avbox_rvalue_get(const struct avbox_rvalue * const dict, const char * const key);
+
+
+#endif
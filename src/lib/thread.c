@@ -6,39 +6,363 @@
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 
 #define LOG_MODULE "thread"
 
 #include "log.h"
 #include "debug.h"
+#include "compiler.h"
 #include "dispatch.h"
 #include "linkedlist.h"
 #include "delegate.h"
 #include "time_util.h"
+#include "math_util.h"
+#include "ionice.h"
+#include "thread.h"
 
 
-#define N_THREADS (3)
+/* The foreground pool starts one worker per CPU (but no less
+ * than AVBOX_THREAD_MIN) and grows up to AVBOX_THREAD_MAX when all
+ * workers are blocked */
+#define AVBOX_THREAD_MIN	(2)
+#define AVBOX_THREAD_MAX	(16)
 
+/* initial size of each worker's deque */
+#define AVBOX_THREAD_DEQUE_SIZE	(16)
 
-LISTABLE_STRUCT(avbox_thread,
+/* if there's queued work and every worker has been running the
+ * same job for this long (usecs) we assume they're blocked and
+ * start a new worker */
+#define AVBOX_THREAD_BLOCKED	(250L * 1000L)
+
+/* the number of jobs a busy worker runs before checking
+ * it's message queue */
+#define AVBOX_THREAD_MSGCHECK	(16)
+
+/* nice value of background workers */
+#define AVBOX_THREAD_BACKGROUND_NICE	(10)
+
+
+/* worker pools */
+enum avbox_thread_poolid
+{
+	AVBOX_THREAD_POOL_FOREGROUND,
+	AVBOX_THREAD_POOL_BACKGROUND,
+	AVBOX_THREAD_POOL_IDLE,
+	AVBOX_THREAD_POOL_COUNT
+};
+
+
+struct avbox_thread_pool;
+
+
+/**
+ * Worker thread. Each worker owns a deque of jobs. It
+ * takes jobs from the front of it's own deque and when
+ * that's empty it steals from the back of the others
+ * in the same pool.
+ */
+struct avbox_thread
+{
+	int no;
+	int started;	/* set once the thread is up or failed to start */
 	int running;
+	int idle;
 	int busy;
-#ifndef NDEBUG
-	int no;
-	int64_t jobs;
-#endif
 	pthread_t thread;
-	struct timespec start_time;
-	struct timespec stop_time;
+	pthread_mutex_t lock;
+	struct avbox_delegate **deque;
+	size_t deque_head;
+	size_t deque_len;
+	size_t deque_sz;
+	int64_t start_time;
+	int64_t busy_time;
+	int64_t jobs;
+	int64_t steals;
 	struct avbox_object *object;
-);
+	struct avbox_thread_pool *pool;
+};
+
+
+/**
+ * A set of workers that run at the same priority.
+ */
+struct avbox_thread_pool
+{
+	const char *name;
+	enum avbox_thread_qos qos;
+	int pausable;
+	int max_workers;
+	struct avbox_thread *workers[AVBOX_THREAD_MAX];
+	int n_workers;
+	volatile int pending;
+	unsigned int next_worker;
+	pthread_rwlock_t lock;
+};
 
 
-static LIST threads;
+static struct avbox_thread_pool pools[AVBOX_THREAD_POOL_COUNT] =
+{
+	{
+		.name = "avbox-worker",
+		.qos = AVBOX_THREAD_QOS_DEFAULT,
+		.pausable = 0,
+		.max_workers = AVBOX_THREAD_MAX,
+		.lock = PTHREAD_RWLOCK_INITIALIZER
+	},
+	{
+		.name = "avbox-bgworker",
+		.qos = AVBOX_THREAD_QOS_BACKGROUND,
+		.pausable = 0,
+		.max_workers = AVBOX_THREAD_MAX / 4,
+		.lock = PTHREAD_RWLOCK_INITIALIZER
+	},
+	{
+		.name = "avbox-idleworker",
+		.qos = AVBOX_THREAD_QOS_IDLE,
+		.pausable = 1,
+		.max_workers = AVBOX_THREAD_MAX / 4,
+		.lock = PTHREAD_RWLOCK_INITIALIZER
+	}
+};
+
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static __thread struct avbox_thread *current_thread = NULL;
+
+/* pausing of idle work */
+static volatile int paused = 0;
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
+
+/* pool monitor */
+static pthread_t monitor_thread;
+static pthread_mutex_t monitor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t monitor_cond = PTHREAD_COND_INITIALIZER;
+static int monitor_armed = 0;
+static int monitor_quit = 0;
+
+
+/**
+ * Gets the monotonic time in microseconds.
+ */
+static inline int64_t
+avbox_thread_now(void)
+{
+	struct timespec now;
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
+	return SEC2USEC((int64_t) now.tv_sec) + NSEC2USEC(now.tv_nsec);
+}
+
+
+/**
+ * Gets the pool that runs jobs of a given QoS class.
+ */
+static inline struct avbox_thread_pool *
+avbox_thread_qospool(const enum avbox_thread_qos qos)
+{
+	switch (qos) {
+	case AVBOX_THREAD_QOS_INTERACTIVE:
+	case AVBOX_THREAD_QOS_DEFAULT:
+		return &pools[AVBOX_THREAD_POOL_FOREGROUND];
+	case AVBOX_THREAD_QOS_BACKGROUND:
+		return &pools[AVBOX_THREAD_POOL_BACKGROUND];
+	case AVBOX_THREAD_QOS_IDLE:
+		return &pools[AVBOX_THREAD_POOL_IDLE];
+	default:
+		return NULL;
+	}
+}
+
+
+/**
+ * Checks if a pool is paused.
+ */
+static inline int
+avbox_thread_poolpaused(const struct avbox_thread_pool * const pool)
+{
+	return pool->pausable && paused > 0;
+}
+
+
+/**
+ * Set the CPU and IO priority of the calling worker.
+ */
+static void
+avbox_thread_setpriority(const struct avbox_thread_pool * const pool)
+{
+	switch (pool->qos) {
+	case AVBOX_THREAD_QOS_BACKGROUND:
+	{
+		/* on Linux this only affects the calling thread */
+		if (setpriority(PRIO_PROCESS, syscall(SYS_gettid),
+			AVBOX_THREAD_BACKGROUND_NICE) == -1) {
+			LOG_VPRINT_ERROR("Could not set worker nice value: %s",
+				strerror(errno));
+		}
+		if (ioprio_set(IOPRIO_WHO_PROCESS, 0,
+			IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7)) == -1) {
+			LOG_VPRINT_ERROR("Could not set worker IO priority: %s",
+				strerror(errno));
+		}
+		break;
+	}
+	case AVBOX_THREAD_QOS_IDLE:
+	{
+		struct sched_param parms;
+		parms.sched_priority = 0;
+		if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &parms) != 0) {
+			LOG_PRINT_ERROR("Could not set SCHED_IDLE policy");
+		}
+		if (ioprio_set(IOPRIO_WHO_PROCESS, 0,
+			IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) == -1) {
+			LOG_VPRINT_ERROR("Could not set worker IO priority: %s",
+				strerror(errno));
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+
+/**
+ * Push a job to a worker's deque. Interactive jobs go
+ * to the front so they run next.
+ */
+static int
+avbox_thread_push(struct avbox_thread * const thread,
+	struct avbox_delegate * const del, const int front)
+{
+	pthread_mutex_lock(&thread->lock);
+
+	/* if the deque is full grow it */
+	if (thread->deque_len == thread->deque_sz) {
+		size_t i;
+		struct avbox_delegate **deque;
+		if ((deque = malloc(thread->deque_sz * 2 * sizeof(struct avbox_delegate*))) == NULL) {
+			assert(errno == ENOMEM);
+			pthread_mutex_unlock(&thread->lock);
+			return -1;
+		}
+		for (i = 0; i < thread->deque_len; i++) {
+			deque[i] = thread->deque[(thread->deque_head + i) % thread->deque_sz];
+		}
+		free(thread->deque);
+		thread->deque = deque;
+		thread->deque_head = 0;
+		thread->deque_sz *= 2;
+	}
+
+	if (front) {
+		thread->deque_head = (thread->deque_head + thread->deque_sz - 1) % thread->deque_sz;
+		thread->deque[thread->deque_head] = del;
+	} else {
+		thread->deque[(thread->deque_head + thread->deque_len) % thread->deque_sz] = del;
+	}
+	thread->deque_len++;
+	pthread_mutex_unlock(&thread->lock);
+	return 0;
+}
+
+
+/**
+ * Take the job at the front of a worker's deque.
+ */
+static struct avbox_delegate *
+avbox_thread_pop(struct avbox_thread * const thread)
+{
+	struct avbox_delegate *del = NULL;
+	pthread_mutex_lock(&thread->lock);
+	if (thread->deque_len > 0) {
+		del = thread->deque[thread->deque_head];
+		thread->deque_head = (thread->deque_head + 1) % thread->deque_sz;
+		thread->deque_len--;
+	}
+	pthread_mutex_unlock(&thread->lock);
+	return del;
+}
+
+
+/**
+ * Steal the job at the back of a worker's deque.
+ */
+static struct avbox_delegate *
+avbox_thread_steal(struct avbox_thread * const victim)
+{
+	struct avbox_delegate *del = NULL;
+	pthread_mutex_lock(&victim->lock);
+	if (victim->deque_len > 0) {
+		victim->deque_len--;
+		del = victim->deque[(victim->deque_head + victim->deque_len) % victim->deque_sz];
+	}
+	pthread_mutex_unlock(&victim->lock);
+	return del;
+}
+
+
+/**
+ * Get the next job for a worker.
+ */
+static struct avbox_delegate *
+avbox_thread_getjob(struct avbox_thread * const thread)
+{
+	int i;
+	struct avbox_delegate *del;
+	struct avbox_thread_pool * const pool = thread->pool;
+
+	/* if nothing is queued don't bother looking */
+	if (pool->pending == 0 || avbox_thread_poolpaused(pool)) {
+		return NULL;
+	}
+
+	if ((del = avbox_thread_pop(thread)) == NULL) {
+		pthread_rwlock_rdlock(&pool->lock);
+		for (i = 1; i < pool->n_workers; i++) {
+			if ((del = avbox_thread_steal(pool->workers[(thread->no + i) % pool->n_workers])) != NULL) {
+				thread->steals++;
+				break;
+			}
+		}
+		pthread_rwlock_unlock(&pool->lock);
+		if (del == NULL) {
+			return NULL;
+		}
+	}
+
+	ATOMIC_DEC(&pool->pending);
+	return del;
+}
+
+
+/**
+ * Run a job and account for it.
+ */
+static void
+avbox_thread_runjob(struct avbox_thread * const thread, struct avbox_delegate * const del)
+{
+	/* jobs may run nested when a worker helps
+	 * while joining a task group */
+	const int busy = thread->busy;
+	const int64_t start_time = thread->start_time;
+
+	thread->start_time = avbox_thread_now();
+	thread->busy = 1;
+	avbox_delegate_execute(del);
+	if (!busy) {
+		thread->busy_time += avbox_thread_now() - thread->start_time;
+	}
+	thread->busy = busy;
+	thread->start_time = start_time;
+	thread->jobs++;
+}
 
 
 /**
@@ -52,18 +376,10 @@ avbox_thread_msghandler(void * const context, struct avbox_message *msg)
 	switch (avbox_message_id(msg)) {
 	case AVBOX_MESSAGETYPE_DELEGATE:
 	{
-		struct avbox_delegate * const del =
-			avbox_message_payload(msg);
-		(void) clock_gettime(CLOCK_MONOTONIC, &thread->start_time);
-		avbox_delegate_execute(del);
-		(void) clock_gettime(CLOCK_MONOTONIC, &thread->stop_time);
-
-#ifndef NDEBUG
-		thread->jobs++;
-#endif
-
+		avbox_thread_runjob(thread, avbox_message_payload(msg));
 		break;
 	}
+	case AVBOX_MESSAGETYPE_WAKEUP:
 	case AVBOX_MESSAGETYPE_DESTROY:
 	{
 		break;
@@ -86,12 +402,17 @@ avbox_thread_msghandler(void * const context, struct avbox_message *msg)
 static void*
 avbox_thread_run(void *arg)
 {
-	int quit = 0;
+	int i, quit = 0;
 	struct avbox_thread * const thread = (struct avbox_thread*) arg;
+	struct avbox_thread_pool * const pool = thread->pool;
+	struct avbox_delegate *del;
 	struct avbox_message * msg;
 
-	DEBUG_SET_THREAD_NAME("avbox-worker");
-	DEBUG_VPRINT("thread", "Thread #%i starting", thread->no);
+	DEBUG_SET_THREAD_NAME(pool->name);
+	DEBUG_VPRINT("thread", "Thread %s#%i starting",
+		pool->name, thread->no);
+
+	avbox_thread_setpriority(pool);
 
 	/* initialize message dispatcher */
 	if (avbox_dispatch_init() == -1) {
@@ -109,19 +430,47 @@ avbox_thread_run(void *arg)
 		goto end;
 	}
 
-	/* initialize thread timers */
-	clock_gettime(CLOCK_MONOTONIC, &thread->start_time);
-	clock_gettime(CLOCK_MONOTONIC, &thread->stop_time);
+	current_thread = thread;
 
 	/* signal that we're up and running */
 	pthread_mutex_lock(&lock);
 	thread->running = 1;
-	pthread_cond_signal(&cond);
+	thread->started = 1;
+	pthread_cond_broadcast(&cond);
 	pthread_mutex_unlock(&lock);
 
-	/* run the message loop */
 	while (!quit) {
-		if ((msg = avbox_dispatch_getmsg()) == NULL) {
+		/* run queued jobs */
+		for (i = 0; i < AVBOX_THREAD_MSGCHECK; i++) {
+			if ((del = avbox_thread_getjob(thread)) == NULL) {
+				break;
+			}
+			avbox_thread_runjob(thread, del);
+		}
+
+		if (i == AVBOX_THREAD_MSGCHECK) {
+			/* we're still busy so only dispatch
+			 * messages that are already waiting */
+			if (avbox_dispatch_peekmsg() == NULL) {
+				continue;
+			}
+		} else {
+			/* let everyone know that we're going idle and
+			 * check again in case a job was queued (or the
+			 * pool resumed) before they could see it. Whoever
+			 * does that after this will send us a WAKEUP message */
+			thread->idle = 1;
+			__sync_synchronize();
+			if (pool->pending > 0 && !avbox_thread_poolpaused(pool)) {
+				thread->idle = 0;
+				continue;
+			}
+		}
+
+		/* wait for a message */
+		msg = avbox_dispatch_getmsg();
+		thread->idle = 0;
+		if (msg == NULL) {
 			switch (errno) {
 			case EAGAIN: continue;
 			case ESHUTDOWN:
@@ -135,16 +484,24 @@ avbox_thread_run(void *arg)
 		avbox_message_dispatch(msg);
 	}
 
+	/* run anything left on our deque */
+	while ((del = avbox_thread_pop(thread)) != NULL) {
+		ATOMIC_DEC(&pool->pending);
+		avbox_thread_runjob(thread, del);
+	}
+
 	/* cleanup */
+	current_thread = NULL;
 	avbox_dispatch_shutdown();
 
-	DEBUG_VPRINT("thread", "Thread #%i exited after %li jobs",
-		thread->no, thread->jobs);
+	DEBUG_VPRINT("thread", "Thread %s#%i exited after %li jobs (%li stolen)",
+		pool->name, thread->no, thread->jobs, thread->steals);
 
 end:
 	/* signal that we've exited */
 	pthread_mutex_lock(&lock);
-	pthread_cond_signal(&cond);
+	thread->started = 1;
+	pthread_cond_broadcast(&cond);
 	pthread_mutex_unlock(&lock);
 
 	return NULL;
@@ -152,100 +509,313 @@ end:
 
 
 /**
- * Create a new thread.
+ * Free a thread structure.
+ */
+static void
+avbox_thread_free(struct avbox_thread * const thread)
+{
+	pthread_mutex_destroy(&thread->lock);
+	free(thread->deque);
+	free(thread);
+}
+
+
+/**
+ * Create a new thread and add it to a pool.
  */
 static struct avbox_thread *
-avbox_thread_new(void)
+avbox_thread_new(struct avbox_thread_pool * const pool)
 {
 	struct avbox_thread *thread;
-#ifndef NDEBUG
-	static int thread_no = 0;
-#endif
 
 	/* allocate memory */
 	if ((thread = malloc(sizeof(struct avbox_thread))) == NULL) {
 		assert(errno == ENOMEM);
 		return NULL;
 	}
+	memset(thread, 0, sizeof(struct avbox_thread));
+	if ((thread->deque = malloc(AVBOX_THREAD_DEQUE_SIZE * sizeof(struct avbox_delegate*))) == NULL) {
+		assert(errno == ENOMEM);
+		free(thread);
+		return NULL;
+	}
+	thread->deque_sz = AVBOX_THREAD_DEQUE_SIZE;
+	thread->pool = pool;
+	if (pthread_mutex_init(&thread->lock, NULL) != 0) {
+		free(thread->deque);
+		free(thread);
+		errno = EAGAIN;
+		return NULL;
+	}
 
 	/* start thread */
+	pthread_rwlock_wrlock(&pool->lock);
+	if (pool->n_workers == pool->max_workers) {
+		pthread_rwlock_unlock(&pool->lock);
+		avbox_thread_free(thread);
+		errno = EAGAIN;
+		return NULL;
+	}
+	thread->no = pool->n_workers;
+
 	pthread_mutex_lock(&lock);
-#ifndef NDEBUG
-	thread->no = thread_no++;
-	thread->jobs = 0;
-#endif
-	thread->running = 0;
 	if (pthread_create(&thread->thread, NULL, avbox_thread_run, thread) != 0) {
-		free(thread);
+		pthread_mutex_unlock(&lock);
+		pthread_rwlock_unlock(&pool->lock);
+		avbox_thread_free(thread);
 		return NULL;
 	}
-	pthread_cond_wait(&cond, &lock);
+	/* the condition is shared by all threads so
+	 * wait for this one's flag */
+	while (!thread->started) {
+		pthread_cond_wait(&cond, &lock);
+	}
 	pthread_mutex_unlock(&lock);
 
 	/* check that the thread started successfully */
 	if (!thread->running) {
-		free(thread);
-		thread = NULL;
-	} else {
-		LIST_APPEND(&threads, thread);
+		pthread_rwlock_unlock(&pool->lock);
+		pthread_join(thread->thread, NULL);
+		avbox_thread_free(thread);
+		return NULL;
 	}
 
-	DEBUG_VPRINT("thread", "Thread %p started", thread);
+	pool->workers[pool->n_workers++] = thread;
+	pthread_rwlock_unlock(&pool->lock);
+
+	DEBUG_VPRINT("thread", "Thread %s#%i started",
+		pool->name, thread->no);
 
 	return thread;
 }
 
 
 /**
- * Destroy a thread.
+ * Destroy the last thread in a pool.
  */
 static void
-avbox_thread_destroy(struct avbox_thread * const thread)
+avbox_thread_destroylast(struct avbox_thread_pool * const pool)
 {
-	DEBUG_VPRINT("thread", "Shutting down thread #%i",
-		thread->no);
+	struct avbox_thread *thread;
 
-	assert(thread != NULL);
+	/* remove it from the pool first so no more
+	 * jobs are queued to it */
+	pthread_rwlock_wrlock(&pool->lock);
+	thread = pool->workers[--pool->n_workers];
+	pool->workers[pool->n_workers] = NULL;
+	pthread_rwlock_unlock(&pool->lock);
 
-	LIST_REMOVE(thread);
+	DEBUG_VPRINT("thread", "Shutting down thread %s#%i",
+		pool->name, thread->no);
 
 	/* Destroy the thread object and wait for it
 	 * to exit */
 	avbox_object_destroy(thread->object);
 	pthread_join(thread->thread, NULL);
-	free(thread);
+	avbox_thread_free(thread);
 }
 
 
 /**
- * Pick the least busy thread.
+ * Send a WAKEUP message to a worker.
  */
-static struct avbox_thread *
-avbox_thread_pick(void)
+static void
+avbox_thread_wakeup(struct avbox_thread * const thread)
 {
-	struct avbox_thread *thread;
-	struct avbox_thread *best_thread = NULL;
-	struct timespec best_time = { 0xFFFFFF, 999L * 1000L * 1000L };
-
-	/* Pick the first free thread. If one cannot be found
-	 * pick the one with the shortest runtime */
-	LIST_FOREACH(struct avbox_thread*, thread, &threads) {
-		struct timespec now, runtime;
-		if (timegte(&thread->stop_time, &thread->start_time)) {
-			best_thread = thread;
+	if (avbox_object_coalescemsg(&thread->object, AVBOX_MESSAGETYPE_WAKEUP,
+		AVBOX_DISPATCH_UNICAST, 0, NULL, NULL) == NULL) {
+		LOG_VPRINT_ERROR("Could not wake worker %s#%i: %s",
+			thread->pool->name, thread->no, strerror(errno));
+	}
+}
+
+
+/**
+ * Wake an idle worker. Prefer the one given.
+ * The pool lock must be held.
+ *
+ * Returns 0 if a worker was woken or -1 if they're all busy.
+ */
+static int
+avbox_thread_wakeone(struct avbox_thread * const thread)
+{
+	int i;
+	struct avbox_thread *idle = NULL;
+	struct avbox_thread_pool * const pool = thread->pool;
+
+	/* clear the idle flag so a burst of jobs doesn't
+	 * keep waking the same worker */
+	if (ATOMIC_CAS(&thread->idle, 1, 0) == 1) {
+		idle = thread;
+	} else {
+		for (i = 0; i < pool->n_workers; i++) {
+			if (ATOMIC_CAS(&pool->workers[i]->idle, 1, 0) == 1) {
+				idle = pool->workers[i];
+				break;
+			}
+		}
+	}
+	if (idle == NULL) {
+		return -1;
+	}
+	avbox_thread_wakeup(idle);
+	return 0;
+}
+
+
+/**
+ * Checks if all the workers of a pool appear to be blocked.
+ */
+static int
+avbox_thread_blocked(struct avbox_thread_pool * const pool)
+{
+	int i, ret = 1;
+	const int64_t now = avbox_thread_now();
+	pthread_rwlock_rdlock(&pool->lock);
+	for (i = 0; i < pool->n_workers; i++) {
+		if (!pool->workers[i]->busy || (now - pool->workers[i]->start_time) < AVBOX_THREAD_BLOCKED) {
+			ret = 0;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&pool->lock);
+	return ret;
+}
+
+
+/**
+ * Watches the pools while there's queued work and no idle workers
+ * and starts new workers if the existing ones are blocked. When
+ * the pools are keeping up it sleeps until it is armed again.
+ */
+static void *
+avbox_thread_monitor(void *arg)
+{
+	int i, waiting, full;
+	struct timespec tv;
+
+	(void) arg;
+
+	DEBUG_SET_THREAD_NAME("avbox-poolmon");
+
+	pthread_mutex_lock(&monitor_lock);
+	while (!monitor_quit) {
+		if (!monitor_armed) {
+			pthread_cond_wait(&monitor_cond, &monitor_lock);
+			continue;
+		}
+
+		tv.tv_sec = 0;
+		tv.tv_nsec = AVBOX_THREAD_BLOCKED * 1000L;
+		delay2abstime(&tv);
+		pthread_cond_timedwait(&monitor_cond, &monitor_lock, &tv);
+		if (monitor_quit) {
 			break;
 		}
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		runtime = timediff(&now, &thread->start_time);
-		if (timelt(&runtime, &best_time)) {
-			best_time = runtime;
-			best_thread = thread;
+		pthread_mutex_unlock(&monitor_lock);
+
+		for (i = 0, waiting = 0; i < AVBOX_THREAD_POOL_COUNT; i++) {
+			struct avbox_thread_pool * const pool = &pools[i];
+			if (pool->pending == 0 || avbox_thread_poolpaused(pool)) {
+				continue;
+			}
+			waiting = 1;
+			if (avbox_thread_blocked(pool)) {
+				/* at max_workers the jobs have to wait */
+				pthread_rwlock_rdlock(&pool->lock);
+				full = (pool->n_workers == pool->max_workers);
+				pthread_rwlock_unlock(&pool->lock);
+				if (full) {
+					continue;
+				}
+				DEBUG_VPRINT("thread", "All %s threads blocked with %i jobs queued. Growing pool",
+					pool->name, pool->pending);
+				if (avbox_thread_new(pool) == NULL && errno != EAGAIN) {
+					LOG_VPRINT_ERROR("Could not grow %s pool: %s",
+						pool->name, strerror(errno));
+				}
+			}
+		}
+
+		pthread_mutex_lock(&monitor_lock);
+		if (!waiting) {
+			monitor_armed = 0;
 		}
 	}
+	pthread_mutex_unlock(&monitor_lock);
+
+	return NULL;
+}
+
+
+/**
+ * Delegate a function call to a thread with a given QoS class.
+ */
+struct avbox_delegate *
+avbox_thread_delegate_qos(avbox_delegate_fn func, void * arg,
+	const enum avbox_thread_qos qos)
+{
+	struct avbox_delegate *del;
+	struct avbox_thread *thread;
+	struct avbox_thread_pool *pool;
+	int woken;
+
+	if ((pool = avbox_thread_qospool(qos)) == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
 
-	assert(best_thread != NULL);
+	/* create a new delegate */
+	if ((del = avbox_delegate_new(func, arg)) == NULL) {
+		assert(errno == ENOMEM);
+		return NULL;
+	}
+
+	pthread_rwlock_rdlock(&pool->lock);
+
+	if (pool->n_workers == 0) {
+		pthread_rwlock_unlock(&pool->lock);
+		avbox_delegate_destroy(del);
+		errno = ESHUTDOWN;
+		return NULL;
+	}
 
-	return best_thread;
+	/* jobs queued from a worker stay on it's deque, everything
+	 * else is spread round-robin */
+	if ((thread = current_thread) == NULL || thread->pool != pool) {
+		thread = pool->workers[ATOMIC_INC(&pool->next_worker) % pool->n_workers];
+	}
+
+	if (avbox_thread_push(thread, del, qos == AVBOX_THREAD_QOS_INTERACTIVE) == -1) {
+		pthread_rwlock_unlock(&pool->lock);
+		avbox_delegate_destroy(del);
+		return NULL;
+	}
+
+	ATOMIC_INC(&pool->pending);
+	__sync_synchronize();
+
+	/* if the pool is paused the job will be picked
+	 * up when it's resumed */
+	if (avbox_thread_poolpaused(pool)) {
+		pthread_rwlock_unlock(&pool->lock);
+		return del;
+	}
+
+	woken = avbox_thread_wakeone(thread);
+	pthread_rwlock_unlock(&pool->lock);
+
+	/* if all the workers are busy arm the monitor */
+	if (woken == -1) {
+		pthread_mutex_lock(&monitor_lock);
+		if (!monitor_armed) {
+			monitor_armed = 1;
+			pthread_cond_signal(&monitor_cond);
+		}
+		pthread_mutex_unlock(&monitor_lock);
+	}
+
+	return del;
 }
 
 
@@ -255,34 +825,492 @@ avbox_thread_pick(void)
 struct avbox_delegate *
 avbox_thread_delegate(avbox_delegate_fn func, void * arg)
 {
+	return avbox_thread_delegate_qos(func, arg, AVBOX_THREAD_QOS_DEFAULT);
+}
+
+
+/**
+ * Pause idle work. Calls nest.
+ */
+void
+avbox_thread_pause(void)
+{
+	pthread_mutex_lock(&pause_lock);
+	if (paused++ == 0) {
+		DEBUG_PRINT("thread", "Pausing idle work");
+	}
+	pthread_mutex_unlock(&pause_lock);
+}
+
+
+/**
+ * Resume idle work.
+ */
+void
+avbox_thread_resume(void)
+{
+	int i, j;
+
+	pthread_mutex_lock(&pause_lock);
+	assert(paused > 0);
+	if (--paused > 0) {
+		pthread_mutex_unlock(&pause_lock);
+		return;
+	}
+	DEBUG_PRINT("thread", "Resuming idle work");
+	pthread_cond_broadcast(&pause_cond);
+	pthread_mutex_unlock(&pause_lock);
+
+	/* wake the workers of paused pools if they
+	 * have work to do */
+	__sync_synchronize();
+	for (i = 0; i < AVBOX_THREAD_POOL_COUNT; i++) {
+		struct avbox_thread_pool * const pool = &pools[i];
+		if (!pool->pausable || pool->pending == 0) {
+			continue;
+		}
+		pthread_rwlock_rdlock(&pool->lock);
+		for (j = 0; j < pool->n_workers; j++) {
+			if (pool->workers[j]->idle) {
+				avbox_thread_wakeup(pool->workers[j]);
+			}
+		}
+		pthread_rwlock_unlock(&pool->lock);
+	}
+}
+
+
+/**
+ * Called by long running jobs at convenient points. If
+ * the calling worker's pool is paused it blocks until
+ * it's resumed.
+ */
+void
+avbox_thread_yield(void)
+{
+	struct avbox_thread * const thread = current_thread;
+
+	if (thread == NULL || !avbox_thread_poolpaused(thread->pool)) {
+		return;
+	}
+
+	pthread_mutex_lock(&pause_lock);
+	while (paused > 0) {
+		pthread_cond_wait(&pause_cond, &pause_lock);
+	}
+	pthread_mutex_unlock(&pause_lock);
+}
+
+
+/**
+ * Task group.
+ */
+struct avbox_thread_group
+{
+	enum avbox_thread_qos qos;
+	int outstanding;
+	volatile int cancelled;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+
+/**
+ * Task group entry.
+ */
+struct avbox_thread_task
+{
+	struct avbox_thread_group *group;
+	avbox_delegate_fn func;
+	void *arg;
+};
+
+
+/**
+ * Runs a task and signals it's group.
+ */
+static void *
+avbox_thread_grouptask(void *arg)
+{
+	struct avbox_thread_task * const task = arg;
+	struct avbox_thread_group * const group = task->group;
+
+	if (!group->cancelled) {
+		(void) task->func(task->arg);
+	}
+	free(task);
+
+	pthread_mutex_lock(&group->lock);
+	if (--group->outstanding == 0) {
+		pthread_cond_broadcast(&group->cond);
+	}
+	pthread_mutex_unlock(&group->lock);
+	return NULL;
+}
+
+
+/**
+ * Create a task group. Tasks added to the group
+ * run with the given QoS class.
+ */
+struct avbox_thread_group *
+avbox_thread_group_new(const enum avbox_thread_qos qos)
+{
+	struct avbox_thread_group *group;
+
+	if (avbox_thread_qospool(qos) == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((group = malloc(sizeof(struct avbox_thread_group))) == NULL) {
+		assert(errno == ENOMEM);
+		return NULL;
+	}
+
+	group->qos = qos;
+	group->outstanding = 0;
+	group->cancelled = 0;
+
+	if (pthread_mutex_init(&group->lock, NULL) != 0) {
+		free(group);
+		errno = EAGAIN;
+		return NULL;
+	}
+	if (pthread_cond_init(&group->cond, NULL) != 0) {
+		pthread_mutex_destroy(&group->lock);
+		free(group);
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	return group;
+}
+
+
+/**
+ * Add a task to a group. The task's return value is
+ * ignored.
+ */
+int
+avbox_thread_group_add(struct avbox_thread_group * const group,
+	avbox_delegate_fn func, void *arg)
+{
+	struct avbox_thread_task *task;
 	struct avbox_delegate *del;
-	struct avbox_thread *thread = NULL;
 
-	pthread_mutex_lock(&lock);
+	assert(group != NULL);
+	assert(func != NULL);
 
-	/* pick the best thread */
-	if ((thread = avbox_thread_pick()) == NULL) {
-		DEBUG_VABORT("thread", "Could not pick thread: %s",
-			strerror(errno));
+	if (group->cancelled) {
+		errno = ECANCELED;
+		return -1;
 	}
 
-	/* create a new delegate */
-	if ((del = avbox_delegate_new(func, arg)) == NULL) {
+	if ((task = malloc(sizeof(struct avbox_thread_task))) == NULL) {
 		assert(errno == ENOMEM);
-		goto end;
+		return -1;
 	}
 
-	/* dispatch it to the chosen thread */
-	if (avbox_object_sendmsg(&thread->object,
-		AVBOX_MESSAGETYPE_DELEGATE, AVBOX_DISPATCH_UNICAST, del) == NULL) {
-		free(del);
-		del = NULL;
-		goto end;
+	task->group = group;
+	task->func = func;
+	task->arg = arg;
+
+	pthread_mutex_lock(&group->lock);
+	group->outstanding++;
+	pthread_mutex_unlock(&group->lock);
+
+	if ((del = avbox_thread_delegate_qos(avbox_thread_grouptask,
+		task, group->qos)) == NULL) {
+		pthread_mutex_lock(&group->lock);
+		if (--group->outstanding == 0) {
+			pthread_cond_broadcast(&group->cond);
+		}
+		pthread_mutex_unlock(&group->lock);
+		free(task);
+		return -1;
 	}
 
-end:
-	pthread_mutex_unlock(&lock);
-	return del;
+	avbox_delegate_dettach(del);
+	return 0;
+}
+
+
+/**
+ * Cancel a task group. Tasks that have not started will
+ * not run. Running tasks may poll avbox_thread_group_cancelled()
+ * and return early.
+ */
+void
+avbox_thread_group_cancel(struct avbox_thread_group * const group)
+{
+	assert(group != NULL);
+	group->cancelled = 1;
+}
+
+
+/**
+ * Checks if a task group has been cancelled.
+ */
+int
+avbox_thread_group_cancelled(const struct avbox_thread_group * const group)
+{
+	assert(group != NULL);
+	return group->cancelled;
+}
+
+
+/**
+ * Wait for all the tasks in a group to finish. When called
+ * from a worker thread the worker runs queued jobs while it
+ * waits so nested joins cannot starve the pool.
+ *
+ * Returns -1 and sets errno to ECANCELED if the group was
+ * cancelled.
+ */
+int
+avbox_thread_group_join(struct avbox_thread_group * const group)
+{
+	struct avbox_thread * const thread = current_thread;
+	struct avbox_delegate *del;
+
+	assert(group != NULL);
+
+	pthread_mutex_lock(&group->lock);
+	while (group->outstanding > 0) {
+		if (thread != NULL) {
+			pthread_mutex_unlock(&group->lock);
+			del = avbox_thread_getjob(thread);
+			if (del != NULL) {
+				avbox_thread_runjob(thread, del);
+			}
+			pthread_mutex_lock(&group->lock);
+			if (del != NULL || group->outstanding == 0) {
+				continue;
+			}
+		}
+		pthread_cond_wait(&group->cond, &group->lock);
+	}
+	pthread_mutex_unlock(&group->lock);
+
+	if (group->cancelled) {
+		errno = ECANCELED;
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Destroy a task group. It must be joined first.
+ */
+void
+avbox_thread_group_destroy(struct avbox_thread_group * const group)
+{
+	assert(group != NULL);
+	assert(group->outstanding == 0);
+	pthread_cond_destroy(&group->cond);
+	pthread_mutex_destroy(&group->lock);
+	free(group);
+}
+
+
+/**
+ * A slice of a parallel for loop.
+ */
+struct avbox_thread_slice
+{
+	avbox_thread_forfn func;
+	void *arg;
+	int start;
+	int end;
+};
+
+
+/**
+ * Runs a slice of a parallel for loop.
+ */
+static void *
+avbox_thread_runslice(void *arg)
+{
+	struct avbox_thread_slice * const slice = arg;
+	slice->func(slice->arg, slice->start, slice->end);
+	return NULL;
+}
+
+
+/**
+ * Runs func over the range [start, end) split in slices of
+ * at least grain iterations across the pool's workers. The
+ * calling thread runs one of the slices. If called from a
+ * worker the slices run with that worker's QoS class.
+ */
+int
+avbox_thread_parallel_for(int start, int end, int grain,
+	avbox_thread_forfn func, void *arg)
+{
+	int i, n_slices, slice_sz, ret = 0;
+	struct avbox_thread_slice *slices;
+	struct avbox_thread_group *group;
+	const enum avbox_thread_qos qos = (current_thread != NULL) ?
+		current_thread->pool->qos : AVBOX_THREAD_QOS_DEFAULT;
+	struct avbox_thread_pool * const pool = avbox_thread_qospool(qos);
+
+	assert(func != NULL);
+
+	if (end <= start) {
+		return 0;
+	}
+
+	/* a few slices per worker helps balance the load */
+	grain = MAX(grain, 1);
+	n_slices = MAX(pool->n_workers, 1) * 4;
+	slice_sz = MAX(grain, ((end - start) + n_slices - 1) / n_slices);
+	n_slices = ((end - start) + slice_sz - 1) / slice_sz;
+
+	if (n_slices == 1) {
+		func(arg, start, end);
+		return 0;
+	}
+
+	if ((slices = malloc(n_slices * sizeof(struct avbox_thread_slice))) == NULL) {
+		assert(errno == ENOMEM);
+		return -1;
+	}
+	if ((group = avbox_thread_group_new(qos)) == NULL) {
+		free(slices);
+		return -1;
+	}
+
+	for (i = 0; i < n_slices; i++) {
+		slices[i].func = func;
+		slices[i].arg = arg;
+		slices[i].start = start + (i * slice_sz);
+		slices[i].end = MIN(end, slices[i].start + slice_sz);
+	}
+
+	/* queue all the slices but the last one and run
+	 * that one ourselves. If a slice cannot be queued
+	 * run it here */
+	for (i = 0; i < (n_slices - 1); i++) {
+		if (avbox_thread_group_add(group, avbox_thread_runslice, &slices[i]) == -1) {
+			(void) avbox_thread_runslice(&slices[i]);
+		}
+	}
+	(void) avbox_thread_runslice(&slices[n_slices - 1]);
+
+	if (avbox_thread_group_join(group) == -1) {
+		ret = -1;
+	}
+
+	avbox_thread_group_destroy(group);
+	free(slices);
+	return ret;
+}
+
+
+/**
+ * Benchmark kernel.
+ */
+static void *
+avbox_thread_benchtask(void *arg)
+{
+	int i;
+	volatile double x = 0;
+	const int iterations = *((int*) arg);
+	for (i = 0; i < iterations; i++) {
+		x += (double) i / (i + 1);
+	}
+	return NULL;
+}
+
+
+/**
+ * Runs a fixed amount of CPU bound work split in 1 to N
+ * tasks (N being the number of foreground workers) and logs
+ * the time it takes and the speedup over a single task.
+ */
+void
+avbox_thread_benchmark(void)
+{
+	int i, n, iterations;
+	int64_t start, elapsed, base = 0;
+	struct avbox_thread_group *group;
+	const int total = 200 * 1000 * 1000;
+
+	for (n = 1; n <= pools[AVBOX_THREAD_POOL_FOREGROUND].n_workers; n++) {
+		if ((group = avbox_thread_group_new(AVBOX_THREAD_QOS_DEFAULT)) == NULL) {
+			LOG_VPRINT_ERROR("Could not create task group: %s",
+				strerror(errno));
+			return;
+		}
+
+		iterations = total / n;
+		start = avbox_thread_now();
+		for (i = 0; i < n; i++) {
+			if (avbox_thread_group_add(group, avbox_thread_benchtask, &iterations) == -1) {
+				LOG_VPRINT_ERROR("Could not add task: %s",
+					strerror(errno));
+			}
+		}
+		(void) avbox_thread_group_join(group);
+		elapsed = avbox_thread_now() - start;
+		avbox_thread_group_destroy(group);
+
+		if (n == 1) {
+			base = elapsed;
+		}
+		LOG_VPRINT_INFO("%2i thread(s): %8li usecs (%.2fx)",
+			n, (long) elapsed, (double) base / MAX(elapsed, 1));
+	}
+}
+
+
+/**
+ * Get the statistics of the pool's workers.
+ *
+ * Returns the number of entries filled.
+ */
+int
+avbox_thread_getstats(struct avbox_thread_stats *stats, int n)
+{
+	int i, j, cnt = 0;
+	for (i = 0; i < AVBOX_THREAD_POOL_COUNT; i++) {
+		struct avbox_thread_pool * const pool = &pools[i];
+		pthread_rwlock_rdlock(&pool->lock);
+		for (j = 0; cnt < n && j < pool->n_workers; j++, cnt++) {
+			struct avbox_thread * const thread = pool->workers[j];
+			pthread_mutex_lock(&thread->lock);
+			stats[cnt].queue_depth = thread->deque_len;
+			pthread_mutex_unlock(&thread->lock);
+			stats[cnt].no = thread->no;
+			stats[cnt].qos = pool->qos;
+			stats[cnt].busy = thread->busy;
+			stats[cnt].jobs = thread->jobs;
+			stats[cnt].steals = thread->steals;
+			stats[cnt].busy_time = thread->busy_time;
+			if (thread->busy) {
+				stats[cnt].busy_time += avbox_thread_now() - thread->start_time;
+			}
+		}
+		pthread_rwlock_unlock(&pool->lock);
+	}
+	return cnt;
+}
+
+
+/**
+ * Destroy all workers.
+ */
+static void
+avbox_thread_destroyall(void)
+{
+	int i;
+	for (i = 0; i < AVBOX_THREAD_POOL_COUNT; i++) {
+		while (pools[i].n_workers > 0) {
+			avbox_thread_destroylast(&pools[i]);
+		}
+	}
 }
 
 
@@ -292,20 +1320,39 @@ end:
 int
 avbox_thread_init(void)
 {
-	int i;
-	struct avbox_thread *thread;
+	int i, j;
+	long ncpus;
+
+	if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) == -1) {
+		LOG_VPRINT_ERROR("Could not get CPU count: %s",
+			strerror(errno));
+		ncpus = AVBOX_THREAD_MIN;
+	}
+	ncpus = MAX(ncpus, AVBOX_THREAD_MIN);
+	ncpus = MIN(ncpus, AVBOX_THREAD_MAX);
 
-	LIST_INIT(&threads);
+	DEBUG_VPRINT("thread", "Starting %li workers", ncpus);
 
-	for (i = 0; i < N_THREADS; i++) {
-		if ((thread = avbox_thread_new()) == NULL) {
-			LIST_FOREACH_SAFE(struct avbox_thread*, thread, &threads, {
-				avbox_thread_destroy(thread);
-			});
-			return -1;
+	/* one foreground worker per CPU and one of each of
+	 * the others. They all grow when blocked */
+	for (i = 0; i < AVBOX_THREAD_POOL_COUNT; i++) {
+		const int n = (i == AVBOX_THREAD_POOL_FOREGROUND) ? ncpus : 1;
+		for (j = 0; j < n; j++) {
+			if (avbox_thread_new(&pools[i]) == NULL) {
+				avbox_thread_destroyall();
+				return -1;
+			}
 		}
 	}
 
+	monitor_quit = 0;
+	monitor_armed = 0;
+	if (pthread_create(&monitor_thread, NULL, avbox_thread_monitor, NULL) != 0) {
+		LOG_PRINT_ERROR("Could not start pool monitor");
+		avbox_thread_destroyall();
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -316,11 +1363,19 @@ avbox_thread_init(void)
 void
 avbox_thread_shutdown(void)
 {
-	struct avbox_thread *thread;
-
 	DEBUG_PRINT("thread", "Shutting down thread pool");
 
-	while ((thread = LIST_TAIL(struct avbox_thread*, &threads)) != NULL) {
-		avbox_thread_destroy(thread);
-	}
+	pthread_mutex_lock(&monitor_lock);
+	monitor_quit = 1;
+	pthread_cond_signal(&monitor_cond);
+	pthread_mutex_unlock(&monitor_lock);
+	pthread_join(monitor_thread, NULL);
+
+	/* don't leave idle work stranded */
+	pthread_mutex_lock(&pause_lock);
+	paused = 0;
+	pthread_cond_broadcast(&pause_cond);
+	pthread_mutex_unlock(&pause_lock);
+
+	avbox_thread_destroyall();
 }
@@ -1,8 +1,41 @@
 #ifndef __AVBOX_THREAD_H__
 #define __AVBOX_THREAD_H__
+#include <stdint.h>
+#include <stddef.h>
 #include "delegate.h"
 
 
+/**
+ * QoS classes for delegated work. Interactive and default
+ * work runs on normal priority workers (interactive jobs are
+ * run first). Background work runs niced with low IO priority
+ * and idle work runs with SCHED_IDLE and idle IO priority and
+ * is paused while media is playing.
+ */
+enum avbox_thread_qos
+{
+	AVBOX_THREAD_QOS_INTERACTIVE,
+	AVBOX_THREAD_QOS_DEFAULT,
+	AVBOX_THREAD_QOS_BACKGROUND,
+	AVBOX_THREAD_QOS_IDLE
+};
+
+
+/**
+ * Worker statistics.
+ */
+struct avbox_thread_stats
+{
+	int no;
+	enum avbox_thread_qos qos;
+	int busy;
+	size_t queue_depth;
+	int64_t jobs;
+	int64_t steals;
+	int64_t busy_time;	/* usecs */
+};
+
+
 /**
  * Delegate a function call to a thread.
  */
@@ -10,6 +43,120 @@ struct avbox_delegate*
 avbox_thread_delegate(avbox_delegate_fn func, void * arg);
 
 
+/**
+ * Delegate a function call to a thread with a given QoS class.
+ */
+struct avbox_delegate*
+avbox_thread_delegate_qos(avbox_delegate_fn func, void * arg,
+	const enum avbox_thread_qos qos);
+
+
+/**
+ * Pause idle work. Calls nest.
+ */
+void
+avbox_thread_pause(void);
+
+
+/**
+ * Resume idle work.
+ */
+void
+avbox_thread_resume(void);
+
+
+/**
+ * Called by long running jobs at convenient points. Blocks
+ * while the calling worker's pool is paused.
+ */
+void
+avbox_thread_yield(void);
+
+
+/**
+ * Task group.
+ */
+struct avbox_thread_group;
+
+
+/**
+ * Parallel for loop body. Called with a range [start, end).
+ */
+typedef void (*avbox_thread_forfn)(void *arg, int start, int end);
+
+
+/**
+ * Create a task group. Tasks added to the group
+ * run with the given QoS class.
+ */
+struct avbox_thread_group *
+avbox_thread_group_new(const enum avbox_thread_qos qos);
+
+
+/**
+ * Add a task to a group. The task's return value is
+ * ignored.
+ */
+int
+avbox_thread_group_add(struct avbox_thread_group * const group,
+	avbox_delegate_fn func, void *arg);
+
+
+/**
+ * Cancel a task group. Tasks that have not started will
+ * not run.
+ */
+void
+avbox_thread_group_cancel(struct avbox_thread_group * const group);
+
+
+/**
+ * Checks if a task group has been cancelled.
+ */
+int
+avbox_thread_group_cancelled(const struct avbox_thread_group * const group);
+
+
+/**
+ * Wait for all the tasks in a group to finish.
+ *
+ * Returns -1 and sets errno to ECANCELED if the group was
+ * cancelled.
+ */
+int
+avbox_thread_group_join(struct avbox_thread_group * const group);
+
+
+/**
+ * Destroy a task group. It must be joined first.
+ */
+void
+avbox_thread_group_destroy(struct avbox_thread_group * const group);
+
+
+/**
+ * Runs func over the range [start, end) split in slices of
+ * at least grain iterations across the pool's workers.
+ */
+int
+avbox_thread_parallel_for(int start, int end, int grain,
+	avbox_thread_forfn func, void *arg);
+
+
+/**
+ * Logs the scaling of the pool from 1 to N workers.
+ */
+void
+avbox_thread_benchmark(void);
+
+
+/**
+ * Get the statistics of the pool's workers.
+ */
+int
+avbox_thread_getstats(struct avbox_thread_stats *stats, int n);
+
+
 /**
  * Initialize the thread pool.
  */
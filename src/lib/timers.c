@@ -14,6 +14,8 @@
 #include <pthread.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
 
 #define LOG_MODULE "timers"
 
@@ -25,35 +27,275 @@
 #include "dispatch.h"
 
 
+/* number of buckets on the timer id hash table */
+#define AVBOX_TIMERS_BUCKETS	(64)
+
+/* initial size of the timers heap */
+#define AVBOX_TIMERS_HEAP_SIZE	(32)
+
+
+/* cancellation states */
+#define AVBOX_TIMER_CANCELLED		(1)
+#define AVBOX_TIMER_CANCELLED_WAIT	(2)
+
+
 /**
- * Timer structure
+ * Timer structure. Timers are kept on a binary min-heap ordered
+ * by expiration time and on a hash table by id.
  */
 LISTABLE_STRUCT(avbox_timer_state,
 	struct avbox_timer_data public;
-	struct timespec interval;
-	struct timespec value;
+	int64_t interval;	/* nsecs */
+	int64_t slack;		/* nsecs */
+	int64_t deadline;	/* absolute CLOCK_MONOTONIC nsecs */
+	int64_t expires;	/* deadline rounded up to the slack */
+	size_t index;
+	int firing;
+	int cancelled;
 	enum avbox_timer_flags flags;
 	struct avbox_object *message_object;
 	avbox_timer_callback callback;
 );
 
 
-LIST_DECLARE_STATIC(timers);
+static LIST timers[AVBOX_TIMERS_BUCKETS];
+static struct avbox_timer_state **heap = NULL;
+static size_t heap_len = 0;
+static size_t heap_sz = 0;
 static int quit = 0;
+static int timerfd = -1;
+static int64_t armed = -1;
 static pthread_mutex_t timers_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t timers_signal = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t timers_fired = PTHREAD_COND_INITIALIZER;
 static pthread_t timers_thread;
 static int nextid = 1;
 
 
 /**
- * mbt_timers_thread() -- Waits until the next timer should elapsed,
- * processes it, and goes back to sleep
+ * Coalesces two ticks of the same timer. If the handler is
+ * falling behind it only needs to see the last one.
+ */
+static void *
+avbox_timers_coalesce(void *pending, void *payload)
+{
+	free(pending);
+	return payload;
+}
+
+
+/**
+ * Gets the monotonic time in nanoseconds.
+ */
+static inline int64_t
+avbox_timers_now(void)
+{
+	struct timespec now;
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
+	return SEC2NSEC((int64_t) now.tv_sec) + now.tv_nsec;
+}
+
+
+/**
+ * Converts a timespec to nanoseconds.
+ */
+static inline int64_t
+avbox_timers_tons(const struct timespec * const tv)
+{
+	return SEC2NSEC((int64_t) tv->tv_sec) + tv->tv_nsec;
+}
+
+
+/**
+ * Swap two heap entries.
+ */
+static inline void
+avbox_timers_heapswap(const size_t a, const size_t b)
+{
+	struct avbox_timer_state * const tmp = heap[a];
+	heap[a] = heap[b];
+	heap[b] = tmp;
+	heap[a]->index = a;
+	heap[b]->index = b;
+}
+
+
+/**
+ * Move a heap entry up until the heap is ordered.
+ */
+static void
+avbox_timers_heapup(size_t i)
+{
+	while (i > 0 && heap[(i - 1) / 2]->expires > heap[i]->expires) {
+		avbox_timers_heapswap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+
+/**
+ * Move a heap entry down until the heap is ordered.
+ */
+static void
+avbox_timers_heapdown(size_t i)
+{
+	size_t min;
+	while (1) {
+		min = i;
+		if ((2 * i + 1) < heap_len && heap[2 * i + 1]->expires < heap[min]->expires) {
+			min = 2 * i + 1;
+		}
+		if ((2 * i + 2) < heap_len && heap[2 * i + 2]->expires < heap[min]->expires) {
+			min = 2 * i + 2;
+		}
+		if (min == i) {
+			break;
+		}
+		avbox_timers_heapswap(i, min);
+		i = min;
+	}
+}
+
+
+/**
+ * Remove a timer from the heap.
+ */
+static void
+avbox_timers_heapremove(struct avbox_timer_state * const tmr)
+{
+	const size_t i = tmr->index;
+	assert(i < heap_len && heap[i] == tmr);
+	if (i != --heap_len) {
+		heap[i] = heap[heap_len];
+		heap[i]->index = i;
+		avbox_timers_heapdown(i);
+		avbox_timers_heapup(i);
+	}
+	tmr->index = SIZE_MAX;
+}
+
+
+/**
+ * Schedule a timer to expire at it's deadline. The expiration
+ * time is rounded up to a multiple of the timer's slack so that
+ * timers with the same slack expire together.
+ */
+static int
+avbox_timers_schedule(struct avbox_timer_state * const tmr)
+{
+	if (heap_len == heap_sz) {
+		struct avbox_timer_state **newheap;
+		const size_t newsz = (heap_sz == 0) ? AVBOX_TIMERS_HEAP_SIZE : heap_sz * 2;
+		if ((newheap = realloc(heap, newsz * sizeof(struct avbox_timer_state*))) == NULL) {
+			assert(errno == ENOMEM);
+			return -1;
+		}
+		heap = newheap;
+		heap_sz = newsz;
+	}
+
+	if (tmr->slack > 0) {
+		tmr->expires = ((tmr->deadline + tmr->slack - 1) / tmr->slack) * tmr->slack;
+	} else {
+		tmr->expires = tmr->deadline;
+	}
+
+	tmr->index = heap_len;
+	heap[heap_len++] = tmr;
+	avbox_timers_heapup(tmr->index);
+	return 0;
+}
+
+
+/**
+ * Arm the timerfd to wake us when the earliest timer expires.
+ */
+static void
+avbox_timers_arm(void)
+{
+	struct itimerspec its;
+	const int64_t expires = (heap_len > 0) ? heap[0]->expires : 0;
+
+	if (expires == armed) {
+		return;
+	}
+
+	/* a zero value disarms the timer */
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = NSEC2SEC(expires);
+	its.it_value.tv_nsec = expires % SEC2NSEC(1L);
+	if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+		LOG_VPRINT_ERROR("Could not arm timer: %s",
+			strerror(errno));
+		return;
+	}
+	armed = expires;
+}
+
+
+/**
+ * Find a timer by id. Ids are never negative but callers
+ * use -1 for no timer.
+ */
+static struct avbox_timer_state *
+avbox_timers_find(const int timer_id)
+{
+	struct avbox_timer_state *tmr;
+	if (timer_id < 0) {
+		return NULL;
+	}
+	LIST_FOREACH(struct avbox_timer_state*, tmr, &timers[timer_id % AVBOX_TIMERS_BUCKETS]) {
+		if (tmr->public.id == timer_id) {
+			return tmr;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Run a timer's callback and send it's message.
+ */
+static enum avbox_timer_result
+avbox_timers_fire(struct avbox_timer_state * const tmr)
+{
+	enum avbox_timer_result ret;
+
+	/* the timer has elapsed so invoke the callback */
+	if (tmr->callback != NULL) {
+		ret = tmr->callback(tmr->public.id, tmr->public.data);
+	} else {
+		ret = AVBOX_TIMER_CALLBACK_RESULT_CONTINUE;
+	}
+	if (tmr->flags & AVBOX_TIMER_MESSAGE) {
+		if (tmr->message_object != NULL) {
+			struct avbox_timer_data *payload;
+			if ((payload = malloc(sizeof(struct avbox_timer_data))) == NULL) {
+				LOG_PRINT_ERROR("Could not send TIMER message: Out of memory");
+			} else {
+				memcpy(payload, &tmr->public, sizeof(struct avbox_timer_data));
+				if (avbox_object_coalescemsg(&tmr->message_object,
+					AVBOX_MESSAGETYPE_TIMER, AVBOX_DISPATCH_UNICAST,
+					tmr->public.id, payload, avbox_timers_coalesce) == NULL) {
+					LOG_VPRINT_ERROR("Could not send notification message: %s",
+						strerror(errno));
+					free(payload);
+				}
+			}
+		}
+	}
+	return ret;
+}
+
+
+/**
+ * Waits until the next timer expires, runs it's callback
+ * (without holding the lock) and reschedules or frees it.
  */
 void *
 avbox_timers_thread(void *arg)
 {
-	struct timespec last_sleep, elapsed, now, sleeptime;
+	uint64_t expirations;
+	int64_t now;
 	struct avbox_timer_state *tmr;
 	enum avbox_timer_result ret;
 
@@ -62,73 +304,63 @@ avbox_timers_thread(void *arg)
 	DEBUG_PRINT("timers", "Timers system running");
 	MB_DEBUG_SET_THREAD_NAME("timers");
 
-	clock_gettime(CLOCK_MONOTONIC, &last_sleep);
-
 	pthread_mutex_lock(&timers_lock);
 
 	while (!quit) {
+		pthread_mutex_unlock(&timers_lock);
+		if (read(timerfd, &expirations, sizeof(expirations)) == -1) {
+			if (errno != EINTR && errno != EAGAIN) {
+				LOG_VPRINT_ERROR("Could not read timerfd: %s",
+					strerror(errno));
+			}
+		}
+		pthread_mutex_lock(&timers_lock);
+
+		/* the timerfd is disarmed after it fires */
+		armed = 0;
+		now = avbox_timers_now();
+
+		while (!quit && heap_len > 0 && heap[0]->expires <= now) {
+			tmr = heap[0];
+			avbox_timers_heapremove(tmr);
+			tmr->firing = 1;
+
+			pthread_mutex_unlock(&timers_lock);
+			ret = avbox_timers_fire(tmr);
+			pthread_mutex_lock(&timers_lock);
+
+			tmr->firing = 0;
+			pthread_cond_broadcast(&timers_fired);
+
+			if (tmr->cancelled == AVBOX_TIMER_CANCELLED_WAIT) {
+				/* the thread that cancelled it will free it */
+				continue;
+			} else if (tmr->cancelled) {
+				free(tmr);
+				continue;
+			}
 
-		/* this is the maximum time that we're allowed to sleep */
-		sleeptime.tv_sec = 10;
-		sleeptime.tv_nsec = 0;
-
-		/* calculate time elapsed since last sleep */
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		elapsed = timediff(&last_sleep, &now);
-
-		/* iterate through all timers */
-		LIST_FOREACH_SAFE(struct avbox_timer_state*, tmr, &timers, {
-			if (timelte(&tmr->value, &elapsed)) {
-				/* the timer has elapsed so invoke the callback */
-				if (tmr->callback != NULL) {
-					ret = tmr->callback(tmr->public.id, tmr->public.data);
-				} else {
-					ret = AVBOX_TIMER_CALLBACK_RESULT_CONTINUE;
-				}
-				if (tmr->flags & AVBOX_TIMER_MESSAGE) {
-					if (tmr->message_object != NULL) {
-						struct avbox_timer_data *payload;
-						if ((payload = malloc(sizeof(struct avbox_timer_data))) == NULL) {
-							LOG_PRINT_ERROR("Could not send TIMER message: Out of memory");
-						} else {
-							memcpy(payload, &tmr->public, sizeof(struct avbox_timer_data));
-							if (avbox_object_sendmsg(&tmr->message_object,
-								AVBOX_MESSAGETYPE_TIMER, AVBOX_DISPATCH_UNICAST, payload) == NULL) {
-								LOG_VPRINT_ERROR("Could not send notification message: %s",
-									strerror(errno));
-								free(payload);
-							}
-						}
-					}
+			if ((tmr->flags & AVBOX_TIMER_TYPE_AUTORELOAD) &&
+				ret == AVBOX_TIMER_CALLBACK_RESULT_CONTINUE) {
+				/* reload it. If we've fallen behind
+				 * skip the missed ticks */
+				tmr->deadline += tmr->interval;
+				if (tmr->deadline <= now) {
+					tmr->deadline = now + tmr->interval;
 				}
-				if (tmr->flags & AVBOX_TIMER_TYPE_AUTORELOAD) {
-					/* if this is an autoreload timer reload it */
-					if (ret == AVBOX_TIMER_CALLBACK_RESULT_CONTINUE) {
-						tmr->value = tmr->interval;
-						if (timelt(&tmr->value, &sleeptime)) {
-							sleeptime = tmr->interval;
-						}
-					} else {
-						LIST_REMOVE(tmr);
-						free(tmr);
-					}
-				} else {
-					/* remove the timer */
-					LIST_REMOVE(tmr);
-					free(tmr);
-				}
-			} else {
-				/* decrement the timer */
-				tmr->value = timediff(&elapsed, &tmr->value);
-				if (timelt(&tmr->value, &sleeptime)) {
-					sleeptime = tmr->value;
+				if (avbox_timers_schedule(tmr) == 0) {
+					continue;
 				}
+				LOG_VPRINT_ERROR("Could not reload timer %i: %s",
+					tmr->public.id, strerror(errno));
 			}
-		});
 
-		delay2abstime(&sleeptime);
-		last_sleep = now;
-		pthread_cond_timedwait(&timers_signal, &timers_lock, &sleeptime);
+			/* remove the timer */
+			LIST_REMOVE(tmr);
+			free(tmr);
+		}
+
+		avbox_timers_arm();
 	}
 
 	pthread_mutex_unlock(&timers_lock);
@@ -147,7 +379,9 @@ avbox_timers_getnextid(void)
 
 
 /**
- * Cancel a timer.
+ * Cancel a timer. If the timer is firing on another thread
+ * this waits for it's callback to return. Fails with ENOENT
+ * if there's no such timer.
  */
 int
 avbox_timer_cancel(int timer_id)
@@ -159,14 +393,28 @@ avbox_timer_cancel(int timer_id)
 
 	pthread_mutex_lock(&timers_lock);
 
-	LIST_FOREACH_SAFE(struct avbox_timer_state*, tmr, &timers, {
-		if (tmr->public.id == timer_id) {
-			LIST_REMOVE(tmr);
+	if ((tmr = avbox_timers_find(timer_id)) != NULL) {
+		LIST_REMOVE(tmr);
+		if (tmr->firing) {
+			if (pthread_equal(pthread_self(), timers_thread)) {
+				/* cancelled from it's own callback */
+				tmr->cancelled = AVBOX_TIMER_CANCELLED;
+			} else {
+				tmr->cancelled = AVBOX_TIMER_CANCELLED_WAIT;
+				while (tmr->firing) {
+					pthread_cond_wait(&timers_fired, &timers_lock);
+				}
+				free(tmr);
+			}
+		} else {
+			avbox_timers_heapremove(tmr);
+			avbox_timers_arm();
 			free(tmr);
-			ret = 0;
-			break;
 		}
-	});
+		ret = 0;
+	} else {
+		errno = ENOENT;
+	}
 
 	pthread_mutex_unlock(&timers_lock);
 
@@ -174,6 +422,40 @@ avbox_timer_cancel(int timer_id)
 }
 
 
+/**
+ * Set the amount of time that a timer may be delayed
+ * so it can expire together with other timers.
+ */
+int
+avbox_timer_setslack(int timer_id, const struct timespec * const slack)
+{
+	struct avbox_timer_state *tmr;
+	int ret = -1;
+
+	pthread_mutex_lock(&timers_lock);
+	if ((tmr = avbox_timers_find(timer_id)) == NULL) {
+		errno = ENOENT;
+		goto end;
+	}
+
+	tmr->slack = avbox_timers_tons(slack);
+
+	/* if it's waiting to expire reschedule it */
+	if (!tmr->firing) {
+		avbox_timers_heapremove(tmr);
+		if (avbox_timers_schedule(tmr) == -1) {
+			/* this cannot fail since we just made room */
+			abort();
+		}
+		avbox_timers_arm();
+	}
+	ret = 0;
+end:
+	pthread_mutex_unlock(&timers_lock);
+	return ret;
+}
+
+
 /**
  * Register a timer.
  */
@@ -182,6 +464,7 @@ avbox_timer_register(struct timespec *interval,
 	enum avbox_timer_flags flags, struct avbox_object *msgobj, avbox_timer_callback func, void *data)
 {
 	struct avbox_timer_state *timer;
+	int id;
 
 	DEBUG_PRINT("timers", "Registering timer");
 
@@ -191,26 +474,29 @@ avbox_timer_register(struct timespec *interval,
 		return -1;
 	}
 	memset(timer, 0, sizeof(struct avbox_timer_state));
-	timer->interval = *interval;
-	timer->value = *interval;
+	timer->interval = avbox_timers_tons(interval);
+	timer->deadline = avbox_timers_now() + timer->interval;
 	timer->message_object = msgobj;
 	timer->callback = func;
 	timer->public.data = data;
 	timer->flags = flags;
 
 	DEBUG_VPRINT("timers", "Adding timer (%lis%linsecs)",
-		timer->value.tv_sec, timer->value.tv_nsec);
+		interval->tv_sec, interval->tv_nsec);
 
-	/* add entry to list */
+	/* add entry to the heap and hash table */
 	pthread_mutex_lock(&timers_lock);
-	timer->public.id = avbox_timers_getnextid();
-	LIST_ADD(&timers, timer);
+	if (avbox_timers_schedule(timer) == -1) {
+		pthread_mutex_unlock(&timers_lock);
+		free(timer);
+		return -1;
+	}
+	id = timer->public.id = avbox_timers_getnextid();
+	LIST_ADD(&timers[id % AVBOX_TIMERS_BUCKETS], timer);
+	avbox_timers_arm();
 	pthread_mutex_unlock(&timers_lock);
 
-	/* wake the timers thread */
-	pthread_cond_signal(&timers_signal);
-
-	return timer->public.id;
+	return id;
 }
 
 
@@ -220,12 +506,27 @@ avbox_timer_register(struct timespec *interval,
 int
 avbox_timers_init(void)
 {
+	int i;
+
 	DEBUG_PRINT("timers", "Initializing timers system");
 
-	LIST_INIT(&timers);
+	for (i = 0; i < AVBOX_TIMERS_BUCKETS; i++) {
+		LIST_INIT(&timers[i]);
+	}
+
+	if ((timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1) {
+		LOG_VPRINT_ERROR("Could not create timerfd: %s",
+			strerror(errno));
+		return -1;
+	}
+
+	quit = 0;
+	armed = 0;
 
 	if (pthread_create(&timers_thread, NULL, avbox_timers_thread, NULL) != 0) {
 		fprintf(stderr, "timers: Could not start thread\n");
+		close(timerfd);
+		timerfd = -1;
 		return -1;
 	}
 
@@ -239,17 +540,34 @@ avbox_timers_init(void)
 void
 avbox_timers_shutdown(void)
 {
+	int i;
 	struct avbox_timer_state *tmr;
+	struct itimerspec its;
 
 	DEBUG_PRINT("timers", "Shutting down timers system");
 
+	/* set the quit flag and make the timerfd
+	 * fire right away */
+	pthread_mutex_lock(&timers_lock);
 	quit = 1;
-	pthread_cond_signal(&timers_signal);
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_nsec = 1;
+	(void) timerfd_settime(timerfd, 0, &its, NULL);
+	pthread_mutex_unlock(&timers_lock);
+
 	pthread_join(timers_thread, NULL);
 
-	LIST_FOREACH_SAFE(struct avbox_timer_state*, tmr, &timers, {
-		LIST_REMOVE(tmr);
-		free(tmr);
-	});
-}
+	for (i = 0; i < AVBOX_TIMERS_BUCKETS; i++) {
+		LIST_FOREACH_SAFE(struct avbox_timer_state*, tmr, &timers[i], {
+			LIST_REMOVE(tmr);
+			free(tmr);
+		});
+	}
 
+	free(heap);
+	heap = NULL;
+	heap_len = heap_sz = 0;
+
+	close(timerfd);
+	timerfd = -1;
+}
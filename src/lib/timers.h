@@ -66,6 +66,15 @@ avbox_timer_register(struct timespec *interval,
 	enum avbox_timer_flags flags, struct avbox_object *obj, avbox_timer_callback func, void *data);
 
 
+/**
+ * Set the amount of time that a timer may be delayed
+ * so it can expire together with other timers. Timers with
+ * the same slack expire together.
+ */
+int
+avbox_timer_setslack(int timer_id, const struct timespec * const slack);
+
+
 /**
  * Initialize the timers system.
  */
@@ -35,6 +35,11 @@ LISTABLE_STRUCT(avbox_listitem,
 
 /**
  * Structure used to represent an instance of the menu widget.
+ *
+ * When a data source is set the listview is virtual. It keeps no
+ * items, only the row that is selected and the first row in view.
+ * The text of the rows is fetched from the data source when they're
+ * painted.
  */
 struct avbox_listview
 {
@@ -50,10 +55,130 @@ struct avbox_listview
 	void *selection_changed_callback;
 	void *eol_callback_context;
 	avbox_listview_eol_fn end_of_list_callback;
+	avbox_listview_datasource_fn datasource;
+	void *datasource_context;
+	int selected_row;
+	int *window_dirty;
 	LIST_DECLARE(items);
 };
 
 
+/**
+ * Gets the index of a preallocated window.
+ */
+static int
+avbox_listview_windowindex(struct avbox_listview * const inst,
+	struct avbox_window * const window)
+{
+	int i;
+	for (i = 0; i < inst->visible_items; i++) {
+		if (inst->item_windows[i] == window) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/**
+ * Mark the rows in the range [start, end) to be repainted
+ * if they're in view.
+ */
+static void
+avbox_listview_invalidaterows(struct avbox_listview * const inst,
+	int start, int end)
+{
+	start -= inst->visible_window_offset;
+	end -= inst->visible_window_offset;
+	if (start < 0) {
+		start = 0;
+	}
+	if (end > inst->visible_items) {
+		end = inst->visible_items;
+	}
+	for (; start < end; start++) {
+		inst->window_dirty[start] = 1;
+	}
+}
+
+
+/**
+ * Mark all the rows in view to be repainted.
+ */
+static void
+avbox_listview_invalidateall(struct avbox_listview * const inst)
+{
+	int i;
+	for (i = 0; i < inst->visible_items; i++) {
+		inst->window_dirty[i] = 1;
+	}
+}
+
+
+/**
+ * Paints a row of a virtual listview.
+ */
+static int
+avbox_listview_paintrow(struct avbox_listview * const inst,
+	struct avbox_window * const window)
+{
+	const int i = avbox_listview_windowindex(inst, window);
+	const int row = inst->visible_window_offset + i;
+	struct avbox_rect rect;
+	char text[256];
+	void *data;
+
+	if (i == -1 || !inst->window_dirty[i]) {
+		return 0;
+	}
+
+	rect.x = 0;
+	rect.y = 0;
+	avbox_window_getcanvassize(window, &rect.w, &rect.h);
+	avbox_window_setbgcolor(window, MBV_DEFAULT_BACKGROUND);
+	avbox_window_clear(window);
+	inst->window_dirty[i] = 0;
+
+	if (row >= inst->count || inst->datasource(row, text,
+		sizeof(text), &data, inst->datasource_context) == -1) {
+		return 1;
+	}
+
+	if (inst->selected_row == row) {
+		avbox_window_setbgcolor(window, AVBOX_COLOR(0xffffffff));
+		avbox_window_roundrectangle(window, &rect, 0, 2);
+		avbox_window_setcolor(window, AVBOX_COLOR(0x000000ff));
+	} else {
+		avbox_window_setcolor(window, MBV_DEFAULT_FOREGROUND);
+	}
+	avbox_window_drawstring(window, text, rect.w / 2, 5);
+	return 1;
+}
+
+
+/**
+ * Select a row of a virtual listview, scrolling if it's
+ * not in view.
+ */
+static void
+avbox_listview_selectrow(struct avbox_listview * const inst, const int row)
+{
+	if (inst->selected_row >= 0) {
+		avbox_listview_invalidaterows(inst, inst->selected_row,
+			inst->selected_row + 1);
+	}
+	inst->selected_row = row;
+	if (row < inst->visible_window_offset) {
+		inst->visible_window_offset = row;
+		avbox_listview_invalidateall(inst);
+	} else if (row >= inst->visible_window_offset + inst->visible_items) {
+		inst->visible_window_offset = row - inst->visible_items + 1;
+		avbox_listview_invalidateall(inst);
+	}
+	avbox_listview_invalidaterows(inst, row, row + 1);
+}
+
+
 /**
  * Gets the menuitem instance that corresponds to
  * a window
@@ -85,6 +210,10 @@ avbox_listitem_paint(struct avbox_window * const window)
 
 	assert(inst != NULL);
 
+	if (inst->datasource != NULL) {
+		return avbox_listview_paintrow(inst, window);
+	}
+
 	if (item == NULL || !item->dirty) {
 		/* const int dirty = (item != NULL) ? item->dirty : 0;
 		DEBUG_VPRINT("ui-menu", "Not painting clean window (item=0x%p dirty=%i)!",
@@ -158,6 +287,7 @@ avbox_listview_setitemtext(struct avbox_listview *inst, void *item, char *text)
 	assert(inst != NULL);
 	assert(item != NULL);
 	assert(text != NULL);
+	assert(inst->datasource == NULL);
 
 	LIST_FOREACH(struct avbox_listitem*, menuitem, &inst->items) {
 		if (menuitem->data == item) {
@@ -197,6 +327,16 @@ avbox_listview_getselected(struct avbox_listview *inst)
 {
 	assert(inst != NULL);
 
+	if (inst->datasource != NULL) {
+		char text[1];
+		void *data;
+		if (inst->selected_row < 0 || inst->datasource(inst->selected_row,
+			text, sizeof(text), &data, inst->datasource_context) == -1) {
+			return NULL;
+		}
+		return data;
+	}
+
 	if (inst->selected == NULL) {
 		return (void*) NULL;
 	} else {
@@ -249,22 +389,23 @@ avbox_listview_additem(struct avbox_listview *inst, char *name, void *data)
 	assert(inst != NULL);
 	assert(name != NULL);
 
+	if (inst->datasource != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
 	item = malloc(sizeof(struct avbox_listitem));
 	if (item == NULL) {
 		fprintf(stderr, "avbox_listview: Add item failed: Out of memory\n");
 		return -1;
 	}
 
-	if (inst->count < inst->visible_items) {
+	if (!inst->dirty && inst->count - inst->visible_window_offset < inst->visible_items) {
 		/* grab a preallocated subwindow */
-		item->window = inst->item_windows[inst->count];
+		item->window = inst->item_windows[inst->count - inst->visible_window_offset];
 		assert(item->window != NULL);
-
-		/* if there's no selected item make this one it */
-		if (inst->selected == NULL) {
-			inst->selected = item;
-		}
 	} else {
+		/* it will be laid out by avbox_listview_update() */
 		item->window = NULL;
 	}
 
@@ -280,6 +421,11 @@ avbox_listview_additem(struct avbox_listview *inst, char *name, void *data)
 
 	LIST_APPEND(&inst->items, item);
 
+	/* if there's no selected item make this one it */
+	if (inst->selected == NULL) {
+		inst->selected = item;
+	}
+
 	inst->count++;
 
 	return 0;
@@ -289,32 +435,35 @@ avbox_listview_additem(struct avbox_listview *inst, char *name, void *data)
 void
 avbox_listview_removeitem(struct avbox_listview *inst, void *item)
 {
-	int next = 0;
-	struct avbox_listitem *menuitem, *prev = NULL;
-	LIST_FOREACH_SAFE(struct avbox_listitem*, menuitem, &inst->items, {
+	struct avbox_listitem *menuitem;
+	LIST_FOREACH(struct avbox_listitem*, menuitem, &inst->items) {
 		if (menuitem->data == item) {
-			LIST_REMOVE(menuitem);
-			if (menuitem->window != NULL) {
-				avbox_window_setbgcolor(menuitem->window, MBV_DEFAULT_BACKGROUND);
-				avbox_window_clear(menuitem->window);
-			}
-			free(menuitem->name);
-			free(menuitem);
-			inst->count--;
-			if (inst->selected == item) {
-				if (prev != NULL) {
-					inst->selected = prev->data;
+			/* move the selection to the previous item or
+			 * the next one if it's the first */
+			if (inst->selected == menuitem) {
+				if (!LIST_ISNULL(&inst->items, LIST_PREV(struct avbox_listitem*, menuitem))) {
+					inst->selected = LIST_PREV(struct avbox_listitem*, menuitem);
+				} else if (!LIST_ISNULL(&inst->items, LIST_NEXT(struct avbox_listitem*, menuitem))) {
+					inst->selected = LIST_NEXT(struct avbox_listitem*, menuitem);
 				} else {
 					inst->selected = NULL;
-					next = 1;
+				}
+				if (inst->selected != NULL) {
+					inst->selected->dirty = 1;
 				}
 			}
-		} else if (next) {
-			inst->selected = menuitem->data;
+
+			/* the rows bellow need to move up so mark
+			 * the layout as dirty */
+			inst->dirty = 1;
+
+			LIST_REMOVE(menuitem);
+			free(menuitem->name);
+			free(menuitem);
+			inst->count--;
 			break;
 		}
-		prev = menuitem;
-	});
+	}
 }
 
 
@@ -322,6 +471,12 @@ void
 avbox_listview_clearitems(struct avbox_listview * const inst)
 {
 	struct avbox_listitem* item;
+
+	if (inst->datasource != NULL) {
+		avbox_listview_setcount(inst, 0);
+		return;
+	}
+
 	LIST_FOREACH_SAFE(struct avbox_listitem*, item, &inst->items, {
 		LIST_REMOVE(item);
 		if (item->window != NULL) {
@@ -333,6 +488,87 @@ avbox_listview_clearitems(struct avbox_listview * const inst)
 	});
 	inst->count = 0;
 	inst->selected = NULL;
+	inst->visible_window_offset = 0;
+	inst->dirty = 0;
+}
+
+
+/**
+ * Lay out the items after a batch of changes and repaint
+ * only the rows that changed.
+ */
+void
+avbox_listview_update(struct avbox_listview * const inst)
+{
+	int i, j;
+	struct avbox_listitem *item;
+
+	ASSERT(inst != NULL);
+
+	if (inst->datasource != NULL) {
+		/* don't leave empty rows at the bottom
+		 * if we can scroll back */
+		if (inst->visible_window_offset > 0 &&
+			inst->count - inst->visible_window_offset < inst->visible_items) {
+			inst->visible_window_offset = inst->count - inst->visible_items;
+			if (inst->visible_window_offset < 0) {
+				inst->visible_window_offset = 0;
+			}
+			avbox_listview_invalidateall(inst);
+		}
+		for (i = 0; i < inst->visible_items; i++) {
+			if (inst->window_dirty[i]) {
+				avbox_window_update(inst->item_windows[i]);
+			}
+		}
+		return;
+	}
+
+	if (inst->dirty) {
+		/* keep the selected item in view */
+		if (inst->selected != NULL) {
+			i = 0;
+			LIST_FOREACH(struct avbox_listitem*, item, &inst->items) {
+				if (item == inst->selected) {
+					break;
+				}
+				i++;
+			}
+			if (i < inst->visible_window_offset) {
+				inst->visible_window_offset = i;
+			} else if (i >= inst->visible_window_offset + inst->visible_items) {
+				inst->visible_window_offset = i - inst->visible_items + 1;
+			}
+		}
+
+		/* don't leave empty rows at the bottom
+		 * if we can scroll back */
+		if (inst->visible_window_offset > 0 &&
+			inst->count - inst->visible_window_offset < inst->visible_items) {
+			inst->visible_window_offset = inst->count - inst->visible_items;
+			if (inst->visible_window_offset < 0) {
+				inst->visible_window_offset = 0;
+			}
+		}
+
+		avbox_listview_scrollitems(inst, MB_UI_DIRECTION_NONE);
+
+		/* clear the rows that are no longer used */
+		j = inst->count - inst->visible_window_offset;
+		for (j = (j < 0) ? 0 : j; j < inst->visible_items; j++) {
+			avbox_window_setbgcolor(inst->item_windows[j], MBV_DEFAULT_BACKGROUND);
+			avbox_window_clear(inst->item_windows[j]);
+			avbox_window_update(inst->item_windows[j]);
+		}
+		inst->dirty = 0;
+	}
+
+	/* repaint the rows that changed */
+	LIST_FOREACH(struct avbox_listitem*, item, &inst->items) {
+		if (item->window != NULL && item->dirty) {
+			avbox_window_update(item->window);
+		}
+	}
 }
 
 
@@ -411,6 +647,13 @@ avbox_listview_messagehandler(void *context, struct avbox_message *msg)
 		case MBI_EVENT_ARROW_UP:
 		{
 			struct avbox_listitem *item, *prev = NULL, *selected = NULL;
+			if (inst->datasource != NULL) {
+				if (inst->selected_row > 0) {
+					avbox_listview_selectrow(inst, inst->selected_row - 1);
+					avbox_window_update(inst->window);
+				}
+				break;
+			}
 			LIST_FOREACH(struct avbox_listitem*, item, &inst->items) {
 				if (inst->selected == item) {
 					selected = prev;
@@ -432,6 +675,17 @@ avbox_listview_messagehandler(void *context, struct avbox_message *msg)
 			struct avbox_listitem *item, *selected;
 			int select_next;
 start:
+			if (inst->datasource != NULL) {
+				if (inst->selected_row + 1 < inst->count) {
+					avbox_listview_selectrow(inst, inst->selected_row + 1);
+					avbox_window_update(inst->window);
+				} else if (inst->end_of_list_callback != NULL &&
+					inst->end_of_list_callback(inst, inst->eol_callback_context) == 0 &&
+					inst->selected_row + 1 < inst->count) {
+					goto start;
+				}
+				break;
+			}
 			selected = NULL;
 			select_next = 0;
 			LIST_FOREACH(struct avbox_listitem*, item, &inst->items) {
@@ -482,6 +736,7 @@ start:
 	}
 	case AVBOX_MESSAGETYPE_CLEANUP:
 		DEBUG_VPRINT("ui-menu", "Cleaning up listview %p", inst);
+		free(inst->window_dirty);
 		free(inst->item_windows);
 		free(inst);
 		break;
@@ -528,6 +783,10 @@ avbox_listview_new(struct avbox_window *window, struct avbox_object *notify_obje
 	inst->selection_changed_callback = NULL;
 	inst->end_of_list_callback = NULL;
 	inst->count = 0;
+	inst->dirty = 0;
+	inst->datasource = NULL;
+	inst->datasource_context = NULL;
+	inst->selected_row = -1;
 
 	/* calculate item height */
 	int itemheight = mbv_getdefaultfontheight();
@@ -545,8 +804,11 @@ avbox_listview_new(struct avbox_window *window, struct avbox_object *notify_obje
 	 * window objects for each visible item */
 	inst->item_windows = malloc(sizeof(struct avbox_window*) *
 		inst->visible_items);
-	if (inst->item_windows == NULL) {
+	inst->window_dirty = calloc(inst->visible_items + 1, sizeof(int));
+	if (inst->item_windows == NULL || inst->window_dirty == NULL) {
 		fprintf(stderr, "avbox_listview: Out of memory\n");
+		free(inst->item_windows);
+		free(inst->window_dirty);
 		free(inst);
 		return NULL;
 	}
@@ -569,6 +831,7 @@ avbox_listview_new(struct avbox_window *window, struct avbox_object *notify_obje
 			for (j = 0; j < i; j++) {
 				avbox_window_destroy(inst->item_windows[j]);
 			}
+			free(inst->window_dirty);
 			free(inst->item_windows);
 			free(inst);
 			inst = NULL;
@@ -596,6 +859,85 @@ avbox_listview_seteolcallback(struct avbox_listview *inst, avbox_listview_eol_fn
 }
 
 
+/**
+ * Make the listview virtual.
+ */
+int
+avbox_listview_setdatasource(struct avbox_listview * const inst,
+	avbox_listview_datasource_fn datasource, void *context)
+{
+	assert(inst != NULL);
+	assert(datasource != NULL);
+
+	if (inst->count > 0) {
+		errno = EBUSY;
+		return -1;
+	}
+	inst->datasource = datasource;
+	inst->datasource_context = context;
+	inst->selected_row = -1;
+	return 0;
+}
+
+
+/**
+ * Set the number of rows of a virtual listview.
+ */
+void
+avbox_listview_setcount(struct avbox_listview * const inst, const int count)
+{
+	assert(inst != NULL);
+	assert(inst->datasource != NULL);
+
+	if (count == inst->count) {
+		return;
+	}
+
+	/* repaint the rows that were added or removed */
+	if (count < inst->count) {
+		avbox_listview_invalidaterows(inst, count, inst->count);
+	} else {
+		avbox_listview_invalidaterows(inst, inst->count, count);
+	}
+	inst->count = count;
+
+	if (count == 0) {
+		inst->selected_row = -1;
+		inst->visible_window_offset = 0;
+		avbox_listview_invalidateall(inst);
+	} else if (inst->selected_row == -1) {
+		avbox_listview_selectrow(inst, 0);
+	} else if (inst->selected_row >= count) {
+		avbox_listview_selectrow(inst, count - 1);
+	}
+}
+
+
+/**
+ * Mark rows of a virtual listview to be repainted.
+ */
+void
+avbox_listview_invalidate(struct avbox_listview * const inst,
+	const int first, const int n)
+{
+	assert(inst != NULL);
+	assert(inst->datasource != NULL);
+	assert(first >= 0 && n >= 0);
+	avbox_listview_invalidaterows(inst, first, first + n);
+}
+
+
+/**
+ * Gets the selected row of a virtual listview.
+ */
+int
+avbox_listview_getselectedrow(struct avbox_listview * const inst)
+{
+	assert(inst != NULL);
+	return inst->selected_row;
+}
+
+
 /**
  * Destroy an instance of the menu widget.
  */
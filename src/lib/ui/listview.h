@@ -16,6 +16,15 @@ typedef int (*avbox_listview_enumitems_fn)(void *item, void *data);
 typedef int (*avbox_listview_eol_fn)(struct avbox_listview *inst, void * context);
 
 
+/**
+ * Data source of a virtual listview. Copies the text of a row
+ * to text and returns the row's data through data. Returns -1
+ * if the row cannot be fetched.
+ */
+typedef int (*avbox_listview_datasource_fn)(int row, char *text,
+	size_t n, void **data, void *context);
+
+
 /**
  * Release focus
  */
@@ -47,6 +56,14 @@ void
 avbox_listview_clearitems(struct avbox_listview *inst);
 
 
+/**
+ * Lay out the items after a batch of changes and repaint
+ * only the rows that changed.
+ */
+void
+avbox_listview_update(struct avbox_listview * const inst);
+
+
 int
 avbox_listview_additem(struct avbox_listview *inst, char *name, void *data);
 
@@ -54,6 +71,49 @@ int
 avbox_listview_focus(struct avbox_listview *inst);
 
 
+/**
+ * Make an empty listview virtual. A virtual listview holds no
+ * items. Only the rows in view are fetched from the data source
+ * when they're painted, so the cost of scrolling and the memory
+ * used don't depend on the length of the list. The owner tells
+ * the listview how many rows there are with
+ * avbox_listview_setcount() and repaints them with
+ * avbox_listview_update(). avbox_listview_clearitems() sets the
+ * count to zero and the item functions may not be used.
+ */
+int
+avbox_listview_setdatasource(struct avbox_listview * const inst,
+	avbox_listview_datasource_fn datasource, void *context);
+
+
+/**
+ * Set the number of rows of a virtual listview. Only the rows
+ * that were added or removed are repainted. Use
+ * avbox_listview_invalidate() for rows that changed.
+ */
+void
+avbox_listview_setcount(struct avbox_listview * const inst, const int count);
+
+
+/**
+ * Mark n rows of a virtual listview starting at first to be
+ * fetched again from the data source on the next
+ * avbox_listview_update().
+ */
+void
+avbox_listview_invalidate(struct avbox_listview * const inst,
+	const int first, const int n);
+
+
+/**
+ * Gets the index of the selected row of a virtual listview
+ * or -1 if it's empty.
+ */
+int
+avbox_listview_getselectedrow(struct avbox_listview * const inst);
+
+
+
 struct avbox_listview*
 avbox_listview_new(struct avbox_window *window,
 	struct avbox_object *notify_object);
@@ -20,6 +20,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <time.h>
 #include <sys/time.h>
@@ -56,6 +57,10 @@
 #include "../dispatch.h"
 #include "../application.h"
 #include "../math_util.h"
+#include "../thread.h"
+#include "../realtime.h"
+#include "../cgroup.h"
+#include "../partfile.h"
 
 
 /*
@@ -71,9 +76,16 @@
 
 /* This is the # of frames to decode ahead of time */
 #define MB_VIDEO_BUFFER_FRAMES  (40)
+#define MB_PARTFILE_BUFSIZE	(32 * 1024)
+#define MB_PARTFILE_READAHEAD	(1024 * 1024)
+#define MB_PARTFILE_POLL	(250)		/* msecs */
+#define MB_PARTFILE_TIMEOUT	(60 * 1000)	/* msecs */
 #define MB_VIDEO_BUFFER_PACKETS (1)
 #define MB_AUDIO_BUFFER_PACKETS (1)
 
+/* The # of horizontal bands each frame is scaled in */
+#define AVBOX_PLAYER_SCALE_BANDS (4)
+
 #define ALIGNED(addr, bytes) \
     (((uintptr_t)(const void *)(addr)) % (bytes) == 0)
 
@@ -97,6 +109,32 @@ LISTABLE_STRUCT(avbox_player_subscriber,
 );
 
 
+/**
+ * A horizontal band of the video that is scaled
+ * independently of the others.
+ */
+struct avbox_player_scaleband
+{
+	struct SwsContext *ctx;
+	int src_y;
+	int src_h;
+	int dst_y;
+};
+
+
+/**
+ * The arguments for scaling a frame.
+ */
+struct avbox_player_scalejob
+{
+	struct avbox_player_scaleband *bands;
+	const uint8_t *src;
+	int src_stride;
+	uint8_t *dst;
+	int dst_stride;
+};
+
+
 /**
  * Player structure.
  */
@@ -109,13 +147,15 @@ struct avbox_player
 	struct avbox_queue *audio_packets_q;
 	struct avbox_queue *video_frames_q;
 	struct avbox_audiostream *audio_stream;
-	struct SwsContext *swscale_ctx;
+	struct avbox_player_scaleband scale_bands[AVBOX_PLAYER_SCALE_BANDS];
+	int n_scale_bands;
 	struct avbox_rational aspect_ratio;
 	struct avbox_size video_size;
 	struct timespec systemreftime;
 	enum avbox_player_status status;
 
 	AVFormatContext *fmt_ctx;
+	AVIOContext *avio;
 	AVCodecContext *audio_codec_ctx;
 	AVCodecContext *video_codec_ctx;
 
@@ -148,6 +188,9 @@ struct avbox_player
 	int64_t systemtimeoffset;
 	int64_t (*getmastertime)(struct avbox_player *inst);
 	int64_t video_renderer_pts;
+	int64_t partfile_pos;
+	int partfile_fd;
+	struct avbox_partfile *partfile;
 	pthread_t video_decoder_thread;
 	pthread_t video_output_thread;
 	pthread_t audio_decoder_thread;
@@ -264,6 +307,22 @@ avbox_player_subscribers(struct avbox_player * const inst)
 }
 
 
+/**
+ * Merge a status notification with one that is still
+ * pending. The subscriber only needs to see the transition from
+ * the oldest status to the newest one.
+ */
+static void *
+avbox_player_coalescestatus(void *pending, void *payload)
+{
+	struct avbox_player_status_data * const old = pending;
+	struct avbox_player_status_data * const data = payload;
+	data->last_status = old->last_status;
+	free(old);
+	return data;
+}
+
+
 /**
  * Send a message to all subscribers.
  */
@@ -284,8 +343,8 @@ avbox_player_sendmsg(struct avbox_player * const inst,
 	data->sender = inst;
 	data->status = status;
 	data->last_status = last_status;
-	if (avbox_object_sendmsg(subscribers, AVBOX_MESSAGETYPE_PLAYER,
-		AVBOX_DISPATCH_ANYCAST, data) == NULL) {
+	if (avbox_object_coalescemsg(subscribers, AVBOX_MESSAGETYPE_PLAYER,
+		AVBOX_DISPATCH_ANYCAST, 0, data, avbox_player_coalescestatus) == NULL) {
 		LOG_VPRINT_ERROR("Could not send status notification: %s",
 			strerror(errno));
 		free(subscribers);
@@ -297,6 +356,10 @@ avbox_player_sendmsg(struct avbox_player * const inst,
 }
 
 
+#define AVBOX_PLAYER_ACTIVE(status) \
+	((status) == MB_PLAYER_STATUS_PLAYING || (status) == MB_PLAYER_STATUS_BUFFERING)
+
+
 /**
  * Updates the player status and
  * calls any registered callbacks
@@ -311,6 +374,16 @@ avbox_player_updatestatus(struct avbox_player *inst, enum avbox_player_status st
 	last_status = inst->status;
 	inst->status = status;
 
+	/* pause idle work and freeze helpers while
+	 * we're playing or buffering */
+	if (AVBOX_PLAYER_ACTIVE(status) && !AVBOX_PLAYER_ACTIVE(last_status)) {
+		avbox_thread_pause();
+		avbox_cgroup_pause();
+	} else if (!AVBOX_PLAYER_ACTIVE(status) && AVBOX_PLAYER_ACTIVE(last_status)) {
+		avbox_cgroup_resume();
+		avbox_thread_resume();
+	}
+
 	/* send status notification */
 	if (avbox_player_sendmsg(inst, status, last_status) == -1) {
 		LOG_VPRINT_ERROR("Could not send notification: %s",
@@ -463,6 +536,93 @@ avbox_player_getsystemtime(struct avbox_player *inst)
 }
 
 
+/**
+ * Scale the bands [start, end) of a frame.
+ */
+static void
+avbox_player_scalebands(void *arg, int start, int end)
+{
+	int i;
+	struct avbox_player_scalejob * const job = arg;
+
+	for (i = start; i < end; i++) {
+		struct avbox_player_scaleband * const band = &job->bands[i];
+		const uint8_t *src = job->src + band->src_y * job->src_stride;
+		uint8_t *dst = job->dst + band->dst_y * job->dst_stride;
+		sws_scale(band->ctx, &src, &job->src_stride, 0,
+			band->src_h, &dst, &job->dst_stride);
+	}
+}
+
+
+/**
+ * Free the software scaler bands.
+ */
+static void
+avbox_player_freescaler(struct avbox_player * const inst)
+{
+	int i;
+	for (i = 0; i < inst->n_scale_bands; i++) {
+		sws_freeContext(inst->scale_bands[i].ctx);
+		inst->scale_bands[i].ctx = NULL;
+	}
+	inst->n_scale_bands = 0;
+}
+
+
+/**
+ * Initialize the software scaler. The frame is split in
+ * horizontal bands, each with its own context, so that
+ * they can be scaled in parallel.
+ */
+static int
+avbox_player_initscaler(struct avbox_player * const inst)
+{
+	int i, n;
+	const int src_w = inst->video_codec_ctx->width;
+	const int src_h = inst->video_codec_ctx->height;
+	const int dst_h = inst->video_size.h;
+
+	ASSERT(inst->n_scale_bands == 0);
+
+	n = AVBOX_PLAYER_SCALE_BANDS;
+	if (n > src_h) {
+		n = src_h;
+	}
+	if (n > dst_h) {
+		n = dst_h;
+	}
+	if (n < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct avbox_player_scaleband * const band = &inst->scale_bands[i];
+		const int dst_y = (dst_h * i) / n;
+		const int dst_end = (dst_h * (i + 1)) / n;
+		const int src_y = (src_h * i) / n;
+		const int src_end = (src_h * (i + 1)) / n;
+
+		band->src_y = src_y;
+		band->src_h = src_end - src_y;
+		band->dst_y = dst_y;
+
+		if ((band->ctx = sws_getContext(
+			src_w, band->src_h, MB_DECODER_PIX_FMT,
+			inst->video_size.w, dst_end - dst_y, MB_DECODER_PIX_FMT,
+			SWS_FAST_BILINEAR, NULL, NULL, NULL)) == NULL) {
+			avbox_player_freescaler(inst);
+			errno = ENOMEM;
+			return -1;
+		}
+		inst->n_scale_bands++;
+	}
+
+	return 0;
+}
+
+
 /**
  * Update the display from main thread.
  */
@@ -495,7 +655,9 @@ avbox_player_video(void *arg)
 
 	ASSERT(inst != NULL);
 	ASSERT(inst->video_output_quit == 0);
-	ASSERT(inst->swscale_ctx != NULL);
+	ASSERT(inst->n_scale_bands > 0);
+
+	(void) avbox_rt_enter(AVBOX_RT_VIDEO);
 
 	inst->video_playback_running = 1;
 	linesize = av_image_get_linesize(MB_DECODER_PIX_FMT, inst->video_codec_ctx->width, 0);
@@ -555,12 +717,19 @@ avbox_player_video(void *arg)
 		if ((buf = avbox_window_lock(inst->video_window, MBV_LOCKFLAGS_WRITE, &pitch)) == NULL) {
 			LOG_VPRINT_ERROR("Could not lock video window: %s", strerror(errno));
 		} else {
-			ASSERT(inst->swscale_ctx != NULL);
+			struct avbox_player_scalejob job;
+			ASSERT(inst->n_scale_bands > 0);
 			ASSERT(ALIGNED(*frame->data, 16));
 			ASSERT(ALIGNED(buf, 16));
-			buf += pitch * ((inst->height - inst->video_size.h) / 2);
-			sws_scale(inst->swscale_ctx, (uint8_t const * const *) frame->data, &linesize, 0,
-				inst->video_codec_ctx->height, &buf, &pitch);
+			job.bands = inst->scale_bands;
+			job.src = frame->data[0];
+			job.src_stride = linesize;
+			job.dst = buf + pitch * ((inst->height - inst->video_size.h) / 2);
+			job.dst_stride = pitch;
+			if (avbox_thread_parallel_for(0, inst->n_scale_bands, 1,
+				avbox_player_scalebands, &job) == -1) {
+				avbox_player_scalebands(&job, 0, inst->n_scale_bands);
+			}
 			avbox_window_unlock(inst->video_window);
 		}
 
@@ -669,6 +838,8 @@ video_exit:
 	inst->video_renderer_pts = 0;
 	inst->video_flush_output = 0;
 
+	avbox_rt_leave();
+
 	return NULL;
 }
 
@@ -988,7 +1159,7 @@ avbox_player_video_decode(void *arg)
 	ASSERT(inst->video_stream_index == -1);
 	ASSERT(inst->video_decoder_pts == 0);
 	ASSERT(inst->video_codec_ctx == NULL);
-	ASSERT(inst->swscale_ctx == NULL);
+	ASSERT(inst->n_scale_bands == 0);
 	ASSERT(!inst->video_decoder_running);
 
 	/* open the video codec */
@@ -1030,15 +1201,7 @@ avbox_player_video_decode(void *arg)
 	avbox_player_scale2display(inst, &inst->video_size);
 
 	/* initialize the software scaler */
-	if ((inst->swscale_ctx = sws_getContext(
-		inst->video_codec_ctx->width,
-		inst->video_codec_ctx->height,
-		MB_DECODER_PIX_FMT,
-		inst->video_size.w,
-		inst->video_size.h,
-		MB_DECODER_PIX_FMT,
-		SWS_PRINT_INFO | SWS_FAST_BILINEAR,
-		NULL, NULL, NULL)) == NULL) {
+	if (avbox_player_initscaler(inst) == -1) {
 		LOG_PRINT_ERROR("Could not create swscale context!");
 		goto decoder_exit;
 	}
@@ -1215,10 +1378,7 @@ decoder_exit:
 	}
 
 
-	if (inst->swscale_ctx != NULL) {
-		sws_freeContext(inst->swscale_ctx);
-		inst->swscale_ctx = NULL;
-	}
+	avbox_player_freescaler(inst);
 
 	if (inst->video_window != NULL) {
 		avbox_window_destroy(inst->video_window);
@@ -1466,6 +1626,126 @@ end:
 }
 
 
+/**
+ * AVIO read callback for files that are still being
+ * downloaded. It blocks until the data is there and reports
+ * how much of it we have through avbox_player_bufferstate().
+ */
+static int
+avbox_player_partfile_read(void *opaque, uint8_t *buf, int buf_size)
+{
+	struct avbox_player * const inst = opaque;
+	int64_t avail;
+	int percent = 0, last_percent = -1, waited = 0;
+	ssize_t ret;
+
+	/* wait for a bit more than we need so we don't
+	 * stall again right away */
+	while (1) {
+		if (inst->stream_quit) {
+			return AVERROR_EXIT;
+		}
+		if ((avail = avbox_partfile_wait(inst->partfile, inst->partfile_pos,
+			MB_PARTFILE_READAHEAD, MB_PARTFILE_POLL, &percent)) == 0) {
+			return AVERROR_EOF;
+		} else if (avail > 0) {
+			break;
+		} else if (errno != ETIMEDOUT) {
+			LOG_VPRINT_ERROR("Download of '%s' failed", inst->media_file);
+			return AVERROR(EIO);
+		}
+		if ((waited += MB_PARTFILE_POLL) >= MB_PARTFILE_TIMEOUT) {
+			LOG_VPRINT_ERROR("Download of '%s' stalled at %" PRIi64,
+				inst->media_file, inst->partfile_pos);
+			return AVERROR(ETIMEDOUT);
+		}
+		if (percent != last_percent) {
+			inst->stream_percent = last_percent = percent;
+			if (inst->status == MB_PLAYER_STATUS_BUFFERING) {
+				avbox_player_updatestatus(inst, MB_PLAYER_STATUS_BUFFERING);
+			}
+		}
+	}
+
+	if (avail < buf_size) {
+		buf_size = avail;
+	}
+	while ((ret = pread(inst->partfile_fd, buf, buf_size, inst->partfile_pos)) == -1 &&
+		errno == EINTR);
+	if (ret == -1) {
+		return AVERROR(errno);
+	} else if (ret == 0) {
+		return AVERROR_EOF;
+	}
+	inst->partfile_pos += ret;
+	return ret;
+}
+
+
+/**
+ * AVIO seek callback for files that are still being
+ * downloaded. This never blocks, the next read does.
+ */
+static int64_t
+avbox_player_partfile_seek(void *opaque, int64_t offset, int whence)
+{
+	struct avbox_player * const inst = opaque;
+
+	switch (whence & ~AVSEEK_FORCE) {
+	case AVSEEK_SIZE: return avbox_partfile_size(inst->partfile);
+	case SEEK_SET: break;
+	case SEEK_CUR: offset += inst->partfile_pos; break;
+	case SEEK_END: offset += avbox_partfile_size(inst->partfile); break;
+	default: return AVERROR(EINVAL);
+	}
+	if (offset < 0) {
+		return AVERROR(EINVAL);
+	}
+	return inst->partfile_pos = offset;
+}
+
+
+/**
+ * If the file is being downloaded open it through
+ * our own AVIO context.
+ */
+static int
+avbox_player_openpartfile(struct avbox_player * const inst)
+{
+	uint8_t *buf;
+
+	inst->partfile_fd = -1;
+	inst->partfile_pos = 0;
+
+	if ((inst->partfile = avbox_partfile_get(inst->media_file)) == NULL) {
+		return 0;
+	}
+
+	DEBUG_VPRINT("player", "'%s' is still downloading",
+		inst->media_file);
+
+	if ((inst->partfile_fd = avbox_partfile_open(inst->partfile)) == -1) {
+		LOG_VPRINT_ERROR("Could not open '%s': %s",
+			inst->media_file, strerror(errno));
+		return -1;
+	}
+	if ((buf = av_malloc(MB_PARTFILE_BUFSIZE)) == NULL) {
+		return -1;
+	}
+	if ((inst->avio = avio_alloc_context(buf, MB_PARTFILE_BUFSIZE, 0, inst,
+		avbox_player_partfile_read, NULL, avbox_player_partfile_seek)) == NULL) {
+		av_free(buf);
+		return -1;
+	}
+	if ((inst->fmt_ctx = avformat_alloc_context()) == NULL) {
+		return -1;
+	}
+	inst->fmt_ctx->pb = inst->avio;
+	inst->fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+	return 0;
+}
+
+
 /**
  * This is the main decoding loop. It reads the stream and feeds
  * encoded frames to the decoder threads.
@@ -1514,6 +1794,11 @@ avbox_player_stream_parse(void *arg)
 		inst->width, inst->height, inst->media_file);
 
 	/* open file */
+	if (avbox_player_openpartfile(inst) == -1) {
+		LOG_VPRINT_ERROR("Could not open stream '%s'",
+			inst->media_file);
+		goto decoder_exit;
+	}
 	av_dict_set(&stream_opts, "timeout", "30000000", 0);
 	if (avformat_open_input(&inst->fmt_ctx, inst->media_file, NULL, &stream_opts) != 0) {
 		LOG_VPRINT_ERROR("Could not open stream '%s'",
@@ -1858,6 +2143,18 @@ decoder_exit:
 		avformat_close_input(&inst->fmt_ctx);
 		inst->fmt_ctx = NULL;
 	}
+	if (inst->avio != NULL) {
+		av_freep(&inst->avio->buffer);
+		av_freep(&inst->avio);
+	}
+	if (inst->partfile_fd != -1) {
+		close(inst->partfile_fd);
+		inst->partfile_fd = -1;
+	}
+	if (inst->partfile != NULL) {
+		avbox_partfile_unref(inst->partfile);
+		inst->partfile = NULL;
+	}
 
 	if (stream_opts != NULL) {
 		av_dict_free(&stream_opts);
@@ -2494,6 +2791,7 @@ avbox_player_new(struct avbox_window *window)
 	inst->audio_packets_q = NULL;
 	inst->video_packets_q = NULL;
 	inst->video_frames_q = NULL;
+	inst->partfile_fd = -1;
 	inst->video_stream_index = -1;
 	inst->status = MB_PLAYER_STATUS_READY;
 	inst->video_decoder_running = 0;
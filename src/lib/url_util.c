@@ -1,16 +1,40 @@
 /**
  * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
  * This file is part of mediabox.
+ *
+ * URL fetching. We keep a curl share with the DNS and TLS session
+ * caches and a pool of easy handles. Each handle keeps it's own
+ * connections so requests to the same server reuse them. For the
+ * same reason mb_url_fetchmany() takes it's multi handle from a
+ * pool, since the connections of a multi transfer belong to it.
  */
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <curl/curl.h>
 #include <ctype.h>
 
+#define LOG_MODULE "url"
+
+#include "log.h"
+#include "debug.h"
+#include "dispatch.h"
+#include "thread.h"
+#include "url_util.h"
+
+
+#define MB_URL_POOL_SIZE	(8)
+#define MB_URL_MULTI_POOL_SIZE	(4)
+
+
 struct MemoryStruct
 {
 	char *memory;
@@ -19,6 +43,42 @@ struct MemoryStruct
 };
 
 
+/**
+ * An asynchronous fetch.
+ */
+struct mb_url_request
+{
+	char *url;
+	mb_url_callback callback;
+	void *context;
+	void *data;
+	size_t size;
+	int result;
+	int error;
+};
+
+
+/**
+ * A transfer started by mb_url_fetchmany().
+ */
+struct mb_url_transfer
+{
+	CURL *handle;
+	int index;
+	int *aborted;
+	mb_url_chunkfn chunk;
+	void *context;
+};
+
+
+static CURLSH *share = NULL;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static CURL *pool[MB_URL_POOL_SIZE];
+static int n_pool = 0;
+static CURLM *multi_pool[MB_URL_MULTI_POOL_SIZE];
+static int n_multi_pool = 0;
+
 /**
  * urldecode() -- Decode url encoded string.
  *
@@ -64,11 +124,20 @@ WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
 	size_t realsize = size * nmemb;
 	struct MemoryStruct *mem = (struct MemoryStruct *)userp;
 
-	mem->memory = realloc(mem->memory, mem->size + realsize + 1);
-	if(mem->memory == NULL) {
-		/* out of memory! */
-		fprintf(stderr, "not enough memory (realloc returned NULL)\n");
-		return 0;
+	/* grow geometrically so large pages don't
+	 * realloc on every chunk */
+	if (mem->size + realsize + 1 > mem->limit) {
+		size_t limit = (mem->limit == 0) ? 16 * 1024 : mem->limit;
+		char *memory;
+		while (limit < mem->size + realsize + 1) {
+			limit *= 2;
+		}
+		if ((memory = realloc(mem->memory, limit)) == NULL) {
+			LOG_PRINT_ERROR("Not enough memory (realloc returned NULL)");
+			return 0;
+		}
+		mem->memory = memory;
+		mem->limit = limit;
 	}
 
 	memcpy(&(mem->memory[mem->size]), contents, realsize);
@@ -79,59 +148,665 @@ WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
 }
 
 
+static void
+mb_url_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+	(void) handle;
+	(void) access;
+	(void) userptr;
+	pthread_mutex_lock(&share_locks[data]);
+}
+
+
+static void
+mb_url_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+	(void) handle;
+	(void) userptr;
+	pthread_mutex_unlock(&share_locks[data]);
+}
+
+
+/**
+ * Get a handle from the pool or create a new one.
+ */
+static CURL *
+mb_url_gethandle(void)
+{
+	CURL *curl_handle = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	if (n_pool > 0) {
+		curl_handle = pool[--n_pool];
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (curl_handle != NULL) {
+		return curl_handle;
+	}
+
+	if ((curl_handle = curl_easy_init()) == NULL) {
+		return NULL;
+	}
+	curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+	curl_easy_setopt(curl_handle, CURLOPT_ACCEPT_ENCODING, "");
+	curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "mediabox/" PACKAGE_VERSION);
+	curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT, 30L);
+	curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPALIVE, 1L);
+	if (share != NULL) {
+		curl_easy_setopt(curl_handle, CURLOPT_SHARE, share);
+	}
+	return curl_handle;
+}
+
+
+/**
+ * Return a handle to the pool. It keeps it's
+ * connection open.
+ */
+static void
+mb_url_puthandle(CURL * const curl_handle)
+{
+	pthread_mutex_lock(&pool_lock);
+	if (n_pool < MB_URL_POOL_SIZE && share != NULL) {
+		pool[n_pool++] = curl_handle;
+		pthread_mutex_unlock(&pool_lock);
+		return;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	curl_easy_cleanup(curl_handle);
+}
+
+
+/**
+ * Get a multi handle from the pool or create a new one.
+ */
+static CURLM *
+mb_url_getmulti(void)
+{
+	CURLM *multi = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	if (n_multi_pool > 0) {
+		multi = multi_pool[--n_multi_pool];
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (multi == NULL) {
+		multi = curl_multi_init();
+	}
+	return multi;
+}
+
+
+/**
+ * Return a multi handle to the pool. All it's transfers
+ * must have been removed.
+ */
+static void
+mb_url_putmulti(CURLM * const multi)
+{
+	pthread_mutex_lock(&pool_lock);
+	if (n_multi_pool < MB_URL_MULTI_POOL_SIZE && share != NULL) {
+		multi_pool[n_multi_pool++] = multi;
+		pthread_mutex_unlock(&pool_lock);
+		return;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	curl_multi_cleanup(multi);
+}
+
+
 int
 mb_url_fetch2mem(char *url, void **dest, size_t *size)
 {
 	CURL *curl_handle;
 	CURLcode res;
-	int ret = -1;
 
 	struct MemoryStruct chunk;
 
-	chunk.memory = malloc(1);
+	chunk.memory = NULL;
 	chunk.size = 0;
-	if (chunk.memory == NULL) {
-		return -1;
-	}
-
-	curl_global_init(CURL_GLOBAL_ALL);
+	chunk.limit = 0;
 
-	/* init the curl session */
-	if ((curl_handle = curl_easy_init()) == NULL) {
-		fprintf(stderr, "url_util: curl_easy_init() failed\n");
-		goto end;
+	if ((curl_handle = mb_url_gethandle()) == NULL) {
+		LOG_PRINT_ERROR("curl_easy_init() failed");
+		errno = ENOMEM;
+		return -1;
 	}
 
 	curl_easy_setopt(curl_handle, CURLOPT_URL, url);
 	curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
 	curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
-	curl_easy_setopt(curl_handle, CURLOPT_ACCEPT_ENCODING, "");
-	curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "mediabox/" PACKAGE_VERSION);
-	//curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "Mozilla/5.0 (X11; Linux x86_64; rv:46.0) Gecko/20100101 Firefox/46.0");
 
 	/* get it! */
 	res = curl_easy_perform(curl_handle);
 
+	/* the handle is reused so don't leave a
+	 * pointer to our stack on it */
+	curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, NULL);
+	mb_url_puthandle(curl_handle);
+
 	/* check for errors */
-	if(res != CURLE_OK) {
-		fprintf(stderr, "curl_easy_perform() failed: %s\n",
-			curl_easy_strerror(res));
-		goto end;
+	if (res != CURLE_OK) {
+		LOG_VPRINT_ERROR("Could not fetch %s: %s",
+			url, curl_easy_strerror(res));
+		free(chunk.memory);
+		errno = EIO;
+		return -1;
+	}
 
-	} else {
-		*dest = chunk.memory;
-		*size = chunk.size;
-		ret = 0;
+	/* an empty page */
+	if (chunk.memory == NULL && (chunk.memory = malloc(1)) == NULL) {
+		return -1;
 	}
+	chunk.memory[chunk.size] = '\0';
+
+	*dest = chunk.memory;
+	*size = chunk.size;
+	return 0;
+}
 
-end:
 
-	if (ret == -1) {
+/**
+ * POST a request and fetch the response to memory.
+ */
+int
+mb_url_post2mem(const char * const url, const char * const * const headers,
+	const char * const body, void **dest, size_t *size)
+{
+	CURL *curl_handle;
+	CURLcode res;
+	long status = 0;
+	struct curl_slist *list = NULL, *tmp;
+	struct MemoryStruct chunk;
+	int i;
+
+	chunk.memory = NULL;
+	chunk.size = 0;
+	chunk.limit = 0;
+
+	for (i = 0; headers != NULL && headers[i] != NULL; i++) {
+		if ((tmp = curl_slist_append(list, headers[i])) == NULL) {
+			curl_slist_free_all(list);
+			errno = ENOMEM;
+			return -1;
+		}
+		list = tmp;
+	}
+
+	if ((curl_handle = mb_url_gethandle()) == NULL) {
+		LOG_PRINT_ERROR("curl_easy_init() failed");
+		curl_slist_free_all(list);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	curl_easy_setopt(curl_handle, CURLOPT_URL, url);
+	curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, body);
+	curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDSIZE, (long) strlen(body));
+	curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, list);
+	curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, 30L);
+	curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+	curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
+
+	res = curl_easy_perform(curl_handle);
+	curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &status);
+
+	/* put the handle back the way we found it */
+	curl_easy_setopt(curl_handle, CURLOPT_HTTPGET, 1L);
+	curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, NULL);
+	curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, 0L);
+	curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, NULL);
+	mb_url_puthandle(curl_handle);
+	curl_slist_free_all(list);
+
+	if (res != CURLE_OK || status >= 400) {
+		LOG_VPRINT_ERROR("Could not post to %s: %s (status %li)",
+			url, curl_easy_strerror(res), status);
 		free(chunk.memory);
+		errno = EIO;
+		return -1;
 	}
 
-	curl_easy_cleanup(curl_handle);
-	curl_global_cleanup();
-	return ret;
+	if (chunk.memory == NULL && (chunk.memory = malloc(1)) == NULL) {
+		return -1;
+	}
+	chunk.memory[chunk.size] = '\0';
+
+	*dest = chunk.memory;
+	*size = chunk.size;
+	return 0;
+}
+
+
+/**
+ * Gets the monotonic time in usecs.
+ */
+static int64_t
+mb_url_now(void)
+{
+	struct timespec tv;
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	return (tv.tv_sec * 1000000LL) + (tv.tv_nsec / 1000LL);
+}
+
+
+/**
+ * Hands the data of a mb_url_fetchmany() transfer to
+ * the caller as it arrives.
+ */
+static size_t
+mb_url_transfer_write(void *contents, size_t size, size_t nmemb, void *userp)
+{
+	struct mb_url_transfer * const xfer = userp;
+	const size_t realsize = size * nmemb;
+	if (*xfer->aborted || xfer->chunk(xfer->context, xfer->index,
+		contents, realsize) == -1) {
+		*xfer->aborted = 1;
+		return 0;
+	}
+	return realsize;
+}
+
+
+/**
+ * Lets the caller abort a mb_url_fetchmany() transfer
+ * that is not receiving data.
+ */
+static int
+mb_url_transfer_progress(void *userp, curl_off_t dltotal, curl_off_t dlnow,
+	curl_off_t ultotal, curl_off_t ulnow)
+{
+	struct mb_url_transfer * const xfer = userp;
+	(void) dltotal;
+	(void) dlnow;
+	(void) ultotal;
+	(void) ulnow;
+	if (*xfer->aborted || xfer->chunk(xfer->context, xfer->index, NULL, 0) == -1) {
+		*xfer->aborted = 1;
+		return 1;
+	}
+	return 0;
 }
 
+
+/**
+ * Fetch several urls concurrently.
+ */
+int
+mb_url_fetchmany(const char * const * const urls, const int n,
+	const int max_conns, const int interval,
+	mb_url_chunkfn chunk, mb_url_donefn done, void *context)
+{
+	int i, next = 0, active = 0, stop = 0, aborted = 0, msgs;
+	int64_t now, last_start = 0;
+	CURLM *multi;
+	CURLMsg *msg;
+	struct mb_url_transfer *xfers;
+
+	ASSERT(max_conns > 0);
+
+	if ((xfers = malloc(n * sizeof(struct mb_url_transfer))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return -1;
+	}
+	if ((multi = mb_url_getmulti()) == NULL) {
+		LOG_PRINT_ERROR("curl_multi_init() failed");
+		free(xfers);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	while ((!stop && !aborted && next < n) || active > 0) {
+		long timeout = 100;
+
+		/* start as many transfers as we're allowed to */
+		now = mb_url_now();
+		while (!stop && !aborted && next < n && active < max_conns) {
+			if (last_start != 0 && (now - last_start) < interval * 1000LL) {
+				const long wait = ((interval * 1000LL) - (now - last_start)) / 1000;
+				if (wait < timeout) {
+					timeout = (wait > 0) ? wait : 1;
+				}
+				break;
+			}
+
+			struct mb_url_transfer * const xfer = &xfers[next];
+			if ((xfer->handle = mb_url_gethandle()) == NULL) {
+				LOG_PRINT_ERROR("curl_easy_init() failed");
+				aborted = 1;
+				break;
+			}
+			xfer->index = next;
+			xfer->aborted = &aborted;
+			xfer->chunk = chunk;
+			xfer->context = context;
+			curl_easy_setopt(xfer->handle, CURLOPT_URL, urls[next]);
+			curl_easy_setopt(xfer->handle, CURLOPT_WRITEFUNCTION, mb_url_transfer_write);
+			curl_easy_setopt(xfer->handle, CURLOPT_WRITEDATA, xfer);
+			curl_easy_setopt(xfer->handle, CURLOPT_XFERINFOFUNCTION, mb_url_transfer_progress);
+			curl_easy_setopt(xfer->handle, CURLOPT_XFERINFODATA, xfer);
+			curl_easy_setopt(xfer->handle, CURLOPT_NOPROGRESS, 0L);
+			curl_easy_setopt(xfer->handle, CURLOPT_PRIVATE, xfer);
+			curl_multi_add_handle(multi, xfer->handle);
+
+			DEBUG_VPRINT("url", "Fetching %s", urls[next]);
+
+			last_start = now;
+			active++;
+			next++;
+		}
+
+		curl_multi_perform(multi, &i);
+
+		/* reap the finished transfers */
+		while ((msg = curl_multi_info_read(multi, &msgs)) != NULL) {
+			struct mb_url_transfer *xfer;
+			int result = 0;
+
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**) &xfer);
+			if (msg->data.result != CURLE_OK) {
+				if (!aborted) {
+					LOG_VPRINT_ERROR("Could not fetch %s: %s",
+						urls[xfer->index], curl_easy_strerror(msg->data.result));
+				}
+				result = -1;
+			}
+
+			curl_multi_remove_handle(multi, xfer->handle);
+			curl_easy_setopt(xfer->handle, CURLOPT_NOPROGRESS, 1L);
+			curl_easy_setopt(xfer->handle, CURLOPT_XFERINFOFUNCTION, NULL);
+			curl_easy_setopt(xfer->handle, CURLOPT_WRITEDATA, NULL);
+			mb_url_puthandle(xfer->handle);
+			active--;
+
+			if (!aborted && done(context, xfer->index, result) == -1) {
+				stop = 1;
+			}
+		}
+
+		if (active > 0 || (!stop && !aborted && next < n)) {
+			curl_multi_poll(multi, NULL, 0, timeout, NULL);
+		}
+	}
+
+	mb_url_putmulti(multi);
+	free(xfers);
+
+	if (aborted) {
+		errno = ECANCELED;
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Runs an asynchronous fetch on a worker.
+ */
+static void *
+mb_url_fetch2mem_worker(void *arg)
+{
+	struct mb_url_request * const req = arg;
+	req->result = mb_url_fetch2mem(req->url, &req->data, &req->size);
+	req->error = errno;
+	return req;
+}
+
+
+/**
+ * Invokes the callback of an asynchronous fetch.
+ */
+static void
+mb_url_fetch2mem_done(void *context, void *result)
+{
+	struct mb_url_request * const req = result;
+	(void) context;
+	if (req->result == -1) {
+		errno = req->error;
+	}
+	req->callback(req->context, req->result,
+		(req->result == 0) ? req->data : NULL,
+		(req->result == 0) ? req->size : 0);
+	free(req->url);
+	free(req);
+}
+
+
+/**
+ * Fetch a url in the background.
+ */
+int
+mb_url_fetch2mem_async(const char * const url,
+	mb_url_callback callback, void *context)
+{
+	struct avbox_delegate *del;
+	struct mb_url_request *req;
+
+	/* we need a queue to get the result back */
+	if (avbox_dispatch_getobject() == NULL) {
+		return -1;
+	}
+
+	if ((req = malloc(sizeof(struct mb_url_request))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return -1;
+	}
+	if ((req->url = strdup(url)) == NULL) {
+		free(req);
+		errno = ENOMEM;
+		return -1;
+	}
+	req->callback = callback;
+	req->context = context;
+	req->data = NULL;
+	req->size = 0;
+
+	if ((del = avbox_thread_delegate_qos(mb_url_fetch2mem_worker, req,
+		AVBOX_THREAD_QOS_INTERACTIVE)) == NULL) {
+		free(req->url);
+		free(req);
+		return -1;
+	}
+	if (avbox_delegate_then(del, mb_url_fetch2mem_done, NULL) == -1) {
+		/* can't happen since we checked the queue */
+		abort();
+	}
+	return 0;
+}
+
+
+/**
+ * The state of a benchmark thread.
+ */
+struct mb_url_benchmark_context
+{
+	const char *url;
+	int n;
+	int cold;
+	int failed;
+	int64_t *latency;
+};
+
+
+static int
+mb_url_compare_latency(const void *a, const void *b)
+{
+	const int64_t la = *(const int64_t*) a;
+	const int64_t lb = *(const int64_t*) b;
+	return (la > lb) - (la < lb);
+}
+
+
+/**
+ * Benchmark thread.
+ */
+static void *
+mb_url_benchmark_worker(void *arg)
+{
+	int i;
+	int64_t start;
+	void *data;
+	size_t size;
+	struct mb_url_benchmark_context * const ctx = arg;
+
+	for (i = 0; i < ctx->n; i++) {
+		start = mb_url_now();
+		if (ctx->cold) {
+			/* what we used to do for every request */
+			CURL *curl_handle;
+			struct MemoryStruct chunk = { NULL, 0, 0 };
+			curl_global_init(CURL_GLOBAL_ALL);
+			if ((curl_handle = curl_easy_init()) != NULL) {
+				curl_easy_setopt(curl_handle, CURLOPT_URL, ctx->url);
+				curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+				curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
+				curl_easy_setopt(curl_handle, CURLOPT_ACCEPT_ENCODING, "");
+				curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1L);
+				if (curl_easy_perform(curl_handle) != CURLE_OK) {
+					ctx->failed++;
+				}
+				curl_easy_cleanup(curl_handle);
+			}
+			curl_global_cleanup();
+			free(chunk.memory);
+		} else if (mb_url_fetch2mem((char*) ctx->url, &data, &size) == 0) {
+			free(data);
+		} else {
+			ctx->failed++;
+		}
+		ctx->latency[i] = mb_url_now() - start;
+	}
+	return NULL;
+}
+
+
+/**
+ * Run one round of the benchmark and log the results.
+ */
+static int
+mb_url_benchmark_run(const char * const name, const char * const url,
+	const int n, const int threads, const int cold)
+{
+	int i, failed = 0;
+	int64_t start, elapsed, *latency;
+	pthread_t tids[MB_URL_POOL_SIZE];
+	struct mb_url_benchmark_context ctx[MB_URL_POOL_SIZE];
+	const int per_thread = n / threads;
+
+	ASSERT(threads <= MB_URL_POOL_SIZE);
+
+	if ((latency = malloc(per_thread * threads * sizeof(int64_t))) == NULL) {
+		return -1;
+	}
+
+	start = mb_url_now();
+	for (i = 0; i < threads; i++) {
+		ctx[i].url = url;
+		ctx[i].n = per_thread;
+		ctx[i].cold = cold;
+		ctx[i].failed = 0;
+		ctx[i].latency = &latency[i * per_thread];
+		if (pthread_create(&tids[i], NULL, mb_url_benchmark_worker, &ctx[i]) != 0) {
+			abort();
+		}
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(tids[i], NULL);
+		failed += ctx[i].failed;
+	}
+	elapsed = mb_url_now() - start;
+
+	qsort(latency, per_thread * threads, sizeof(int64_t), mb_url_compare_latency);
+	LOG_VPRINT_INFO("%-20s %6.1f req/s  p50 %6.2f ms  p99 %6.2f ms  (%i failed)",
+		name, (per_thread * threads * 1000000.0) / elapsed,
+		latency[(per_thread * threads) / 2] / 1000.0,
+		latency[((per_thread * threads) * 99) / 100] / 1000.0, failed);
+
+	free(latency);
+	return 0;
+}
+
+
+/**
+ * Logs the request rate and latency of fetching a url with
+ * and without the pool.
+ */
+int
+mb_url_benchmark(const char * const url, const int n)
+{
+	LOG_VPRINT_INFO("Fetching %s %i times", url, n);
+	mb_url_benchmark_run("new handle", url, n, 1, 1);
+	mb_url_benchmark_run("pooled", url, n, 1, 0);
+	mb_url_benchmark_run("pooled x4", url, n, 4, 0);
+	mb_url_benchmark_run("pooled x8", url, n, 8, 0);
+	return 0;
+}
+
+
+/**
+ * Initialize the url fetcher.
+ */
+int
+mb_url_init(void)
+{
+	int i;
+
+	DEBUG_PRINT("url", "Initializing url fetcher");
+
+	if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
+		LOG_PRINT_ERROR("Could not initialize curl");
+		return -1;
+	}
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		pthread_mutex_init(&share_locks[i], NULL);
+	}
+
+	if ((share = curl_share_init()) == NULL) {
+		LOG_PRINT_ERROR("Could not create curl share");
+		curl_global_cleanup();
+		return -1;
+	}
+	curl_share_setopt(share, CURLSHOPT_LOCKFUNC, mb_url_lock);
+	curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, mb_url_unlock);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	return 0;
+}
+
+
+/**
+ * Shutdown the url fetcher.
+ */
+void
+mb_url_shutdown(void)
+{
+	int i;
+
+	DEBUG_PRINT("url", "Shutting down url fetcher");
+
+	pthread_mutex_lock(&pool_lock);
+	while (n_pool > 0) {
+		curl_easy_cleanup(pool[--n_pool]);
+	}
+	while (n_multi_pool > 0) {
+		curl_multi_cleanup(multi_pool[--n_multi_pool]);
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (share != NULL) {
+		curl_share_cleanup(share);
+		share = NULL;
+		for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+			pthread_mutex_destroy(&share_locks[i]);
+		}
+		curl_global_cleanup();
+	}
+}
@@ -5,6 +5,7 @@
 
 #ifndef __MB_URL_UTIL_H__
 #define __MB_URL_UTIL_H__
+#include <stddef.h>
 
 
 void
@@ -19,4 +20,90 @@ int
 mb_url_fetch2mem(char *url, void **dest, size_t *size);
 
 
+/**
+ * POST body to url with the given NULL terminated list of
+ * extra headers and fetch the response to a malloc()
+ * allocated buffer. Fails with EIO if the server returns
+ * an error status.
+ */
+int
+mb_url_post2mem(const char * const url, const char * const * const headers,
+	const char * const body, void **dest, size_t *size);
+
+
+/**
+ * Called on the dispatch thread that started an asynchronous
+ * fetch. On success result is 0 and data points to a malloc()
+ * allocated buffer that the callback must free(). On failure
+ * result is -1, data is NULL and errno is set.
+ */
+typedef void (*mb_url_callback)(void *context, int result,
+	void *data, size_t size);
+
+
+/**
+ * Fetch the contents of a url in the background. The
+ * calling thread must have a dispatch queue.
+ */
+int
+mb_url_fetch2mem_async(const char * const url,
+	mb_url_callback callback, void *context);
+
+
+/**
+ * Called by mb_url_fetchmany() with each chunk of data as it
+ * arrives. The function is also called with a NULL chunk while
+ * a transfer is waiting. Returning -1 aborts all the transfers.
+ */
+typedef int (*mb_url_chunkfn)(void *context, const int index,
+	const void * const data, const size_t size);
+
+
+/**
+ * Called by mb_url_fetchmany() when a transfer completes. Result
+ * is -1 if it failed. Returning -1 stops any further transfers
+ * from starting.
+ */
+typedef int (*mb_url_donefn)(void *context, const int index,
+	const int result);
+
+
+/**
+ * Fetch n urls using up to max_conns connections and starting
+ * a new request at most every interval milliseconds. The data
+ * is passed to chunk as it arrives. Blocks until all the
+ * transfers are done.
+ *
+ * Returns -1 and sets errno to ECANCELED if the transfers
+ * were aborted.
+ */
+int
+mb_url_fetchmany(const char * const * const urls, const int n,
+	const int max_conns, const int interval,
+	mb_url_chunkfn chunk, mb_url_donefn done, void *context);
+
+
+/**
+ * Benchmark fetching a url n times with and without
+ * the handle pool. The results are logged.
+ */
+int
+mb_url_benchmark(const char * const url, const int n);
+
+
+/**
+ * Initialize the shared DNS and TLS session caches and
+ * the handle pools.
+ */
+int
+mb_url_init(void);
+
+
+/**
+ * Free the shared caches and the handle pools.
+ */
+void
+mb_url_shutdown(void);
+
+
 #endif
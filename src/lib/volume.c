@@ -145,8 +145,8 @@ avbox_volume_set(int volume)
 
 	if (msgobj != NULL) {
 		vol = volume;
-		if (avbox_object_sendmsg(&msgobj, AVBOX_MESSAGETYPE_VOLUME,
-			AVBOX_DISPATCH_UNICAST, &vol) == NULL) {
+		if (avbox_object_coalescemsg(&msgobj, AVBOX_MESSAGETYPE_VOLUME,
+			AVBOX_DISPATCH_UNICAST, 0, &vol, NULL) == NULL) {
 			LOG_VPRINT_ERROR("Could not send volume changed message: %s",
 				strerror(errno));
 		}
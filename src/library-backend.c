@@ -119,7 +119,7 @@ mb_library_backend_startmediatomb(const char * iface_name, void  *data)
 	/* launch the mediatomb process */
 	if ((inst->procid = avbox_process_start(MEDIATOMB_BIN, (const char **) mtargs,
 		AVBOX_PROCESS_AUTORESTART | AVBOX_PROCESS_NICE | AVBOX_PROCESS_IONICE_IDLE |
-		AVBOX_PROCESS_SUPERUSER/* | AVBOX_PROCESS_STDOUT_LOG | AVBOX_PROCESS_STDERR_LOG */,
+		AVBOX_PROCESS_SUPERUSER | AVBOX_PROCESS_CGROUP/* | AVBOX_PROCESS_STDOUT_LOG | AVBOX_PROCESS_STDERR_LOG */,
 		"mediatomb", NULL, NULL)) == -1) {
 		LOG_PRINT_ERROR("Could not start mediatomb daemon");
 		free(inst);
@@ -525,8 +525,8 @@ mb_library_backend_init(const int launch_avmount,
 
 		if ((avmount_process_id = avbox_process_start(AVMOUNT_BIN, (const char **) avargs,
 			AVBOX_PROCESS_AUTORESTART | AVBOX_PROCESS_AUTORESTART_ALWAYS |
-			AVBOX_PROCESS_NICE | AVBOX_PROCESS_IONICE_IDLE | AVBOX_PROCESS_SUPERUSER,
-			"avmount", avbox_avmount_exit, NULL)) == -1) {
+			AVBOX_PROCESS_NICE | AVBOX_PROCESS_IONICE_IDLE | AVBOX_PROCESS_SUPERUSER |
+			AVBOX_PROCESS_CGROUP, "avmount", avbox_avmount_exit, NULL)) == -1) {
 			LOG_PRINT(MB_LOGLEVEL_ERROR, "library-backend", "Could not start avmount daemon");
 			return -1;
 		}
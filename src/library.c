@@ -10,9 +10,8 @@
 #include <assert.h>
 #include <limits.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
-#include <sys/stat.h>
-#include <dirent.h>
 
 #define LOG_MODULE "library"
 
@@ -26,9 +25,15 @@
 #include "lib/ui/input.h"
 #include "lib/ui/player.h"
 #include "library.h"
+#include "libraryindex.h"
+#include "upnp.h"
 #include "shell.h"
 
 
+#define MBOX_LIBRARY_MAXTERMS	(64)
+#define MBOX_LIBRARY_MAXRESULTS	(200)
+
+
 struct mbox_library_playlist_item
 {
 	int isdir;
@@ -40,20 +45,43 @@ struct mbox_library_playlist_item
 };
 
 
+/**
+ * A row of the list. The rows are only accessed from the
+ * main thread.
+ */
+struct mbox_library_row
+{
+	char *title;
+	struct mbox_library_playlist_item *item;
+};
+
+
 struct mbox_library
 {
 	LIST playlist;
 	struct avbox_window *window;
 	struct avbox_listview *menu;
+	struct mbox_library_row *rows;
+	int n_rows;
+	int rows_size;
 	struct avbox_object *parent_obj;
 	char *dotdot;
+	char *cwd;
+	char terms[MBOX_LIBRARY_MAXTERMS];
+	int generation;			/* bumped every time the list is reloaded */
+	pthread_mutex_t load_lock;	/* held while loading the list */
 };
 
 
+/**
+ * Context of a folder listing or a search. Path is the
+ * search terms when searching.
+ */
 struct mbox_library_loadlist_context
 {
 	struct mbox_library *inst;
 	char *path;
+	int generation;
 };
 
 
@@ -62,12 +90,10 @@ struct mbox_library_additem_context
 	struct mbox_library *inst;
 	struct mbox_library_playlist_item *item;
 	char *title;
+	int generation;
 };
 
 
-#define LIBRARY_ROOT "/media/UPnP"
-
-
 static struct avbox_playlist_item *
 mbox_library_addtoplaylist(struct mbox_library *inst, const char *file)
 {
@@ -155,14 +181,85 @@ mbox_library_stripext(char *filename)
 
 
 /**
- * Update the window from the main thread.
+ * Called on the main thread when the list has
+ * been loaded.
  */
-static void *
-mbox_library_updatewindow(void *ctx)
+static void
+mbox_library_loadlistdone(void *ctx, void *result)
 {
 	struct mbox_library * const inst = ctx;
+	if ((intptr_t) result != 0) {
+		DEBUG_VPRINT("library", "Loadlist failed with status %i",
+			(int) (intptr_t) result);
+	}
 	avbox_window_update(inst->window);
-	return NULL;
+}
+
+
+/**
+ * Called back by avbox_listview_enumitems(). Used to free
+ * item list entries
+ */
+static int
+mbox_library_freeitems(void *item, void *data)
+{
+	struct mbox_library_playlist_item *playlist_item =
+		(struct mbox_library_playlist_item*) item;
+
+	if (playlist_item->isdir) {
+		if (playlist_item->data.filepath != NULL) {
+			free((void*) playlist_item->data.filepath);
+		}
+	} else {
+		/* NOTE: We don't need to free the playlist item because
+		 * it belongs to the global playlist and it will be freed
+		 * once the list gets reloaded or the library object gets
+		 * destroyed */
+
+		/*
+		if (playlist_item->data.playlist_item != NULL) {
+			mbox_library_freeplaylistitem(playlist_item->data.playlist_item);
+		}
+		*/
+	}
+	free(item);
+	return 0;
+}
+
+
+/**
+ * Data source of the listview.
+ */
+static int
+mbox_library_getrow(int row, char *text, size_t n, void **data, void *context)
+{
+	struct mbox_library * const inst = context;
+
+	if (row < 0 || row >= inst->n_rows) {
+		return -1;
+	}
+	strncpy(text, inst->rows[row].title, n);
+	text[n - 1] = '\0';
+	*data = inst->rows[row].item;
+	return 0;
+}
+
+
+/**
+ * Free all the rows and empty the list.
+ */
+static void
+mbox_library_clearrows(struct mbox_library * const inst)
+{
+	int i;
+	for (i = 0; i < inst->n_rows; i++) {
+		mbox_library_freeitems(inst->rows[i].item, NULL);
+		free(inst->rows[i].title);
+	}
+	inst->n_rows = 0;
+	if (inst->menu != NULL) {
+		avbox_listview_clearitems(inst->menu);
+	}
 }
 
 
@@ -176,13 +273,190 @@ mbox_library_additem(void *ctx)
 	struct mbox_library_playlist_item * const library_item =
 		((struct mbox_library_additem_context*)ctx)->item;
 	char * const title = ((struct mbox_library_additem_context*)ctx)->title;
-	avbox_listview_additem(inst->menu, title, library_item);
+
+	/* drop the items of a list that has been replaced */
+	if (((struct mbox_library_additem_context*)ctx)->generation != inst->generation) {
+		goto drop;
+	}
+
+	if (inst->n_rows == inst->rows_size) {
+		const int size = (inst->rows_size == 0) ? 64 : inst->rows_size * 2;
+		struct mbox_library_row * const rows =
+			realloc(inst->rows, size * sizeof(struct mbox_library_row));
+		if (rows == NULL) {
+			LOG_PRINT_ERROR("Could not add item: Out of memory");
+			goto drop;
+		}
+		inst->rows = rows;
+		inst->rows_size = size;
+	}
+
+	inst->rows[inst->n_rows].title = title;
+	inst->rows[inst->n_rows].item = library_item;
+	avbox_listview_setcount(inst->menu, ++inst->n_rows);
+	free(ctx);
+	return NULL;
+
+drop:
+	mbox_library_freeitems(library_item, NULL);
+	free(title);
+	free(ctx);
 	return NULL;
 }
 
 
 /**
- * Populate the list from a background thread.
+ * Add an entry of the index to the list. Called on the
+ * loadlist thread.
+ */
+static int
+mbox_library_loadentry(const struct mbox_libraryindex_entry * const entry,
+	void *ctx)
+{
+	struct mbox_library_loadlist_context * const loadctx = ctx;
+	struct mbox_library * const inst = loadctx->inst;
+	struct mbox_library_playlist_item *library_item;
+	struct mbox_library_additem_context *addctx;
+	struct avbox_delegate *del;
+	char *title, *ext = NULL;
+
+	/* media servers and their contents */
+	const int remote = (entry->path[0] != '/');
+
+	/* stop if the list has been replaced */
+	if (loadctx->generation != inst->generation) {
+		return -1;
+	}
+
+	/* do not show dot files */
+	if (entry->name[0] == '.') {
+		return 0;
+	}
+
+	/* get a copy of the filename (this will be the title) */
+	if ((title = strdup(entry->name)) == NULL) {
+		LOG_VPRINT_ERROR("Could not load list: %s",
+			strerror(errno));
+		return -1;
+	}
+
+	/* strip the filename extension from the title. Media
+	 * servers give us titles, not filenames */
+	if (!remote) {
+		ext = mbox_library_stripext(title);
+	}
+
+	/* do not show subtitles */
+	if (ext != NULL) {
+		if (!strcasecmp("srt", ext) || !strcasecmp("sub", ext) || !strcasecmp("idx", ext)) {
+			free(title);
+			return 0;
+		}
+	}
+
+	if ((library_item = malloc(sizeof(struct mbox_library_playlist_item))) == NULL) {
+		LOG_PRINT_ERROR("Add to playlist failed");
+		free(title);
+		return -1;
+	}
+
+	if (entry->isdir) {
+		char *filepathrel;
+		if ((filepathrel = malloc(strlen(entry->path) + 2)) == NULL) {
+			LOG_VPRINT_ERROR("Could not load list: %s",
+				strerror(errno));
+			free(library_item);
+			free(title);
+			return -1;
+		}
+		if (remote) {
+			strcpy(filepathrel, entry->path);
+		} else {
+			strcpy(filepathrel, entry->path + sizeof(LIBRARY_ROOT) - 1);
+			strcat(filepathrel, "/");
+		}
+		library_item->isdir = 1;
+		library_item->data.filepath = filepathrel;
+	} else {
+		library_item->isdir = 0;
+
+		/* add item to playlist */
+		if ((library_item->data.playlist_item =
+			mbox_library_addtoplaylist(inst, entry->path)) == NULL) {
+			LOG_PRINT_ERROR("Add to playlist failed");
+			free(library_item);
+			free(title);
+			return -1;
+		}
+	}
+
+	/* add item to menu. We don't wait for it, the
+	 * main thread frees the context and title */
+	if ((addctx = malloc(sizeof(struct mbox_library_additem_context))) == NULL) {
+		LOG_PRINT_ERROR("Could not add item: Out of memory");
+		mbox_library_freeitems(library_item, NULL);
+		free(title);
+		return -1;
+	}
+	addctx->inst = inst;
+	addctx->title = title;
+	addctx->item = library_item;
+	addctx->generation = loadctx->generation;
+	if ((del = avbox_application_delegate(mbox_library_additem, addctx)) == NULL) {
+		LOG_VPRINT_ERROR("Could not add item. "
+			"avbox_application_delegate() failed: %s",
+			strerror(errno));
+		mbox_library_freeitems(library_item, NULL);
+		free(addctx);
+		free(title);
+	} else {
+		avbox_delegate_dettach(del);
+	}
+	return 0;
+}
+
+
+/**
+ * Browse a media server from a background thread.
+ */
+static int
+mbox_library_loadremote(struct mbox_library_loadlist_context * const ctx)
+{
+	struct mbox_library * const inst = ctx->inst;
+	char *slash;
+
+	if (inst->dotdot != NULL) {
+		free(inst->dotdot);
+		inst->dotdot = NULL;
+	}
+
+	/* the parent is the previous container or the
+	 * library root if this is the server's root */
+	if ((inst->dotdot = strdup(ctx->path)) == NULL) {
+		return -1;
+	}
+	while ((slash = strrchr(inst->dotdot, '/')) != NULL && slash[1] == '\0') {
+		*slash = '\0';
+	}
+	if (slash == NULL || slash == inst->dotdot + sizeof(MBOX_UPNP_PREFIX) - 1) {
+		strcpy(inst->dotdot, "/");
+	} else {
+		*slash = '\0';
+	}
+
+	if (mbox_upnp_browse(ctx->path, mbox_library_loadentry, ctx) == -1) {
+		LOG_VPRINT_ERROR("Cannot browse '%s': %s",
+			ctx->path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Populate the list from a background thread. Folders are
+ * listed from the library index and the media servers are
+ * listed on the root.
  */
 static void *
 __mbox_library_loadlist(void *ctx)
@@ -190,20 +464,29 @@ __mbox_library_loadlist(void *ctx)
 	struct mbox_library * const inst =
 		((struct mbox_library_loadlist_context*) ctx)->inst;
 	const char * const path = ((struct mbox_library_loadlist_context*) ctx)->path;
-	DIR *dir = NULL;
 	int isroot, ret = -1;
-	struct dirent *ent;
 	char *rpath;
 	const size_t path_len = strlen(path);
-	size_t resolved_path_len;
 	char resolved_path[PATH_MAX];
-	struct avbox_delegate *del;
 
 	assert(path != NULL);
 
+	pthread_mutex_lock(&inst->load_lock);
+
+	/* don't bother if the list has been replaced already */
+	if (((struct mbox_library_loadlist_context*) ctx)->generation != inst->generation) {
+		ret = 0;
+		goto end;
+	}
+
 	/* first free the playlist */
 	mbox_library_freeplaylist(inst);
 
+	if (!strncmp(path, MBOX_UPNP_PREFIX, sizeof(MBOX_UPNP_PREFIX) - 1)) {
+		ret = mbox_library_loadremote(ctx);
+		goto end;
+	}
+
 	/* allocate memory for item path */
 	rpath = malloc(sizeof(LIBRARY_ROOT) + path_len + 2);
 	if (rpath == NULL) {
@@ -221,167 +504,56 @@ __mbox_library_loadlist(void *ctx)
 	}
 
 	if (realpath(rpath, resolved_path) == NULL) {
-		DEBUG_VPRINT("library", "Invalid path %s",
-			rpath);
-		free(rpath);
-		goto end;
+		/* the root may not exist when everything
+		 * is on media servers */
+		if (strcmp(path, "/")) {
+			DEBUG_VPRINT("library", "Invalid path %s",
+				rpath);
+			free(rpath);
+			goto end;
+		}
+		resolved_path[0] = '\0';
 	}
 
-	isroot = (strcmp(LIBRARY_ROOT, resolved_path) == 0);
-	resolved_path_len = strlen(resolved_path);
+	isroot = (resolved_path[0] == '\0' || strcmp(LIBRARY_ROOT, resolved_path) == 0);
 	free(rpath);
 
-	if ((dir = opendir(resolved_path)) == NULL) {
-		LOG_VPRINT_ERROR("Cannot open directory '%s': %s",
-			resolved_path, strerror(errno));
-		goto end;
-	}
-
 	if (inst->dotdot != NULL) {
 		free(inst->dotdot);
 		inst->dotdot = NULL;
 	}
 
-	while ((ent = readdir(dir)) != NULL) {
-		char *filepath, *filepathrel, *title, *ext;
-		struct stat st;
-
-		/* do not show dot directories except .. */
-		if (ent->d_name[0] == '.') {
-			if (strcmp(ent->d_name, "..") || isroot) {
-				continue;
-			}
-		}
-
-		/* do not show the dot directory */
-		if (ent->d_name[0] == '.' && ent->d_name[1] == '\0') {
-			continue;
-		}
-
-		/* get a copy of the filename (this will be the title) */
-		title = strdup(ent->d_name);
-		if (title == NULL) {
-			LOG_VPRINT_ERROR("Could not load list: %s",
-				strerror(errno));
-			goto end;
-		}
-
-		/* strip the filename extension from the title */
-		ext = mbox_library_stripext(title);
-
-		/* do not show subtitles */
-		if (ext != NULL) {
-			if (!strcasecmp("srt", ext) || !strcasecmp("sub", ext) || !strcasecmp("idx", ext)) {
-				free(title);
-				continue;
-			}
-		}
-
-		/* allocate mem for a copy of the filepath */
-		filepath = malloc(resolved_path_len + strlen(ent->d_name) + 3);
-		if (filepath == NULL) {
-			LOG_VPRINT_ERROR("Could not load list: %s",
-				strerror(errno));
-			free(title);
-			goto end;
-		}
-
-		strcpy(filepath, resolved_path);
-		strcat(filepath, "/");
-		strcat(filepath, ent->d_name);
-
-		if (stat(filepath, &st) == -1) {
-			LOG_VPRINT_ERROR("Could not stat '%s': %s",
-				strerror(errno));
-			free(filepath);
-			free(title);
-			continue;
-		}
-
-		if (S_ISDIR(st.st_mode)) {
-			strcat(filepath, "/");
-			filepathrel = strdup(filepath + sizeof(LIBRARY_ROOT) - 1);
-		} else {
-			filepathrel = strdup(filepath);
-		}
-		if (filepathrel == NULL) {
+	/* the parent directory */
+	if (!isroot) {
+		if ((inst->dotdot = malloc(strlen(resolved_path) + 5)) == NULL) {
 			LOG_VPRINT_ERROR("Could not load list: %s",
 				strerror(errno));
-			free(filepath);
-			free(title);
 			goto end;
 		}
-
-		if (!strcmp(ent->d_name, "..")) {
-			inst->dotdot = filepathrel;
-		} else {
-			struct mbox_library_playlist_item *library_item;
-
-			if ((library_item = malloc(sizeof(struct mbox_library_playlist_item))) == NULL) {
-				LOG_PRINT_ERROR("Add to playlist failed");
-				free(filepathrel);
-				free(filepath);
-				free(title);
-				goto end;
-			}
-
-			if (S_ISDIR(st.st_mode)) {
-				library_item->isdir = 1;
-				library_item->data.filepath = filepathrel;
-			} else {
-				library_item->isdir = 0;
-
-				/* add item to playlist */
-				if ((library_item->data.playlist_item =
-					mbox_library_addtoplaylist(inst, filepathrel)) == NULL) {
-					LOG_PRINT_ERROR("Add to playlist failed");
-					free(library_item);
-					free(filepathrel);
-					free(filepath);
-					free(title);
-					goto end;
-				}
-
-				free(filepathrel);
-			}
-
-			assert(library_item != NULL);
-
-			/* add item to menu */
-			struct mbox_library_additem_context addctx;
-			addctx.inst = inst;
-			addctx.title = title;
-			addctx.item = library_item;
-			if ((del = avbox_application_delegate(mbox_library_additem, &addctx)) == NULL) {
-				LOG_VPRINT_ERROR("Could not add item. "
-					"avbox_application_delegate() failed: %s",
-					strerror(errno));
-			} else {
-				avbox_delegate_wait(del, NULL);
-			}
-		}
-
-		free(filepath);
-		free(title);
+		strcpy(inst->dotdot, resolved_path + sizeof(LIBRARY_ROOT) - 1);
+		strcat(inst->dotdot, "/../");
 	}
 
-	/* update the library window */
-	if ((del = avbox_application_delegate(mbox_library_updatewindow, inst)) == NULL) {
-		LOG_VPRINT_ERROR("Could not update window!: %s",
+	/* the media servers go first */
+	if (isroot && mbox_upnp_servers(mbox_library_loadentry, ctx) == -1) {
+		LOG_VPRINT_ERROR("Could not list media servers: %s",
 			strerror(errno));
-	} else {
-		avbox_delegate_wait(del, NULL);
+	}
+
+	if (resolved_path[0] != '\0' &&
+		mbox_libraryindex_list(resolved_path, mbox_library_loadentry, ctx) == -1) {
+		LOG_VPRINT_ERROR("Cannot list directory '%s': %s",
+			resolved_path, strerror(errno));
+		goto end;
 	}
 
 	ret = 0;
 end:
+	pthread_mutex_unlock(&inst->load_lock);
 	if (ret != 0) {
 		DEBUG_VPRINT("library", "Loadlist baling with status %i",
 			ret);
 	}
-	if (dir != NULL) {
-		closedir(dir);
-	}
 	if (path != NULL) {
 		free(((struct mbox_library_loadlist_context*)ctx)->path);
 	}
@@ -392,33 +564,47 @@ end:
 
 
 /**
- * Called back by avbox_listview_enumitems(). Used to free
- * item list entries
+ * Search the library from a background thread.
  */
-static int
-mbox_library_freeitems(void *item, void *data)
+static void *
+__mbox_library_search(void *arg)
 {
-	struct mbox_library_playlist_item *playlist_item =
-		(struct mbox_library_playlist_item*) item;
+	struct mbox_library_loadlist_context * const ctx = arg;
+	struct mbox_library * const inst = ctx->inst;
 
-	if (playlist_item->isdir) {
-		if (playlist_item->data.filepath != NULL) {
-			free((void*) playlist_item->data.filepath);
+	pthread_mutex_lock(&inst->load_lock);
+	if (ctx->generation == inst->generation) {
+		mbox_library_freeplaylist(inst);
+		if (mbox_libraryindex_search(ctx->path, mbox_library_loadentry,
+			ctx, MBOX_LIBRARY_MAXRESULTS) == -1) {
+			LOG_VPRINT_ERROR("Could not search for '%s': %s",
+				ctx->path, strerror(errno));
 		}
-	} else {
-		/* NOTE: We don't need to free the playlist item because
-		 * it belongs to the global playlist and it will be freed
-		 * once the list gets reloaded or the library object gets
-		 * destroyed */
+	}
+	pthread_mutex_unlock(&inst->load_lock);
 
-		/*
-		if (playlist_item->data.playlist_item != NULL) {
-			mbox_library_freeplaylistitem(playlist_item->data.playlist_item);
-		}
-		*/
+	free(ctx->path);
+	free(ctx);
+	return NULL;
+}
+
+
+/**
+ * Update the window title.
+ */
+static void
+mbox_library_settitle(struct mbox_library * const inst)
+{
+	char title[MBOX_LIBRARY_MAXTERMS + 16];
+	if (inst->terms[0] != '\0') {
+		snprintf(title, sizeof(title), "MEDIA LIBRARY: %s", inst->terms);
+	} else {
+		strcpy(title, "MEDIA LIBRARY");
+	}
+	if (avbox_window_settitle(inst->window, title) == -1) {
+		LOG_VPRINT_ERROR("Could not set window title: %s",
+			strerror(errno));
 	}
-	free(item);
-	return 0;
 }
 
 
@@ -440,24 +626,117 @@ mbox_library_loadlist(struct mbox_library * const inst, const char * const path)
 		abort();
 	}
 
+	/* remember the folder so we can go back to it
+	 * when the search is cleared */
+	if (inst->cwd != path) {
+		free(inst->cwd);
+		if ((inst->cwd = strdup(path)) == NULL) {
+			abort();
+		}
+	}
+	if (inst->terms[0] != '\0') {
+		inst->terms[0] = '\0';
+		mbox_library_settitle(inst);
+	}
+
 	/* clear the list and load the next page */
-	avbox_listview_enumitems(inst->menu, mbox_library_freeitems, NULL);
-	avbox_listview_clearitems(inst->menu);
+	mbox_library_clearrows(inst);
 
 	/* populate the list from a background thread */
 	ctx->inst = inst;
 	ctx->path = selected_copy;
+	ctx->generation = ++inst->generation;
 	if ((del = avbox_thread_delegate(__mbox_library_loadlist, ctx)) == NULL) {
 		LOG_VPRINT_ERROR("Could not delegate to main thread: %s",
 			strerror(errno));
 		free(ctx);
 		free(selected_copy);
-	} else {
+	} else if (avbox_delegate_then(del, mbox_library_loadlistdone, inst) == -1) {
+		LOG_VPRINT_ERROR("Could not set completion callback: %s",
+			strerror(errno));
+		avbox_delegate_dettach(del);
+	}
+}
+
+
+/**
+ * Search the library for the current terms. The results replace
+ * the list as they're found. When the terms are cleared the folder
+ * is shown again.
+ */
+static void
+mbox_library_search(struct mbox_library * const inst)
+{
+	struct mbox_library_loadlist_context *ctx;
+	struct avbox_delegate *del;
+
+	if (inst->terms[0] == '\0') {
+		mbox_library_settitle(inst);
+		mbox_library_loadlist(inst, inst->cwd);
+		return;
+	}
+
+	mbox_library_settitle(inst);
+	mbox_library_clearrows(inst);
+	avbox_window_update(inst->window);
+
+	if ((ctx = malloc(sizeof(struct mbox_library_loadlist_context))) == NULL ||
+		(ctx->path = strdup(inst->terms)) == NULL) {
+		LOG_PRINT_ERROR("Could not search: Out of memory");
+		free(ctx);
+		return;
+	}
+	ctx->inst = inst;
+	ctx->generation = ++inst->generation;
+
+	if ((del = avbox_thread_delegate_qos(__mbox_library_search, ctx,
+		AVBOX_THREAD_QOS_INTERACTIVE)) == NULL) {
+		LOG_VPRINT_ERROR("Could not search: %s",
+			strerror(errno));
+		free(ctx->path);
+		free(ctx);
+	} else if (avbox_delegate_then(del, mbox_library_loadlistdone, inst) == -1) {
+		LOG_VPRINT_ERROR("Could not set completion callback: %s",
+			strerror(errno));
 		avbox_delegate_dettach(del);
 	}
 }
 
 
+/**
+ * Handle a key press. Letters and space are added to the
+ * search terms and CLEAR deletes the last one.
+ */
+static int
+mbox_library_keypress(struct mbox_library * const inst,
+	const enum avbox_input_event key)
+{
+	const size_t len = strlen(inst->terms);
+
+	if (key >= MBI_EVENT_KBD_A && key <= MBI_EVENT_KBD_Z) {
+		if (len + 1 < sizeof(inst->terms)) {
+			inst->terms[len] = 'A' + (key - MBI_EVENT_KBD_A);
+			inst->terms[len + 1] = '\0';
+		}
+	} else if (key == MBI_EVENT_KBD_SPACE) {
+		if (len > 0 && len + 1 < sizeof(inst->terms)) {
+			inst->terms[len] = ' ';
+			inst->terms[len + 1] = '\0';
+		}
+	} else if (key == MBI_EVENT_CLEAR) {
+		if (len == 0) {
+			return AVBOX_DISPATCH_CONTINUE;
+		}
+		inst->terms[len - 1] = '\0';
+	} else {
+		return AVBOX_DISPATCH_CONTINUE;
+	}
+
+	mbox_library_search(inst);
+	return AVBOX_DISPATCH_OK;
+}
+
+
 /**
  * Handle incoming messages.
  */
@@ -467,6 +746,16 @@ mbox_library_messagehandler(void *context, struct avbox_message *msg)
 	struct mbox_library * const inst = context;
 
 	switch (avbox_message_id(msg)) {
+	case AVBOX_MESSAGETYPE_INPUT:
+	{
+		struct avbox_input_message * const ev =
+			avbox_message_payload(msg);
+		if (mbox_library_keypress(inst, ev->msg) == AVBOX_DISPATCH_CONTINUE) {
+			return AVBOX_DISPATCH_CONTINUE;
+		}
+		avbox_input_eventfree(ev);
+		break;
+	}
 	case AVBOX_MESSAGETYPE_SELECTED:
 	{
 		ASSERT(avbox_message_payload(msg) == inst->menu);
@@ -500,6 +789,7 @@ mbox_library_messagehandler(void *context, struct avbox_message *msg)
 
 				/* hide window */
 				avbox_listview_releasefocus(inst->menu);
+				avbox_input_release(avbox_window_object(inst->window));
 				avbox_window_hide(inst->window);
 
 				/* send dismissed message */
@@ -522,11 +812,16 @@ mbox_library_messagehandler(void *context, struct avbox_message *msg)
 		DEBUG_ASSERT("library", avbox_message_payload(msg) == inst->menu,
 			"Invalid message payload!");
 
-		if (inst->dotdot != NULL) {
+		if (inst->terms[0] != '\0') {
+			/* back to the folder */
+			inst->terms[0] = '\0';
+			mbox_library_search(inst);
+		} else if (inst->dotdot != NULL) {
 			mbox_library_loadlist(inst, inst->dotdot);
 		} else {
 			/* hide window */
 			avbox_listview_releasefocus(inst->menu);
+			avbox_input_release(avbox_window_object(inst->window));
 			avbox_window_hide(inst->window);
 
 			/* send DISMISSED message */
@@ -539,27 +834,48 @@ mbox_library_messagehandler(void *context, struct avbox_message *msg)
 
 		break;
 	}
+	case MBOX_MESSAGETYPE_UPNP:
+	{
+		/* the media servers are listed on the root */
+		if (inst->terms[0] == '\0' && inst->dotdot == NULL && inst->cwd != NULL) {
+			DEBUG_PRINT("library", "Media servers changed. Reloading");
+			mbox_library_loadlist(inst, inst->cwd);
+		}
+		break;
+	}
 	case AVBOX_MESSAGETYPE_DESTROY:
 	{
 		DEBUG_PRINT("library", "Shutdown library");
 
+		mbox_upnp_unsubscribe(avbox_window_object(inst->window));
+
 		if (inst->dotdot != NULL) {
 			free(inst->dotdot);
 			inst->dotdot = NULL;
 		}
 
 		if (avbox_window_isvisible(inst->window)) {
+			avbox_input_release(avbox_window_object(inst->window));
 			avbox_window_hide(inst->window);
 		}
 
+		/* wait for the list to finish loading */
+		inst->generation++;
+		pthread_mutex_lock(&inst->load_lock);
 		mbox_library_freeplaylist(inst);
+		pthread_mutex_unlock(&inst->load_lock);
+		free(inst->cwd);
+		inst->cwd = NULL;
+		mbox_library_clearrows(inst);
+		free(inst->rows);
+		inst->rows = NULL;
 		if (inst->menu != NULL) {
-			avbox_listview_enumitems(inst->menu, mbox_library_freeitems, NULL);
 			avbox_listview_destroy(inst->menu);
 		}
 		return AVBOX_DISPATCH_OK;
 	}
 	case AVBOX_MESSAGETYPE_CLEANUP:
+		pthread_mutex_destroy(&inst->load_lock);
 		free(inst);
 		break;
 	default:
@@ -587,6 +903,7 @@ mbox_library_new(struct avbox_object *parent)
 
 	memset(inst, 0, sizeof(struct mbox_library));
 	LIST_INIT(&inst->playlist);
+	pthread_mutex_init(&inst->load_lock, NULL);
 
 	avbox_window_getcanvassize(avbox_video_getrootwindow(0), &resx, &resy);
 
@@ -627,10 +944,26 @@ mbox_library_new(struct avbox_object *parent)
 		return NULL;
 	}
 
+	/* folders can have thousands of entries so we keep them
+	 * ourselves and let the listview fetch the rows in view */
+	if (avbox_listview_setdatasource(inst->menu, mbox_library_getrow, inst) == -1) {
+		LOG_VPRINT_ERROR("Could not set data source: %s",
+			strerror(errno));
+		avbox_window_destroy(inst->window);
+		return NULL;
+	}
+
 	/* initialize context */
 	inst->parent_obj = parent;
 	inst->dotdot = NULL;
 
+	/* the servers may still be being discovered so
+	 * we list them again when they show up */
+	if (mbox_upnp_subscribe(avbox_window_object(inst->window)) == -1) {
+		LOG_VPRINT_ERROR("Could not subscribe to media servers: %s",
+			strerror(errno));
+	}
+
 	/* populate the menu */
 	mbox_library_loadlist(inst, "/");
 
@@ -644,8 +977,15 @@ mbox_library_show(struct mbox_library * const inst)
 	/* show the menu window */
         avbox_window_show(inst->window);
 
+	/* the listview passes us the keys it doesn't
+	 * handle so we can search as the user types */
+	if (avbox_input_grab(avbox_window_object(inst->window)) == -1) {
+		LOG_PRINT_ERROR("Could not grab input!");
+		return -1;
+	}
 	if (avbox_listview_focus(inst->menu) == -1) {
 		LOG_PRINT_ERROR("Could not show menu!");
+		avbox_input_release(avbox_window_object(inst->window));
 		return -1;
 	}
 
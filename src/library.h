@@ -8,6 +8,9 @@
 #include "lib/dispatch.h"
 
 
+#define LIBRARY_ROOT "/media/UPnP"
+
+
 struct mbox_library;
 
 
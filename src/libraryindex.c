@@ -0,0 +1,1480 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ *
+ * Media library index. The library tree is indexed on a SQLite
+ * database in the state directory so folders can be listed without
+ * touching the disk or the network. Local folders are kept current
+ * with inotify. Folders on network and FUSE filesystems (like the
+ * avmount UPnP mount) are rescanned every library.rescan_interval
+ * seconds. The directories are crawled in parallel on the background
+ * thread pool. The metadata of media files is extracted in the
+ * background by librarymeta.c and stored here too.
+ *
+ * Names, folders and metadata are also indexed for full text search
+ * on an FTS5 table that is kept in sync with triggers. Searches run on
+ * their own read-only connection so they never wait for the crawler.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sqlite3.h>
+
+#define LOG_MODULE "libraryindex"
+
+#include "lib/log.h"
+#include "lib/debug.h"
+#include "lib/linkedlist.h"
+#include "lib/settings.h"
+#include "lib/file_util.h"
+#include "lib/delegate.h"
+#include "lib/thread.h"
+#include "libraryindex.h"
+#include "librarymeta.h"
+
+
+#define MBOX_LIBRARYINDEX_RESCAN	(10 * 60)	/* secs */
+#define MBOX_LIBRARYINDEX_SETTLE	(250)		/* ms */
+#define MBOX_LIBRARYINDEX_BUCKETS	(64)
+#define MBOX_LIBRARYINDEX_MAXDEPTH	(32)
+#define MBOX_LIBRARYINDEX_CRAWLERS	(4)
+#define MBOX_LIBRARYINDEX_VERSION	(1)
+
+/* the metadata of a file as it's indexed for searching */
+#define MBOX_LIBRARYINDEX_METATEXT(path) \
+	"(SELECT coalesce(m.vcodec, '') || ' ' || coalesce(m.acodec, '') || ' ' || " \
+	"coalesce(m.height || 'p', '') || ' ' || coalesce(m.languages, '') " \
+	"FROM metadata m WHERE m.path = " path " AND m.valid = 1)"
+
+#define MBOX_LIBRARYINDEX_EVENTS	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+	IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | \
+	IN_ONLYDIR)
+
+
+/**
+ * A watched directory.
+ */
+LISTABLE_STRUCT(mbox_libraryindex_watch,
+	int wd;
+	char *path;
+);
+
+
+/**
+ * A directory waiting to be indexed.
+ */
+LISTABLE_STRUCT(mbox_libraryindex_dir,
+	char *path;
+	int force;		/* scan even if it seems current */
+	int recursive;		/* index the subdirectories too */
+);
+
+
+/**
+ * The contents of a directory as read from disk.
+ */
+struct mbox_libraryindex_scan
+{
+	struct mbox_libraryindex_entry *entries;
+	int n;
+	int cap;
+	int remote;
+	time_t mtime;
+};
+
+
+/* filesystems that inotify doesn't work on */
+static const long remote_fs[] =
+{
+	0x65735546,	/* fuse */
+	0x6969,		/* nfs */
+	0x517b,		/* smb */
+	0xff534d42,	/* cifs */
+	0xfe534d42,	/* smb2 */
+	0
+};
+
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t thread;
+static sqlite3 *db = NULL;
+static sqlite3 *search_db = NULL;
+static sqlite3_stmt *search_stmt = NULL;
+static char *root = NULL;
+static int rescan = MBOX_LIBRARYINDEX_RESCAN;
+static int inotify_fd = -1;
+static int wakefd = -1;
+static int quit = 0;
+static int crawling = 0;
+static int watches_full = 0;
+static LIST watches[MBOX_LIBRARYINDEX_BUCKETS];
+LIST_DECLARE_STATIC(pending);
+LIST_DECLARE_STATIC(dirty);
+
+static sqlite3_stmt *dir_stmt = NULL;
+static sqlite3_stmt *list_stmt = NULL;
+static sqlite3_stmt *subdirs_stmt = NULL;
+static sqlite3_stmt *insert_stmt = NULL;
+static sqlite3_stmt *clear_stmt = NULL;
+static sqlite3_stmt *setdir_stmt = NULL;
+static sqlite3_stmt *delfiles_stmt = NULL;
+static sqlite3_stmt *deldirs_stmt = NULL;
+static sqlite3_stmt *delmeta_stmt = NULL;
+static sqlite3_stmt *stalemeta_stmt = NULL;
+static sqlite3_stmt *unprobed_stmt = NULL;
+static sqlite3_stmt *setmeta_stmt = NULL;
+
+static const struct
+{
+	sqlite3_stmt **stmt;
+	const char *sql;
+} statements[] =
+{
+	{ &dir_stmt, "SELECT mtime, scanned, remote FROM dirs WHERE path = ?;" },
+	{ &list_stmt, "SELECT f.name, f.type, f.size, f.mtime, m.path, m.duration, "
+		"m.width, m.height, m.vcodec, m.acodec, m.audio_tracks, m.languages "
+		"FROM files f LEFT JOIN metadata m ON m.path = f.path AND "
+		"m.size = f.size AND m.mtime = f.mtime AND m.valid = 1 "
+		"WHERE f.parent = ? ORDER BY f.name COLLATE NOCASE;" },
+	{ &subdirs_stmt, "SELECT name FROM files WHERE parent = ? AND type = 1;" },
+	{ &insert_stmt, "INSERT OR REPLACE INTO files (path, parent, name, type, size, mtime) "
+		"VALUES (?, ?, ?, ?, ?, ?);" },
+	{ &clear_stmt, "DELETE FROM files WHERE parent = ?;" },
+	{ &setdir_stmt, "INSERT OR REPLACE INTO dirs (path, mtime, scanned, remote) "
+		"VALUES (?, ?, ?, ?);" },
+	{ &delfiles_stmt, "DELETE FROM files WHERE path = ?1 OR "
+		"(path > ?1 || '/' AND path < ?1 || '0');" },
+	{ &deldirs_stmt, "DELETE FROM dirs WHERE path = ?1 OR "
+		"(path > ?1 || '/' AND path < ?1 || '0');" },
+	{ &delmeta_stmt, "DELETE FROM metadata WHERE path = ?1 OR "
+		"(path > ?1 || '/' AND path < ?1 || '0');" },
+	{ &stalemeta_stmt, "DELETE FROM metadata WHERE parent = ?1 AND "
+		"path NOT IN (SELECT path FROM files WHERE parent = ?1);" },
+	{ &unprobed_stmt, "SELECT f.path, f.name, f.size, f.mtime FROM files f "
+		"LEFT JOIN metadata m ON m.path = f.path WHERE f.type = 0 AND "
+		"(m.path IS NULL OR m.size != f.size OR m.mtime != f.mtime) LIMIT ?;" },
+	{ &setmeta_stmt, "INSERT OR REPLACE INTO metadata (path, parent, size, mtime, "
+		"valid, duration, width, height, vcodec, acodec, audio_tracks, languages) "
+		"VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);" },
+	{ NULL, NULL }
+};
+
+
+/**
+ * Gets the monotonic time in msecs.
+ */
+static int64_t
+mbox_libraryindex_now(void)
+{
+	struct timespec tv;
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	return (tv.tv_sec * 1000LL) + (tv.tv_nsec / 1000000LL);
+}
+
+
+/**
+ * Read the metadata columns of a row. Returns NULL if the
+ * file has not been probed.
+ */
+static const struct mbox_libraryindex_metadata *
+mbox_libraryindex_getmeta(sqlite3_stmt * const stmt, const int col,
+	struct mbox_libraryindex_metadata * const meta)
+{
+	if (sqlite3_column_type(stmt, col) == SQLITE_NULL) {
+		return NULL;
+	}
+	meta->duration = sqlite3_column_int64(stmt, col + 1);
+	meta->width = sqlite3_column_int(stmt, col + 2);
+	meta->height = sqlite3_column_int(stmt, col + 3);
+	meta->vcodec = (const char*) sqlite3_column_text(stmt, col + 4);
+	meta->acodec = (const char*) sqlite3_column_text(stmt, col + 5);
+	meta->audio_tracks = sqlite3_column_int(stmt, col + 6);
+	meta->languages = (const char*) sqlite3_column_text(stmt, col + 7);
+	return meta;
+}
+
+
+/**
+ * Wake the index thread.
+ */
+static void
+mbox_libraryindex_wake(void)
+{
+	const uint64_t one = 1;
+	if (wakefd != -1 && write(wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+		LOG_VPRINT_ERROR("Could not wake index thread: %s",
+			strerror(errno));
+	}
+}
+
+
+/**
+ * Checks if a directory is on a filesystem that inotify
+ * doesn't work on.
+ */
+static int
+mbox_libraryindex_isremote(const char * const path)
+{
+	int i;
+	struct statfs st;
+	if (statfs(path, &st) == -1) {
+		return 0;
+	}
+	for (i = 0; remote_fs[i] != 0; i++) {
+		if ((long) (uint32_t) st.f_type == remote_fs[i]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Add a directory to a list unless it's already there.
+ * The index lock must be held.
+ */
+static void
+mbox_libraryindex_queue(LIST * const list, const char * const path,
+	const int force, const int recursive)
+{
+	struct mbox_libraryindex_dir *dir;
+
+	LIST_FOREACH(struct mbox_libraryindex_dir*, dir, list) {
+		if (!strcmp(dir->path, path)) {
+			dir->force |= force;
+			dir->recursive |= recursive;
+			return;
+		}
+	}
+
+	if ((dir = malloc(sizeof(struct mbox_libraryindex_dir))) == NULL ||
+		(dir->path = strdup(path)) == NULL) {
+		LOG_VPRINT_ERROR("Could not queue '%s': Out of memory", path);
+		free(dir);
+		return;
+	}
+	dir->force = force;
+	dir->recursive = recursive;
+	LIST_APPEND(list, dir);
+}
+
+
+/**
+ * Free a directory list.
+ */
+static void
+mbox_libraryindex_freedirs(LIST * const list)
+{
+	struct mbox_libraryindex_dir *dir;
+	LIST_FOREACH_SAFE(struct mbox_libraryindex_dir*, dir, list, {
+		LIST_REMOVE(dir);
+		free(dir->path);
+		free(dir);
+	});
+}
+
+
+/**
+ * Watch a local directory for changes. The index lock
+ * must be held.
+ */
+static void
+mbox_libraryindex_watch(const char * const path)
+{
+	int wd;
+	char *copy;
+	struct mbox_libraryindex_watch *watch;
+
+	if (inotify_fd == -1 || watches_full) {
+		return;
+	}
+
+	if ((wd = inotify_add_watch(inotify_fd, path, MBOX_LIBRARYINDEX_EVENTS)) == -1) {
+		if (errno == ENOSPC) {
+			LOG_PRINT_ERROR("Out of inotify watches. Some folders will "
+				"only be updated when rescanned");
+			watches_full = 1;
+		} else {
+			LOG_VPRINT_ERROR("Could not watch '%s': %s",
+				path, strerror(errno));
+		}
+		return;
+	}
+
+	/* the same directory always gets the same descriptor */
+	LIST_FOREACH(struct mbox_libraryindex_watch*, watch,
+		&watches[wd % MBOX_LIBRARYINDEX_BUCKETS]) {
+		if (watch->wd == wd) {
+			if (strcmp(watch->path, path) && (copy = strdup(path)) != NULL) {
+				free(watch->path);
+				watch->path = copy;
+			}
+			return;
+		}
+	}
+
+	if ((watch = malloc(sizeof(struct mbox_libraryindex_watch))) == NULL ||
+		(watch->path = strdup(path)) == NULL) {
+		LOG_VPRINT_ERROR("Could not watch '%s': Out of memory", path);
+		free(watch);
+		inotify_rm_watch(inotify_fd, wd);
+		return;
+	}
+	watch->wd = wd;
+	LIST_ADD(&watches[wd % MBOX_LIBRARYINDEX_BUCKETS], watch);
+}
+
+
+/**
+ * Find a watch by descriptor. The index lock must be held.
+ */
+static struct mbox_libraryindex_watch *
+mbox_libraryindex_getwatch(const int wd)
+{
+	struct mbox_libraryindex_watch *watch;
+	LIST_FOREACH(struct mbox_libraryindex_watch*, watch,
+		&watches[wd % MBOX_LIBRARYINDEX_BUCKETS]) {
+		if (watch->wd == wd) {
+			return watch;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Free the contents of a scan.
+ */
+static void
+mbox_libraryindex_freescan(struct mbox_libraryindex_scan * const scan)
+{
+	int i;
+	for (i = 0; i < scan->n; i++) {
+		free((void*) scan->entries[i].name);
+	}
+	free(scan->entries);
+	scan->entries = NULL;
+	scan->n = scan->cap = 0;
+}
+
+
+static int
+mbox_libraryindex_compare(const void *a, const void *b)
+{
+	return strcmp(((const struct mbox_libraryindex_entry*) a)->name,
+		((const struct mbox_libraryindex_entry*) b)->name);
+}
+
+
+static int
+mbox_libraryindex_comparecase(const void *a, const void *b)
+{
+	return strcasecmp(((const struct mbox_libraryindex_entry*) a)->name,
+		((const struct mbox_libraryindex_entry*) b)->name);
+}
+
+
+/**
+ * Read a directory from disk. The entries are sorted
+ * by name.
+ */
+static int
+mbox_libraryindex_scan(const char * const path, struct mbox_libraryindex_scan * const scan)
+{
+	DIR *dir;
+	struct dirent *ent;
+	struct stat st;
+
+	memset(scan, 0, sizeof(struct mbox_libraryindex_scan));
+
+	if ((dir = opendir(path)) == NULL) {
+		LOG_VPRINT_ERROR("Cannot open directory '%s': %s",
+			path, strerror(errno));
+		return -1;
+	}
+	if (fstat(dirfd(dir), &st) == 0) {
+		scan->mtime = st.st_mtime;
+	}
+	scan->remote = mbox_libraryindex_isremote(path);
+
+	while ((ent = readdir(dir)) != NULL) {
+		struct mbox_libraryindex_entry *entry;
+
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+			continue;
+		}
+		if (fstatat(dirfd(dir), ent->d_name, &st, 0) == -1) {
+			DEBUG_VPRINT("libraryindex", "Could not stat '%s/%s': %s",
+				path, ent->d_name, strerror(errno));
+			continue;
+		}
+
+		if (scan->n == scan->cap) {
+			const int cap = (scan->cap == 0) ? 64 : scan->cap * 2;
+			struct mbox_libraryindex_entry *entries;
+			if ((entries = realloc(scan->entries, cap * sizeof(*entries))) == NULL) {
+				goto nomem;
+			}
+			scan->entries = entries;
+			scan->cap = cap;
+		}
+
+		entry = &scan->entries[scan->n];
+		if ((entry->name = strdup(ent->d_name)) == NULL) {
+			goto nomem;
+		}
+		entry->path = NULL;
+		entry->meta = NULL;
+		entry->isdir = S_ISDIR(st.st_mode);
+		entry->size = st.st_size;
+		entry->mtime = st.st_mtime;
+		scan->n++;
+	}
+	closedir(dir);
+
+	if (scan->n > 1) {
+		qsort(scan->entries, scan->n, sizeof(struct mbox_libraryindex_entry),
+			mbox_libraryindex_compare);
+	}
+	return 0;
+
+nomem:
+	LOG_VPRINT_ERROR("Could not scan '%s': Out of memory", path);
+	closedir(dir);
+	mbox_libraryindex_freescan(scan);
+	errno = ENOMEM;
+	return -1;
+}
+
+
+/**
+ * Remove a directory and everything under it from the
+ * index. The index lock must be held.
+ */
+static void
+mbox_libraryindex_remove(const char * const path)
+{
+	DEBUG_VPRINT("libraryindex", "Removing '%s'", path);
+
+	sqlite3_bind_text(delfiles_stmt, 1, path, -1, SQLITE_STATIC);
+	if (sqlite3_step(delfiles_stmt) != SQLITE_DONE) {
+		LOG_VPRINT_ERROR("Could not remove '%s': %s",
+			path, sqlite3_errmsg(db));
+	}
+	sqlite3_reset(delfiles_stmt);
+
+	sqlite3_bind_text(deldirs_stmt, 1, path, -1, SQLITE_STATIC);
+	if (sqlite3_step(deldirs_stmt) != SQLITE_DONE) {
+		LOG_VPRINT_ERROR("Could not remove '%s': %s",
+			path, sqlite3_errmsg(db));
+	}
+	sqlite3_reset(deldirs_stmt);
+
+	sqlite3_bind_text(delmeta_stmt, 1, path, -1, SQLITE_STATIC);
+	if (sqlite3_step(delmeta_stmt) != SQLITE_DONE) {
+		LOG_VPRINT_ERROR("Could not remove '%s': %s",
+			path, sqlite3_errmsg(db));
+	}
+	sqlite3_reset(delmeta_stmt);
+}
+
+
+/**
+ * Checks if a directory has been indexed. The index lock
+ * must be held.
+ */
+static int
+mbox_libraryindex_isindexed(const char * const path, time_t * const mtime,
+	time_t * const scanned)
+{
+	int ret = 0;
+	sqlite3_bind_text(dir_stmt, 1, path, -1, SQLITE_STATIC);
+	if (sqlite3_step(dir_stmt) == SQLITE_ROW) {
+		if (mtime != NULL) {
+			*mtime = (time_t) sqlite3_column_int64(dir_stmt, 0);
+		}
+		if (scanned != NULL) {
+			*scanned = (time_t) sqlite3_column_int64(dir_stmt, 1);
+		}
+		ret = 1;
+	}
+	sqlite3_reset(dir_stmt);
+	return ret;
+}
+
+
+/**
+ * Save a directory scan to the index. Subdirectories that are
+ * gone are removed with everything under them and the new ones
+ * are queued for indexing if queue_new is set. The index lock
+ * must be held.
+ */
+static int
+mbox_libraryindex_store(const char * const path,
+	const struct mbox_libraryindex_scan * const scan, const int queue_new)
+{
+	int i, ret = -1, files = 0;
+	char child[PATH_MAX];
+
+	if (sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not begin transaction: %s",
+			sqlite3_errmsg(db));
+		return -1;
+	}
+
+	/* remove the subdirectories that are gone */
+	sqlite3_bind_text(subdirs_stmt, 1, path, -1, SQLITE_STATIC);
+	while (sqlite3_step(subdirs_stmt) == SQLITE_ROW) {
+		struct mbox_libraryindex_entry key, *found;
+		key.name = (const char*) sqlite3_column_text(subdirs_stmt, 0);
+		if (key.name == NULL) {
+			continue;
+		}
+		found = bsearch(&key, scan->entries, scan->n,
+			sizeof(struct mbox_libraryindex_entry), mbox_libraryindex_compare);
+		if (found == NULL || !found->isdir) {
+			snprintf(child, sizeof(child), "%s/%s", path, key.name);
+			mbox_libraryindex_remove(child);
+		}
+	}
+	sqlite3_reset(subdirs_stmt);
+
+	sqlite3_bind_text(clear_stmt, 1, path, -1, SQLITE_STATIC);
+	if (sqlite3_step(clear_stmt) != SQLITE_DONE) {
+		LOG_VPRINT_ERROR("Could not clear '%s': %s",
+			path, sqlite3_errmsg(db));
+		sqlite3_reset(clear_stmt);
+		goto end;
+	}
+	sqlite3_reset(clear_stmt);
+
+	for (i = 0; i < scan->n; i++) {
+		const struct mbox_libraryindex_entry * const entry = &scan->entries[i];
+		snprintf(child, sizeof(child), "%s/%s", path, entry->name);
+
+		if (queue_new && entry->isdir && !mbox_libraryindex_isindexed(child, NULL, NULL)) {
+			mbox_libraryindex_queue(&pending, child, 0, 1);
+		}
+
+		sqlite3_bind_text(insert_stmt, 1, child, -1, SQLITE_STATIC);
+		sqlite3_bind_text(insert_stmt, 2, path, -1, SQLITE_STATIC);
+		sqlite3_bind_text(insert_stmt, 3, entry->name, -1, SQLITE_STATIC);
+		sqlite3_bind_int(insert_stmt, 4, entry->isdir);
+		sqlite3_bind_int64(insert_stmt, 5, (sqlite3_int64) entry->size);
+		sqlite3_bind_int64(insert_stmt, 6, (sqlite3_int64) entry->mtime);
+		if (sqlite3_step(insert_stmt) != SQLITE_DONE) {
+			LOG_VPRINT_ERROR("Could not index '%s': %s",
+				child, sqlite3_errmsg(db));
+			sqlite3_reset(insert_stmt);
+			goto end;
+		}
+		sqlite3_reset(insert_stmt);
+		if (!entry->isdir) {
+			files++;
+		}
+	}
+
+	/* drop the metadata of files that are gone */
+	sqlite3_bind_text(stalemeta_stmt, 1, path, -1, SQLITE_STATIC);
+	if (sqlite3_step(stalemeta_stmt) != SQLITE_DONE) {
+		LOG_VPRINT_ERROR("Could not clear metadata of '%s': %s",
+			path, sqlite3_errmsg(db));
+		sqlite3_reset(stalemeta_stmt);
+		goto end;
+	}
+	sqlite3_reset(stalemeta_stmt);
+
+	sqlite3_bind_text(setdir_stmt, 1, path, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(setdir_stmt, 2, (sqlite3_int64) scan->mtime);
+	sqlite3_bind_int64(setdir_stmt, 3, (sqlite3_int64) time(NULL));
+	sqlite3_bind_int(setdir_stmt, 4, scan->remote);
+	if (sqlite3_step(setdir_stmt) != SQLITE_DONE) {
+		LOG_VPRINT_ERROR("Could not index '%s': %s",
+			path, sqlite3_errmsg(db));
+		sqlite3_reset(setdir_stmt);
+		goto end;
+	}
+	sqlite3_reset(setdir_stmt);
+
+	ret = 0;
+end:
+	if (sqlite3_exec(db, (ret == 0) ? "COMMIT;" : "ROLLBACK;",
+		NULL, NULL, NULL) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not end transaction: %s",
+			sqlite3_errmsg(db));
+		ret = -1;
+	}
+	if (queue_new) {
+		mbox_libraryindex_wake();
+	}
+	if (ret == 0 && files > 0) {
+		mbox_librarymeta_wake();
+	}
+	return ret;
+}
+
+
+/**
+ * Bring the index of a directory up to date. Local directories
+ * are only scanned if their mtime changed and remote ones if
+ * they've not been scanned for a while, unless force is set.
+ */
+static int
+mbox_libraryindex_refresh(const char * const path, const int force,
+	const int queue_new)
+{
+	struct stat st;
+	time_t mtime, scanned;
+	int remote, indexed;
+	struct mbox_libraryindex_scan scan;
+
+	if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+		pthread_mutex_lock(&index_lock);
+		mbox_libraryindex_remove(path);
+		pthread_mutex_unlock(&index_lock);
+		return -1;
+	}
+
+	remote = mbox_libraryindex_isremote(path);
+
+	pthread_mutex_lock(&index_lock);
+	indexed = mbox_libraryindex_isindexed(path, &mtime, &scanned);
+	if (!remote) {
+		/* watch it before reading it so we don't miss
+		 * any changes */
+		mbox_libraryindex_watch(path);
+	}
+	pthread_mutex_unlock(&index_lock);
+
+	if (!force && indexed) {
+		if (remote ? (time(NULL) - scanned < rescan) : (mtime == st.st_mtime)) {
+			return 0;
+		}
+	}
+
+	DEBUG_VPRINT("libraryindex", "Indexing '%s'", path);
+
+	if (mbox_libraryindex_scan(path, &scan) == -1) {
+		return -1;
+	}
+	pthread_mutex_lock(&index_lock);
+	(void) mbox_libraryindex_store(path, &scan, queue_new);
+	pthread_mutex_unlock(&index_lock);
+	mbox_libraryindex_freescan(&scan);
+	return 0;
+}
+
+
+/**
+ * Index a directory from the queue.
+ */
+static void
+mbox_libraryindex_process(struct mbox_libraryindex_dir * const dir)
+{
+	int depth = 0;
+	const char *p;
+	char child[PATH_MAX];
+
+	if (mbox_libraryindex_refresh(dir->path, dir->force, !dir->recursive) == -1 ||
+		!dir->recursive) {
+		return;
+	}
+
+	/* don't follow symlink loops forever */
+	for (p = dir->path + strlen(root); *p != '\0'; p++) {
+		if (*p == '/') {
+			depth++;
+		}
+	}
+	if (depth >= MBOX_LIBRARYINDEX_MAXDEPTH) {
+		return;
+	}
+
+	pthread_mutex_lock(&index_lock);
+	sqlite3_bind_text(subdirs_stmt, 1, dir->path, -1, SQLITE_STATIC);
+	while (sqlite3_step(subdirs_stmt) == SQLITE_ROW) {
+		const char * const name = (const char*) sqlite3_column_text(subdirs_stmt, 0);
+		if (name != NULL) {
+			snprintf(child, sizeof(child), "%s/%s", dir->path, name);
+			mbox_libraryindex_queue(&pending, child, 0, 1);
+		}
+	}
+	sqlite3_reset(subdirs_stmt);
+	pthread_mutex_unlock(&index_lock);
+}
+
+
+/**
+ * Read inotify events. The directories that changed are
+ * rescanned once the events settle.
+ */
+static int
+mbox_libraryindex_readevents(void)
+{
+	ssize_t len;
+	char *p;
+	int ret = 0;
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+		pthread_mutex_lock(&index_lock);
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) +
+			((struct inotify_event*) p)->len) {
+			const struct inotify_event * const ev = (struct inotify_event*) p;
+			struct mbox_libraryindex_watch *watch;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				LOG_PRINT_ERROR("Lost inotify events. Rescanning");
+				mbox_libraryindex_queue(&pending, root, 0, 1);
+				continue;
+			}
+			if ((watch = mbox_libraryindex_getwatch(ev->wd)) == NULL) {
+				continue;
+			}
+			if (ev->mask & IN_IGNORED) {
+				LIST_REMOVE(watch);
+				free(watch->path);
+				free(watch);
+				continue;
+			}
+			mbox_libraryindex_queue(&dirty, watch->path, 1, 0);
+			ret = 1;
+		}
+		pthread_mutex_unlock(&index_lock);
+	}
+	return ret;
+}
+
+
+/**
+ * Index pending directories until there are none left. Several
+ * of these run at once so a slow directory doesn't hold up the
+ * rest. Only the scans overlap, the index is still updated
+ * under index_lock.
+ */
+static void
+mbox_libraryindex_crawlslice(void *arg, int start, int end)
+{
+	struct mbox_libraryindex_dir *dir;
+
+	(void) arg;
+	(void) start;
+	(void) end;
+
+	while (1) {
+		pthread_mutex_lock(&index_lock);
+		if (quit || LIST_EMPTY(&pending)) {
+			pthread_mutex_unlock(&index_lock);
+			break;
+		}
+		dir = LIST_NEXT(struct mbox_libraryindex_dir*, &pending);
+		LIST_REMOVE(dir);
+		pthread_mutex_unlock(&index_lock);
+
+		mbox_libraryindex_process(dir);
+		free(dir->path);
+		free(dir);
+	}
+}
+
+
+/**
+ * Crawls the pending directories on the background pool
+ * until there are none left.
+ */
+static void *
+mbox_libraryindex_crawl(void *arg)
+{
+	int done = 0;
+
+	(void) arg;
+
+	while (!done) {
+		if (avbox_thread_parallel_for(0, MBOX_LIBRARYINDEX_CRAWLERS, 1,
+			mbox_libraryindex_crawlslice, NULL) == -1) {
+			mbox_libraryindex_crawlslice(NULL, 0, 1);
+		}
+
+		/* a slice may have given up while another one was
+		 * still queueing subdirectories */
+		pthread_mutex_lock(&index_lock);
+		if (quit || LIST_EMPTY(&pending)) {
+			crawling = 0;
+			done = 1;
+		}
+		pthread_mutex_unlock(&index_lock);
+	}
+
+	/* let the index thread collect us */
+	mbox_libraryindex_wake();
+	return NULL;
+}
+
+
+/**
+ * Index thread. It schedules the crawls and watches
+ * for changes.
+ */
+static void *
+mbox_libraryindex_thread(void *arg)
+{
+	int64_t now, next_rescan = 0, settle = -1;
+	int timeout;
+	uint64_t cnt;
+	struct pollfd fds[2];
+	struct mbox_libraryindex_dir *dir;
+	struct avbox_delegate *crawler = NULL;
+
+	(void) arg;
+
+	DEBUG_SET_THREAD_NAME("libraryindex");
+
+	while (!quit) {
+		now = mbox_libraryindex_now();
+		dir = NULL;
+
+		pthread_mutex_lock(&index_lock);
+		if (now >= next_rescan) {
+			mbox_libraryindex_queue(&pending, root, 0, 1);
+			next_rescan = now + (rescan * 1000LL);
+		}
+		if (settle != -1 && now >= settle) {
+			LIST_FOREACH_SAFE(struct mbox_libraryindex_dir*, dir, &dirty, {
+				LIST_REMOVE(dir);
+				mbox_libraryindex_queue(&pending, dir->path, dir->force, dir->recursive);
+				free(dir->path);
+				free(dir);
+			});
+			dir = NULL;
+			settle = -1;
+		}
+		if (!crawling && !LIST_EMPTY(&pending)) {
+			/* the last crawl is done or about to be */
+			if (crawler != NULL) {
+				avbox_delegate_wait(crawler, NULL);
+				crawler = NULL;
+			}
+			if ((crawler = avbox_thread_delegate_qos(mbox_libraryindex_crawl,
+				NULL, AVBOX_THREAD_QOS_BACKGROUND)) != NULL) {
+				crawling = 1;
+			} else {
+				/* crawl one directory ourselves */
+				LOG_VPRINT_ERROR("Could not start crawler: %s",
+					strerror(errno));
+				dir = LIST_NEXT(struct mbox_libraryindex_dir*, &pending);
+				LIST_REMOVE(dir);
+			}
+		}
+		pthread_mutex_unlock(&index_lock);
+
+		if (dir != NULL) {
+			mbox_libraryindex_process(dir);
+			free(dir->path);
+			free(dir);
+			timeout = 0;
+		} else {
+			timeout = (int) (next_rescan - now);
+			if (settle != -1 && settle - now < timeout) {
+				timeout = (int) (settle - now);
+			}
+		}
+
+		fds[0].fd = inotify_fd;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		fds[1].fd = wakefd;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+		if (poll(fds, 2, timeout) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG_VPRINT_ERROR("poll() failed: %s", strerror(errno));
+			break;
+		}
+		if (fds[1].revents & POLLIN) {
+			(void) read(wakefd, &cnt, sizeof(cnt));
+		}
+		if ((fds[0].revents & POLLIN) && mbox_libraryindex_readevents()) {
+			settle = mbox_libraryindex_now() + MBOX_LIBRARYINDEX_SETTLE;
+		}
+	}
+
+	/* the crawler stops after the current directory */
+	if (crawler != NULL) {
+		avbox_delegate_wait(crawler, NULL);
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Strip the trailing slashes of a path.
+ */
+static void
+mbox_libraryindex_normalize(char * const dst, const size_t n, const char * const path)
+{
+	size_t len;
+	snprintf(dst, n, "%s", path);
+	len = strlen(dst);
+	while (len > 1 && dst[len - 1] == '/') {
+		dst[--len] = '\0';
+	}
+}
+
+
+/**
+ * List a directory from the index.
+ */
+int
+mbox_libraryindex_list(const char * const path,
+	mbox_libraryindex_callback callback, void *context)
+{
+	int i, ret = 0;
+	char dirpath[PATH_MAX], child[PATH_MAX];
+	struct mbox_libraryindex_entry entry;
+	struct mbox_libraryindex_metadata meta;
+	struct mbox_libraryindex_scan scan;
+
+	mbox_libraryindex_normalize(dirpath, sizeof(dirpath), path);
+
+	pthread_mutex_lock(&index_lock);
+	if (db != NULL && mbox_libraryindex_isindexed(dirpath, NULL, NULL)) {
+		sqlite3_bind_text(list_stmt, 1, dirpath, -1, SQLITE_STATIC);
+		while (sqlite3_step(list_stmt) == SQLITE_ROW) {
+			entry.name = (const char*) sqlite3_column_text(list_stmt, 0);
+			if (entry.name == NULL) {
+				continue;
+			}
+			snprintf(child, sizeof(child), "%s/%s", dirpath, entry.name);
+			entry.path = child;
+			entry.isdir = sqlite3_column_int(list_stmt, 1);
+			entry.size = sqlite3_column_int64(list_stmt, 2);
+			entry.mtime = (time_t) sqlite3_column_int64(list_stmt, 3);
+			entry.meta = mbox_libraryindex_getmeta(list_stmt, 4, &meta);
+			if (callback(&entry, context) == -1) {
+				break;
+			}
+		}
+		sqlite3_reset(list_stmt);
+		pthread_mutex_unlock(&index_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&index_lock);
+
+	/* it's not indexed yet so read it now */
+	if (mbox_libraryindex_scan(dirpath, &scan) == -1) {
+		return -1;
+	}
+	if (db != NULL) {
+		pthread_mutex_lock(&index_lock);
+		if (!mbox_libraryindex_isremote(dirpath)) {
+			mbox_libraryindex_watch(dirpath);
+		}
+		(void) mbox_libraryindex_store(dirpath, &scan, 1);
+		pthread_mutex_unlock(&index_lock);
+	}
+
+	qsort(scan.entries, scan.n, sizeof(struct mbox_libraryindex_entry),
+		mbox_libraryindex_comparecase);
+	for (i = 0; i < scan.n; i++) {
+		snprintf(child, sizeof(child), "%s/%s", dirpath, scan.entries[i].name);
+		scan.entries[i].path = child;
+		if (callback(&scan.entries[i], context) == -1) {
+			break;
+		}
+	}
+	mbox_libraryindex_freescan(&scan);
+	return ret;
+}
+
+
+/**
+ * Search the index.
+ */
+int
+mbox_libraryindex_search(const char * const terms,
+	mbox_libraryindex_callback callback, void *context, const int max)
+{
+	int n = 0, res;
+	const char *src;
+	char query[512], *dst = query;
+	int64_t start;
+	struct mbox_libraryindex_entry entry;
+	struct mbox_libraryindex_metadata meta;
+
+	/* match every word as a prefix */
+	for (src = terms; *src != '\0'; ) {
+		while (*src == ' ') {
+			src++;
+		}
+		if (*src == '\0') {
+			break;
+		}
+		if (dst + 4 >= query + sizeof(query)) {
+			break;
+		}
+		if (dst != query) {
+			*dst++ = ' ';
+		}
+		*dst++ = '"';
+		while (*src != '\0' && *src != ' ' && dst + 4 < query + sizeof(query)) {
+			if (*src == '"') {
+				*dst++ = '"';
+			}
+			*dst++ = *src++;
+		}
+		*dst++ = '"';
+		*dst++ = '*';
+		while (*src != '\0' && *src != ' ') {
+			src++;
+		}
+	}
+	*dst = '\0';
+	if (query[0] == '\0') {
+		return 0;
+	}
+
+	start = mbox_libraryindex_now();
+
+	pthread_mutex_lock(&search_lock);
+	if (search_stmt == NULL) {
+		pthread_mutex_unlock(&search_lock);
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/* results are not ranked. Ranking needs all the matches
+	 * and short prefixes can match most of the library */
+	sqlite3_bind_text(search_stmt, 1, query, -1, SQLITE_STATIC);
+	sqlite3_bind_int(search_stmt, 2, max);
+	while ((res = sqlite3_step(search_stmt)) == SQLITE_ROW) {
+		entry.path = (const char*) sqlite3_column_text(search_stmt, 0);
+		entry.name = (const char*) sqlite3_column_text(search_stmt, 1);
+		if (entry.path == NULL || entry.name == NULL) {
+			continue;
+		}
+		entry.isdir = sqlite3_column_int(search_stmt, 2);
+		entry.size = sqlite3_column_int64(search_stmt, 3);
+		entry.mtime = (time_t) sqlite3_column_int64(search_stmt, 4);
+		entry.meta = mbox_libraryindex_getmeta(search_stmt, 5, &meta);
+		n++;
+		if (callback(&entry, context) == -1) {
+			res = SQLITE_DONE;
+			break;
+		}
+	}
+	if (res != SQLITE_DONE) {
+		LOG_VPRINT_ERROR("Could not search for '%s': %s",
+			query, sqlite3_errmsg(search_db));
+	}
+	sqlite3_reset(search_stmt);
+	pthread_mutex_unlock(&search_lock);
+
+	DEBUG_VPRINT("libraryindex", "Search for '%s' returned %i results in %" PRIi64 "ms",
+		query, n, mbox_libraryindex_now() - start);
+
+	return n;
+}
+
+
+/**
+ * Get the files that have not been probed.
+ */
+int
+mbox_libraryindex_unprobed(mbox_libraryindex_callback callback,
+	void *context, const int max)
+{
+	int n = 0;
+	struct mbox_libraryindex_entry entry;
+
+	pthread_mutex_lock(&index_lock);
+	if (db == NULL) {
+		pthread_mutex_unlock(&index_lock);
+		return 0;
+	}
+	sqlite3_bind_int(unprobed_stmt, 1, max);
+	while (sqlite3_step(unprobed_stmt) == SQLITE_ROW) {
+		entry.path = (const char*) sqlite3_column_text(unprobed_stmt, 0);
+		entry.name = (const char*) sqlite3_column_text(unprobed_stmt, 1);
+		if (entry.path == NULL || entry.name == NULL) {
+			continue;
+		}
+		entry.isdir = 0;
+		entry.size = sqlite3_column_int64(unprobed_stmt, 2);
+		entry.mtime = (time_t) sqlite3_column_int64(unprobed_stmt, 3);
+		entry.meta = NULL;
+		n++;
+		if (callback(&entry, context) == -1) {
+			break;
+		}
+	}
+	sqlite3_reset(unprobed_stmt);
+	pthread_mutex_unlock(&index_lock);
+	return n;
+}
+
+
+/**
+ * Save the metadata of a file.
+ */
+int
+mbox_libraryindex_setmetadata(const char * const path, const int64_t size,
+	const time_t mtime, const struct mbox_libraryindex_metadata * const meta)
+{
+	int i, ret = 0;
+	char parent[PATH_MAX], *sep;
+
+	snprintf(parent, sizeof(parent), "%s", path);
+	if ((sep = strrchr(parent, '/')) != NULL) {
+		*sep = '\0';
+	}
+
+	pthread_mutex_lock(&index_lock);
+	if (db == NULL) {
+		pthread_mutex_unlock(&index_lock);
+		errno = ENOENT;
+		return -1;
+	}
+	sqlite3_bind_text(setmeta_stmt, 1, path, -1, SQLITE_STATIC);
+	sqlite3_bind_text(setmeta_stmt, 2, parent, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(setmeta_stmt, 3, (sqlite3_int64) size);
+	sqlite3_bind_int64(setmeta_stmt, 4, (sqlite3_int64) mtime);
+	sqlite3_bind_int(setmeta_stmt, 5, meta != NULL);
+	if (meta != NULL) {
+		sqlite3_bind_int64(setmeta_stmt, 6, (sqlite3_int64) meta->duration);
+		sqlite3_bind_int(setmeta_stmt, 7, meta->width);
+		sqlite3_bind_int(setmeta_stmt, 8, meta->height);
+		sqlite3_bind_text(setmeta_stmt, 9, meta->vcodec, -1, SQLITE_STATIC);
+		sqlite3_bind_text(setmeta_stmt, 10, meta->acodec, -1, SQLITE_STATIC);
+		sqlite3_bind_int(setmeta_stmt, 11, meta->audio_tracks);
+		sqlite3_bind_text(setmeta_stmt, 12, meta->languages, -1, SQLITE_STATIC);
+	} else {
+		/* remember the failure so we don't probe it again */
+		for (i = 6; i <= 12; i++) {
+			sqlite3_bind_null(setmeta_stmt, i);
+		}
+	}
+	if (sqlite3_step(setmeta_stmt) != SQLITE_DONE) {
+		LOG_VPRINT_ERROR("Could not save metadata of '%s': %s",
+			path, sqlite3_errmsg(db));
+		errno = EIO;
+		ret = -1;
+	}
+	sqlite3_reset(setmeta_stmt);
+	pthread_mutex_unlock(&index_lock);
+	return ret;
+}
+
+
+/**
+ * Close the search connection.
+ */
+static void
+mbox_libraryindex_closesearch(void)
+{
+	pthread_mutex_lock(&search_lock);
+	sqlite3_finalize(search_stmt);
+	search_stmt = NULL;
+	sqlite3_close(search_db);
+	search_db = NULL;
+	pthread_mutex_unlock(&search_lock);
+}
+
+
+/**
+ * Setup the search index. Folder names are indexed relative
+ * to the library root so the root doesn't match everything.
+ * The triggers are temporary because of that.
+ */
+static int
+mbox_libraryindex_initsearch(const char * const dbfile)
+{
+	int res, version = 0;
+	char *sql;
+	sqlite3_stmt *stmt;
+	const int skip = strlen(root) + 2;
+
+	if ((sql = sqlite3_mprintf(
+		"CREATE VIRTUAL TABLE IF NOT EXISTS search USING fts5("
+		"title, dir, meta, prefix = '1 2 3', "
+		"tokenize = 'unicode61 remove_diacritics 1');"
+		"CREATE TEMP TRIGGER search_insert AFTER INSERT ON main.files BEGIN "
+		"INSERT INTO search (rowid, title, dir, meta) VALUES (new.rowid, new.name, "
+		"substr(new.parent, %d), " MBOX_LIBRARYINDEX_METATEXT("new.path") "); END;"
+		"CREATE TEMP TRIGGER search_delete AFTER DELETE ON main.files BEGIN "
+		"DELETE FROM search WHERE rowid = old.rowid; END;"
+		"CREATE TEMP TRIGGER search_meta AFTER INSERT ON main.metadata BEGIN "
+		"UPDATE search SET meta = " MBOX_LIBRARYINDEX_METATEXT("new.path")
+		" WHERE rowid = (SELECT rowid FROM files WHERE path = new.path); END;",
+		skip)) == NULL) {
+		return -1;
+	}
+	res = sqlite3_exec(db, sql, NULL, NULL, NULL);
+	sqlite3_free(sql);
+	if (res != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not create search index: %s (%d)",
+			sqlite3_errmsg(db), res);
+		return -1;
+	}
+
+	/* index the files that were indexed before
+	 * there was a search index */
+	if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			version = sqlite3_column_int(stmt, 0);
+		}
+		sqlite3_finalize(stmt);
+	}
+	if (version < MBOX_LIBRARYINDEX_VERSION) {
+		DEBUG_PRINT("libraryindex", "Building search index");
+		if ((sql = sqlite3_mprintf(
+			"BEGIN;"
+			"DELETE FROM search;"
+			"INSERT INTO search (rowid, title, dir, meta) "
+			"SELECT f.rowid, f.name, substr(f.parent, %d), "
+			MBOX_LIBRARYINDEX_METATEXT("f.path") " FROM files f;"
+			"PRAGMA user_version = %d;"
+			"COMMIT;", skip, MBOX_LIBRARYINDEX_VERSION)) == NULL) {
+			return -1;
+		}
+		res = sqlite3_exec(db, sql, NULL, NULL, NULL);
+		sqlite3_free(sql);
+		if (res != SQLITE_OK) {
+			LOG_VPRINT_ERROR("Could not build search index: %s (%d)",
+				sqlite3_errmsg(db), res);
+			(void) sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&search_lock);
+	if ((res = sqlite3_open_v2(dbfile, &search_db,
+		SQLITE_OPEN_READONLY, NULL)) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not open database '%s': %s (%d)",
+			dbfile, sqlite3_errmsg(search_db), res);
+		goto err;
+	}
+	if (sqlite3_prepare_v2(search_db,
+		"SELECT f.path, f.name, f.type, f.size, f.mtime, m.path, m.duration, "
+		"m.width, m.height, m.vcodec, m.acodec, m.audio_tracks, m.languages "
+		"FROM search JOIN files f ON f.rowid = search.rowid "
+		"LEFT JOIN metadata m ON m.path = f.path AND m.size = f.size AND "
+		"m.mtime = f.mtime AND m.valid = 1 "
+		"WHERE search MATCH ? LIMIT ?;", -1, &search_stmt, NULL) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not prepare search: %s",
+			sqlite3_errmsg(search_db));
+		goto err;
+	}
+	pthread_mutex_unlock(&search_lock);
+	return 0;
+err:
+	sqlite3_close(search_db);
+	search_db = NULL;
+	pthread_mutex_unlock(&search_lock);
+	return -1;
+}
+
+
+/**
+ * Initialize the library index.
+ */
+int
+mbox_libraryindex_init(const char * const path)
+{
+	int i, res;
+	char *statedir, dbfile[PATH_MAX], resolved[PATH_MAX];
+
+	DEBUG_PRINT("libraryindex", "Initializing library index");
+
+	LIST_INIT(&pending);
+	LIST_INIT(&dirty);
+	for (i = 0; i < MBOX_LIBRARYINDEX_BUCKETS; i++) {
+		LIST_INIT(&watches[i]);
+	}
+
+	if ((rescan = avbox_settings_getint("library.rescan_interval",
+		MBOX_LIBRARYINDEX_RESCAN)) < 1) {
+		rescan = 1;
+	}
+
+	if (realpath(path, resolved) == NULL) {
+		LOG_VPRINT_ERROR("Invalid library root '%s': %s",
+			path, strerror(errno));
+		return -1;
+	}
+	if ((root = strdup(resolved)) == NULL) {
+		return -1;
+	}
+
+	if ((statedir = getstatedir()) == NULL) {
+		LOG_VPRINT_ERROR("Could not get state directory: %s",
+			strerror(errno));
+		goto err;
+	}
+	snprintf(dbfile, sizeof(dbfile), "%s/library.db", statedir);
+	free(statedir);
+
+	if ((res = sqlite3_open_v2(dbfile, &db,
+		SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL)) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not open database '%s': %s (%d)",
+			dbfile, sqlite3_errmsg(db), res);
+		goto err;
+	}
+	if ((res = sqlite3_exec(db,
+		"PRAGMA journal_mode=WAL;"
+		"PRAGMA synchronous=NORMAL;"
+		"PRAGMA recursive_triggers=ON;"
+		"CREATE TABLE IF NOT EXISTS files ("
+		"path TEXT PRIMARY KEY,"
+		"parent TEXT,"
+		"name TEXT,"
+		"type INTEGER,"
+		"size INTEGER,"
+		"mtime INTEGER);"
+		"CREATE INDEX IF NOT EXISTS files_parent ON files (parent);"
+		"CREATE TABLE IF NOT EXISTS dirs ("
+		"path TEXT PRIMARY KEY,"
+		"mtime INTEGER,"
+		"scanned INTEGER,"
+		"remote INTEGER);"
+		"CREATE TABLE IF NOT EXISTS metadata ("
+		"path TEXT PRIMARY KEY,"
+		"parent TEXT,"
+		"size INTEGER,"
+		"mtime INTEGER,"
+		"valid INTEGER,"
+		"duration INTEGER,"
+		"width INTEGER,"
+		"height INTEGER,"
+		"vcodec TEXT,"
+		"acodec TEXT,"
+		"audio_tracks INTEGER,"
+		"languages TEXT);"
+		"CREATE INDEX IF NOT EXISTS metadata_parent ON metadata (parent);",
+		NULL, NULL, NULL)) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not create tables: %s (%d)",
+			sqlite3_errmsg(db), res);
+		goto err;
+	}
+	for (i = 0; statements[i].stmt != NULL; i++) {
+		if (sqlite3_prepare_v2(db, statements[i].sql, -1,
+			statements[i].stmt, NULL) != SQLITE_OK) {
+			LOG_VPRINT_ERROR("Could not prepare '%s': %s",
+				statements[i].sql, sqlite3_errmsg(db));
+			goto err;
+		}
+	}
+
+	/* the library can still be browsed without search */
+	if (mbox_libraryindex_initsearch(dbfile) == -1) {
+		LOG_PRINT_ERROR("Library search is not available");
+	}
+
+	/* without inotify local folders are updated
+	 * when they're rescanned */
+	if ((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		LOG_VPRINT_ERROR("Could not initialize inotify: %s",
+			strerror(errno));
+	}
+
+	if ((wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+		LOG_VPRINT_ERROR("Could not create eventfd: %s",
+			strerror(errno));
+		goto err;
+	}
+
+	quit = 0;
+	if (pthread_create(&thread, NULL, mbox_libraryindex_thread, NULL) != 0) {
+		LOG_PRINT_ERROR("Could not start index thread");
+		goto err;
+	}
+
+	return 0;
+err:
+	/* folders are still listed from disk */
+	if (wakefd != -1) {
+		close(wakefd);
+		wakefd = -1;
+	}
+	if (inotify_fd != -1) {
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+	for (i = 0; statements[i].stmt != NULL; i++) {
+		sqlite3_finalize(*statements[i].stmt);
+		*statements[i].stmt = NULL;
+	}
+	mbox_libraryindex_closesearch();
+	sqlite3_close(db);
+	db = NULL;
+	return -1;
+}
+
+
+/**
+ * Shutdown the library index.
+ */
+void
+mbox_libraryindex_shutdown(void)
+{
+	int i;
+	struct mbox_libraryindex_watch *watch;
+
+	DEBUG_PRINT("libraryindex", "Shutting down library index");
+
+	if (wakefd != -1) {
+		quit = 1;
+		mbox_libraryindex_wake();
+		pthread_join(thread, NULL);
+		close(wakefd);
+		wakefd = -1;
+	}
+
+	pthread_mutex_lock(&index_lock);
+	for (i = 0; i < MBOX_LIBRARYINDEX_BUCKETS; i++) {
+		LIST_FOREACH_SAFE(struct mbox_libraryindex_watch*, watch, &watches[i], {
+			LIST_REMOVE(watch);
+			free(watch->path);
+			free(watch);
+		});
+	}
+	mbox_libraryindex_freedirs(&pending);
+	mbox_libraryindex_freedirs(&dirty);
+	if (inotify_fd != -1) {
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+	for (i = 0; statements[i].stmt != NULL; i++) {
+		sqlite3_finalize(*statements[i].stmt);
+		*statements[i].stmt = NULL;
+	}
+	mbox_libraryindex_closesearch();
+	sqlite3_close(db);
+	db = NULL;
+	free(root);
+	root = NULL;
+	pthread_mutex_unlock(&index_lock);
+}
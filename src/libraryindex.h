@@ -0,0 +1,111 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ */
+
+#ifndef __MBOX_LIBRARYINDEX_H__
+#define __MBOX_LIBRARYINDEX_H__
+#include <stdint.h>
+#include <time.h>
+
+
+/**
+ * The metadata of a media file.
+ */
+struct mbox_libraryindex_metadata
+{
+	int64_t duration;	/* msecs, -1 if unknown */
+	int width;
+	int height;
+	const char *vcodec;
+	const char *acodec;
+	int audio_tracks;
+	const char *languages;	/* of the audio tracks, comma separated */
+};
+
+
+/**
+ * A directory entry.
+ */
+struct mbox_libraryindex_entry
+{
+	const char *name;
+	const char *path;
+	int isdir;
+	int64_t size;
+	time_t mtime;
+	const struct mbox_libraryindex_metadata *meta;	/* NULL if not probed */
+};
+
+
+/**
+ * Called by mbox_libraryindex_list() for each entry. Return
+ * -1 to stop.
+ */
+typedef int (*mbox_libraryindex_callback)(
+	const struct mbox_libraryindex_entry * const entry, void *context);
+
+
+/**
+ * List a directory from the index. If the directory has not
+ * been indexed yet it is scanned now. Entries are listed by
+ * name.
+ *
+ * Returns -1 and sets errno if the directory could not be
+ * listed.
+ */
+int
+mbox_libraryindex_list(const char * const path,
+	mbox_libraryindex_callback callback, void *context);
+
+
+/**
+ * Search the library. Every word of terms is matched as a
+ * prefix of a word of the name, folder or metadata of the
+ * entry. Up to max results are returned through callback as
+ * they're found, in no particular order.
+ *
+ * Returns the number of results or -1 if search is not
+ * available.
+ */
+int
+mbox_libraryindex_search(const char * const terms,
+	mbox_libraryindex_callback callback, void *context, const int max);
+
+
+/**
+ * Calls callback for up to max files that have not been
+ * probed or have changed since they were. Returns the number
+ * of files.
+ */
+int
+mbox_libraryindex_unprobed(mbox_libraryindex_callback callback,
+	void *context, const int max);
+
+
+/**
+ * Save the metadata of a file. The size and mtime are the
+ * ones the file had when it was probed. If meta is NULL the
+ * file is marked as not probeable.
+ */
+int
+mbox_libraryindex_setmetadata(const char * const path, const int64_t size,
+	const time_t mtime, const struct mbox_libraryindex_metadata * const meta);
+
+
+/**
+ * Initialize the library index and start indexing the
+ * library root in the background.
+ */
+int
+mbox_libraryindex_init(const char * const root);
+
+
+/**
+ * Shutdown the library index.
+ */
+void
+mbox_libraryindex_shutdown(void);
+
+
+#endif
@@ -0,0 +1,464 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ *
+ * Media metadata extractor. Files that are new to the library index
+ * (or that changed since they were probed) are probed on the
+ * background workers, which run niced with low IO priority so they
+ * don't compete with the player. Only the headers are read so probing
+ * a file costs about the same on local disks and on the network.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+
+#define LOG_MODULE "librarymeta"
+
+#include "lib/log.h"
+#include "lib/debug.h"
+#include "lib/linkedlist.h"
+#include "lib/settings.h"
+#include "lib/thread.h"
+#include "libraryindex.h"
+#include "librarymeta.h"
+
+
+#define MBOX_LIBRARYMETA_JOBS		(2)
+#define MBOX_LIBRARYMETA_BATCH		(32)
+#define MBOX_LIBRARYMETA_PROBESIZE	(512 * 1024)	/* bytes */
+#define MBOX_LIBRARYMETA_ANALYZE	(1000000)	/* usecs */
+
+
+/**
+ * A file waiting to be probed.
+ */
+LISTABLE_STRUCT(mbox_librarymeta_file,
+	char *path;
+	int64_t size;
+	time_t mtime;
+);
+
+
+/* files that are never media */
+static const char * const skip_exts[] =
+{
+	"srt", "sub", "idx", "nfo", "txt", "jpg", "jpeg", "png", "gif",
+	NULL
+};
+
+
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t meta_cond = PTHREAD_COND_INITIALIZER;
+static int initialized = 0;
+static int quit = 0;
+static int jobs = MBOX_LIBRARYMETA_JOBS;
+static int running = 0;
+static int refilling = 0;
+static int dirty = 0;
+static int64_t run_start;
+static int run_files;
+static int run_failed;
+LIST_DECLARE_STATIC(queue);
+LIST_DECLARE_STATIC(inflight);
+
+
+/**
+ * Gets the monotonic time in msecs.
+ */
+static int64_t
+mbox_librarymeta_now(void)
+{
+	struct timespec tv;
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	return (tv.tv_sec * 1000LL) + (tv.tv_nsec / 1000000LL);
+}
+
+
+/**
+ * Checks if a file is on a list.
+ */
+static int
+mbox_librarymeta_listed(LIST * const list, const char * const path)
+{
+	struct mbox_librarymeta_file *file;
+	LIST_FOREACH(struct mbox_librarymeta_file*, file, list) {
+		if (!strcmp(file->path, path)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Free a list of files.
+ */
+static void
+mbox_librarymeta_freefiles(LIST * const list)
+{
+	struct mbox_librarymeta_file *file;
+	LIST_FOREACH_SAFE(struct mbox_librarymeta_file*, file, list, {
+		LIST_REMOVE(file);
+		free(file->path);
+		free(file);
+	});
+}
+
+
+/**
+ * Queue an unprobed file. Called by mbox_libraryindex_unprobed().
+ */
+static int
+mbox_librarymeta_add(const struct mbox_libraryindex_entry * const entry,
+	void *context)
+{
+	struct mbox_librarymeta_file *file;
+
+	(void) context;
+
+	pthread_mutex_lock(&meta_lock);
+
+	/* the files that are being probed are still
+	 * unprobed on the index */
+	if (mbox_librarymeta_listed(&inflight, entry->path) ||
+		mbox_librarymeta_listed(&queue, entry->path)) {
+		pthread_mutex_unlock(&meta_lock);
+		return 0;
+	}
+
+	if ((file = malloc(sizeof(struct mbox_librarymeta_file))) == NULL ||
+		(file->path = strdup(entry->path)) == NULL) {
+		LOG_VPRINT_ERROR("Could not queue '%s': Out of memory",
+			entry->path);
+		pthread_mutex_unlock(&meta_lock);
+		free(file);
+		return -1;
+	}
+	file->size = entry->size;
+	file->mtime = entry->mtime;
+	LIST_APPEND(&queue, file);
+	pthread_mutex_unlock(&meta_lock);
+	return 0;
+}
+
+
+/**
+ * Gets the next file to probe. When the queue runs out it
+ * is refilled from the index by one of the workers while
+ * the others wait. When there's nothing left the worker is
+ * retired and NULL is returned.
+ */
+static struct mbox_librarymeta_file *
+mbox_librarymeta_next(void)
+{
+	int n;
+	int64_t elapsed;
+	struct mbox_librarymeta_file *file = NULL;
+
+	pthread_mutex_lock(&meta_lock);
+	while (!quit) {
+		if (!LIST_EMPTY(&queue)) {
+			file = LIST_NEXT(struct mbox_librarymeta_file*, &queue);
+			LIST_REMOVE(file);
+			LIST_ADD(&inflight, file);
+			break;
+		}
+		if (refilling) {
+			pthread_cond_wait(&meta_cond, &meta_lock);
+			continue;
+		}
+		if (!dirty) {
+			break;
+		}
+
+		refilling = 1;
+		dirty = 0;
+		pthread_mutex_unlock(&meta_lock);
+		n = mbox_libraryindex_unprobed(mbox_librarymeta_add,
+			NULL, MBOX_LIBRARYMETA_BATCH);
+		pthread_mutex_lock(&meta_lock);
+		refilling = 0;
+		if (n == MBOX_LIBRARYMETA_BATCH) {
+			dirty = 1;
+		}
+		pthread_cond_broadcast(&meta_cond);
+	}
+
+	/* this is done while holding the lock so that
+	 * mbox_librarymeta_wake() never sees a worker
+	 * that is about to exit */
+	if (file == NULL && --running == 0) {
+		if (run_files > 0) {
+			elapsed = mbox_librarymeta_now() - run_start;
+			LOG_VPRINT_INFO("Probed %i files (%i failed) in %.1fs (%.1f files/s)",
+				run_files, run_failed, elapsed / 1000.0,
+				(elapsed > 0) ? (run_files * 1000.0) / elapsed : 0.0);
+		}
+		pthread_cond_broadcast(&meta_cond);
+	}
+	pthread_mutex_unlock(&meta_lock);
+	return file;
+}
+
+
+/**
+ * Aborts blocking reads on shutdown.
+ */
+static int
+mbox_librarymeta_interrupt(void *context)
+{
+	(void) context;
+	return quit;
+}
+
+
+/**
+ * Checks if a file is worth probing.
+ */
+static int
+mbox_librarymeta_probeable(const char * const path)
+{
+	int i;
+	const char * const name = strrchr(path, '/');
+	const char * const ext = strrchr(path, '.');
+
+	if (name != NULL && name[1] == '.') {
+		return 0;
+	}
+	if (ext != NULL && (name == NULL || ext > name)) {
+		for (i = 0; skip_exts[i] != NULL; i++) {
+			if (!strcasecmp(ext + 1, skip_exts[i])) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+
+/**
+ * Probe a file and save it's metadata to the index. Only
+ * the container headers and the first few packets are read.
+ *
+ * Returns -1 if the file could not be probed.
+ */
+static int
+mbox_librarymeta_probe(const struct mbox_librarymeta_file * const file)
+{
+	int i, ret = -1;
+	size_t len = 0;
+	char languages[128] = "";
+	AVFormatContext *fmt_ctx;
+	AVDictionary *opts = NULL;
+	AVDictionaryEntry *lang;
+	struct mbox_libraryindex_metadata meta;
+
+	if (!mbox_librarymeta_probeable(file->path)) {
+		return -1;
+	}
+
+	if ((fmt_ctx = avformat_alloc_context()) == NULL) {
+		LOG_PRINT_ERROR("Could not allocate format context");
+		return -1;
+	}
+	fmt_ctx->interrupt_callback.callback = mbox_librarymeta_interrupt;
+	fmt_ctx->interrupt_callback.opaque = NULL;
+
+	av_dict_set_int(&opts, "probesize", MBOX_LIBRARYMETA_PROBESIZE, 0);
+	av_dict_set_int(&opts, "analyzeduration", MBOX_LIBRARYMETA_ANALYZE, 0);
+	if (avformat_open_input(&fmt_ctx, file->path, NULL, &opts) != 0) {
+		DEBUG_VPRINT("librarymeta", "Could not open '%s'", file->path);
+		av_dict_free(&opts);
+		return -1;
+	}
+	av_dict_free(&opts);
+
+	if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+		DEBUG_VPRINT("librarymeta", "Could not find stream info for '%s'",
+			file->path);
+		goto end;
+	}
+
+	memset(&meta, 0, sizeof(meta));
+	meta.duration = (fmt_ctx->duration != AV_NOPTS_VALUE) ?
+		fmt_ctx->duration / (AV_TIME_BASE / 1000) : -1;
+	meta.languages = languages;
+
+	for (i = 0; i < fmt_ctx->nb_streams; i++) {
+		const AVStream * const st = fmt_ctx->streams[i];
+		const AVCodecParameters * const par = st->codecpar;
+
+		if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+			/* skip cover art */
+			if (meta.vcodec != NULL || (st->disposition & AV_DISPOSITION_ATTACHED_PIC)) {
+				continue;
+			}
+			meta.vcodec = avcodec_get_name(par->codec_id);
+			meta.width = par->width;
+			meta.height = par->height;
+
+		} else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
+			if (meta.acodec == NULL) {
+				meta.acodec = avcodec_get_name(par->codec_id);
+			}
+			meta.audio_tracks++;
+			if ((lang = av_dict_get(st->metadata, "language", NULL, 0)) != NULL &&
+				len + strlen(lang->value) + 2 < sizeof(languages)) {
+				len += sprintf(languages + len, "%s%s",
+					(len > 0) ? "," : "", lang->value);
+			}
+		}
+	}
+
+	if (meta.vcodec == NULL && meta.acodec == NULL) {
+		goto end;
+	}
+
+	if (mbox_libraryindex_setmetadata(file->path, file->size,
+		file->mtime, &meta) == -1) {
+		pthread_mutex_lock(&meta_lock);
+		dirty = 0;
+		pthread_mutex_unlock(&meta_lock);
+	}
+	ret = 0;
+end:
+	avformat_close_input(&fmt_ctx);
+	return ret;
+}
+
+
+/**
+ * Probe files until there are none left.
+ */
+static void *
+mbox_librarymeta_worker(void *arg)
+{
+	struct mbox_librarymeta_file *file;
+
+	(void) arg;
+
+	while (1) {
+		/* give way to the player */
+		avbox_thread_yield();
+
+		if ((file = mbox_librarymeta_next()) == NULL) {
+			break;
+		}
+
+		if (mbox_librarymeta_probe(file) == -1 && !quit) {
+			/* remember it so we don't try again */
+			if (mbox_libraryindex_setmetadata(file->path, file->size,
+				file->mtime, NULL) == -1) {
+				pthread_mutex_lock(&meta_lock);
+				dirty = 0;
+				pthread_mutex_unlock(&meta_lock);
+			}
+			pthread_mutex_lock(&meta_lock);
+			run_failed++;
+			pthread_mutex_unlock(&meta_lock);
+		}
+
+		pthread_mutex_lock(&meta_lock);
+		LIST_REMOVE(file);
+		run_files++;
+		pthread_mutex_unlock(&meta_lock);
+		free(file->path);
+		free(file);
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Tell the metadata extractor that there may be new files
+ * on the index.
+ */
+void
+mbox_librarymeta_wake(void)
+{
+	struct avbox_delegate *del;
+
+	pthread_mutex_lock(&meta_lock);
+	if (!initialized || quit) {
+		pthread_mutex_unlock(&meta_lock);
+		return;
+	}
+	dirty = 1;
+	while (running < jobs) {
+		if ((del = avbox_thread_delegate_qos(mbox_librarymeta_worker,
+			NULL, AVBOX_THREAD_QOS_BACKGROUND)) == NULL) {
+			LOG_VPRINT_ERROR("Could not start worker: %s",
+				strerror(errno));
+			break;
+		}
+		avbox_delegate_dettach(del);
+		if (running++ == 0) {
+			run_start = mbox_librarymeta_now();
+			run_files = 0;
+			run_failed = 0;
+		}
+	}
+	pthread_mutex_unlock(&meta_lock);
+}
+
+
+/**
+ * Initialize the metadata extractor.
+ */
+int
+mbox_librarymeta_init(void)
+{
+	DEBUG_PRINT("librarymeta", "Initializing metadata extractor");
+
+	LIST_INIT(&queue);
+	LIST_INIT(&inflight);
+
+	/* 0 disables extraction */
+	if ((jobs = avbox_settings_getint("library.metadata_jobs",
+		MBOX_LIBRARYMETA_JOBS)) < 0) {
+		jobs = 0;
+	}
+
+	av_register_all();
+
+	pthread_mutex_lock(&meta_lock);
+	quit = 0;
+	initialized = 1;
+	pthread_mutex_unlock(&meta_lock);
+
+	/* probe whatever was indexed while we were down */
+	mbox_librarymeta_wake();
+	return 0;
+}
+
+
+/**
+ * Shutdown the metadata extractor.
+ */
+void
+mbox_librarymeta_shutdown(void)
+{
+	DEBUG_PRINT("librarymeta", "Shutting down metadata extractor");
+
+	pthread_mutex_lock(&meta_lock);
+	quit = 1;
+	while (running > 0) {
+		pthread_cond_wait(&meta_cond, &meta_lock);
+	}
+	mbox_librarymeta_freefiles(&queue);
+	mbox_librarymeta_freefiles(&inflight);
+	initialized = 0;
+	pthread_mutex_unlock(&meta_lock);
+}
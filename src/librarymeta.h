@@ -0,0 +1,33 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ */
+
+#ifndef __MBOX_LIBRARYMETA_H__
+#define __MBOX_LIBRARYMETA_H__
+
+
+/**
+ * Tell the metadata extractor that there may be new files
+ * on the index.
+ */
+void
+mbox_librarymeta_wake(void);
+
+
+/**
+ * Initialize the metadata extractor and start probing the
+ * files that are already indexed.
+ */
+int
+mbox_librarymeta_init(void);
+
+
+/**
+ * Shutdown the metadata extractor.
+ */
+void
+mbox_librarymeta_shutdown(void);
+
+
+#endif
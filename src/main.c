@@ -14,6 +14,11 @@
 #include <unistd.h>
 
 #include "lib/application.h"
+#include "lib/log.h"
+#include "lib/dispatch.h"
+#include "lib/thread.h"
+#include "lib/process.h"
+#include "lib/url_util.h"
 #include "shell.h"
 
 #define WORKDIR  "/var/lib/mediabox"
@@ -27,8 +32,11 @@ print_usage(const char * const prog)
 	printf("%s: mediabox [options]\n", prog);
 	printf("\n");
 	printf(" --version\t\tPrint version information\n");
-	printf(" --no-avmount\t\tAssume avmount is already mounted\n");
+	printf(" --avmount\t\tMount the UPnP servers at /media/UPnP with avmount\n");
 	printf(" --no-mediatomb\t\tDon't launch mediatomb\n");
+	printf(" --bench-threads\tBenchmark the thread pool and exit\n");
+	printf(" --bench-spawn\t\tBenchmark process spawning and exit\n");
+	printf(" --bench-url <url>\tBenchmark fetching a url and exit\n");
 	printf("\n");
 	printf("AVBox options:\n\n");
 	printf(" --video:driver=<drv>\tSet the video driver string\n");
@@ -50,6 +58,60 @@ print_version()
 }
 
 
+/**
+ * Runs the thread pool benchmark.
+ */
+static int
+bench_threads(void)
+{
+	log_init();
+
+	if (avbox_dispatch_init() == -1) {
+		fprintf(stderr, "Could not initialize dispatcher\n");
+		return -1;
+	}
+	if (avbox_thread_init() == -1) {
+		fprintf(stderr, "Could not initialize thread pool\n");
+		avbox_dispatch_shutdown();
+		return -1;
+	}
+	avbox_thread_benchmark();
+	avbox_thread_shutdown();
+	avbox_dispatch_shutdown();
+	return 0;
+}
+
+
+/**
+ * Runs the process spawn benchmark.
+ */
+static int
+bench_spawn(void)
+{
+	log_init();
+	avbox_process_benchmark();
+	return 0;
+}
+
+
+/**
+ * Runs the url fetcher benchmark.
+ */
+static int
+bench_url(const char * const url)
+{
+	int ret;
+	log_init();
+	if (mb_url_init() == -1) {
+		fprintf(stderr, "Could not initialize url fetcher\n");
+		return -1;
+	}
+	ret = mb_url_benchmark(url, 200);
+	mb_url_shutdown();
+	return ret;
+}
+
+
 /**
  * Program entry point.
  */
@@ -57,7 +119,7 @@ int
 main (int argc, char **argv)
 {
 	int i;
-	int launch_avmount = 1;
+	int launch_avmount = 0;
 	int launch_mediatomb = 1;
 
 	/* parse command line */
@@ -80,10 +142,22 @@ main (int argc, char **argv)
 			/* let video args pass */
 		} else if (!strncmp(argv[i], "--input:", 8)) {
 			/* let input args pass */
+		} else if (!strcmp(argv[i], "--avmount")) {
+			launch_avmount = 1;
 		} else if (!strcmp(argv[i], "--no-avmount")) {
 			launch_avmount = 0;
 		} else if (!strcmp(argv[i], "--no-mediatomb")) {
 			launch_mediatomb = 0;
+		} else if (!strcmp(argv[i], "--bench-threads")) {
+			exit((bench_threads() == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+		} else if (!strcmp(argv[i], "--bench-spawn")) {
+			exit((bench_spawn() == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+		} else if (!strcmp(argv[i], "--bench-url")) {
+			if (i + 1 >= argc) {
+				print_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			exit((bench_url(argv[i + 1]) == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
 		} else if (!strcmp(argv[i], "--init")) {
 			/* pass through */
 		} else {
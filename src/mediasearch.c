@@ -1,10 +1,14 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <assert.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #define LOG_MODULE "mediasearch"
 
@@ -18,13 +22,47 @@
 #include "lib/dispatch.h"
 #include "lib/thread.h"
 #include "lib/application.h"
+#include "lib/settings.h"
 #include "downloads-backend.h"
+#include "searchcache.h"
+#include "searchprovider.h"
 
 
 #define AVBOX_MEDIASEARCH_STATE_NONE       (0)
 #define AVBOX_MEDIASEARCH_STATE_CATEGORIES (1)
 #define AVBOX_MEDIASEARCH_STATE_ITEMS      (2)
 
+#define MBOX_MESSAGETYPE_MEDIASEARCH	(AVBOX_MESSAGETYPE_USER + 2)
+
+#define MBOX_MEDIASEARCH_BATCH		(16)	/* items */
+#define MBOX_MEDIASEARCH_FLUSH		(100)	/* ms */
+#define MBOX_MEDIASEARCH_MAXPAGES	(8)
+#define MBOX_MEDIASEARCH_REVALIDATE	(5 * 60)	/* secs */
+#define MBOX_MEDIASEARCH_MAXPROVIDERS	(8)
+#define MBOX_MEDIASEARCH_BUCKETS	(64)
+
+
+/**
+ * The state of the search on a provider.
+ */
+struct mbox_mediasearch_source
+{
+	const struct mbox_searchprovider *provider;
+	int deadline;		/* ms */
+	int next_page;
+	int exhausted;
+	int searching;
+};
+
+
+/**
+ * A result that has been shown. Used to drop the results
+ * that more than one provider returns.
+ */
+LISTABLE_STRUCT(mbox_mediasearch_seen,
+	char *key;
+);
+
 
 struct mbox_mediasearch
 {
@@ -34,20 +72,95 @@ struct mbox_mediasearch
 	struct avbox_object *parent_object;
 	int state;
 	char *terms;
-	char *last_terms;
 	size_t terms_sz;
 	int items_count;
 	int updater_quit;
 	char *cat;
+	int generation;
+	int searching;		/* sources being searched */
+	int closing;
+	int n_queries;
 	pthread_mutex_t terms_lock;
+	pthread_cond_t queries_done;
+	struct mbox_mediasearch_source sources[MBOX_MEDIASEARCH_MAXPROVIDERS];
+	int n_sources;
+	LIST seen[MBOX_MEDIASEARCH_BUCKETS];
 };
 
 
-struct avbox_additem_args
+/**
+ * A search result.
+ */
+struct mbox_mediasearch_result
 {
-	struct avbox_listview *inst;
 	char *name;
-	char *url;
+	char *magnet;
+};
+
+
+/**
+ * A result page as it's being fetched and parsed.
+ */
+struct mbox_mediasearch_page
+{
+	struct mbox_searchprovider_input input;	/* must be first */
+	size_t cap;
+	int done;
+	int failed;
+	int number;
+	int revalidate;
+	char *cache;		/* the results as stored in the cache */
+	size_t cache_len;
+	struct mbox_mediasearch_result *results;
+	int n_results;
+	int cap_results;
+	int released;
+};
+
+
+/**
+ * A batch of results sent to the main thread. The last
+ * batch of a query has last set.
+ */
+struct mbox_mediasearch_batch
+{
+	int generation;
+	int source;
+	int last;
+	int next_page;
+	int exhausted;
+	int n;
+	struct mbox_mediasearch_result items[MBOX_MEDIASEARCH_BATCH];
+};
+
+
+/**
+ * A query for one or more pages of a provider. It runs on a
+ * worker and sends the results to the dispatch object in page
+ * order. Revalidation queries only refresh the cache and
+ * don't belong to any instance.
+ */
+struct mbox_mediasearch_query
+{
+	struct mbox_mediasearch *inst;
+	struct avbox_object *object;
+	const struct mbox_searchprovider *provider;
+	char *terms;
+	const char *cat;
+	int source;
+	int generation;
+	int revalidate;
+	int64_t deadline;	/* absolute ms. 0 if none */
+	int first_page;
+	int n_pages;
+	int next_release;
+	int exhausted;
+	int pending;
+	int finished;
+	int64_t last_flush;
+	struct mbox_mediasearch_page *pages;
+	struct mbox_mediasearch_page **fetch;	/* pages being fetched */
+	struct mbox_mediasearch_batch *batch;
 };
 
 
@@ -64,226 +177,876 @@ mbox_mediasearch_freeitems(void *item, void *data)
 }
 
 
+/**
+ * Forget the results that have been shown.
+ */
+static void
+mbox_mediasearch_clearseen(struct mbox_mediasearch * const inst)
+{
+	int i;
+	struct mbox_mediasearch_seen *seen;
+	for (i = 0; i < MBOX_MEDIASEARCH_BUCKETS; i++) {
+		LIST_FOREACH_SAFE(struct mbox_mediasearch_seen*, seen, &inst->seen[i], {
+			LIST_REMOVE(seen);
+			free(seen->key);
+			free(seen);
+		});
+	}
+}
+
+
 /**
  * Clear the list.
  */
-static void *
-mbox_mediasearch_clearlist(void *arg)
+static void
+mbox_mediasearch_clearlist(struct mbox_mediasearch * const inst)
 {
-	struct mbox_mediasearch * const inst = arg;
 	avbox_listview_enumitems(inst->menu, mbox_mediasearch_freeitems, NULL);
 	avbox_listview_clearitems(inst->menu);
 	inst->items_count = 0;
-	return NULL;
+	mbox_mediasearch_clearseen(inst);
 }
 
 
-static void *
-mbox_mediasearch_additem(void *arg)
+/**
+ * Gets the monotonic time in msecs.
+ */
+static int64_t
+mbox_mediasearch_now(void)
 {
-	struct avbox_additem_args * const args = arg;
-	avbox_listview_additem(args->inst, args->name, args->url);
-	return NULL;
+	struct timespec tv;
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	return (tv.tv_sec * 1000LL) + (tv.tv_nsec / 1000000LL);
 }
 
 
+/**
+ * Checks if the query has been superseded by a newer one
+ * or the window is being destroyed. Revalidations are
+ * never cancelled.
+ */
 static int
-mbox_mediasearch_search(struct mbox_mediasearch *inst,
-	char *terms, unsigned int skip, unsigned int count)
+mbox_mediasearch_cancelled(struct mbox_mediasearch_query * const query)
 {
-	#define ITEMS_PER_PAGE (25)
-	char *content = NULL;
-	size_t content_length = 0;
-	char *strptr, *end;
-	char url[255];
-	unsigned int page = 0, skipped = 0;
+	int ret;
+	if (query->revalidate) {
+		return 0;
+	}
+	pthread_mutex_lock(&query->inst->terms_lock);
+	ret = query->inst->closing ||
+		query->generation != query->inst->generation;
+	pthread_mutex_unlock(&query->inst->terms_lock);
+	return ret;
+}
+
 
-	static struct timespec tv = { 0, 0 };
+/**
+ * Append a result to the cache entry of a page. Each result
+ * is stored as a "name\tmagnet\n" line.
+ */
+static void
+mbox_mediasearch_cacheresult(struct mbox_mediasearch_page * const page,
+	const char * const name, const char * const magnet)
+{
+	char *p;
+	const char *src;
+	const size_t len = strlen(name) + strlen(magnet) + 2;
 
-	if (skip) {
-		page = skip / ITEMS_PER_PAGE;
-		skipped = page * ITEMS_PER_PAGE;
+	if ((p = realloc(page->cache, page->cache_len + len + 1)) == NULL) {
+		LOG_PRINT_ERROR("Could not cache result: Out of memory");
+		return;
 	}
+	page->cache = p;
+	p += page->cache_len;
+	page->cache_len += len;
 
-	/* fprintf(stderr, "skip=%i, count=%i, page=%i, skipped=%i\n",
-		skip, count, page, skipped); */
+	/* keep the separators out of the name */
+	for (src = name; *src != '\0'; src++) {
+		*p++ = (*src == '\t' || *src == '\n') ? ' ' : *src;
+	}
+	sprintf(p, "\t%s\n", magnet);
+}
 
-	while (count) {
 
-		page++;
+/**
+ * Add a result to a page. The page takes ownership of
+ * name and magnet.
+ */
+static int
+mbox_mediasearch_addresult(struct mbox_mediasearch_page * const page,
+	char * const name, char * const magnet)
+{
+	if (page->n_results == page->cap_results) {
+		const int cap = (page->cap_results == 0) ? 32 : page->cap_results * 2;
+		struct mbox_mediasearch_result *results;
+		if ((results = realloc(page->results, cap * sizeof(*results))) == NULL) {
+			LOG_PRINT_ERROR("Could not add result: Out of memory");
+			free(magnet);
+			free(name);
+			return -1;
+		}
+		page->results = results;
+		page->cap_results = cap;
+	}
+	page->results[page->n_results].name = name;
+	page->results[page->n_results].magnet = magnet;
+	page->n_results++;
+	return 0;
+}
 
-		if (terms != NULL && strcmp(terms, "")) {
-			snprintf(url, 255-1, "https://kat.cr/usearch/%s category:%s/%i/",
-				terms, inst->cat, page);
 
-		} else {
-			snprintf(url, 255-1, "https://kat.cr/%s/%i/", inst->cat, page);
+/**
+ * Called by the provider's parser for each result.
+ */
+static void
+mbox_mediasearch_parsed(struct mbox_searchprovider_input * const input,
+	char * const name, char * const magnet)
+{
+	struct mbox_mediasearch_page * const page =
+		(struct mbox_mediasearch_page*) input;
+	mbox_mediasearch_cacheresult(page, name, magnet);
+	mbox_mediasearch_addresult(page, name, magnet);
+}
+
+
+/**
+ * Load a page from it's cache entry.
+ */
+static void
+mbox_mediasearch_loadpage(struct mbox_mediasearch_page * const page, const char * data)
+{
+	const char *tab, *end;
+	char *name, *magnet;
+
+	while ((tab = strchr(data, '\t')) != NULL &&
+		(end = strchr(tab, '\n')) != NULL) {
+		if ((name = strndup(data, tab - data)) == NULL ||
+			(magnet = strndup(tab + 1, end - tab - 1)) == NULL) {
+			LOG_PRINT_ERROR("Could not load result: Out of memory");
+			free(name);
+			break;
 		}
+		mbox_mediasearch_addresult(page, name, magnet);
+		data = end + 1;
+	}
+	page->input.started = page->input.ended = page->done = 1;
+}
+
+
+/**
+ * Send the pending batch to the main thread.
+ */
+static void
+mbox_mediasearch_flush(struct mbox_mediasearch_query * const query)
+{
+	struct mbox_mediasearch_batch * const batch = query->batch;
 
-		fprintf(stderr, "mediasearch: Fetching page %s...\n", url);
+	query->batch = NULL;
+	query->last_flush = mbox_mediasearch_now();
+
+	if (batch == NULL) {
+		return;
+	}
 
-		if (tv.tv_sec || tv.tv_nsec) {
-			struct timespec nt;
-			(void) clock_gettime(CLOCK_MONOTONIC, &nt);
-			if (utimediff(&nt, &tv) < 1000L * 1000 * 1000 * 5) {
-				sleep(5);
+	batch->generation = query->generation;
+	batch->source = query->source;
+	if (avbox_object_sendmsg(&query->object, MBOX_MESSAGETYPE_MEDIASEARCH,
+		AVBOX_DISPATCH_UNICAST, batch) == NULL) {
+		LOG_VPRINT_ERROR("Could not send results: %s",
+			strerror(errno));
+		while (batch->n > 0) {
+			batch->n--;
+			free(batch->items[batch->n].name);
+			free(batch->items[batch->n].magnet);
+		}
+		free(batch);
+	}
+}
+
+
+/**
+ * Move the results that can be shown to the pending batch. The
+ * results of a page are only released once all the pages before
+ * it are done so they show up in order.
+ */
+static void
+mbox_mediasearch_release(struct mbox_mediasearch_query * const query)
+{
+	/* revalidations don't send anything */
+	if (query->revalidate) {
+		return;
+	}
+
+	while (query->next_release < query->n_pages) {
+		struct mbox_mediasearch_page * const page =
+			&query->pages[query->next_release];
+
+		while (page->released < page->n_results) {
+			if (query->batch == NULL) {
+				if ((query->batch = malloc(sizeof(struct mbox_mediasearch_batch))) == NULL) {
+					ASSERT(errno == ENOMEM);
+					return;
+				}
+				memset(query->batch, 0, sizeof(struct mbox_mediasearch_batch));
+			}
+			query->batch->items[query->batch->n++] =
+				page->results[page->released++];
+			if (query->batch->n == MBOX_MEDIASEARCH_BATCH) {
+				mbox_mediasearch_flush(query);
 			}
 		}
 
-		if (mb_url_fetch2mem(url, (void**) &content, &content_length) == -1) {
-			fprintf(stderr, "mediasearch: mb_url_fetch2mem() failed\n");
-			return -1;
+		if (!page->done || page->failed) {
+			break;
 		}
-	
-		(void) clock_gettime(CLOCK_MONOTONIC, &tv);
+
+		/* an empty page means there are no more */
+		if (page->n_results == 0) {
+			query->exhausted = 1;
+		}
+		query->next_release++;
+	}
+
+	if (query->batch != NULL &&
+		mbox_mediasearch_now() - query->last_flush >= MBOX_MEDIASEARCH_FLUSH) {
+		mbox_mediasearch_flush(query);
+	}
+}
 
 
-		if (strstr(content, "Nothing found!") != NULL) {
-			free(content);
-			return 0;
+/**
+ * Send the last batch of a query along with the state of
+ * the search. Pages that are being revalidated may still
+ * be downloading.
+ */
+static void
+mbox_mediasearch_finish(struct mbox_mediasearch_query * const query)
+{
+	if (query->finished) {
+		return;
+	}
+	query->finished = 1;
+
+	if (mbox_mediasearch_cancelled(query)) {
+		return;
+	}
+	if (query->batch == NULL) {
+		if ((query->batch = malloc(sizeof(struct mbox_mediasearch_batch))) == NULL) {
+			ASSERT(errno == ENOMEM);
+			return;
 		}
+		memset(query->batch, 0, sizeof(struct mbox_mediasearch_batch));
+	}
+	query->batch->last = 1;
+	query->batch->next_page = query->first_page + query->next_release;
+	query->batch->exhausted = query->exhausted;
+	mbox_mediasearch_flush(query);
+}
 
-		if ((strptr = strstr(content, "<tr class=\"firstr\">")) != NULL) {
-			end = strstr(strptr, "</table>");
-			*end = '\0';
 
-			while (count > 0 && (strptr = strstr(strptr + 1, "<tr")) != NULL) {
-				size_t sz;
-				char *buf, *data_start, *end, *name, *magnet;
+/**
+ * Gets the cache key of a page.
+ */
+static void
+mbox_mediasearch_getkey(char * const key, const size_t n,
+	const struct mbox_mediasearch_query * const query, const int page)
+{
+	snprintf(key, n, "%s\n%s\n%s\n%i", query->provider->name,
+		query->cat, query->terms, page);
+}
 
-				if (skipped < skip) {
-					skipped++;
-					continue;
-				}
-				
-				if ((data_start = strstr(strptr, "data-sc-params=\"")) != NULL) {
-					data_start += 16;
-					if ((name = strstr(data_start, "'name': '")) != NULL) {
-						name += 9;
-						if ((end = strstr(name, "'")) != NULL) {
-							sz = end - name;
-							if ((buf = malloc(sz + 1)) != NULL) {
-								memcpy(buf, name, sz);
-								buf[sz] = '\0';
-								urldecode(buf, buf);
-								if ((name = strdup(buf)) == NULL) {
-									fprintf(stderr, "mediasearch: Out of memory\n");
-								}
-								free(buf);
-							} else {
-								fprintf(stderr, "mediaseach: Out of memory\n");
-								name = NULL;
-							}
-						} else {
-							fprintf(stderr, "mediasearch: Invalid input\n");
-							name = NULL;
-						}
-					}
 
-					if ((magnet = strstr(data_start, "'magnet': '")) != NULL) {
-						magnet += 11;
-						if ((end = strstr(magnet, "'")) != NULL) {
-							sz = end - magnet;
-							if ((buf = malloc(sz + 1)) != NULL) {
-								memcpy(buf, magnet, sz);
-								buf[sz] = '\0';
-								if ((magnet = strdup(buf)) == NULL) {
-									fprintf(stderr, "mediasearch: Out of memory\n");
-								}
-								free(buf);
-							} else {
-								fprintf(stderr, "mediasearch: Out of memory\n");
-								magnet = NULL;
-							}
-						} else {
-							fprintf(stderr, "mediasearch: Invalid input\n");
-							magnet = NULL;
-						}
-					}
-					if (name != NULL && magnet != NULL) {
-						struct avbox_delegate *del;
-						struct avbox_additem_args args;
-						args.inst = inst->menu;
-						args.name = name;
-						args.url = magnet;
-
-						/* add the item to the list from the main thread */
-						if ((del = avbox_application_delegate(
-							mbox_mediasearch_additem, &args)) == NULL) {
-							LOG_VPRINT_ERROR("Could not delegate call 'additem' to main thread: %s",
-								strerror(errno));
-						} else {
-							avbox_delegate_wait(del, NULL);
-						}
-
-						free(name);
-						count--;
-						inst->items_count++;
-						/* free(magnet) -- later */
+/**
+ * Called by mb_url_fetchmany() as each page arrives.
+ */
+static int
+mbox_mediasearch_chunk(void *context, const int index,
+	const void * const data, const size_t size)
+{
+	struct mbox_mediasearch_query * const query = context;
+	struct mbox_mediasearch_page * const page = query->fetch[index];
 
-					}
-				}
-			}
-		} else {
-			LOG_VPRINT_ERROR("Invalid input (content=\"%s\")",
-				content);
+	if (mbox_mediasearch_cancelled(query)) {
+		return -1;
+	}
+
+	/* don't let a slow provider hold up the search. The
+	 * pages it didn't finish are fetched again when the
+	 * user scrolls to the end of the list */
+	if (query->deadline != 0 && mbox_mediasearch_now() > query->deadline) {
+		LOG_VPRINT_ERROR("Provider '%s' missed it's deadline",
+			query->provider->name);
+		return -1;
+	}
+
+	if (data == NULL || page->input.ended) {
+		/* flush results that are waiting */
+		mbox_mediasearch_release(query);
+		return 0;
+	}
+
+	if (page->input.len + size + 1 > page->cap) {
+		size_t cap = (page->cap == 0) ? 16 * 1024 : page->cap;
+		char *buf;
+		while (cap < page->input.len + size + 1) {
+			cap *= 2;
+		}
+		if ((buf = realloc(page->input.buf, cap)) == NULL) {
+			LOG_PRINT_ERROR("Could not grow page buffer: Out of memory");
 			return -1;
 		}
-		free(content);
+		page->input.buf = buf;
+		page->cap = cap;
 	}
+	memcpy(page->input.buf + page->input.len, data, size);
+	page->input.len += size;
+	page->input.buf[page->input.len] = '\0';
+
+	query->provider->parse(&page->input, 0);
+	mbox_mediasearch_release(query);
+	return 0;
+}
 
-	avbox_window_update(inst->window);
 
+/**
+ * Called by mb_url_fetchmany() when a page is done.
+ */
+static int
+mbox_mediasearch_pagedone(void *context, const int index, const int result)
+{
+	char key[512];
+	struct mbox_mediasearch_query * const query = context;
+	struct mbox_mediasearch_page * const page = query->fetch[index];
+
+	if (result == 0 && page->input.buf != NULL) {
+		query->provider->parse(&page->input, 1);
+	} else {
+		page->failed = 1;
+	}
+	page->done = 1;
+
+	free(page->input.buf);
+	page->input.buf = NULL;
+	page->input.len = page->cap = 0;
+
+	/* save it for next time */
+	if (!page->failed) {
+		mbox_mediasearch_getkey(key, sizeof(key), query, page->number);
+		if (mbox_searchcache_put(key, (page->cache != NULL) ? page->cache : "") == -1) {
+			LOG_VPRINT_ERROR("Could not cache page %i: %s",
+				page->number, strerror(errno));
+		}
+	}
+
+	if (page->revalidate) {
+		DEBUG_VPRINT("mediasearch", "Revalidated page %i (results=%i)",
+			page->number, page->n_results);
+		return 0;
+	}
+
+	mbox_mediasearch_release(query);
+	if (--query->pending == 0) {
+		mbox_mediasearch_finish(query);
+	}
+
+	/* don't fetch past the end */
+	if (page->failed || page->n_results == 0) {
+		return -1;
+	}
 	return 0;
 }
 
 
-#define STRINGIZE2(x) #x
-#define STRINGIZE(x) STRINGIZE2(x)
+/**
+ * Free a page.
+ */
+static void
+mbox_mediasearch_freepage(struct mbox_mediasearch_page * const page)
+{
+	while (page->released < page->n_results) {
+		free(page->results[page->released].name);
+		free(page->results[page->released].magnet);
+		page->released++;
+	}
+	free(page->results);
+	free(page->cache);
+	free(page->input.buf);
+}
+
 
+/**
+ * Free a query.
+ */
+static void
+mbox_mediasearch_freequery(struct mbox_mediasearch_query * const query)
+{
+	int i;
+
+	/* free anything that was not sent */
+	if (query->batch != NULL) {
+		while (query->batch->n > 0) {
+			query->batch->n--;
+			free(query->batch->items[query->batch->n].name);
+			free(query->batch->items[query->batch->n].magnet);
+		}
+		free(query->batch);
+	}
+	for (i = 0; i < query->n_pages; i++) {
+		mbox_mediasearch_freepage(&query->pages[i]);
+	}
+	free(query->pages);
+	free(query->terms);
+	free(query);
+}
+
+
+/**
+ * Fetch pages again to update the cache. Runs as idle work so
+ * it doesn't hold up searches or playback. Since the idle pool
+ * is paused during playback the query owns everything it uses
+ * and the instance doesn't wait for it.
+ */
 static void *
-mbox_mediasearch_dosearch(void *arg)
+mbox_mediasearch_revalidate(void *arg)
 {
-	char *tmp;
-	struct mbox_mediasearch * const inst = arg;
+	int i;
+	struct mbox_mediasearch_query * const query = arg;
+	char urls[query->n_pages][512];
+	const char *purls[query->n_pages];
+	struct mbox_mediasearch_page *fetch[query->n_pages];
+	const int max_conns = avbox_settings_getint("mediasearch.max_connections", 2);
+	const int interval = avbox_settings_getint("mediasearch.request_interval", 250);
+
+	DEBUG_VPRINT("mediasearch", "Revalidating %i pages of '%s' from %s",
+		query->n_pages, query->terms, query->provider->name);
+
+	for (i = 0; i < query->n_pages; i++) {
+		if (query->provider->geturl(urls[i], sizeof(urls[i]),
+			query->terms, query->cat, query->pages[i].number) == -1) {
+			break;
+		}
+		query->pages[i].input.addresult = mbox_mediasearch_parsed;
+		purls[i] = urls[i];
+		fetch[i] = &query->pages[i];
+	}
+	query->fetch = fetch;
 
-	DEBUG_PRINT("mediasearch", "Performing search");
+	if (i == query->n_pages && mb_url_fetchmany(purls, query->n_pages, (max_conns > 0) ? max_conns : 1,
+		(interval > 0) ? interval : 0, mbox_mediasearch_chunk,
+		mbox_mediasearch_pagedone, query) == -1 && errno != ECANCELED) {
+		LOG_VPRINT_ERROR("Could not revalidate '%s': %s",
+			query->terms, strerror(errno));
+	}
 
-	pthread_mutex_lock(&inst->terms_lock);
-	if ((tmp = strdup(inst->terms)) == NULL) {
-		LOG_PRINT_ERROR("strdup() failed!");
-		return NULL;
+	mbox_mediasearch_freequery(query);
+	return NULL;
+}
+
+
+/**
+ * Runs a query on a background worker. Cached pages are sent
+ * right away and the rest are fetched. Cached pages older than
+ * the mediasearch.cache_revalidate setting are fetched again
+ * in the background to update the cache.
+ */
+static void *
+mbox_mediasearch_runquery(void *arg)
+{
+	int i, n_fetch = 0, age;
+	char key[512], *data;
+	struct avbox_delegate *del;
+	struct mbox_mediasearch_query * const query = arg;
+	struct mbox_mediasearch_query *stale = NULL;
+	struct mbox_mediasearch * const inst = query->inst;
+	char urls[query->n_pages][512];
+	const char *purls[query->n_pages];
+	struct mbox_mediasearch_page *fetch[query->n_pages];
+	const int max_conns = avbox_settings_getint("mediasearch.max_connections", 2);
+	const int interval = avbox_settings_getint("mediasearch.request_interval", 250);
+	const int revalidate = avbox_settings_getint("mediasearch.cache_revalidate",
+		MBOX_MEDIASEARCH_REVALIDATE);
+
+	query->fetch = fetch;
+	query->last_flush = mbox_mediasearch_now();
+
+	for (i = 0; i < query->n_pages; i++) {
+		struct mbox_mediasearch_page * const page = &query->pages[i];
+		page->number = query->first_page + i;
+		page->input.addresult = mbox_mediasearch_parsed;
+
+		mbox_mediasearch_getkey(key, sizeof(key), query, page->number);
+		if ((data = mbox_searchcache_get(key, &age)) == NULL) {
+			if (query->provider->geturl(urls[n_fetch], sizeof(urls[n_fetch]),
+				query->terms, query->cat, page->number) == -1) {
+				LOG_VPRINT_ERROR("Could not get url of page %i from '%s'",
+					page->number, query->provider->name);
+				page->done = page->failed = 1;
+				break;
+			}
+			purls[n_fetch] = urls[n_fetch];
+			fetch[n_fetch++] = page;
+			query->pending++;
+			continue;
+		}
+
+		mbox_mediasearch_loadpage(page, data);
+		free(data);
+
+		DEBUG_VPRINT("mediasearch", "Page %i of '%s' from %s is cached (age=%is, results=%i)",
+			page->number, query->terms, query->provider->name, age, page->n_results);
+
+		if (age >= revalidate) {
+			if (stale == NULL) {
+				if ((stale = malloc(sizeof(struct mbox_mediasearch_query))) != NULL) {
+					memset(stale, 0, sizeof(struct mbox_mediasearch_query));
+					stale->provider = query->provider;
+					stale->cat = query->cat;
+					stale->revalidate = 1;
+					stale->pages = calloc(query->n_pages, sizeof(struct mbox_mediasearch_page));
+					stale->terms = strdup(query->terms);
+					if (stale->pages == NULL || stale->terms == NULL) {
+						mbox_mediasearch_freequery(stale);
+						stale = NULL;
+					}
+				}
+			}
+			if (stale != NULL) {
+				stale->pages[stale->n_pages].number = page->number;
+				stale->pages[stale->n_pages].revalidate = 1;
+				stale->n_pages++;
+			}
+		}
+
+		/* there's nothing past an empty page */
+		if (page->n_results == 0) {
+			break;
+		}
+	}
+
+	/* send the cached results now */
+	mbox_mediasearch_release(query);
+	if (query->batch != NULL) {
+		mbox_mediasearch_flush(query);
+	}
+	if (query->pending == 0) {
+		mbox_mediasearch_finish(query);
+	}
+
+	if (stale != NULL) {
+		if ((del = avbox_thread_delegate_qos(mbox_mediasearch_revalidate, stale,
+			AVBOX_THREAD_QOS_IDLE)) == NULL) {
+			LOG_VPRINT_ERROR("Could not revalidate '%s': %s",
+				query->terms, strerror(errno));
+			mbox_mediasearch_freequery(stale);
+		} else {
+			avbox_delegate_dettach(del);
+		}
+	}
+
+	if (n_fetch > 0) {
+		DEBUG_VPRINT("mediasearch", "Fetching %i pages of '%s' from %s",
+			n_fetch, query->terms, query->provider->name);
+
+		if (mb_url_fetchmany(purls, n_fetch, (max_conns > 0) ? max_conns : 1,
+			(interval > 0) ? interval : 0, mbox_mediasearch_chunk,
+			mbox_mediasearch_pagedone, query) == -1 && errno != ECANCELED) {
+			LOG_PRINT_ERROR("Search failed!");
+		}
 	}
+
+	/* send whatever is left along with the state
+	 * of the search */
+	mbox_mediasearch_finish(query);
+	mbox_mediasearch_freequery(query);
+
+	pthread_mutex_lock(&inst->terms_lock);
+	inst->n_queries--;
+	pthread_cond_signal(&inst->queries_done);
 	pthread_mutex_unlock(&inst->terms_lock);
 
-	/* clear the list */
+	return NULL;
+}
+
+
+/**
+ * Start fetching the next pages of a source. Must be
+ * called from the main thread.
+ */
+static int
+mbox_mediasearch_query(struct mbox_mediasearch * const inst, const int source)
+{
 	struct avbox_delegate *del;
-	if ((del = avbox_application_delegate(
-		mbox_mediasearch_clearlist, inst)) == NULL) {
-		LOG_VPRINT_ERROR("Could not delegate call 'clearlist' to main thread: %s",
+	struct mbox_mediasearch_query *query;
+	struct mbox_mediasearch_source * const src = &inst->sources[source];
+	const int n_pages = avbox_settings_getint("mediasearch.prefetch_pages", 2);
+
+	if ((query = malloc(sizeof(struct mbox_mediasearch_query))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return -1;
+	}
+	memset(query, 0, sizeof(struct mbox_mediasearch_query));
+
+	query->inst = inst;
+	query->object = inst->dispatch_object;
+	query->provider = src->provider;
+	query->source = source;
+	query->cat = inst->cat;
+	query->first_page = src->next_page;
+	query->n_pages = (n_pages < 1) ? 1 :
+		(n_pages > MBOX_MEDIASEARCH_MAXPAGES) ? MBOX_MEDIASEARCH_MAXPAGES : n_pages;
+	if (src->deadline > 0) {
+		query->deadline = mbox_mediasearch_now() + src->deadline;
+	}
+
+	if ((query->pages = calloc(query->n_pages, sizeof(struct mbox_mediasearch_page))) == NULL ||
+		(query->terms = strdup(inst->terms)) == NULL) {
+		free(query->pages);
+		free(query);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pthread_mutex_lock(&inst->terms_lock);
+	query->generation = inst->generation;
+	inst->n_queries++;
+	pthread_mutex_unlock(&inst->terms_lock);
+
+	/* each provider runs on it's own worker so
+	 * a slow one doesn't hold up the others */
+	if ((del = avbox_thread_delegate_qos(mbox_mediasearch_runquery, query,
+		AVBOX_THREAD_QOS_DEFAULT)) == NULL) {
+		LOG_VPRINT_ERROR("Could not start search: %s",
 			strerror(errno));
-	} else {
-		avbox_delegate_wait(del, NULL);
+		pthread_mutex_lock(&inst->terms_lock);
+		inst->n_queries--;
+		pthread_mutex_unlock(&inst->terms_lock);
+		free(query->terms);
+		free(query->pages);
+		free(query);
+		return -1;
+	}
+	avbox_delegate_dettach(del);
+
+	src->searching = 1;
+	inst->searching++;
+	return 0;
+}
+
+
+/**
+ * Fetch the next pages from all the sources that
+ * have more results.
+ */
+static void
+mbox_mediasearch_querymore(struct mbox_mediasearch * const inst)
+{
+	int i;
+	for (i = 0; i < inst->n_sources; i++) {
+		if (!inst->sources[i].searching && !inst->sources[i].exhausted &&
+			mbox_mediasearch_query(inst, i) == -1) {
+			LOG_VPRINT_ERROR("Search on '%s' failed!",
+				inst->sources[i].provider->name);
+		}
+	}
+}
+
+
+/**
+ * Cancel the running queries.
+ */
+static void
+mbox_mediasearch_cancel(struct mbox_mediasearch * const inst)
+{
+	int i;
+	pthread_mutex_lock(&inst->terms_lock);
+	inst->generation++;
+	pthread_mutex_unlock(&inst->terms_lock);
+	for (i = 0; i < inst->n_sources; i++) {
+		inst->sources[i].searching = 0;
+	}
+	inst->searching = 0;
+}
+
+
+/**
+ * Start a new search with the current terms on all the
+ * enabled providers.
+ */
+static void
+mbox_mediasearch_newsearch(struct mbox_mediasearch * const inst)
+{
+	int i;
+	char key[64];
+	const struct mbox_searchprovider *providers[MBOX_MEDIASEARCH_MAXPROVIDERS];
+
+	mbox_mediasearch_cancel(inst);
+	mbox_mediasearch_clearlist(inst);
+	avbox_listview_update(inst->menu);
+
+	inst->n_sources = mbox_searchprovider_getenabled(providers,
+		MBOX_MEDIASEARCH_MAXPROVIDERS);
+	if (inst->n_sources == 0) {
+		LOG_PRINT_ERROR("No search providers enabled!");
+		return;
+	}
+
+	for (i = 0; i < inst->n_sources; i++) {
+		struct mbox_mediasearch_source * const src = &inst->sources[i];
+		snprintf(key, sizeof(key), "mediasearch.%s.deadline", providers[i]->name);
+		src->provider = providers[i];
+		src->deadline = avbox_settings_getint(key, providers[i]->deadline);
+		src->next_page = 1;
+		src->exhausted = 0;
+		src->searching = 0;
+	}
+
+	mbox_mediasearch_querymore(inst);
+}
+
+
+/**
+ * Gets the key used to find duplicate results. That's the
+ * info hash in hex when the magnet has one.
+ */
+static void
+mbox_mediasearch_getresultkey(char * const key, const size_t n,
+	const char * const magnet)
+{
+	static const char * const hex = "0123456789abcdef";
+	const char *hash;
+	size_t len, i;
+
+	for (hash = magnet; *hash != '\0'; hash++) {
+		if (!strncasecmp(hash, "urn:btih:", 9)) {
+			break;
+		}
+	}
+	if (*hash == '\0' || n < 41) {
+		snprintf(key, n, "%s", magnet);
+		return;
 	}
+	hash += 9;
+	len = strcspn(hash, "&");
 
-	/* search with the new terms */
-	if (mbox_mediasearch_search(inst, tmp, inst->items_count, 25) == 0) {
-		avbox_window_update(inst->window);
+	if (len == 40) {
+		for (i = 0; i < len; i++) {
+			key[i] = tolower((unsigned char) hash[i]);
+		}
+		key[len] = '\0';
+	} else if (len == 32) {
+		/* base32 encoded */
+		unsigned int bits = 0, acc = 0, v;
+		char *dst = key;
+		for (i = 0; i < len; i++) {
+			const char c = toupper((unsigned char) hash[i]);
+			if (c >= 'A' && c <= 'Z') {
+				v = c - 'A';
+			} else if (c >= '2' && c <= '7') {
+				v = c - '2' + 26;
+			} else {
+				snprintf(key, n, "%s", magnet);
+				return;
+			}
+			acc = (acc << 5) | v;
+			bits += 5;
+			if (bits >= 8) {
+				const unsigned int byte = (acc >> (bits - 8)) & 0xff;
+				bits -= 8;
+				*dst++ = hex[byte >> 4];
+				*dst++ = hex[byte & 0xf];
+			}
+		}
+		*dst = '\0';
 	} else {
-		LOG_PRINT_ERROR("Search failed!");
+		snprintf(key, n, "%s", magnet);
 	}
+}
 
-	if (inst->last_terms != NULL) {
-		free(inst->last_terms);
+
+/**
+ * Checks if a result has been shown already and
+ * remembers it if it hasn't.
+ */
+static int
+mbox_mediasearch_isdup(struct mbox_mediasearch * const inst,
+	const char * const magnet)
+{
+	char key[256];
+	unsigned int hash = 5381;
+	const char *p;
+	LIST *bucket;
+	struct mbox_mediasearch_seen *seen;
+
+	mbox_mediasearch_getresultkey(key, sizeof(key), magnet);
+	for (p = key; *p != '\0'; p++) {
+		hash = (hash * 33) ^ (unsigned char) *p;
 	}
-	if ((inst->last_terms = strdup(tmp)) == NULL) {
-		LOG_PRINT_ERROR("Out of memory");
+	bucket = &inst->seen[hash % MBOX_MEDIASEARCH_BUCKETS];
+
+	LIST_FOREACH(struct mbox_mediasearch_seen*, seen, bucket) {
+		if (!strcmp(seen->key, key)) {
+			return 1;
+		}
 	}
-	free(tmp);
-	return NULL;
+
+	if ((seen = malloc(sizeof(struct mbox_mediasearch_seen))) == NULL ||
+		(seen->key = strdup(key)) == NULL) {
+		ASSERT(errno == ENOMEM);
+		free(seen);
+		return 0;
+	}
+	LIST_ADD(bucket, seen);
+	return 0;
+}
+
+
+/**
+ * Add a batch of results to the list. Results that another
+ * provider already returned are dropped.
+ */
+static void
+mbox_mediasearch_addbatch(struct mbox_mediasearch * const inst,
+	struct mbox_mediasearch_batch * const batch)
+{
+	int i, added = 0;
+	const int current = (inst->menu != NULL &&
+		batch->generation == inst->generation);
+
+	for (i = 0; i < batch->n; i++) {
+		if (!current || mbox_mediasearch_isdup(inst, batch->items[i].magnet) ||
+			avbox_listview_additem(inst->menu,
+			batch->items[i].name, batch->items[i].magnet) == -1) {
+			free(batch->items[i].magnet);
+		} else {
+			inst->items_count++;
+			added++;
+		}
+		free(batch->items[i].name);
+	}
+
+	if (current) {
+		if (added > 0) {
+			avbox_listview_update(inst->menu);
+		}
+		if (batch->last) {
+			struct mbox_mediasearch_source * const src =
+				&inst->sources[batch->source];
+			DEBUG_VPRINT("mediasearch", "Search on %s done (items=%i, exhausted=%i)",
+				src->provider->name, inst->items_count, batch->exhausted);
+			src->next_page = batch->next_page;
+			src->exhausted = batch->exhausted;
+			src->searching = 0;
+			inst->searching--;
+		}
+	}
+	free(batch);
 }
 
 
+#define STRINGIZE2(x) #x
+#define STRINGIZE(x) STRINGIZE2(x)
+
+
 static int
 mbox_mediasearch_appendtoterms(struct mbox_mediasearch * const inst, char *c)
 {
@@ -319,21 +1082,18 @@ end:
 
 
 /**
- * Called by the menu widget when it reaches the end of the list.
+ * Called by the menu widget when it reaches the end of the list. The
+ * next pages are fetched in the background and show up when they
+ * arrive. Providers that are still busy are skipped.
  */
 int
 mbox_mediasearch_endoflist(struct avbox_listview *inst, void *context)
 {
 	struct mbox_mediasearch * const me = context;
+	(void) inst;
 
 	if (me->state == AVBOX_MEDIASEARCH_STATE_ITEMS) {
-		(void) inst;
-		if (mbox_mediasearch_search(me, me->terms, me->items_count, 25) == 0) {
-			avbox_window_update(me->window);
-			return 0;
-		} else {
-			LOG_PRINT_ERROR("Search failed!");
-		}
+		mbox_mediasearch_querymore(me);
 	}
 	return -1;
 }
@@ -404,14 +1164,10 @@ mbox_mediasearch_msghandler(void *context, struct avbox_message *msg)
 					inst->terms);
 				avbox_window_settitle(inst->window, title);
 				avbox_window_update(inst->window);
-
-				struct avbox_delegate *del;
-				if ((del = avbox_thread_delegate(mbox_mediasearch_dosearch, inst)) == NULL) {
-					LOG_PRINT_ERROR("Could not call search delegate!");
-				} else {
-					avbox_delegate_wait(del, NULL);
-				}
 				free(title);
+
+				/* the results show up as they arrive */
+				mbox_mediasearch_newsearch(inst);
 			}
 		}
 
@@ -462,9 +1218,9 @@ mbox_mediasearch_msghandler(void *context, struct avbox_message *msg)
 			avbox_window_hide(inst->window);
 
 			/* reset state */
+			mbox_mediasearch_cancel(inst);
 			inst->state = AVBOX_MEDIASEARCH_STATE_CATEGORIES;
-			avbox_listview_enumitems(inst->menu, mbox_mediasearch_freeitems, NULL);
-			avbox_listview_clearitems(inst->menu);
+			mbox_mediasearch_clearlist(inst);
 			avbox_listview_additem(inst->menu, "Movies", "MOV");
 			avbox_listview_additem(inst->menu, "TV Shows", "TV");
 			avbox_window_update(inst->window);
@@ -480,9 +1236,27 @@ mbox_mediasearch_msghandler(void *context, struct avbox_message *msg)
 		default:
 			DEBUG_ABORT("mediasearch", "Invalid state!");
 		}
+		break;
+	}
+	case MBOX_MESSAGETYPE_MEDIASEARCH:
+	{
+		mbox_mediasearch_addbatch(inst, avbox_message_payload(msg));
+		break;
+	}
+	case AVBOX_MESSAGETYPE_DESTROY:
+	{
+		break;
+	}
+	case AVBOX_MESSAGETYPE_CLEANUP:
+	{
+		pthread_cond_destroy(&inst->queries_done);
+		pthread_mutex_destroy(&inst->terms_lock);
+		free(inst->terms);
+		free(inst);
+		break;
 	}
 	default:
-		abort();
+		return AVBOX_DISPATCH_CONTINUE;
 	}
 	return AVBOX_DISPATCH_OK;
 }
@@ -497,7 +1271,7 @@ mbox_mediasearch_new(struct avbox_object *parent)
 	int xres, yres;
 	int font_height;
 	int window_height, window_width;
-	int n_entries = 10;
+	int n_entries = 10, i;
 	struct mbox_mediasearch *inst;
 
 	/* allocate memory for instance */
@@ -505,6 +1279,7 @@ mbox_mediasearch_new(struct avbox_object *parent)
 		assert(errno == ENOMEM);
 		return NULL;
 	}
+	memset(inst, 0, sizeof(struct mbox_mediasearch));
 
 	/* allocate memory for search terms */
 	if ((inst->terms = malloc(1)) == NULL) {
@@ -519,7 +1294,12 @@ mbox_mediasearch_new(struct avbox_object *parent)
 	inst->cat = NULL;
 	inst->updater_quit = 0;
 	inst->terms_sz = 1;
+	for (i = 0; i < MBOX_MEDIASEARCH_BUCKETS; i++) {
+		LIST_INIT(&inst->seen[i]);
+	}
 	strcpy(inst->terms, "");
+	pthread_mutex_init(&inst->terms_lock, NULL);
+	pthread_cond_init(&inst->queries_done, NULL);
 
 	/* set height according to font size */
 	avbox_window_getcanvassize(avbox_video_getrootwindow(0), &xres, &yres);
@@ -560,15 +1340,15 @@ mbox_mediasearch_new(struct avbox_object *parent)
 		avbox_window_destroy(inst->window);
 		free(inst->terms);
 		free(inst);
+		return NULL;
 	}
 
 	/* create a new menu widget inside main window */
 	inst->menu = avbox_listview_new(inst->window, inst->dispatch_object);
 	if (inst->menu == NULL) {
 		LOG_PRINT_ERROR("Could not create listview!");
+		avbox_object_destroy(inst->dispatch_object);
 		avbox_window_destroy(inst->window);
-		free(inst->terms);
-		free(inst);
 		return NULL;
 	}
 
@@ -578,11 +1358,9 @@ mbox_mediasearch_new(struct avbox_object *parent)
 	avbox_listview_seteolcallback(inst->menu, mbox_mediasearch_endoflist, inst);
 
 	/* initialize context */
-	inst->terms = NULL;
-	inst->last_terms = NULL;
 	inst->state = AVBOX_MEDIASEARCH_STATE_CATEGORIES;
 
-	return 0;
+	return inst;
 }
 
 
@@ -604,14 +1382,25 @@ mbox_mediasearch_show(struct mbox_mediasearch * const inst)
 void
 mbox_mediasearch_destroy(struct mbox_mediasearch * const inst)
 {
+	/* stop the running queries. The batches they already
+	 * sent are dropped when they arrive */
+	mbox_mediasearch_cancel(inst);
+	pthread_mutex_lock(&inst->terms_lock);
+	inst->closing = 1;
+	while (inst->n_queries > 0) {
+		pthread_cond_wait(&inst->queries_done, &inst->terms_lock);
+	}
+	pthread_mutex_unlock(&inst->terms_lock);
+
 	if (inst->state == AVBOX_MEDIASEARCH_STATE_ITEMS) {
 		avbox_listview_enumitems(inst->menu, mbox_mediasearch_freeitems, NULL);
 	}
+	mbox_mediasearch_clearseen(inst);
 
-	/* free resources */
+	/* free resources. The instance is freed when the
+	 * dispatch object is cleaned up */
 	avbox_listview_destroy(inst->menu);
+	inst->menu = NULL;
 	avbox_window_destroy(inst->window);
-	if (inst->terms != NULL) {
-		free(inst->terms);
-	}
+	avbox_object_destroy(inst->dispatch_object);
 }
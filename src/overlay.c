@@ -270,6 +270,11 @@ mbox_overlay_handler(void *context, struct avbox_message *msg)
 				LOG_VPRINT_ERROR("Could not register overlay timer: %s",
 					strerror(errno));
 				avbox_window_hide(inst->window);
+			} else {
+				/* let it tick with other timers */
+				tv.tv_sec = 0;
+				tv.tv_nsec = 250L * 1000L * 1000L;
+				(void) avbox_timer_setslack(inst->duration_timer, &tv);
 			}
 		}
 
@@ -0,0 +1,287 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ *
+ * Search page cache. The most recently used pages are kept in
+ * memory and all pages are saved to a database in the state
+ * directory so they survive restarts. Entries expire after the
+ * mediasearch.cache_ttl setting (in seconds).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sqlite3.h>
+
+#define LOG_MODULE "searchcache"
+
+#include "lib/log.h"
+#include "lib/debug.h"
+#include "lib/linkedlist.h"
+#include "lib/settings.h"
+#include "lib/file_util.h"
+#include "searchcache.h"
+
+
+#define MBOX_SEARCHCACHE_ENTRIES	(64)
+#define MBOX_SEARCHCACHE_TTL		(6 * 60 * 60)
+
+
+LISTABLE_STRUCT(mbox_searchcache_entry,
+	char *key;
+	char *data;
+	time_t time;
+);
+
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST entries = { &entries, &entries };	/* most recent first */
+static int n_entries = 0;
+static int max_entries = MBOX_SEARCHCACHE_ENTRIES;
+static int ttl = MBOX_SEARCHCACHE_TTL;
+static sqlite3 *db = NULL;
+static sqlite3_stmt *select_stmt = NULL;
+static sqlite3_stmt *replace_stmt = NULL;
+
+
+/**
+ * Free a memory entry. The cache lock must be held.
+ */
+static void
+mbox_searchcache_freeentry(struct mbox_searchcache_entry * const entry)
+{
+	LIST_REMOVE(entry);
+	n_entries--;
+	free(entry->key);
+	free(entry->data);
+	free(entry);
+}
+
+
+/**
+ * Add or update a memory entry and evict the least recently
+ * used ones. The cache lock must be held.
+ */
+static int
+mbox_searchcache_addentry(const char * const key, const char * const data,
+	const time_t time)
+{
+	struct mbox_searchcache_entry *entry;
+	char *copy;
+
+	if ((copy = strdup(data)) == NULL) {
+		return -1;
+	}
+
+	LIST_FOREACH(struct mbox_searchcache_entry*, entry, &entries) {
+		if (!strcmp(entry->key, key)) {
+			free(entry->data);
+			entry->data = copy;
+			entry->time = time;
+			LIST_REMOVE(entry);
+			LIST_ADD(&entries, entry);
+			return 0;
+		}
+	}
+
+	if ((entry = malloc(sizeof(struct mbox_searchcache_entry))) == NULL ||
+		(entry->key = strdup(key)) == NULL) {
+		free(entry);
+		free(copy);
+		errno = ENOMEM;
+		return -1;
+	}
+	entry->data = copy;
+	entry->time = time;
+	LIST_ADD(&entries, entry);
+	n_entries++;
+
+	while (n_entries > max_entries) {
+		mbox_searchcache_freeentry(LIST_TAIL(struct mbox_searchcache_entry*, &entries));
+	}
+	return 0;
+}
+
+
+/**
+ * Gets a cached search page.
+ */
+char *
+mbox_searchcache_get(const char * const key, int * const age)
+{
+	char *data = NULL;
+	struct mbox_searchcache_entry *entry;
+	const time_t now = time(NULL);
+
+	pthread_mutex_lock(&cache_lock);
+
+	LIST_FOREACH_SAFE(struct mbox_searchcache_entry*, entry, &entries, {
+		if (!strcmp(entry->key, key)) {
+			if (now - entry->time >= ttl) {
+				mbox_searchcache_freeentry(entry);
+				break;
+			}
+			LIST_REMOVE(entry);
+			LIST_ADD(&entries, entry);
+			if ((data = strdup(entry->data)) != NULL && age != NULL) {
+				*age = now - entry->time;
+			}
+			pthread_mutex_unlock(&cache_lock);
+			return data;
+		}
+	});
+
+	/* look it up on the database */
+	if (select_stmt != NULL) {
+		sqlite3_reset(select_stmt);
+		sqlite3_bind_text(select_stmt, 1, key, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(select_stmt, 2, (sqlite3_int64) (now - ttl));
+		if (sqlite3_step(select_stmt) == SQLITE_ROW) {
+			const time_t time = (time_t) sqlite3_column_int64(select_stmt, 0);
+			const char * const text = (const char*) sqlite3_column_text(select_stmt, 1);
+			if (text != NULL && (data = strdup(text)) != NULL) {
+				(void) mbox_searchcache_addentry(key, data, time);
+				if (age != NULL) {
+					*age = now - time;
+				}
+			}
+		}
+		sqlite3_reset(select_stmt);
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	if (data == NULL) {
+		errno = ENOENT;
+	}
+	return data;
+}
+
+
+/**
+ * Store a search page.
+ */
+int
+mbox_searchcache_put(const char * const key, const char * const data)
+{
+	int ret;
+	const time_t now = time(NULL);
+
+	pthread_mutex_lock(&cache_lock);
+
+	ret = mbox_searchcache_addentry(key, data, now);
+
+	if (replace_stmt != NULL) {
+		sqlite3_reset(replace_stmt);
+		sqlite3_bind_text(replace_stmt, 1, key, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(replace_stmt, 2, (sqlite3_int64) now);
+		sqlite3_bind_text(replace_stmt, 3, data, -1, SQLITE_STATIC);
+		if (sqlite3_step(replace_stmt) != SQLITE_DONE) {
+			LOG_VPRINT_ERROR("Could not save '%s': %s",
+				key, sqlite3_errmsg(db));
+		}
+		sqlite3_reset(replace_stmt);
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+	return ret;
+}
+
+
+/**
+ * Initialize the search cache.
+ */
+int
+mbox_searchcache_init(void)
+{
+	int res;
+	char *statedir, dbfile[PATH_MAX], sql[256];
+
+	DEBUG_PRINT("searchcache", "Initializing search cache");
+
+	if ((max_entries = avbox_settings_getint("mediasearch.cache_entries",
+		MBOX_SEARCHCACHE_ENTRIES)) < 1) {
+		max_entries = 1;
+	}
+	ttl = avbox_settings_getint("mediasearch.cache_ttl", MBOX_SEARCHCACHE_TTL);
+
+	if ((statedir = getstatedir()) == NULL) {
+		LOG_VPRINT_ERROR("Could not get state directory: %s",
+			strerror(errno));
+		return -1;
+	}
+	snprintf(dbfile, sizeof(dbfile), "%s/searchcache.db", statedir);
+	free(statedir);
+
+	if ((res = sqlite3_open_v2(dbfile, &db,
+		SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL)) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not open database '%s': %s (%d)",
+			dbfile, sqlite3_errmsg(db), res);
+		goto err;
+	}
+
+	/* create the table and drop the expired pages */
+	snprintf(sql, sizeof(sql),
+		"CREATE TABLE IF NOT EXISTS cache ("
+		"key TEXT PRIMARY KEY,"
+		"time INTEGER,"
+		"data TEXT);"
+		"DELETE FROM cache WHERE time < %lli;",
+		(long long) (time(NULL) - ttl));
+	if ((res = sqlite3_exec(db, sql, NULL, NULL, NULL)) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("SQL Query: '%s' failed: %s (%d)",
+			sql, sqlite3_errmsg(db), res);
+		goto err;
+	}
+
+	if (sqlite3_prepare_v2(db,
+		"SELECT time, data FROM cache WHERE key = ? AND time >= ?;",
+		-1, &select_stmt, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db,
+		"INSERT OR REPLACE INTO cache (key, time, data) VALUES (?, ?, ?);",
+		-1, &replace_stmt, NULL) != SQLITE_OK) {
+		LOG_VPRINT_ERROR("Could not prepare statements: %s",
+			sqlite3_errmsg(db));
+		goto err;
+	}
+
+	return 0;
+err:
+	/* we can still cache in memory */
+	sqlite3_finalize(select_stmt);
+	sqlite3_finalize(replace_stmt);
+	select_stmt = replace_stmt = NULL;
+	sqlite3_close(db);
+	db = NULL;
+	return -1;
+}
+
+
+/**
+ * Shutdown the search cache.
+ */
+void
+mbox_searchcache_shutdown(void)
+{
+	struct mbox_searchcache_entry *entry;
+
+	DEBUG_PRINT("searchcache", "Shutting down search cache");
+
+	pthread_mutex_lock(&cache_lock);
+	LIST_FOREACH_SAFE(struct mbox_searchcache_entry*, entry, &entries, {
+		mbox_searchcache_freeentry(entry);
+	});
+	sqlite3_finalize(select_stmt);
+	sqlite3_finalize(replace_stmt);
+	select_stmt = replace_stmt = NULL;
+	sqlite3_close(db);
+	db = NULL;
+	pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,43 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ */
+
+#ifndef __MBOX_SEARCHCACHE_H__
+#define __MBOX_SEARCHCACHE_H__
+
+
+/**
+ * Gets a cached search page. The result must be freed with
+ * free(). If age is not NULL it is set to the age of the entry
+ * in seconds.
+ *
+ * Returns NULL and sets errno to ENOENT if the page is not
+ * cached or has expired.
+ */
+char *
+mbox_searchcache_get(const char * const key, int * const age);
+
+
+/**
+ * Store a search page.
+ */
+int
+mbox_searchcache_put(const char * const key, const char * const data);
+
+
+/**
+ * Initialize the search cache.
+ */
+int
+mbox_searchcache_init(void);
+
+
+/**
+ * Shutdown the search cache.
+ */
+void
+mbox_searchcache_shutdown(void);
+
+
+#endif
@@ -0,0 +1,182 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ *
+ * Kickass Torrents search provider.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOG_MODULE "searchprovider-kat"
+
+#include "lib/log.h"
+#include "lib/debug.h"
+#include "lib/url_util.h"
+#include "searchprovider.h"
+
+
+/**
+ * Gets the value of a field of a result's data-sc-params
+ * attribute.
+ */
+static char *
+mbox_searchprovider_kat_getfield(const char * const params, const char * const key)
+{
+	char *value, *end, *buf;
+	size_t sz;
+
+	if ((value = strstr(params, key)) == NULL) {
+		return NULL;
+	}
+	value += strlen(key);
+	if ((end = strstr(value, "'")) == NULL) {
+		LOG_PRINT_ERROR("Invalid input");
+		return NULL;
+	}
+	sz = end - value;
+	if ((buf = malloc(sz + 1)) == NULL) {
+		LOG_PRINT_ERROR("Out of memory");
+		return NULL;
+	}
+	memcpy(buf, value, sz);
+	buf[sz] = '\0';
+	return buf;
+}
+
+
+/**
+ * Parse a result row.
+ */
+static void
+mbox_searchprovider_kat_parserow(struct mbox_searchprovider_input * const input,
+	char * const row)
+{
+	char *data_start, *name, *magnet;
+
+	if ((data_start = strstr(row, "data-sc-params=\"")) == NULL) {
+		return;
+	}
+	data_start += 16;
+
+	if ((name = mbox_searchprovider_kat_getfield(data_start, "'name': '")) == NULL) {
+		return;
+	}
+	if ((magnet = mbox_searchprovider_kat_getfield(data_start, "'magnet': '")) == NULL) {
+		free(name);
+		return;
+	}
+	urldecode(name, name);
+
+	input->addresult(input, name, magnet);
+}
+
+
+/**
+ * Parse all the complete rows in the buffer. Rows are parsed
+ * as soon as the next one starts so we don't wait for the whole
+ * page.
+ */
+static void
+mbox_searchprovider_kat_parse(struct mbox_searchprovider_input * const input,
+	const int final)
+{
+	char *row, *next, *end;
+
+	if (input->ended) {
+		return;
+	}
+
+	if (!input->started) {
+		if ((row = strstr(input->buf, "<tr class=\"firstr\">")) == NULL) {
+			if (final) {
+				input->ended = 1;
+				if (strstr(input->buf, "Nothing found!") == NULL) {
+					LOG_VPRINT_ERROR("Invalid input (content=\"%s\")",
+						input->buf);
+				}
+			}
+			return;
+		}
+		input->started = 1;
+		mbox_searchprovider_consume(input, row);
+	}
+
+	/* the buffer always starts at the current row */
+	row = input->buf;
+	while (1) {
+		next = strstr(row + 1, "<tr");
+		end = strstr(row + 1, "</table>");
+		if (end != NULL && (next == NULL || end < next)) {
+			*end = '\0';
+			mbox_searchprovider_kat_parserow(input, row);
+			input->ended = 1;
+			input->len = 0;
+			return;
+		} else if (next == NULL) {
+			if (final) {
+				mbox_searchprovider_kat_parserow(input, row);
+				input->ended = 1;
+				input->len = 0;
+				return;
+			}
+			break;
+		}
+		*next = '\0';
+		mbox_searchprovider_kat_parserow(input, row);
+		*next = '<';
+		row = next;
+	}
+
+	mbox_searchprovider_consume(input, row);
+}
+
+
+/**
+ * Format the url of a result page.
+ */
+static int
+mbox_searchprovider_kat_geturl(char * const url, const size_t n,
+	const char * const terms, const char * const cat, const int page)
+{
+	if (terms != NULL && strcmp(terms, "")) {
+		char escaped[128], *dst = escaped;
+		const char *src = terms;
+		while (*src != '\0' && dst < escaped + sizeof(escaped) - 4) {
+			if (*src == ' ') {
+				strcpy(dst, "%20");
+				dst += 3;
+			} else {
+				*dst++ = *src;
+			}
+			src++;
+		}
+		*dst = '\0';
+		snprintf(url, n, "https://kat.cr/usearch/%s%%20category:%s/%i/",
+			escaped, cat, page);
+	} else {
+		snprintf(url, n, "https://kat.cr/%s/%i/", cat, page);
+	}
+	return 0;
+}
+
+
+static int
+mbox_searchprovider_kat_available(void)
+{
+	return 1;
+}
+
+
+const struct mbox_searchprovider mbox_searchprovider_kat =
+{
+	.name = "kat",
+	.deadline = 5000,
+	.available = mbox_searchprovider_kat_available,
+	.geturl = mbox_searchprovider_kat_geturl,
+	.parse = mbox_searchprovider_kat_parse
+};
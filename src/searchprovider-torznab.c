@@ -0,0 +1,238 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ *
+ * Torznab search provider. Torznab is the RSS based API served by
+ * indexer proxies such as Jackett. The endpoint is set with the
+ * mediasearch.torznab.url and mediasearch.torznab.apikey settings.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#define LOG_MODULE "searchprovider-torznab"
+
+#include "lib/log.h"
+#include "lib/debug.h"
+#include "lib/settings.h"
+#include "searchprovider.h"
+
+
+#define MBOX_TORZNAB_PAGESIZE	(50)
+
+
+/**
+ * Decode the XML entities of a string in place.
+ */
+static void
+mbox_searchprovider_torznab_unescape(char *str)
+{
+	static const char * const entities[][2] =
+	{
+		{ "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" },
+		{ "&quot;", "\"" }, { "&apos;", "'" }, { NULL, NULL }
+	};
+	char *dst = str;
+	int i;
+
+	while (*str != '\0') {
+		if (*str == '&') {
+			for (i = 0; entities[i][0] != NULL; i++) {
+				const size_t len = strlen(entities[i][0]);
+				if (!strncmp(str, entities[i][0], len)) {
+					*dst++ = *entities[i][1];
+					str += len;
+					break;
+				}
+			}
+			if (entities[i][0] != NULL) {
+				continue;
+			}
+		}
+		*dst++ = *str++;
+	}
+	*dst = '\0';
+}
+
+
+/**
+ * Gets the text between two strings.
+ */
+static char *
+mbox_searchprovider_torznab_between(const char * const item,
+	const char * const start, const char * const end)
+{
+	const char *value, *value_end;
+
+	if ((value = strstr(item, start)) == NULL) {
+		return NULL;
+	}
+	value += strlen(start);
+	if ((value_end = strstr(value, end)) == NULL) {
+		return NULL;
+	}
+	return strndup(value, value_end - value);
+}
+
+
+/**
+ * Parse an item.
+ */
+static void
+mbox_searchprovider_torznab_parseitem(struct mbox_searchprovider_input * const input,
+	const char * const item)
+{
+	char *name, *magnet, *hash;
+
+	if ((name = mbox_searchprovider_torznab_between(item, "<title>", "</title>")) == NULL) {
+		return;
+	}
+	if (!strncmp(name, "<![CDATA[", 9)) {
+		char * const end = strstr(name, "]]>");
+		if (end != NULL) {
+			*end = '\0';
+		}
+		memmove(name, name + 9, strlen(name + 9) + 1);
+	} else {
+		mbox_searchprovider_torznab_unescape(name);
+	}
+
+	/* use the magnet link or make one from the info hash */
+	if ((magnet = mbox_searchprovider_torznab_between(item,
+		"name=\"magneturl\" value=\"", "\"")) == NULL) {
+		if ((hash = mbox_searchprovider_torznab_between(item,
+			"name=\"infohash\" value=\"", "\"")) == NULL) {
+			free(name);
+			return;
+		}
+		if ((magnet = malloc(strlen(hash) + 21)) != NULL) {
+			sprintf(magnet, "magnet:?xt=urn:btih:%s", hash);
+		}
+		free(hash);
+		if (magnet == NULL) {
+			LOG_PRINT_ERROR("Out of memory");
+			free(name);
+			return;
+		}
+	}
+	mbox_searchprovider_torznab_unescape(magnet);
+
+	input->addresult(input, name, magnet);
+}
+
+
+/**
+ * Parse all the complete items in the buffer.
+ */
+static void
+mbox_searchprovider_torznab_parse(struct mbox_searchprovider_input * const input,
+	const int final)
+{
+	char *item, *end, *channel_end;
+
+	if (input->ended) {
+		return;
+	}
+
+	if (!input->started) {
+		if ((item = strstr(input->buf, "<channel>")) == NULL) {
+			if (final) {
+				input->ended = 1;
+				LOG_VPRINT_ERROR("Invalid input (content=\"%s\")",
+					input->buf);
+			}
+			return;
+		}
+		input->started = 1;
+		mbox_searchprovider_consume(input, item);
+	}
+
+	while (1) {
+		item = strstr(input->buf, "<item>");
+		channel_end = strstr(input->buf, "</channel>");
+		if (item == NULL || (channel_end != NULL && channel_end < item)) {
+			if (channel_end != NULL || final) {
+				input->ended = 1;
+				input->len = 0;
+				return;
+			}
+			break;
+		}
+		if ((end = strstr(item, "</item>")) == NULL) {
+			if (final) {
+				input->ended = 1;
+				input->len = 0;
+				return;
+			}
+			mbox_searchprovider_consume(input, item);
+			break;
+		}
+		*end = '\0';
+		mbox_searchprovider_torznab_parseitem(input, item);
+		mbox_searchprovider_consume(input, end + 7);
+	}
+}
+
+
+/**
+ * Format the url of a result page.
+ */
+static int
+mbox_searchprovider_torznab_geturl(char * const url, const size_t n,
+	const char * const terms, const char * const cat, const int page)
+{
+	char escaped[128], *dst = escaped, *endpoint, *apikey;
+	const char *src;
+
+	if ((endpoint = avbox_settings_getstring("mediasearch.torznab.url")) == NULL) {
+		return -1;
+	}
+	apikey = avbox_settings_getstring("mediasearch.torznab.apikey");
+
+	for (src = (terms != NULL) ? terms : ""; *src != '\0' &&
+		dst < escaped + sizeof(escaped) - 4; src++) {
+		if (isalnum((unsigned char) *src)) {
+			*dst++ = *src;
+		} else {
+			dst += sprintf(dst, "%%%02X", (unsigned char) *src);
+		}
+	}
+	*dst = '\0';
+
+	snprintf(url, n, "%s%sapikey=%s&t=search&q=%s&cat=%s&offset=%i&limit=%i",
+		endpoint, (strchr(endpoint, '?') == NULL) ? "?" : "&",
+		(apikey != NULL) ? apikey : "", escaped,
+		(!strcmp(cat, "tv")) ? "5000" : "2000",
+		(page - 1) * MBOX_TORZNAB_PAGESIZE, MBOX_TORZNAB_PAGESIZE);
+
+	free(apikey);
+	free(endpoint);
+	return 0;
+}
+
+
+static int
+mbox_searchprovider_torznab_available(void)
+{
+	char * const endpoint = avbox_settings_getstring("mediasearch.torznab.url");
+	if (endpoint == NULL) {
+		return 0;
+	}
+	free(endpoint);
+	return 1;
+}
+
+
+const struct mbox_searchprovider mbox_searchprovider_torznab =
+{
+	.name = "torznab",
+	.deadline = 10000,
+	.available = mbox_searchprovider_torznab_available,
+	.geturl = mbox_searchprovider_torznab_geturl,
+	.parse = mbox_searchprovider_torznab_parse
+};
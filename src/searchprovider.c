@@ -0,0 +1,77 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_MODULE "searchprovider"
+
+#include "lib/log.h"
+#include "lib/debug.h"
+#include "lib/settings.h"
+#include "searchprovider.h"
+
+
+/* all the compiled in providers */
+static const struct mbox_searchprovider * const providers[] =
+{
+	&mbox_searchprovider_kat,
+	&mbox_searchprovider_torznab,
+	NULL
+};
+
+
+/**
+ * Remove the data before pos from the buffer.
+ */
+void
+mbox_searchprovider_consume(struct mbox_searchprovider_input * const input,
+	char * const pos)
+{
+	input->len -= pos - input->buf;
+	memmove(input->buf, pos, input->len + 1);
+}
+
+
+/**
+ * Gets the enabled search providers.
+ */
+int
+mbox_searchprovider_getenabled(const struct mbox_searchprovider ** const enabled,
+	const int n)
+{
+	int i, cnt = 0;
+	char *list, *name, *saveptr;
+
+	if ((list = avbox_settings_getstring("mediasearch.providers")) == NULL) {
+		for (i = 0; providers[i] != NULL && cnt < n; i++) {
+			if (providers[i]->available()) {
+				enabled[cnt++] = providers[i];
+			}
+		}
+		return cnt;
+	}
+
+	for (name = strtok_r(list, ", ", &saveptr); name != NULL && cnt < n;
+		name = strtok_r(NULL, ", ", &saveptr)) {
+		for (i = 0; providers[i] != NULL; i++) {
+			if (!strcmp(providers[i]->name, name)) {
+				break;
+			}
+		}
+		if (providers[i] == NULL) {
+			LOG_VPRINT_ERROR("Unknown search provider '%s'", name);
+		} else if (!providers[i]->available()) {
+			LOG_VPRINT_ERROR("Search provider '%s' is not configured", name);
+		} else {
+			enabled[cnt++] = providers[i];
+		}
+	}
+	free(list);
+	return cnt;
+}
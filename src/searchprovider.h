@@ -0,0 +1,85 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ */
+
+#ifndef __MBOX_SEARCHPROVIDER_H__
+#define __MBOX_SEARCHPROVIDER_H__
+#include <stddef.h>
+
+
+/**
+ * A result page as it arrives. The buffer holds the data that
+ * has not been parsed yet and is always nul terminated.
+ */
+struct mbox_searchprovider_input
+{
+	char *buf;
+	size_t len;
+	int started;
+	int ended;
+
+	/**
+	 * Add a result to the page. Takes ownership of
+	 * name and magnet.
+	 */
+	void (*addresult)(struct mbox_searchprovider_input *input,
+		char *name, char *magnet);
+};
+
+
+/**
+ * A search provider.
+ */
+struct mbox_searchprovider
+{
+	const char *name;
+	int deadline;		/* default deadline (ms) */
+
+	/**
+	 * Checks if the provider is configured.
+	 */
+	int (*available)(void);
+
+	/**
+	 * Format the url of a result page. Pages are
+	 * numbered from 1.
+	 */
+	int (*geturl)(char *url, const size_t n, const char * const terms,
+		const char * const cat, const int page);
+
+	/**
+	 * Parse all the complete results at the start of the
+	 * buffer, drop them and set input->ended when there are
+	 * no more results. When final is set there's no more
+	 * data coming.
+	 */
+	void (*parse)(struct mbox_searchprovider_input *input, const int final);
+};
+
+
+/**
+ * Remove the data before pos from the buffer.
+ */
+void
+mbox_searchprovider_consume(struct mbox_searchprovider_input * const input,
+	char * const pos);
+
+
+/**
+ * Gets the enabled search providers. The mediasearch.providers
+ * setting is a comma separated list of providers. If it's not
+ * set all the available providers are used.
+ *
+ * Returns the number of providers.
+ */
+int
+mbox_searchprovider_getenabled(const struct mbox_searchprovider ** const providers,
+	const int n);
+
+
+extern const struct mbox_searchprovider mbox_searchprovider_kat;
+extern const struct mbox_searchprovider mbox_searchprovider_torznab;
+
+
+#endif
@@ -29,6 +29,10 @@
 #include "downloads-backend.h"
 #include "library-backend.h"
 #include "overlay.h"
+#include "searchcache.h"
+#include "libraryindex.h"
+#include "librarymeta.h"
+#include "upnp.h"
 
 
 #define MEDIA_FILE "/mov.mp4"
@@ -222,6 +226,12 @@ mbox_shell_startclock(void)
 	clock_timer_id = avbox_timer_register(&tv,
 		AVBOX_TIMER_TYPE_AUTORELOAD | AVBOX_TIMER_MESSAGE,
 		dispatch_object, NULL, NULL);
+
+	/* the clock doesn't need to be exact */
+	if (clock_timer_id != -1) {
+		tv.tv_sec = 1;
+		(void) avbox_timer_setslack(clock_timer_id, &tv);
+	}
 }
 
 
@@ -503,6 +513,7 @@ mbox_shell_shutdown(void)
 
 	/* destroy player */
 	if (player != NULL) {
+		mb_downloadmanager_unwatchplayer();
 		if (avbox_player_unsubscribe(player, dispatch_object) == -1) {
 			LOG_VPRINT_ERROR("Could not unsubscribe from player events: %s",
 				strerror(errno));
@@ -546,6 +557,10 @@ mbox_shell_shutdown(void)
 	}
 
 	/* shutdown services */
+	mbox_upnp_shutdown();
+	mbox_librarymeta_shutdown();
+	mbox_libraryindex_shutdown();
+	mbox_searchcache_shutdown();
 	avbox_discovery_shutdown();
 	mb_downloadmanager_destroy();
 
@@ -789,6 +804,24 @@ mbox_shell_init(int launch_avmount, int launch_mediatomb)
 		return -1;
 	}
 
+	/* initialize the search cache. If it fails
+	 * we only cache in memory */
+	if (mbox_searchcache_init() == -1) {
+		LOG_PRINT_ERROR("Could not open search cache");
+	}
+
+	/* initialize the library index. If it fails
+	 * folders are listed from disk */
+	if (mbox_libraryindex_init(LIBRARY_ROOT) == -1) {
+		LOG_PRINT_ERROR("Could not open library index");
+	}
+	if (mbox_librarymeta_init() == -1) {
+		LOG_PRINT_ERROR("Could not start metadata extractor");
+	}
+	if (mbox_upnp_init() == -1) {
+		LOG_PRINT_ERROR("Could not start UPnP client");
+	}
+
 	/* get the screen size in pixels (that's the
 	 * size of the root window */
 	root_window = avbox_video_getrootwindow(0);
@@ -840,9 +873,16 @@ mbox_shell_init(int launch_avmount, int launch_mediatomb)
 		return -1;
 	}
 
+	/* throttle downloads during playback. This must go
+	 * before us because we consume the notifications */
+	if (mb_downloadmanager_watchplayer(player) == -1) {
+		LOG_PRINT_ERROR("Could not throttle downloads during playback");
+	}
+
 	/* subscribe to player notifications */
 	if (avbox_player_subscribe(player, dispatch_object) == -1) {
 		LOG_PRINT_ERROR("Could not reqister notification object");
+		mb_downloadmanager_unwatchplayer();
 		avbox_object_destroy(dispatch_object);
 		avbox_player_destroy(player);
 		avbox_window_destroy(main_window);
@@ -853,6 +893,7 @@ mbox_shell_init(int launch_avmount, int launch_mediatomb)
 	if (avbox_application_subscribe(mbox_shell_appevent, NULL) == -1) {
 		LOG_VPRINT_ERROR("Could not subscribe to app events: %s",
 			strerror(errno));
+		mb_downloadmanager_unwatchplayer();
 		avbox_object_destroy(dispatch_object);
 		avbox_player_destroy(player);
 		avbox_window_destroy(main_window);
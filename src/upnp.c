@@ -0,0 +1,1300 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ *
+ * UPnP ContentDirectory client. Media servers are found with SSDP
+ * and from the upnp.servers setting (a comma separated list of device
+ * description urls for servers that don't answer to multicast) and
+ * browsed with SOAP requests. Listings are fetched in pages and the
+ * containers that were browsed last are cached. Items are handed to
+ * the player as the HTTP url of their resource so reads and seeks
+ * (range requests) go straight to the server.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define LOG_MODULE "upnp"
+
+#include "lib/log.h"
+#include "lib/debug.h"
+#include "lib/linkedlist.h"
+#include "lib/settings.h"
+#include "lib/dispatch.h"
+#include "lib/thread.h"
+#include "lib/url_util.h"
+#include "upnp.h"
+
+
+#define MBOX_UPNP_SSDP_ADDR		"239.255.255.250"
+#define MBOX_UPNP_SSDP_PORT		(1900)
+#define MBOX_UPNP_SSDP_WAIT		(2)	/* secs */
+#define MBOX_UPNP_DISCOVERY_INTERVAL	(60)	/* secs */
+#define MBOX_UPNP_SERVER_TIMEOUT	(600)	/* secs */
+#define MBOX_UPNP_MAXLOCATIONS		(32)
+#define MBOX_UPNP_PAGESIZE		(200)
+#define MBOX_UPNP_CACHE_TTL		(300)	/* secs */
+#define MBOX_UPNP_CACHE_SIZE		(64)	/* containers */
+#define MBOX_UPNP_CDS			"urn:schemas-upnp-org:service:ContentDirectory:1"
+#define MBOX_UPNP_BROWSE \
+	"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n" \
+	"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" " \
+	"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">" \
+	"<s:Body><u:Browse xmlns:u=\"" MBOX_UPNP_CDS "\">" \
+	"<ObjectID>%s</ObjectID>" \
+	"<BrowseFlag>BrowseDirectChildren</BrowseFlag>" \
+	"<Filter>dc:title,res,res@size,res@duration,res@resolution,res@protocolInfo</Filter>" \
+	"<StartingIndex>%i</StartingIndex>" \
+	"<RequestedCount>%i</RequestedCount>" \
+	"<SortCriteria></SortCriteria>" \
+	"</u:Browse></s:Body></s:Envelope>\r\n"
+
+
+/**
+ * A media server.
+ */
+LISTABLE_STRUCT(mbox_upnp_server,
+	char *udn;
+	char *name;
+	char *control_url;
+	int64_t last_seen;
+);
+
+
+/**
+ * An object that is notified when the servers change.
+ */
+LISTABLE_STRUCT(mbox_upnp_subscriber,
+	struct avbox_object *object;
+);
+
+
+/**
+ * A container or item. Containers have no url.
+ */
+struct mbox_upnp_object
+{
+	char *id;
+	char *title;
+	char *url;
+	int64_t size;
+	int64_t duration;
+	int width;
+	int height;
+};
+
+
+/**
+ * A cached listing. The objects don't change once it's on the
+ * cache so it's read without the lock while it's referenced.
+ */
+LISTABLE_STRUCT(mbox_upnp_container,
+	char *path;
+	struct mbox_upnp_object *objects;
+	int n_objects;
+	int objects_size;
+	int64_t fetched;
+	int refs;
+	int dead;
+);
+
+
+static pthread_mutex_t upnp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t upnp_cond = PTHREAD_COND_INITIALIZER;
+static int initialized = 0;
+static int quit = 0;
+static int discovering = 0;
+static int servers_changed = 0;
+static int64_t last_discovery = 0;
+static int cache_ttl = MBOX_UPNP_CACHE_TTL;
+static int n_cached = 0;
+static char *configured_servers = NULL;
+LIST_DECLARE_STATIC(servers);
+LIST_DECLARE_STATIC(cache);
+LIST_DECLARE_STATIC(subscribers);
+
+
+/**
+ * Gets the monotonic time in msecs.
+ */
+static int64_t
+mbox_upnp_now(void)
+{
+	struct timespec tv;
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	return (tv.tv_sec * 1000LL) + (tv.tv_nsec / 1000000LL);
+}
+
+
+/**
+ * Decode the XML entities of a string IN PLACE.
+ */
+static void
+mbox_upnp_unescape(char *s)
+{
+	static const char * const entities[] =
+		{ "&lt;", "<", "&gt;", ">", "&amp;", "&", "&quot;", "\"", "&apos;", "'", NULL };
+	char *d = s, *e;
+	unsigned long c;
+	int i;
+
+	while (*s != '\0') {
+		if (*s != '&') {
+			*d++ = *s++;
+			continue;
+		}
+		for (i = 0; entities[i] != NULL; i += 2) {
+			if (!strncmp(s, entities[i], strlen(entities[i]))) {
+				break;
+			}
+		}
+		if (entities[i] != NULL) {
+			*d++ = *entities[i + 1];
+			s += strlen(entities[i]);
+			continue;
+		}
+		if (s[1] == '#') {
+			c = (s[2] == 'x' || s[2] == 'X') ?
+				strtoul(s + 3, &e, 16) : strtoul(s + 2, &e, 10);
+			if (*e == ';' && c > 0 && c < 0x110000) {
+				/* encode it as UTF-8 */
+				if (c < 0x80) {
+					*d++ = c;
+				} else if (c < 0x800) {
+					*d++ = 0xc0 | (c >> 6);
+					*d++ = 0x80 | (c & 0x3f);
+				} else if (c < 0x10000) {
+					*d++ = 0xe0 | (c >> 12);
+					*d++ = 0x80 | ((c >> 6) & 0x3f);
+					*d++ = 0x80 | (c & 0x3f);
+				} else {
+					*d++ = 0xf0 | (c >> 18);
+					*d++ = 0x80 | ((c >> 12) & 0x3f);
+					*d++ = 0x80 | ((c >> 6) & 0x3f);
+					*d++ = 0x80 | (c & 0x3f);
+				}
+				s = e + 1;
+				continue;
+			}
+		}
+		*d++ = *s++;
+	}
+	*d = '\0';
+}
+
+
+/**
+ * Find the next element named name (ignoring the namespace
+ * prefix) in [p, end), or the next element of any name if name
+ * is NULL. Sets the local name, attributes and content of the
+ * element and returns a pointer past it, or NULL if there's none.
+ */
+static const char *
+mbox_upnp_element(const char *p, const char * const end, const char * const name,
+	const char **tag, size_t *tag_len, const char **attrs,
+	const char **body, const char **body_end)
+{
+	const char *qname, *local, *gt, *q;
+	size_t qlen;
+
+	while (p < end && (p = memchr(p, '<', end - p)) != NULL) {
+		qname = local = ++p;
+		if (p >= end) {
+			break;
+		}
+		if (*p == '/' || *p == '?' || *p == '!') {
+			continue;
+		}
+		while (p < end && !isspace((unsigned char) *p) && *p != '>' && *p != '/') {
+			if (*p == ':') {
+				local = p + 1;
+			}
+			p++;
+		}
+		qlen = p - qname;
+		if (name != NULL && (strlen(name) != (size_t) (p - local) ||
+			strncmp(local, name, p - local))) {
+			continue;
+		}
+		if ((gt = memchr(p, '>', end - p)) == NULL) {
+			break;
+		}
+		if (tag != NULL) {
+			*tag = local;
+			*tag_len = p - local;
+		}
+		*attrs = p;
+
+		/* empty element */
+		if (gt[-1] == '/') {
+			*body = *body_end = gt;
+			return gt + 1;
+		}
+
+		/* find the closing tag */
+		for (q = gt + 1; q < end && (q = memchr(q, '<', end - q)) != NULL; q++) {
+			if (q + qlen + 2 < end && q[1] == '/' &&
+				!strncmp(q + 2, qname, qlen) &&
+				(q[qlen + 2] == '>' || isspace((unsigned char) q[qlen + 2]))) {
+				*body = gt + 1;
+				*body_end = q;
+				if ((q = memchr(q, '>', end - q)) == NULL) {
+					return end;
+				}
+				return q + 1;
+			}
+		}
+		break;
+	}
+	return NULL;
+}
+
+
+/**
+ * Get a copy of the content of the first element named
+ * name in [p, end) with the entities decoded.
+ */
+static char *
+mbox_upnp_text(const char * const p, const char * const end, const char * const name)
+{
+	const char *attrs, *body, *body_end;
+	char *text;
+
+	if (mbox_upnp_element(p, end, name, NULL, NULL, &attrs, &body, &body_end) == NULL) {
+		return NULL;
+	}
+	if ((text = strndup(body, body_end - body)) == NULL) {
+		return NULL;
+	}
+	mbox_upnp_unescape(text);
+	return text;
+}
+
+
+/**
+ * Get a copy of the value of an attribute with the
+ * entities decoded.
+ */
+static char *
+mbox_upnp_attr(const char * const attrs, const char * const name)
+{
+	const char * const gt = strchr(attrs, '>');
+	const size_t len = strlen(name);
+	const char *p = attrs, *value, *value_end;
+	char *text;
+
+	if (gt == NULL) {
+		return NULL;
+	}
+	while ((p = strstr(p, name)) != NULL && p < gt) {
+		value = p + len;
+		if (isspace((unsigned char) p[-1]) && value[0] == '=' &&
+			(value[1] == '"' || value[1] == '\'')) {
+			if ((value_end = strchr(value + 2, value[1])) == NULL) {
+				return NULL;
+			}
+			if ((text = strndup(value + 2, value_end - value - 2)) == NULL) {
+				return NULL;
+			}
+			mbox_upnp_unescape(text);
+			return text;
+		}
+		p = value;
+	}
+	return NULL;
+}
+
+
+/**
+ * Parse a DIDL-Lite duration (H+:MM:SS[.F+]) to msecs.
+ */
+static int64_t
+mbox_upnp_parseduration(const char * const duration)
+{
+	unsigned int h, m;
+	double s;
+	if (duration == NULL || sscanf(duration, "%u:%u:%lf", &h, &m, &s) != 3) {
+		return -1;
+	}
+	return (h * 3600LL + m * 60LL) * 1000LL + (int64_t) (s * 1000.0);
+}
+
+
+/**
+ * Make a relative url absolute.
+ */
+static char *
+mbox_upnp_resolve(const char * const base, const char * const url)
+{
+	const char *p, *slash;
+	char *ret;
+	size_t len;
+
+	if (strstr(url, "://") != NULL) {
+		return strdup(url);
+	}
+	if ((p = strstr(base, "://")) == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	p += 3;
+	if (url[0] == '/') {
+		p += strcspn(p, "/");
+	} else if ((slash = strrchr(p, '/')) != NULL) {
+		p = slash + 1;
+	} else {
+		p += strlen(p);
+	}
+
+	len = p - base;
+	if ((ret = malloc(len + strlen(url) + 2)) == NULL) {
+		return NULL;
+	}
+	memcpy(ret, base, len);
+	ret[len] = '\0';
+	if (url[0] != '/' && ret[len - 1] != '/') {
+		strcat(ret, "/");
+	}
+	strcat(ret, url);
+	return ret;
+}
+
+
+/**
+ * Get a copy of the value of a header of an SSDP response.
+ */
+static char *
+mbox_upnp_header(const char *msg, const char * const name)
+{
+	const size_t len = strlen(name);
+	while ((msg = strchr(msg, '\n')) != NULL) {
+		msg++;
+		if (!strncasecmp(msg, name, len) && msg[len] == ':') {
+			msg += len + 1;
+			while (*msg == ' ' || *msg == '\t') {
+				msg++;
+			}
+			return strndup(msg, strcspn(msg, "\r\n"));
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Fetch the description of a device and add it to the
+ * server list if it has a ContentDirectory service.
+ */
+static int
+mbox_upnp_adddevice(const char * const location)
+{
+	struct mbox_upnp_server *server;
+	const char *p, *end, *attrs, *body, *body_end;
+	char *xml, *type, *url = NULL, *base, *udn, *name, *control_url;
+	size_t size;
+
+	if (mb_url_fetch2mem((char*) location, (void**) &xml, &size) == -1) {
+		return -1;
+	}
+	end = xml + size;
+
+	/* find the ContentDirectory service */
+	for (p = xml; url == NULL && (p = mbox_upnp_element(p, end, "service",
+		NULL, NULL, &attrs, &body, &body_end)) != NULL;) {
+		if ((type = mbox_upnp_text(body, body_end, "serviceType")) != NULL) {
+			if (!strncmp(type, MBOX_UPNP_CDS, sizeof(MBOX_UPNP_CDS) - 2)) {
+				url = mbox_upnp_text(body, body_end, "controlURL");
+			}
+			free(type);
+		}
+	}
+	if (url == NULL) {
+		DEBUG_VPRINT("upnp", "%s is not a media server", location);
+		free(xml);
+		errno = ENOENT;
+		return -1;
+	}
+
+	udn = mbox_upnp_text(xml, end, "UDN");
+	name = mbox_upnp_text(xml, end, "friendlyName");
+	base = mbox_upnp_text(xml, end, "URLBase");
+	control_url = mbox_upnp_resolve((base != NULL && base[0] != '\0') ?
+		base : location, url);
+	free(base);
+	free(url);
+	free(xml);
+
+	/* the udn goes in library paths so it can't have slashes */
+	if (udn == NULL || name == NULL || control_url == NULL ||
+		udn[0] == '\0' || strchr(udn, '/') != NULL) {
+		LOG_VPRINT_ERROR("Invalid device description: %s", location);
+		free(udn);
+		free(name);
+		free(control_url);
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&upnp_lock);
+	LIST_FOREACH(struct mbox_upnp_server*, server, &servers) {
+		if (!strcmp(server->udn, udn)) {
+			break;
+		}
+	}
+	if (LIST_ISNULL(&servers, server)) {
+		if ((server = malloc(sizeof(struct mbox_upnp_server))) == NULL) {
+			pthread_mutex_unlock(&upnp_lock);
+			free(udn);
+			free(name);
+			free(control_url);
+			return -1;
+		}
+		LOG_VPRINT_INFO("Found media server '%s' at %s",
+			name, location);
+		LIST_APPEND(&servers, server);
+		servers_changed = 1;
+	} else {
+		free(server->udn);
+		free(server->name);
+		free(server->control_url);
+	}
+	server->udn = udn;
+	server->name = name;
+	server->control_url = control_url;
+	server->last_seen = mbox_upnp_now();
+	pthread_mutex_unlock(&upnp_lock);
+	return 0;
+}
+
+
+/**
+ * Send an SSDP search for media servers and collect the
+ * locations of the descriptions of the servers that answer.
+ */
+static int
+mbox_upnp_msearch(char ** const locations, const int max)
+{
+	int fd, i, n = 0, timeout;
+	ssize_t len;
+	char buf[1500], *location;
+	const unsigned char ttl = 2;
+	struct sockaddr_in addr;
+	struct pollfd pfd;
+	int64_t deadline;
+
+	snprintf(buf, sizeof(buf),
+		"M-SEARCH * HTTP/1.1\r\n"
+		"HOST: " MBOX_UPNP_SSDP_ADDR ":%i\r\n"
+		"MAN: \"ssdp:discover\"\r\n"
+		"MX: %i\r\n"
+		"ST: " MBOX_UPNP_CDS "\r\n"
+		"\r\n", MBOX_UPNP_SSDP_PORT, MBOX_UPNP_SSDP_WAIT);
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1) {
+		LOG_VPRINT_ERROR("Could not create socket: %s",
+			strerror(errno));
+		return -1;
+	}
+	(void) setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(MBOX_UPNP_SSDP_PORT);
+	addr.sin_addr.s_addr = inet_addr(MBOX_UPNP_SSDP_ADDR);
+
+	/* it's UDP so send it twice */
+	for (i = 0; i < 2; i++) {
+		if (sendto(fd, buf, strlen(buf), 0, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+			LOG_VPRINT_ERROR("Could not send M-SEARCH: %s",
+				strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+
+	/* servers answer within MX seconds */
+	deadline = mbox_upnp_now() + (MBOX_UPNP_SSDP_WAIT + 1) * 1000;
+	while (n < max && !quit && (timeout = deadline - mbox_upnp_now()) > 0) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, timeout) <= 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if ((len = recv(fd, buf, sizeof(buf) - 1, 0)) <= 0) {
+			continue;
+		}
+		buf[len] = '\0';
+		if ((location = mbox_upnp_header(buf, "LOCATION")) == NULL) {
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			if (!strcmp(locations[i], location)) {
+				break;
+			}
+		}
+		if (i < n) {
+			free(location);
+		} else {
+			locations[n++] = location;
+		}
+	}
+	close(fd);
+	return n;
+}
+
+
+/**
+ * Discover the media servers on the network. Runs on a
+ * worker thread.
+ */
+static void *
+mbox_upnp_discover(void *arg)
+{
+	struct mbox_upnp_server *server;
+	struct mbox_upnp_subscriber *sub;
+	char *locations[MBOX_UPNP_MAXLOCATIONS];
+	char *copy, *location, *saveptr = NULL;
+	int i, n;
+	int64_t start;
+
+	(void) arg;
+
+	start = mbox_upnp_now();
+
+	if ((n = mbox_upnp_msearch(locations, MBOX_UPNP_MAXLOCATIONS)) > 0) {
+		for (i = 0; i < n; i++) {
+			if (!quit) {
+				(void) mbox_upnp_adddevice(locations[i]);
+			}
+			free(locations[i]);
+		}
+	}
+
+	/* servers that don't answer to multicast */
+	if (configured_servers != NULL && (copy = strdup(configured_servers)) != NULL) {
+		for (location = strtok_r(copy, ", ", &saveptr); location != NULL && !quit;
+			location = strtok_r(NULL, ", ", &saveptr)) {
+			(void) mbox_upnp_adddevice(location);
+		}
+		free(copy);
+	}
+
+	pthread_mutex_lock(&upnp_lock);
+
+	/* forget the servers that are gone */
+	LIST_FOREACH_SAFE(struct mbox_upnp_server*, server, &servers, {
+		if (server->last_seen < start - MBOX_UPNP_SERVER_TIMEOUT * 1000LL) {
+			LOG_VPRINT_INFO("Media server '%s' is gone", server->name);
+			LIST_REMOVE(server);
+			free(server->udn);
+			free(server->name);
+			free(server->control_url);
+			free(server);
+			servers_changed = 1;
+		}
+	});
+
+	/* let the subscribers know so they can list them again */
+	if (servers_changed && !quit) {
+		LIST_FOREACH(struct mbox_upnp_subscriber*, sub, &subscribers) {
+			if (avbox_object_sendmsg(&sub->object, MBOX_MESSAGETYPE_UPNP,
+				AVBOX_DISPATCH_UNICAST, NULL) == NULL) {
+				LOG_VPRINT_ERROR("Could not notify subscriber: %s",
+					strerror(errno));
+			}
+		}
+	}
+	servers_changed = 0;
+
+	discovering = 0;
+	last_discovery = mbox_upnp_now();
+	pthread_cond_broadcast(&upnp_cond);
+	pthread_mutex_unlock(&upnp_lock);
+	return NULL;
+}
+
+
+/**
+ * Start discovering servers if we haven't recently. Must
+ * be called with the lock held.
+ */
+static void
+mbox_upnp_startdiscovery(void)
+{
+	struct avbox_delegate *del;
+
+	if (discovering || quit || (last_discovery != 0 &&
+		mbox_upnp_now() - last_discovery < MBOX_UPNP_DISCOVERY_INTERVAL * 1000LL)) {
+		return;
+	}
+	if ((del = avbox_thread_delegate(mbox_upnp_discover, NULL)) == NULL) {
+		LOG_VPRINT_ERROR("Could not start discovery: %s",
+			strerror(errno));
+		return;
+	}
+	avbox_delegate_dettach(del);
+	discovering = 1;
+}
+
+
+/**
+ * Free a listing.
+ */
+static void
+mbox_upnp_freecontainer(struct mbox_upnp_container * const container)
+{
+	int i;
+	for (i = 0; i < container->n_objects; i++) {
+		free(container->objects[i].id);
+		free(container->objects[i].title);
+		free(container->objects[i].url);
+	}
+	free(container->objects);
+	free(container->path);
+	free(container);
+}
+
+
+/**
+ * Take a listing off the cache. It's freed when the
+ * last reference is dropped. Must be called with the
+ * lock held.
+ */
+static void
+mbox_upnp_evict(struct mbox_upnp_container * const container)
+{
+	LIST_REMOVE(container);
+	n_cached--;
+	if (container->refs == 0) {
+		mbox_upnp_freecontainer(container);
+	} else {
+		container->dead = 1;
+	}
+}
+
+
+/**
+ * Get a reference to a cached listing if it's fresh. Must
+ * be called with the lock held.
+ */
+static struct mbox_upnp_container *
+mbox_upnp_getcached(const char * const path)
+{
+	struct mbox_upnp_container *container;
+
+	LIST_FOREACH(struct mbox_upnp_container*, container, &cache) {
+		if (!strcmp(container->path, path)) {
+			if (mbox_upnp_now() - container->fetched > cache_ttl * 1000LL) {
+				mbox_upnp_evict(container);
+				return NULL;
+			}
+
+			/* most recently used go first */
+			LIST_REMOVE(container);
+			LIST_ADD(&cache, container);
+			container->refs++;
+			return container;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Drop a reference to a cached listing. Must be called
+ * with the lock held.
+ */
+static void
+mbox_upnp_putcached(struct mbox_upnp_container * const container)
+{
+	if (--container->refs == 0 && container->dead) {
+		mbox_upnp_freecontainer(container);
+	}
+}
+
+
+/**
+ * Cache a listing. Must be called with the lock held.
+ */
+static void
+mbox_upnp_addcached(struct mbox_upnp_container * const container)
+{
+	struct mbox_upnp_container *old;
+
+	LIST_FOREACH_SAFE(struct mbox_upnp_container*, old, &cache, {
+		if (!strcmp(old->path, container->path)) {
+			mbox_upnp_evict(old);
+		}
+	});
+
+	container->fetched = mbox_upnp_now();
+	LIST_ADD(&cache, container);
+	n_cached++;
+
+	while (n_cached > MBOX_UPNP_CACHE_SIZE) {
+		mbox_upnp_evict(LIST_TAIL(struct mbox_upnp_container*, &cache));
+	}
+}
+
+
+/**
+ * Gets the library path of a child container. The object id
+ * is percent encoded so it can be used as a path component.
+ */
+static char *
+mbox_upnp_childpath(const char * const path, const char * const id)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	const size_t len = strlen(path);
+	const char *s;
+	char *ret, *d;
+
+	if ((ret = malloc(len + 1 + strlen(id) * 3 + 1)) == NULL) {
+		return NULL;
+	}
+	memcpy(ret, path, len);
+	d = ret + len;
+	*d++ = '/';
+	for (s = id; *s != '\0'; s++) {
+		if (isalnum((unsigned char) *s) || *s == '-' || *s == '_' ||
+			*s == '.' || *s == '~') {
+			*d++ = *s;
+		} else {
+			*d++ = '%';
+			*d++ = hex[((unsigned char) *s) >> 4];
+			*d++ = hex[((unsigned char) *s) & 0xf];
+		}
+	}
+	*d = '\0';
+	return ret;
+}
+
+
+/**
+ * Pass a range of a listing to the callback. Returns -1
+ * if the callback stopped it.
+ */
+static int
+mbox_upnp_emit(const char * const path, const struct mbox_upnp_object * const objects,
+	const int n, mbox_libraryindex_callback callback, void *context)
+{
+	struct mbox_libraryindex_entry entry;
+	struct mbox_libraryindex_metadata meta;
+	char *childpath = NULL;
+	int i, ret;
+
+	memset(&meta, 0, sizeof(meta));
+
+	for (i = 0; i < n; i++) {
+		entry.name = objects[i].title;
+		entry.isdir = (objects[i].url == NULL);
+		entry.size = objects[i].size;
+		entry.mtime = 0;
+		entry.meta = NULL;
+
+		if (entry.isdir) {
+			if ((childpath = mbox_upnp_childpath(path, objects[i].id)) == NULL) {
+				return -1;
+			}
+			entry.path = childpath;
+		} else {
+			entry.path = objects[i].url;
+
+			/* what the server told us about it */
+			if (objects[i].duration != -1 || objects[i].width > 0) {
+				meta.duration = objects[i].duration;
+				meta.width = objects[i].width;
+				meta.height = objects[i].height;
+				entry.meta = &meta;
+			}
+		}
+
+		ret = callback(&entry, context);
+		free(childpath);
+		childpath = NULL;
+		if (ret == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Parse an object of a DIDL-Lite document and add it to
+ * the listing.
+ */
+static int
+mbox_upnp_addobject(struct mbox_upnp_container * const container,
+	const int isdir, const char * const attrs,
+	const char * const body, const char * const body_end)
+{
+	struct mbox_upnp_object *object;
+	const char *p, *res_attrs, *res, *res_end;
+	char *protocol, *value;
+
+	if (container->n_objects == container->objects_size) {
+		const int size = (container->objects_size == 0) ?
+			MBOX_UPNP_PAGESIZE : container->objects_size * 2;
+		if ((object = realloc(container->objects,
+			size * sizeof(struct mbox_upnp_object))) == NULL) {
+			return -1;
+		}
+		container->objects = object;
+		container->objects_size = size;
+	}
+
+	object = &container->objects[container->n_objects];
+	memset(object, 0, sizeof(struct mbox_upnp_object));
+	object->duration = -1;
+
+	if ((object->id = mbox_upnp_attr(attrs, "id")) == NULL ||
+		(object->title = mbox_upnp_text(body, body_end, "title")) == NULL) {
+		goto skip;
+	}
+
+	if (!isdir) {
+		/* use the first resource we can get over HTTP */
+		for (p = body; object->url == NULL && (p = mbox_upnp_element(p, body_end, "res",
+			NULL, NULL, &res_attrs, &res, &res_end)) != NULL;) {
+			if ((protocol = mbox_upnp_attr(res_attrs, "protocolInfo")) == NULL) {
+				continue;
+			}
+			if (!strncmp(protocol, "http-get:", 9)) {
+				if ((object->url = strndup(res, res_end - res)) == NULL) {
+					free(protocol);
+					goto skip;
+				}
+				mbox_upnp_unescape(object->url);
+				if ((value = mbox_upnp_attr(res_attrs, "size")) != NULL) {
+					object->size = strtoll(value, NULL, 10);
+					free(value);
+				}
+				if ((value = mbox_upnp_attr(res_attrs, "duration")) != NULL) {
+					object->duration = mbox_upnp_parseduration(value);
+					free(value);
+				}
+				if ((value = mbox_upnp_attr(res_attrs, "resolution")) != NULL) {
+					if (sscanf(value, "%ix%i", &object->width, &object->height) != 2) {
+						object->width = object->height = 0;
+					}
+					free(value);
+				}
+			}
+			free(protocol);
+		}
+		if (object->url == NULL || object->url[0] == '\0') {
+			goto skip;
+		}
+	}
+
+	container->n_objects++;
+	return 0;
+skip:
+	free(object->id);
+	free(object->title);
+	free(object->url);
+	return 0;
+}
+
+
+/**
+ * Fetch a page of a listing and add it's objects to the
+ * container.
+ */
+static int
+mbox_upnp_fetchpage(const char * const control_url, const char * const id,
+	const int start, struct mbox_upnp_container * const container,
+	int * const returned, int * const total)
+{
+	static const char * const headers[] =
+	{
+		"Content-Type: text/xml; charset=\"utf-8\"",
+		"SOAPACTION: \"" MBOX_UPNP_CDS "#Browse\"",
+		NULL
+	};
+	const char *p, *end, *tag, *attrs, *body, *body_end;
+	char *request, *response = NULL, *didl = NULL, *escaped_id = NULL, *value, *d;
+	const char *s;
+	size_t size, tag_len;
+	int ret = -1;
+
+	/* escape the object id */
+	if ((escaped_id = malloc(strlen(id) * 6 + 1)) == NULL) {
+		return -1;
+	}
+	for (s = id, d = escaped_id; *s != '\0'; s++) {
+		switch (*s) {
+		case '<': strcpy(d, "&lt;"); d += 4; break;
+		case '>': strcpy(d, "&gt;"); d += 4; break;
+		case '&': strcpy(d, "&amp;"); d += 5; break;
+		case '"': strcpy(d, "&quot;"); d += 6; break;
+		default: *d++ = *s;
+		}
+	}
+	*d = '\0';
+
+	size = sizeof(MBOX_UPNP_BROWSE) + strlen(escaped_id) + 24;
+	if ((request = malloc(size)) == NULL) {
+		free(escaped_id);
+		return -1;
+	}
+	snprintf(request, size, MBOX_UPNP_BROWSE,
+		escaped_id, start, MBOX_UPNP_PAGESIZE);
+	free(escaped_id);
+
+	if (mb_url_post2mem(control_url, headers, request, (void**) &response, &size) == -1) {
+		goto end;
+	}
+	end = response + size;
+
+	/* the result is an escaped DIDL-Lite document */
+	if ((didl = mbox_upnp_text(response, end, "Result")) == NULL) {
+		LOG_VPRINT_ERROR("Invalid Browse response from %s", control_url);
+		errno = EPROTO;
+		goto end;
+	}
+	*returned = ((value = mbox_upnp_text(response, end, "NumberReturned")) != NULL) ?
+		atoi(value) : 0;
+	free(value);
+	*total = ((value = mbox_upnp_text(response, end, "TotalMatches")) != NULL) ?
+		atoi(value) : 0;
+	free(value);
+
+	p = didl;
+	end = didl + strlen(didl);
+	if (mbox_upnp_element(p, end, "DIDL-Lite", NULL, NULL, &attrs, &body, &body_end) == NULL) {
+		LOG_VPRINT_ERROR("Invalid DIDL-Lite document from %s", control_url);
+		errno = EPROTO;
+		goto end;
+	}
+	for (p = body; (p = mbox_upnp_element(p, body_end, NULL, &tag, &tag_len,
+		&attrs, &body, &end)) != NULL;) {
+		if (tag_len == 9 && !strncmp(tag, "container", 9)) {
+			if (mbox_upnp_addobject(container, 1, attrs, body, end) == -1) {
+				goto end;
+			}
+		} else if (tag_len == 4 && !strncmp(tag, "item", 4)) {
+			if (mbox_upnp_addobject(container, 0, attrs, body, end) == -1) {
+				goto end;
+			}
+		}
+	}
+	ret = 0;
+end:
+	free(didl);
+	free(response);
+	free(request);
+	return ret;
+}
+
+
+/**
+ * List the media servers.
+ */
+int
+mbox_upnp_servers(mbox_libraryindex_callback callback, void *context)
+{
+	struct mbox_upnp_server *server;
+	struct mbox_libraryindex_entry entry;
+	char **names, **paths;
+	int i, n = 0;
+
+	pthread_mutex_lock(&upnp_lock);
+	if (!initialized) {
+		pthread_mutex_unlock(&upnp_lock);
+		return 0;
+	}
+
+	mbox_upnp_startdiscovery();
+
+	/* copy them so we don't call back with the lock held */
+	n = LIST_SIZE(&servers);
+	names = calloc(n + 1, sizeof(char*));
+	paths = calloc(n + 1, sizeof(char*));
+	if (names == NULL || paths == NULL) {
+		pthread_mutex_unlock(&upnp_lock);
+		free(names);
+		free(paths);
+		return -1;
+	}
+	i = 0;
+	LIST_FOREACH(struct mbox_upnp_server*, server, &servers) {
+		names[i] = strdup(server->name);
+		if ((paths[i] = malloc(sizeof(MBOX_UPNP_PREFIX) + strlen(server->udn) + 1)) != NULL) {
+			strcpy(paths[i], MBOX_UPNP_PREFIX "/");
+			strcat(paths[i], server->udn);
+		}
+		i++;
+	}
+	pthread_mutex_unlock(&upnp_lock);
+
+	for (i = 0; i < n; i++) {
+		if (names[i] != NULL && paths[i] != NULL) {
+			entry.name = names[i];
+			entry.path = paths[i];
+			entry.isdir = 1;
+			entry.size = 0;
+			entry.mtime = 0;
+			entry.meta = NULL;
+			if (callback(&entry, context) == -1) {
+				break;
+			}
+		}
+	}
+	for (i = 0; i < n; i++) {
+		free(names[i]);
+		free(paths[i]);
+	}
+	free(names);
+	free(paths);
+	return n;
+}
+
+
+/**
+ * Browse a container.
+ */
+int
+mbox_upnp_browse(const char * const path,
+	mbox_libraryindex_callback callback, void *context)
+{
+	struct mbox_upnp_container *container;
+	struct mbox_upnp_server *server;
+	char *key, *udn, *id, *control_url = NULL;
+	int start = 0, returned, total, emitted = 0, ret = -1;
+	size_t len;
+
+	/* paths look like upnp:/<udn>[/<id>...] */
+	if (strncmp(path, MBOX_UPNP_PREFIX "/", sizeof(MBOX_UPNP_PREFIX))) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((key = strdup(path)) == NULL) {
+		return -1;
+	}
+	for (len = strlen(key); len > sizeof(MBOX_UPNP_PREFIX) && key[len - 1] == '/'; len--) {
+		key[len - 1] = '\0';
+	}
+
+	pthread_mutex_lock(&upnp_lock);
+
+	/* serve it from the cache */
+	if ((container = mbox_upnp_getcached(key)) != NULL) {
+		pthread_mutex_unlock(&upnp_lock);
+		ret = container->n_objects;
+		(void) mbox_upnp_emit(key, container->objects,
+			container->n_objects, callback, context);
+		pthread_mutex_lock(&upnp_lock);
+		mbox_upnp_putcached(container);
+		pthread_mutex_unlock(&upnp_lock);
+		free(key);
+		return ret;
+	}
+
+	udn = key + sizeof(MBOX_UPNP_PREFIX);
+	len = strcspn(udn, "/");
+	LIST_FOREACH(struct mbox_upnp_server*, server, &servers) {
+		if (strlen(server->udn) == len && !strncmp(server->udn, udn, len)) {
+			control_url = strdup(server->control_url);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&upnp_lock);
+
+	if (control_url == NULL) {
+		free(key);
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* the last component is the object id. The root
+	 * container is always 0 */
+	if (udn[len] == '\0') {
+		id = strdup("0");
+	} else if ((id = strdup(strrchr(udn, '/') + 1)) != NULL) {
+		urldecode(id, strrchr(udn, '/') + 1);
+	}
+	if (id == NULL || (container = calloc(1, sizeof(struct mbox_upnp_container))) == NULL) {
+		free(id);
+		free(control_url);
+		free(key);
+		return -1;
+	}
+
+	DEBUG_VPRINT("upnp", "Browsing %s (id=%s)", key, id);
+
+	/* fetch it a page at a time and pass each page to
+	 * the caller as soon as we get it */
+	do {
+		if (mbox_upnp_fetchpage(control_url, id, start, container, &returned, &total) == -1) {
+			LOG_VPRINT_ERROR("Could not browse %s: %s",
+				key, strerror(errno));
+			goto end;
+		}
+		if (mbox_upnp_emit(key, container->objects + emitted,
+			container->n_objects - emitted, callback, context) == -1) {
+			/* the caller doesn't want the rest */
+			ret = container->n_objects;
+			goto end;
+		}
+		emitted = container->n_objects;
+		start += returned;
+	} while (returned > 0 && start < total && !quit);
+
+	ret = container->n_objects;
+	if ((container->path = strdup(key)) != NULL) {
+		pthread_mutex_lock(&upnp_lock);
+		if (!quit) {
+			mbox_upnp_addcached(container);
+			container = NULL;
+		}
+		pthread_mutex_unlock(&upnp_lock);
+	}
+end:
+	if (container != NULL) {
+		mbox_upnp_freecontainer(container);
+	}
+	free(id);
+	free(control_url);
+	free(key);
+	return ret;
+}
+
+
+/**
+ * Subscribe an object to server list changes.
+ */
+int
+mbox_upnp_subscribe(struct avbox_object * const object)
+{
+	struct mbox_upnp_subscriber *sub;
+
+	if ((sub = malloc(sizeof(struct mbox_upnp_subscriber))) == NULL) {
+		ASSERT(errno == ENOMEM);
+		return -1;
+	}
+	sub->object = object;
+
+	pthread_mutex_lock(&upnp_lock);
+	if (!initialized) {
+		pthread_mutex_unlock(&upnp_lock);
+		free(sub);
+		return 0;
+	}
+	LIST_APPEND(&subscribers, sub);
+	pthread_mutex_unlock(&upnp_lock);
+	return 0;
+}
+
+
+/**
+ * Unsubscribe from server list changes.
+ */
+void
+mbox_upnp_unsubscribe(struct avbox_object * const object)
+{
+	struct mbox_upnp_subscriber *sub;
+	pthread_mutex_lock(&upnp_lock);
+	if (!initialized) {
+		pthread_mutex_unlock(&upnp_lock);
+		return;
+	}
+	LIST_FOREACH_SAFE(struct mbox_upnp_subscriber*, sub, &subscribers, {
+		if (sub->object == object) {
+			LIST_REMOVE(sub);
+			free(sub);
+			break;
+		}
+	});
+	pthread_mutex_unlock(&upnp_lock);
+}
+
+
+/**
+ * Start the UPnP client.
+ */
+int
+mbox_upnp_init(void)
+{
+	DEBUG_PRINT("upnp", "Starting UPnP client");
+
+	LIST_INIT(&servers);
+	LIST_INIT(&cache);
+	LIST_INIT(&subscribers);
+
+	if ((cache_ttl = avbox_settings_getint("upnp.cache_ttl",
+		MBOX_UPNP_CACHE_TTL)) < 0) {
+		cache_ttl = 0;
+	}
+	configured_servers = avbox_settings_getstring("upnp.servers");
+
+	pthread_mutex_lock(&upnp_lock);
+	quit = 0;
+	initialized = 1;
+	last_discovery = 0;
+	mbox_upnp_startdiscovery();
+	pthread_mutex_unlock(&upnp_lock);
+	return 0;
+}
+
+
+/**
+ * Shutdown the UPnP client.
+ */
+void
+mbox_upnp_shutdown(void)
+{
+	struct mbox_upnp_server *server;
+	struct mbox_upnp_container *container;
+	struct mbox_upnp_subscriber *sub;
+
+	DEBUG_PRINT("upnp", "Shutting down UPnP client");
+
+	pthread_mutex_lock(&upnp_lock);
+	if (!initialized) {
+		pthread_mutex_unlock(&upnp_lock);
+		return;
+	}
+	quit = 1;
+	while (discovering) {
+		pthread_cond_wait(&upnp_cond, &upnp_lock);
+	}
+	LIST_FOREACH_SAFE(struct mbox_upnp_server*, server, &servers, {
+		LIST_REMOVE(server);
+		free(server->udn);
+		free(server->name);
+		free(server->control_url);
+		free(server);
+	});
+	LIST_FOREACH_SAFE(struct mbox_upnp_container*, container, &cache, {
+		mbox_upnp_evict(container);
+	});
+	LIST_FOREACH_SAFE(struct mbox_upnp_subscriber*, sub, &subscribers, {
+		LIST_REMOVE(sub);
+		free(sub);
+	});
+	free(configured_servers);
+	configured_servers = NULL;
+	initialized = 0;
+	pthread_mutex_unlock(&upnp_lock);
+}
@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) 2016-2017 Fernando Rodriguez - All rights reserved
+ * This file is part of mediabox.
+ */
+
+#ifndef __MBOX_UPNP_H__
+#define __MBOX_UPNP_H__
+#include "lib/dispatch.h"
+#include "libraryindex.h"
+
+
+/**
+ * Library paths that start with this prefix are containers
+ * of a UPnP media server.
+ */
+#define MBOX_UPNP_PREFIX "upnp:"
+
+
+/**
+ * Sent to subscribers when a discovery finds new media
+ * servers or some are gone. There's no payload.
+ */
+#define MBOX_MESSAGETYPE_UPNP	(AVBOX_MESSAGETYPE_USER + 3)
+
+
+/**
+ * Calls callback with a directory entry for each media
+ * server known now. The path of the entries is the library
+ * path of the server's root container. It doesn't wait for
+ * a discovery to finish. Subscribers are notified when it
+ * finds new servers.
+ *
+ * Returns the number of servers.
+ */
+int
+mbox_upnp_servers(mbox_libraryindex_callback callback, void *context);
+
+
+/**
+ * Browse a container. Containers are listed as directories
+ * whose path is the library path of the container. Items are
+ * listed with the HTTP url of the media as their path so it can
+ * be played directly. The listing is fetched in pages and cached
+ * for upnp.cache_ttl seconds.
+ *
+ * Returns the number of entries or -1 and sets errno if the
+ * container could not be browsed.
+ */
+int
+mbox_upnp_browse(const char * const path,
+	mbox_libraryindex_callback callback, void *context);
+
+
+/**
+ * Subscribe an object to MBOX_MESSAGETYPE_UPNP messages.
+ */
+int
+mbox_upnp_subscribe(struct avbox_object * const object);
+
+
+/**
+ * Unsubscribe from MBOX_MESSAGETYPE_UPNP messages.
+ */
+void
+mbox_upnp_unsubscribe(struct avbox_object * const object);
+
+
+/**
+ * Start the UPnP client and discover the media servers
+ * on the network.
+ */
+int
+mbox_upnp_init(void);
+
+
+/**
+ * Shutdown the UPnP client.
+ */
+void
+mbox_upnp_shutdown(void);
+
+
+#endif